@@ -575,6 +575,7 @@ class Application (object):
             # This mapping is still required for certain problematic hw
             # See https://github.com/mypaint/mypaint/issues/275
             m = mypaintlib.MappingWrapper(1)
+            m.set_compiled(True)
             m.set_n(0, len(p))
             for i, (x, y) in enumerate(p):
                 m.set_point(0, i, x, 1.0-y)
@@ -771,6 +772,10 @@ class Application (object):
         """Starts profiling, or stops it (and tries to show the results)"""
         self.profiler.toggle_profiling()
 
+    def start_native_tracing_cb(self, action):
+        """Starts tracing the C++ code, or stops it and saves the trace"""
+        self.profiler.toggle_native_tracing()
+
     def print_memory_leak_cb(self, action):
         helpers.record_memory_leak_status(print_diff=True)
 
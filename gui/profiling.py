@@ -22,6 +22,7 @@ from gi.repository import Gtk
 from distutils.spawn import find_executable
 
 import lib.fileutils
+from lib import mypaintlib
 
 
 logger = logging.getLogger(__name__)
@@ -37,6 +38,10 @@ class Profiler (object):
     tools, you can copy the output .pstats files elsewhere and run
     gprof2dot.py and dot on them manually.
 
+    Native tracing records the C++ code's hot paths into a Chrome trace
+    JSON file in the same tempdir, which can be opened in Chromium's
+    about:tracing page or the Perfetto UI.
+
     The tempdir is deleted when the application exits normally.
 
     """
@@ -51,6 +56,7 @@ class Profiler (object):
         super(Profiler, self).__init__()
         self.profiler_active = False
         self.profile_num = 0
+        self.trace_num = 0
         self.__temp_dir = None
 
     def toggle_profiling(self):
@@ -60,6 +66,27 @@ class Profiler (object):
         else:
             GLib.idle_add(self._do_profiling)
 
+    def toggle_native_tracing(self):
+        """Starts native tracing if not running, or stops it & saves it."""
+        if not mypaintlib.trace_is_enabled():
+            mypaintlib.trace_clear()
+            mypaintlib.trace_set_enabled(True)
+            logger.info('--- Native tracing starts ---')
+            return
+        mypaintlib.trace_set_enabled(False)
+        logger.info('--- Native tracing ends ---')
+        self.trace_num += 1
+        basename = "{isotime}-{n}".format(
+            isotime = time.strftime("%Y%m%d-%H%M%S"),
+            n = self.trace_num,
+        )
+        trace_filepath = os.path.join(self._tempdir, basename + ".json")
+        with open(trace_filepath, "wb") as fp:
+            fp.write(mypaintlib.trace_dump_json())
+        mypaintlib.trace_clear()
+        logger.info("Native trace written to %r", trace_filepath)
+        lib.fileutils.startfile(self._tempdir)
+
     @property
     def _tempdir(self):
         td = self.__temp_dir
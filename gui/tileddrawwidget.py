@@ -1110,7 +1110,7 @@ class CanvasRenderer (Gtk.DrawingArea, DrawCursorMixin):
             cr.set_source_rgb(tmp, tmp, tmp)
             cr.paint()
 
-        # Prep a pixbuf-surface aligned to the model to render into.
+        # Prep a cairo surface aligned to the model to render into.
         # This also applies the transformation.
         transformation, surface, sparse, mipmap_level, clip_rect = \
             self._render_prepare(cr)
@@ -1121,12 +1121,12 @@ class CanvasRenderer (Gtk.DrawingArea, DrawCursorMixin):
         cr.rectangle(*model_bbox)
         cr.clip()
 
-        # Clear the pixbuf to be rendered with a random red,
+        # Clear the surface to be rendered with a random red,
         # to make it apparent if something is not being painted.
         if self.visualize_rendering:
-            surface.pixbuf.fill(int(random.random() * 0xff) << 16)
+            surface.fill((random.random(), 0, 0, 1))
 
-        # Render to the pixbuf, then paint it.
+        # Render to the surface, then paint it.
         self._render_execute(
             cr,
             transformation,
@@ -1272,11 +1272,11 @@ class CanvasRenderer (Gtk.DrawingArea, DrawCursorMixin):
         return clip_rect.overlaps(tile_rect)
 
     def _render_prepare(self, cr):
-        """Prepares a blank pixbuf & other details for later rendering.
+        """Prepares a blank surface & other details for later rendering.
 
         Called when handling "draw" events. The size and shape of the
-        returned pixbuf (wrapped in a tile-accessible and read/write
-        lib.pixbufsurface.Surface) is determined by the Cairo clipping
+        returned surface (a tile-accessible and read/write
+        lib.pixbufsurface.CairoSurface) is determined by the Cairo clipping
         region that expresses what we've been asked to redraw, and by
         the TDW's own view transformation of the document.
 
@@ -1330,20 +1330,19 @@ class CanvasRenderer (Gtk.DrawingArea, DrawCursorMixin):
         # factor 3 for ATI/Radeon Xorg driver (and hopefully others).
         # https://bugs.freedesktop.org/show_bug.cgi?id=28670
 
-        surface = pixbufsurface.Surface(x1, y1, x2 - x1 + 1, y2 - y1 + 1)
+        surface = pixbufsurface.CairoSurface(
+            x1, y1, x2 - x1 + 1, y2 - y1 + 1,
+        )
         return transformation, surface, sparse, mipmap_level, clip_rect
 
     def _render_execute(self, cr, transformation, surface, sparse,
                         mipmap_level, clip_rect, filter=None):
-        """Renders tiles into a prepared pixbufsurface, then blits it.
+        """Renders tiles into a prepared CairoSurface, then blits it.
 
 
         """
         translation_only = self.is_translation_only()
 
-        if self.visualize_rendering:
-            surface.pixbuf.fill(int(random.random() * 0xff) << 16)
-
         fake_alpha_check_tile = None
         if not self._draw_real_alpha_checks:
             fake_alpha_check_tile = self._fake_alpha_check_tile
@@ -1363,7 +1362,7 @@ class CanvasRenderer (Gtk.DrawingArea, DrawCursorMixin):
             ]
 
         # Composite each stack of tiles in the exposed area
-        # into the pixbufsurface.
+        # into the surface.
         self.doc._layers.render(
             surface,
             tiles,
@@ -1373,11 +1372,12 @@ class CanvasRenderer (Gtk.DrawingArea, DrawCursorMixin):
             filter = filter,
         )
 
-        # Set the surface's underlying pixbuf as the source, then paint
-        # it with Cairo. We don't care if it's pixelized at high zoom-in
-        # levels: in fact, it'll look sharper and better.
-        Gdk.cairo_set_source_pixbuf(
-            cr, surface.pixbuf,
+        # Copy the rendered tiles into the surface's cairo surface,
+        # and paint that. We don't care if it's pixelized at high
+        # zoom-in levels: in fact, it'll look sharper and better.
+        surface.flush()
+        cr.set_source_surface(
+            surface.cairo_surface,
             round(surface.x), round(surface.y)
         )
         if self.scale > self.pixelize_threshold:
@@ -14,7 +14,7 @@
 #define __HAVE_BLENDING
 #define WGM_EPSILON 0.001
 
-#include "fastapprox/fastpow.h"
+#include "fastapprox_batch.hpp"
 #include "fix15.hpp"
 #include "compositing.hpp"
 
@@ -41,7 +41,7 @@ static const float spectral_b_small[10] = {0.537052150373386,0.546646402401469,0
 ,0.006699764779016,0.006676219883241};
 
 
-void
+static inline void
 rgb_to_spectral (float r, float g, float b, float *spectral_) {
   float offset = 1.0 - WGM_EPSILON;
   r = r * offset + WGM_EPSILON;
@@ -67,7 +67,7 @@ rgb_to_spectral (float r, float g, float b, float *spectral_) {
 
 }
 
-void
+static inline void
 spectral_to_rgb (float *spectral, float *rgb_) {
   float offset = 1.0 - WGM_EPSILON;
   for (int i=0; i<10; i++) {
@@ -125,70 +125,161 @@ class BufferCombineFunc <DSTALPHA, BUFSIZE, BlendNormal, CompositeSpectralWGM>
 {
     // Spectral Upsampled Weighted Geometric Mean Pigment/Paint Emulation
     // Based on work by Scott Allen Burns, Meng, and others.
+  private:
+    // Pixels where the WGM mix degenerates to plain source-over
+    static inline bool
+    is_plain_src_over (const fix15_short_t * const src,
+                       const fix15_short_t * const dst,
+                       const fix15_short_t opac)
+    {
+        const fix15_t Sa = fix15_mul(src[3], opac);
+        return (DSTALPHA && dst[3] == 0) || Sa == (1<<15) || Sa == 0;
+    }
+
+    // Alpha-weighted ratio for WGM (sums to 1.0)
+    static inline float
+    src_mix_factor (const fix15_t Sa, const fix15_t one_minus_Sa,
+                    const fix15_short_t * const dst)
+    {
+        if (DSTALPHA) {
+            return (float)Sa / (Sa + one_minus_Sa * dst[3] / (1<<15));
+        } else {
+            return (float)Sa / (1<<15);
+        }
+    }
+
+    // Unpremultiplied, epsilon-offset colour values as rgb_to_spectral()
+    // uses them.
+    static inline void
+    spectral_inputs (const fix15_short_t * const pix, const bool has_alpha,
+                     float &r, float &g, float &b)
+    {
+        if (has_alpha && pix[3] > 0) {
+            r = (float)pix[0] / pix[3];
+            g = (float)pix[1] / pix[3];
+            b = (float)pix[2] / pix[3];
+        } else {
+            r = (float)pix[0] / (1<<15);
+            g = (float)pix[1] / (1<<15);
+            b = (float)pix[2] / (1<<15);
+        }
+        float offset = 1.0 - WGM_EPSILON;
+        r = r * offset + WGM_EPSILON;
+        g = g * offset + WGM_EPSILON;
+        b = b * offset + WGM_EPSILON;
+    }
+
+    // The upsampling part of rgb_to_spectral(), for already offset inputs
+    static inline void
+    spectral_from_inputs (const float r, const float g, const float b,
+                          float *spectral_)
+    {
+        for (int i=0; i < 10; i++) {
+            spectral_[i] = spectral_r_small[i] * r
+                         + spectral_g_small[i] * g
+                         + spectral_b_small[i] * b;
+        }
+    }
+
+    // Turns the mixed, unclamped RGB back into a premultiplied output pixel
+    static inline void
+    store_result (float *rgb_result, const fix15_t Sa,
+                  const fix15_t one_minus_Sa, fix15_short_t * const dst)
+    {
+        float offset = 1.0 - WGM_EPSILON;
+        for (int j=0; j<3; j++) {
+            rgb_result[j] = CLAMP((rgb_result[j] - WGM_EPSILON) / offset, 0.0f, 1.0f);
+        }
+        if (DSTALPHA) {
+            rgb_result[3] = fix15_short_clamp(Sa + fix15_mul(dst[3], one_minus_Sa));
+        } else {
+            rgb_result[3] = (1<<15);
+        }
+        for (int j=0; j<3; j++) {
+            dst[j] =(rgb_result[j] * (rgb_result[3] + 0.5));
+        }
+        if (DSTALPHA) {
+            dst[3] = rgb_result[3];
+        }
+    }
+
+    static inline void
+    combine_plain_pixel (const fix15_short_t * const src,
+                         fix15_short_t * const dst,
+                         const fix15_short_t opac)
+    {
+        const fix15_t Sa = fix15_mul(src[3], opac);
+        const fix15_t one_minus_Sa = fix15_one - Sa;
+        dst[0] = fix15_sumprods(src[0], opac, one_minus_Sa, dst[0]);
+        dst[1] = fix15_sumprods(src[1], opac, one_minus_Sa, dst[1]);
+        dst[2] = fix15_sumprods(src[2], opac, one_minus_Sa, dst[2]);
+        if (DSTALPHA) {
+            dst[3] = fix15_short_clamp(Sa + fix15_mul(dst[3], one_minus_Sa));
+        }
+    }
+
+    // Pixels which need the spectral mix are gathered in batches of this
+    // many, so that their twenty fastpow()s each can be done by two calls
+    // to fastpow_n().
+    static const unsigned int BATCH_PIXELS = 64;
+
   public:
     inline void operator() (const fix15_short_t * const src,
                             fix15_short_t * const dst,
                             const fix15_short_t opac) const
     {
-        for (unsigned int i=0; i<BUFSIZE; i+=4) {
-            const fix15_t Sa = fix15_mul(src[i+3], opac);
-            const fix15_t one_minus_Sa = fix15_one - Sa;
-            if ((DSTALPHA && dst[i+3] == 0)|| Sa == (1<<15) || Sa == 0) {
-              dst[i+0] = fix15_sumprods(src[i], opac, one_minus_Sa, dst[i]);
-              dst[i+1] = fix15_sumprods(src[i+1], opac, one_minus_Sa, dst[i+1]);
-              dst[i+2] = fix15_sumprods(src[i+2], opac, one_minus_Sa, dst[i+2]);
-              if (DSTALPHA) {
-                dst[i+3] = fix15_short_clamp(Sa + fix15_mul(dst[i+3], one_minus_Sa));
-              }   
-            } else {
-              //alpha-weighted ratio for WGM (sums to 1.0)
-              //fix15_t dst_alpha = (1<<15);
-              float fac_a;
-              if (DSTALPHA) {
-                fac_a = (float)Sa / (Sa + one_minus_Sa * dst[i+3] / (1<<15));
-              } else {
-                fac_a = (float)Sa / (1<<15);
-              }
-              float fac_b = 1.0 - fac_a;
-
-              //convert bottom to spectral.  Un-premult alpha to obtain reflectance
-              //color noise is not a problem since low alpha also implies low weight
-              float spectral_b[10] = {0};
-              if (DSTALPHA && dst[i+3] > 0) {
-                rgb_to_spectral((float)dst[i] / dst[i+3], (float)dst[i+1] / dst[i+3], (float)dst[i+2] / dst[i+3], spectral_b);
-              } else {
-                rgb_to_spectral((float)dst[i]/ (1<<15), (float)dst[i+1]/ (1<<15), (float)dst[i+2]/ (1<<15), spectral_b);
-              }
-              // convert top to spectral.  Already straight color
-              float spectral_a[10] = {0};
-              if (src[i+3] > 0) {
-                rgb_to_spectral((float)src[i] / src[i+3], (float)src[i+1] / src[i+3], (float)src[i+2] / src[i+3], spectral_a);
-              } else {
-                rgb_to_spectral((float)src[i] / (1<<15), (float)src[i+1] / (1<<15), (float)src[i+2] / (1<<15), spectral_a);
-              }
-              // mix to the two spectral reflectances using WGM
-              float spectral_result[10] = {0};
-              for (int i=0; i<10; i++) {
-                spectral_result[i] = fastpow(spectral_a[i], fac_a) * fastpow(spectral_b[i], fac_b);
-              }
-              
-              // convert back to RGB and premultiply alpha
-              float rgb_result[4] = {0};
-              spectral_to_rgb(spectral_result, rgb_result);
-              if (DSTALPHA) {
-                rgb_result[3] = fix15_short_clamp(Sa + fix15_mul(dst[i+3], one_minus_Sa));
-              } else {
-                rgb_result[3] = (1<<15);
-              }
-              for (int j=0; j<3; j++) {
-                dst[i+j] =(rgb_result[j] * (rgb_result[3] + 0.5));
-              }
-              
-              if (DSTALPHA) {
-                  dst[i+3] = rgb_result[3];
-              }            
+        // Spectral reflectances of the top and bottom of each pixel in a
+        // batch, and their weights. The mix is done in place.
+        float spectral_a[BATCH_PIXELS*10], fac_a[BATCH_PIXELS*10];
+        float spectral_b[BATCH_PIXELS*10], fac_b[BATCH_PIXELS*10];
+        unsigned int offsets[BATCH_PIXELS];
+
+        unsigned int i = 0;
+        while (i < BUFSIZE) {
+            unsigned int n = 0;
+            for (; i < BUFSIZE && n < BATCH_PIXELS; i += 4) {
+                if (is_plain_src_over(src+i, dst+i, opac)) {
+                    combine_plain_pixel(src+i, dst+i, opac);
+                    continue;
+                }
+                const fix15_t Sa = fix15_mul(src[i+3], opac);
+                const float fa = src_mix_factor(Sa, fix15_one - Sa, dst+i);
+                const float fb = 1.0 - fa;
+                //convert bottom to spectral.  Un-premult alpha to obtain reflectance
+                //color noise is not a problem since low alpha also implies low weight
+                float r, g, b;
+                spectral_inputs(dst+i, DSTALPHA, r, g, b);
+                spectral_from_inputs(r, g, b, spectral_b + 10*n);
+                // convert top to spectral.  Already straight color
+                spectral_inputs(src+i, true, r, g, b);
+                spectral_from_inputs(r, g, b, spectral_a + 10*n);
+                for (int k=0; k<10; k++) {
+                    fac_a[10*n+k] = fa;
+                    fac_b[10*n+k] = fb;
+                }
+                offsets[n++] = i;
+            }
+            if (n == 0) {
+                continue;
             }
 
+            // mix to the two spectral reflectances using WGM
+            fastpow_n(spectral_a, fac_a, spectral_a, 10*n);
+            fastpow_n(spectral_b, fac_b, spectral_b, 10*n);
+
+            // convert back to RGB and premultiply alpha
+            for (unsigned int j=0; j<n; j++) {
+                const unsigned int o = offsets[j];
+                float rgb_result[4] = {0};
+                for (int k=0; k<10; k++) {
+                    const float mixed = spectral_a[10*j+k] * spectral_b[10*j+k];
+                    rgb_result[0] += T_MATRIX_SMALL[0][k] * mixed;
+                    rgb_result[1] += T_MATRIX_SMALL[1][k] * mixed;
+                    rgb_result[2] += T_MATRIX_SMALL[2][k] * mixed;
+                }
+                const fix15_t Sa = fix15_mul(src[o+3], opac);
+                store_result(rgb_result, Sa, fix15_one - Sa, dst+o);
+            }
         }
     }
 };
@@ -307,18 +398,30 @@ class BufferCombineFunc <DSTALPHA, BUFSIZE, BlendNormal, CompositeDestinationAto
 };
 
 
+// The separable modes below blend each channel on its own. Most do it in a
+// branch-free process_channel() template, which compositing_simd.cpp also
+// instantiates for whole vectors of channels: see fix15xN.hpp.
+
+
 // Multiply: http://www.w3.org/TR/compositing/#blendingmultiply
 
 class BlendMultiply : public BlendFunc
 {
+  public:
+    template <class T>
+    static inline void process_channel(const T &Cs, T &Cb)
+    {
+        Cb = fix15_mul(Cs, Cb);
+    }
+
   public:
     inline void operator()
         (const fix15_t src_r, const fix15_t src_g, const fix15_t src_b,
          fix15_t &dst_r, fix15_t &dst_g, fix15_t &dst_b) const
     {
-        dst_r = fix15_mul(src_r, dst_r);
-        dst_g = fix15_mul(src_g, dst_g);
-        dst_b = fix15_mul(src_b, dst_b);
+        process_channel(src_r, dst_r);
+        process_channel(src_g, dst_g);
+        process_channel(src_b, dst_b);
     }
 };
 
@@ -329,14 +432,21 @@ class BlendMultiply : public BlendFunc
 
 class BlendScreen : public BlendFunc
 {
+  public:
+    template <class T>
+    static inline void process_channel(const T &Cs, T &Cb)
+    {
+        Cb = Cb + Cs - fix15_mul(Cb, Cs);
+    }
+
   public:
     inline void operator()
         (const fix15_t src_r, const fix15_t src_g, const fix15_t src_b,
          fix15_t &dst_r, fix15_t &dst_g, fix15_t &dst_b) const
     {
-        dst_r = dst_r + src_r - fix15_mul(dst_r, src_r);
-        dst_g = dst_g + src_g - fix15_mul(dst_g, src_g);
-        dst_b = dst_b + src_b - fix15_mul(dst_b, src_b);
+        process_channel(src_r, dst_r);
+        process_channel(src_g, dst_g);
+        process_channel(src_b, dst_b);
     }
 };
 
@@ -346,20 +456,17 @@ class BlendScreen : public BlendFunc
 
 class BlendOverlay : public BlendFunc
 {
-  private:
-    static inline void process_channel(const fix15_t Cs, fix15_t &Cb)
+  public:
+    template <class T>
+    static inline void process_channel(const T &Cs, T &Cb)
     {
-        const fix15_t two_Cb = fix15_double(Cb);
-        if (two_Cb <= fix15_one) {
-            Cb = fix15_mul(Cs, two_Cb);
-        }
-        else {
-            const fix15_t tmp = two_Cb - fix15_one;
-            Cb = Cs + tmp - fix15_mul(Cs, tmp);
-        }
+        const T two_Cb = fix15_double(Cb);
+        const T tmp = two_Cb - fix15_one;
+        Cb = fix15_select(two_Cb <= fix15_one,
+                          fix15_mul(Cs, two_Cb),
+                          Cs + tmp - fix15_mul(Cs, tmp));
     }
 
-  public:
     inline void operator()
         (const fix15_t src_r, const fix15_t src_g, const fix15_t src_b,
          fix15_t &dst_r, fix15_t &dst_g, fix15_t &dst_b) const
@@ -375,14 +482,21 @@ class BlendOverlay : public BlendFunc
 
 class BlendDarken : public BlendFunc
 {
+  public:
+    template <class T>
+    static inline void process_channel(const T &Cs, T &Cb)
+    {
+        Cb = fix15_min(Cs, Cb);
+    }
+
   public:
     inline void operator()
         (const fix15_t src_r, const fix15_t src_g, const fix15_t src_b,
          fix15_t &dst_r, fix15_t &dst_g, fix15_t &dst_b) const
     {
-        if (src_r < dst_r) dst_r = src_r;
-        if (src_g < dst_g) dst_g = src_g;
-        if (src_b < dst_b) dst_b = src_b;
+        process_channel(src_r, dst_r);
+        process_channel(src_g, dst_g);
+        process_channel(src_b, dst_b);
     }
 };
 
@@ -391,14 +505,21 @@ class BlendDarken : public BlendFunc
 
 class BlendLighten : public BlendFunc
 {
+  public:
+    template <class T>
+    static inline void process_channel(const T &Cs, T &Cb)
+    {
+        Cb = fix15_max(Cs, Cb);
+    }
+
   public:
     inline void operator()
         (const fix15_t src_r, const fix15_t src_g, const fix15_t src_b,
          fix15_t &dst_r, fix15_t &dst_g, fix15_t &dst_b) const
     {
-        if (src_r > dst_r) dst_r = src_r;
-        if (src_g > dst_g) dst_g = src_g;
-        if (src_b > dst_b) dst_b = src_b;
+        process_channel(src_r, dst_r);
+        process_channel(src_g, dst_g);
+        process_channel(src_b, dst_b);
     }
 };
 
@@ -408,20 +529,17 @@ class BlendLighten : public BlendFunc
 
 class BlendHardLight : public BlendFunc
 {
-  private:
-    static inline void process_channel(const fix15_t Cs, fix15_t &Cb)
+  public:
+    template <class T>
+    static inline void process_channel(const T &Cs, T &Cb)
     {
-        const fix15_t two_Cs = fix15_double(Cs);
-        if (two_Cs <= fix15_one) {
-            Cb = fix15_mul(Cb, two_Cs);
-        }
-        else {
-            const fix15_t tmp = two_Cs - fix15_one;
-            Cb = Cb + tmp - fix15_mul(Cb, tmp);
-        }
+        const T two_Cs = fix15_double(Cs);
+        const T tmp = two_Cs - fix15_one;
+        Cb = fix15_select(two_Cs <= fix15_one,
+                          fix15_mul(Cb, two_Cs),
+                          Cb + tmp - fix15_mul(Cb, tmp));
     }
 
-  public:
     inline void operator()
         (const fix15_t src_r, const fix15_t src_g, const fix15_t src_b,
          fix15_t &dst_r, fix15_t &dst_g, fix15_t &dst_b) const
@@ -437,20 +555,15 @@ class BlendHardLight : public BlendFunc
 
 class BlendColorDodge : public BlendFunc
 {
-  private:
-    static inline void process_channel(const fix15_t Cs, fix15_t &Cb)
+  public:
+    template <class T>
+    static inline void process_channel(const T &Cs, T &Cb)
     {
-        if (Cs < fix15_one) {
-            const fix15_t tmp = fix15_div(Cb, fix15_one - Cs);
-            if (tmp < fix15_one) {
-                Cb = tmp;
-                return;
-            }
-        }
-        Cb = fix15_one;
+        Cb = fix15_select(Cs < fix15_one,
+                          fix15_div_clamp(Cb, fix15_one - Cs),
+                          fix15_one);
     }
 
-  public:
     inline void operator()
         (const fix15_t src_r, const fix15_t src_g, const fix15_t src_b,
          fix15_t &dst_r, fix15_t &dst_g, fix15_t &dst_b) const
@@ -466,20 +579,15 @@ class BlendColorDodge : public BlendFunc
 
 class BlendColorBurn : public BlendFunc
 {
-  private:
-    static inline void process_channel(const fix15_t Cs, fix15_t &Cb)
+  public:
+    template <class T>
+    static inline void process_channel(const T &Cs, T &Cb)
     {
-        if (Cs > 0) {
-            const fix15_t tmp = fix15_div(fix15_one - Cb, Cs);
-            if (tmp < fix15_one) {
-                Cb = fix15_one - tmp;
-                return;
-            }
-        }
-        Cb = 0;
+        Cb = fix15_select(Cs > 0,
+                          fix15_one - fix15_div_clamp(fix15_one - Cb, Cs),
+                          0);
     }
 
-  public:
     inline void operator()
         (const fix15_t src_r, const fix15_t src_g, const fix15_t src_b,
          fix15_t &dst_r, fix15_t &dst_g, fix15_t &dst_b) const
@@ -545,16 +653,13 @@ class BlendSoftLight : public BlendFunc
 
 class BlendDifference : public BlendFunc
 {
-  private:
-    static inline void process_channel(const fix15_t Cs, fix15_t &Cb)
+  public:
+    template <class T>
+    static inline void process_channel(const T &Cs, T &Cb)
     {
-        if (Cs >= Cb)
-            Cb = Cs - Cb;
-        else
-            Cb = Cb - Cs;
+        Cb = fix15_select(Cs >= Cb, Cs - Cb, Cb - Cs);
     }
 
-  public:
     inline void operator()
         (const fix15_t src_r, const fix15_t src_g, const fix15_t src_b,
          fix15_t &dst_r, fix15_t &dst_g, fix15_t &dst_b) const
@@ -570,13 +675,13 @@ class BlendDifference : public BlendFunc
 
 class BlendExclusion : public BlendFunc
 {
-  private:
-    static inline void process_channel(const fix15_t Cs, fix15_t &Cb)
+  public:
+    template <class T>
+    static inline void process_channel(const T &Cs, T &Cb)
     {
         Cb = Cb + Cs - fix15_double(fix15_mul(Cb, Cs));
     }
 
-  public:
     inline void operator()
         (const fix15_t src_r, const fix15_t src_g, const fix15_t src_b,
          fix15_t &dst_r, fix15_t &dst_g, fix15_t &dst_b) const
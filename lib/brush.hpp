@@ -16,6 +16,8 @@
 
 #include <mypaint-brush.h>
 
+#include "tracing.hpp"
+
 /** Brush:
  *
  * C++ wrapper around MyPaintBrush. */
@@ -65,6 +67,7 @@ public:
 
   bool stroke_to (Surface * surface, float x, float y, float pressure, float xtilt, float ytilt, double dtime, float viewzoom, float viewrotation, float barrel_rotation)
   {
+      TRACE_SCOPE("Brush::stroke_to");
       MyPaintSurface2 *c_surface = surface->get_surface2_interface();
       return mypaint_brush_stroke_to_2(c_brush, c_surface, x, y, pressure, xtilt, ytilt, dtime, viewzoom, viewrotation, barrel_rotation);
   }
@@ -0,0 +1,227 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef COLORCHANGER_CACHE_HPP
+#define COLORCHANGER_CACHE_HPP
+
+#include <stdint.h>
+#include <math.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Support code for the precalculated color changers (wash, crossed bowl),
+// and the HSV to RGBA row conversion the color ring uses too.
+//
+// The changers' hue/saturation/value offset tables depend on nothing but
+// the phase, so each table is computed once per process and shared by all
+// instances, whatever the brush color. The offsets all fit in 16 bits.
+
+struct ColorChangerTable {
+    explicit ColorChangerTable(int size)
+        : h(size*size), s(size*size), v(size*size) {}
+    std::vector<int16_t> h;
+    std::vector<int16_t> s;
+    std::vector<int16_t> v;
+};
+
+
+// The tables of one kind of color changer, one for each of its phases.
+
+class ColorChangerTableCache {
+  public:
+    typedef void (*PrecalcFunc)(float phase0, ColorChangerTable &table);
+    static const int NUM_PHASES = 4;
+
+    ColorChangerTableCache(int size, PrecalcFunc precalc)
+        : size(size), precalc(precalc) {}
+
+    const ColorChangerTable &
+    get(int phase_index)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::unique_ptr<ColorChangerTable> &t = tables[phase_index];
+        if (! t) {
+            t.reset(new ColorChangerTable(size));
+            precalc(2*M_PI*(phase_index/float(NUM_PHASES)), *t);
+        }
+        return *t;
+    }
+
+  private:
+    const int size;
+    const PrecalcFunc precalc;
+    std::mutex lock;
+    std::unique_ptr<ColorChangerTable> tables[NUM_PHASES];
+};
+
+
+// Offsets the brush color by each entry of a table, and writes the results
+// as opaque RGBA.
+//
+// With `fold`, saturations and values overshooting 0 or 1 by more than 0.2
+// are reflected back into range, as the wash changer wants. The others
+// are clamped. The vector code computes the same colors as the scalar code
+// using a branchless form of the HSV to RGB conversion; the two can differ
+// by one step of rounding now and then.
+
+#ifdef __SSE2__
+
+static inline __m128
+colorchanger_select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128
+colorchanger_floor(__m128 x)
+{
+    const __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.0f)));
+}
+
+static inline __m128
+colorchanger_fold(__m128 x)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 slack = _mm_set1_ps(0.2f);
+    // below 0: -(x + 0.2), or 0 when within slack
+    const __m128 lo = _mm_max_ps(_mm_sub_ps(zero, _mm_add_ps(x, slack)), zero);
+    x = colorchanger_select(_mm_cmplt_ps(x, zero), lo, x);
+    // above 1 (also after the above): 2.2 - x, or 1 when within slack
+    const __m128 top = _mm_add_ps(one, _mm_add_ps(one, slack));
+    const __m128 hi = _mm_min_ps(_mm_sub_ps(top, x), one);
+    x = colorchanger_select(_mm_cmpgt_ps(x, one), hi, x);
+    return x;
+}
+
+// One RGB channel of the HSV color: hue6 in [0, 6), n = 5, 3, 1 for R, G, B
+static inline __m128
+colorchanger_channel(__m128 hue6, __m128 s, __m128 v, float n)
+{
+    const __m128 six = _mm_set1_ps(6.0f);
+    __m128 k = _mm_add_ps(hue6, _mm_set1_ps(n));
+    k = _mm_sub_ps(k, _mm_and_ps(_mm_cmpge_ps(k, six), six));
+    __m128 m = _mm_min_ps(k, _mm_sub_ps(_mm_set1_ps(4.0f), k));
+    m = _mm_max_ps(_mm_min_ps(m, _mm_set1_ps(1.0f)), _mm_setzero_ps());
+    return _mm_sub_ps(v, _mm_mul_ps(_mm_mul_ps(v, s), m));
+}
+
+// Converts four HSV colors with components in [0, 1] (hue wrapping around,
+// the others clamped) to RGB bytes, packed with the given alpha bits.
+static inline __m128i
+colorchanger_pack(__m128 h, __m128 s, __m128 v, __m128i alpha)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    h = _mm_sub_ps(h, colorchanger_floor(h));
+    s = _mm_max_ps(_mm_min_ps(s, one), zero);
+    v = _mm_max_ps(_mm_min_ps(v, one), zero);
+    __m128 hue6 = _mm_mul_ps(h, _mm_set1_ps(6.0f));
+    hue6 = _mm_and_ps(hue6, _mm_cmplt_ps(hue6, _mm_set1_ps(6.0f)));
+    const __m128i r = _mm_cvttps_epi32(
+        _mm_mul_ps(colorchanger_channel(hue6, s, v, 5.0f), scale));
+    const __m128i g = _mm_cvttps_epi32(
+        _mm_mul_ps(colorchanger_channel(hue6, s, v, 3.0f), scale));
+    const __m128i b = _mm_cvttps_epi32(
+        _mm_mul_ps(colorchanger_channel(hue6, s, v, 1.0f), scale));
+    __m128i px = _mm_or_si128(r, _mm_slli_epi32(g, 8));
+    px = _mm_or_si128(px, _mm_slli_epi32(b, 16));
+    return _mm_or_si128(px, alpha);
+}
+
+#endif /* #ifdef __SSE2__ */
+
+
+// Converts a row of HSV colors and alphas in [0, 255] to RGBA.
+static inline void
+colorchanger_hsva_to_rgba(const float *h, const float *s, const float *v,
+                          const float *a, int n_pixels, uint8_t *pixels)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= n_pixels; i += 4) {
+        const __m128i alpha = _mm_slli_epi32(
+            _mm_cvttps_epi32(_mm_loadu_ps(a + i)), 24);
+        const __m128i px = colorchanger_pack(
+            _mm_loadu_ps(h + i), _mm_loadu_ps(s + i), _mm_loadu_ps(v + i),
+            alpha);
+        _mm_storeu_si128((__m128i *)(pixels + 4*i), px);
+    }
+#endif /* #ifdef __SSE2__ */
+    for (; i < n_pixels; i++) {
+        float r = h[i], g = s[i], b = v[i];
+        hsv_to_rgb_range_one(&r, &g, &b);
+        uint8_t * p = pixels + 4*i;
+        p[0] = r; p[1] = g; p[2] = b; p[3] = a[i];
+    }
+}
+
+
+static inline void
+colorchanger_render(const ColorChangerTable &table, int n_pixels,
+                    float brush_h, float brush_s, float brush_v,
+                    bool fold, uint8_t *pixels)
+{
+    const int16_t *th = &table.h[0];
+    const int16_t *ts = &table.s[0];
+    const int16_t *tv = &table.v[0];
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128 bh = _mm_set1_ps(brush_h);
+    const __m128 bs = _mm_set1_ps(brush_s);
+    const __m128 bv = _mm_set1_ps(brush_v);
+    const __m128 inv_360 = _mm_set1_ps(1.0f/360.0f);
+    const __m128 inv_255 = _mm_set1_ps(1.0f/255.0f);
+    const __m128i opaque = _mm_set1_epi32(0xff000000);
+    for (; i + 4 <= n_pixels; i += 4) {
+        const __m128i hi = _mm_loadl_epi64((const __m128i *)(th + i));
+        const __m128i si = _mm_loadl_epi64((const __m128i *)(ts + i));
+        const __m128i vi = _mm_loadl_epi64((const __m128i *)(tv + i));
+        // sign-extend the offsets to 32 bits
+        __m128 h = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16));
+        __m128 s = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(si, si), 16));
+        __m128 v = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(vi, vi), 16));
+        h = _mm_add_ps(bh, _mm_mul_ps(h, inv_360));
+        s = _mm_add_ps(bs, _mm_mul_ps(s, inv_255));
+        v = _mm_add_ps(bv, _mm_mul_ps(v, inv_255));
+        if (fold) {
+            s = colorchanger_fold(s);
+            v = colorchanger_fold(v);
+        }
+        const __m128i px = colorchanger_pack(h, s, v, opaque);
+        _mm_storeu_si128((__m128i *)(pixels + 4*i), px);
+    }
+#endif /* #ifdef __SSE2__ */
+
+    for (; i < n_pixels; i++) {
+        float h = brush_h + th[i]/360.0;
+        float s = brush_s + ts[i]/255.0;
+        float v = brush_v + tv[i]/255.0;
+        if (fold) {
+            if (s < 0) { if (s < -0.2) { s = - (s + 0.2); } else { s = 0; } }
+            if (s > 1) { if (s > 1.0 + 0.2) { s = 1.0 - ((s-0.2)-1.0); } else { s = 1.0; } }
+            if (v < 0) { if (v < -0.2) { v = - (v + 0.2); } else { v = 0; } }
+            if (v > 1) { if (v > 1.0 + 0.2) { v = 1.0 - ((v-0.2)-1.0); } else { v = 1.0; } }
+        }
+        hsv_to_rgb_range_one (&h, &s, &v);
+        uint8_t * p = pixels + 4*i;
+        p[0] = h; p[1] = s; p[2] = v; p[3] = 255;
+    }
+}
+
+#endif // COLORCHANGER_CACHE_HPP
@@ -26,26 +26,23 @@ public:
 
 #ifndef SWIG
 
-  struct PrecalcData {
-    int h;
-    int s;
-    int v;
-    //signed char s;
-    //signed char v;
-  };
-
-  PrecalcData * precalcData[4];
+  // Offset tables, shared by all instances. See colorchanger_cache.hpp.
+  const ColorChangerTable * precalcData;
   int precalcDataIndex;
 
   ColorChangerCrossedBowl()
   {
     precalcDataIndex = -1;
-    for (int i=0; i<4; i++) {
-      precalcData[i] = NULL;
-    }
+    precalcData = NULL;
   }
 
-  PrecalcData * precalc_data(float phase0)
+  static const ColorChangerTable & precalc_table(int index)
+  {
+    static ColorChangerTableCache cache(ccdb_size, precalc_data);
+    return cache.get(index);
+  }
+
+  static void precalc_data(float phase0, ColorChangerTable &result)
   {
     // Hint to the casual reader: some of the calculation here do not
     // what I originally intended. Not everything here will make sense.
@@ -54,11 +51,9 @@ public:
     int width, height;
     int x, y, i;
     int s_radius = ccdb_size/2.6;
-    PrecalcData * result;
 
     width = ccdb_size;
     height = ccdb_size;
-    result = (PrecalcData*)malloc(sizeof(PrecalcData)*width*height);
 
     i = 0;
     for (y=0; y<height; y++) {
@@ -134,20 +129,19 @@ public:
           }
         }
 
-        result[i].h = (int)h;
-        result[i].v = (int)v;
-        result[i].s = (int)s;
+        result.h[i] = (int)h;
+        result.v[i] = (int)v;
+        result.s[i] = (int)s;
         i++;
       }
     }
-    return result;
   }
 
-  void get_hsv(float &h, float &s, float &v, PrecalcData * pre)
+  void get_hsv(float &h, float &s, float &v, int i)
   {
-    h = brush_h + pre->h/360.0;
-    s = brush_s + pre->s/255.0;
-    v = brush_v + pre->v/255.0;
+    h = brush_h + precalcData->h[i]/360.0;
+    s = brush_s + precalcData->s[i]/255.0;
+    v = brush_v + precalcData->v[i]/255.0;
 
     h -= floor(h);
     s = CLAMP(s, 0.0, 1.0);
@@ -160,8 +154,6 @@ public:
   void render(PyObject * obj)
   {
     uint8_t * pixels;
-    int x, y;
-    float h, s, v;
 
     PyArrayObject* arr = (PyArrayObject*)obj;
 
@@ -173,36 +165,21 @@ public:
     pixels = (uint8_t*)PyArray_DATA(arr);
     
     precalcDataIndex++;
-    precalcDataIndex %= 4;
-
-    PrecalcData * pre = precalcData[precalcDataIndex];
-    if (!pre) {
-      pre = precalcData[precalcDataIndex] = precalc_data(2*M_PI*(precalcDataIndex/4.0));
-    }
-
-    for (y=0; y<ccdb_size; y++) {
-      for (x=0; x<ccdb_size; x++) {
-
-        get_hsv(h, s, v, pre);
-        pre++;
+    precalcDataIndex %= ColorChangerTableCache::NUM_PHASES;
+    precalcData = &precalc_table(precalcDataIndex);
 
-        hsv_to_rgb_range_one (&h, &s, &v);
-        uint8_t * p = pixels + 4*(y*ccdb_size + x);
-        p[0] = h; p[1] = s; p[2] = v; p[3] = 255;
-      }
-    }
+    colorchanger_render(*precalcData, ccdb_size*ccdb_size,
+                        brush_h, brush_s, brush_v, false, pixels);
   }
 
   PyObject* pick_color_at(float x_, float y_)
   {
     float h,s,v;
-    PrecalcData * pre = precalcData[precalcDataIndex];
     assert(precalcDataIndex >= 0);
-    assert(pre != NULL);
-    int x = CLAMP(x_, 0, ccdb_size);
-    int y = CLAMP(y_, 0, ccdb_size);
-    pre += y*ccdb_size + x;
-    get_hsv(h, s, v, pre);
+    assert(precalcData != NULL);
+    int x = CLAMP(x_, 0, ccdb_size-1);
+    int y = CLAMP(y_, 0, ccdb_size-1);
+    get_hsv(h, s, v, y*ccdb_size + x);
     return Py_BuildValue("fff",h,s,v);
   }
 };
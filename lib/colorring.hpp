@@ -9,6 +9,12 @@
 
 #include <cmath> // atan2, sqrt or hypot
 #include "helpers2.hpp"
+#include "colorchanger_cache.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 const int colorring_size = 256; // diameter of Swiss Cheese Wheel Color Selector(TM)
 const int center = (colorring_size/2); // radii/center coordinate of SCWCS
@@ -20,6 +26,82 @@ const float TWO_PI = 2.0f*M_PI;
 const float ONE_OVER_THREE = 1.0f/3.0f;
 const float TWO_OVER_THREE = 2.0f/3.0f;
   
+#ifndef SWIG
+
+// The rings of the selector, from the inside out
+enum SCWSRing {
+  SCWS_RING_HOLE,       // click to exit
+  SCWS_RING_CENTER,     // white disk around the hole
+  SCWS_RING_SATURATION,
+  SCWS_RING_VALUE,
+  SCWS_RING_HUE,
+  SCWS_RING_BORDER,     // current color
+  SCWS_RING_OUTSIDE,    // transparent
+};
+
+// Polar coordinates of every pixel of a selector of some size, relative to
+// its center, and the ring each one falls in. The rings keep their
+// proportions at sizes other than colorring_size.
+// Built once per size and shared, since they never change.
+class SCWSGeometry {
+public:
+  int size;
+  std::vector<float> theta;   // [0, 2*PI)
+  std::vector<unsigned char> ring;
+
+  static SCWSRing
+  ring_at(float radi, float scale)
+  {
+    if( radi <= 15.0f*scale ) return (radi < 12.0f*scale) ? SCWS_RING_HOLE : SCWS_RING_CENTER;
+    if( radi <= 47.0f*scale ) return SCWS_RING_SATURATION;
+    if( radi <= 81.0f*scale ) return SCWS_RING_VALUE;
+    if( radi <= 114.0f*scale ) return SCWS_RING_HUE;
+    if( radi <= 128.0f*scale ) return SCWS_RING_BORDER;
+    return SCWS_RING_OUTSIDE;
+  }
+
+  static void
+  polar_at(float x, float y, int size, float &radi, float &theta)
+  {
+    const int c = size/2;
+    float rel_x = (c-x);
+    float rel_y = (c-y);
+    radi = hypot( rel_x, rel_y );
+    theta = atan2( rel_y, rel_x );
+    if( theta < 0.0f ) theta += TWO_PI; // Range: [ 0, 2*PI )
+  }
+
+  static const SCWSGeometry &
+  get(int size)
+  {
+    static std::mutex lock;
+    static std::map<int, std::unique_ptr<SCWSGeometry>> cache;
+    std::lock_guard<std::mutex> guard(lock);
+    std::unique_ptr<SCWSGeometry> &g = cache[size];
+    if (! g) {
+      g.reset(new SCWSGeometry(size));
+    }
+    return *g;
+  }
+
+private:
+  explicit SCWSGeometry(int size_)
+    : size(size_), theta(size_*size_), ring(size_*size_)
+  {
+    const float scale = float(size) / colorring_size;
+    for (int y = 0; y < size; y++) {
+      for (int x = 0; x < size; x++) {
+        float radi, t;
+        polar_at(x, y, size, radi, t);
+        theta[y*size + x] = t;
+        ring[y*size + x] = ring_at(radi, scale);
+      }
+    }
+  }
+};
+
+#endif /* #ifndef SWIG */
+
 class SCWSColorSelector {
 public:
 
@@ -49,76 +131,94 @@ public:
   // 1 Mile of variables....
   void get_hsva_at( float* h, float* s, float* v, float* a, float x, float y, bool adjust_color = true, bool only_colors = true, float mark_h = 0.0f )
   {
-    float rel_x = (center-x);
-    float rel_y = (center-y);
-    
-    //float radi = sqrt( rel_x*rel_x + rel_y*rel_y ); // Pre-C99 solution
-    float radi = hypot( rel_x, rel_y );
-    float theta = atan2( rel_y, rel_x );
-    if( theta < 0.0f ) theta += TWO_PI; // Range: [ 0, 2*PI )
-  
+    const SCWSGeometry &geom = SCWSGeometry::get(colorring_size);
+    const int ix = x, iy = y;
+    if (ix == x && iy == y && ix >= 0 && iy >= 0
+        && ix < colorring_size && iy < colorring_size) {
+      const int i = iy*colorring_size + ix;
+      get_hsva_in_ring(h, s, v, a, (SCWSRing)geom.ring[i], geom.theta[i],
+                       adjust_color, only_colors, mark_h);
+      return;
+    }
+    float radi, theta;
+    SCWSGeometry::polar_at(x, y, colorring_size, radi, theta);
+    get_hsva_in_ring(h, s, v, a, SCWSGeometry::ring_at(radi, 1.0f), theta,
+                     adjust_color, only_colors, mark_h);
+  }
+
+#ifndef SWIG
+
+  void get_hsva_in_ring( float* h, float* s, float* v, float* a, SCWSRing ring, float theta, bool adjust_color, bool only_colors, float mark_h )
+  {
     // Current brush color
     *h = brush_h;
     *s = brush_s;
     *v = brush_v;
     *a = 255.0f; // Alpha is always [0,255]
-  
-    if( radi <= 15.0f ) // center disk
+
+    switch (ring) {
+    case SCWS_RING_HOLE:
+    case SCWS_RING_CENTER: // center disk
       {
-        if( radi < 12.0f ) {
+        if( ring == SCWS_RING_HOLE ) {
           // exit by clicking
           if (only_colors) *a = 0.0f;
         }
         *h = *s = 0.0f;
         *v = 1.0f;
       }
-    else if( radi > 15.0f && radi <= 47.0f ) // Saturation
+      break;
+    case SCWS_RING_SATURATION:
       {
         *s = (theta/TWO_PI);
-    
+
         if( only_colors == false && floor(*s*200.0f) == floor(brush_s*200.0f) ) {
           // Draw marker
           *s = *v = 1.0f;
           *h = mark_h;
         }
-    
+
       }
-    else if( radi > 47.0f && radi <= 81.0f ) // Value 
+      break;
+    case SCWS_RING_VALUE:
       {
         *v = (theta/TWO_PI);
-    
+
         if( only_colors == false && floor(*v*200.0f) == floor(brush_v*200.0f) ) {
           // Draw marker
           *s = *v = 1.0f;
           *h = mark_h;
         }
-    
+
       }
-    else if( radi > 81.0f && radi <= 114.0f ) // Hue
+      break;
+    case SCWS_RING_HUE:
       {
         *h = (theta*RAD_TO_ONE);
-    
+
         if( only_colors == false && floor(*h*200.0f) == floor(brush_h*200.0f) ) {
           // Draw marker
           *h = mark_h;
         }
-    
+
         if( adjust_color == false ) {
           // Picking a new hue resets Saturation and Value
           *s = *v = 1.0f;
         }
       }
-    else if( radi > 114.0f && radi <= 128.0f ) // outermost border ring
-      {
-        // nothing, leave selected color
-      }
-    else if( radi > 128.0f ) // Masked/Clipped/Transparent area
-      {
-        // transparent/cut away
-        *a = 0.0f;
-      }
+      break;
+    case SCWS_RING_BORDER: // outermost border ring
+      // nothing, leave selected color
+      break;
+    case SCWS_RING_OUTSIDE: // Masked/Clipped/Transparent area
+      // transparent/cut away
+      *a = 0.0f;
+      break;
+    }
   }
 
+#endif /* #ifndef SWIG */
+
   PyObject* pick_color_at( float x, float y)
   {
     float h,s,v,a;
@@ -142,17 +242,19 @@ public:
   
     const int pixels_inc = PyArray_DIM(arr, 2);
   
-    float h,s,v,a;
-  
     float ofs_h = ((brush_h+ONE_OVER_THREE)>1.0f)?(brush_h-TWO_OVER_THREE):(brush_h+ONE_OVER_THREE); // offset hue
 
-    for(float y=0; y<colorring_size; y++) {
-      for(float x=0; x<colorring_size; x++) {
-        get_hsva_at(&h, &s, &v, &a, x, y, false, false, ofs_h);
-        hsv_to_rgb_range_one(&h,&s,&v); // convert from HSV [0,1] to RGB [0,255]
-        pixels[0] = h; pixels[1] = s; pixels[2] = v; pixels[3] = a;
-        pixels += pixels_inc; // next pixel block
+    // Look up each row's colors, then convert the row in one go
+    const SCWSGeometry &geom = SCWSGeometry::get(colorring_size);
+    float h[colorring_size], s[colorring_size], v[colorring_size], a[colorring_size];
+    for(int y=0; y<colorring_size; y++) {
+      for(int x=0; x<colorring_size; x++) {
+        const int i = y*colorring_size + x;
+        get_hsva_in_ring(&h[x], &s[x], &v[x], &a[x], (SCWSRing)geom.ring[i],
+                         geom.theta[i], false, false, ofs_h);
       }
+      colorchanger_hsva_to_rgba(h, s, v, a, colorring_size, pixels);
+      pixels += colorring_size*pixels_inc; // next row
     }
   }
 };
@@ -0,0 +1,415 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "compositing_simd.hpp"
+#include "blending.hpp"
+
+#include <mypaint-tiled-surface.h>
+
+#include <stddef.h>
+
+// The build does not pass any -m flags, so x86 kernels are compiled for
+// their instruction set with function attributes and picked at runtime.
+// NEON is part of the AArch64 baseline and needs no runtime check.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_COMBINE_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_COMBINE_NEON
+#include <arm_neon.h>
+#endif
+
+
+static const unsigned int TILE_BUFSIZE = MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE*4;
+
+
+#ifdef SIMD_COMBINE_X86
+
+namespace simd_sse2 {
+
+// The x86-64 baseline, emulating what SSE4.1 added: 32-bit multiplies,
+// unsigned minima, blends, and widening or narrowing moves.
+
+#define SIMD_TARGET __attribute__((target("sse2")))
+
+typedef __m128i vec;
+static const int PIXELS_PER_VEC = 1;
+
+static inline SIMD_TARGET vec set1 (uint32_t n) { return _mm_set1_epi32(n); }
+static inline SIMD_TARGET vec add (vec a, vec b) { return _mm_add_epi32(a, b); }
+static inline SIMD_TARGET vec sub (vec a, vec b) { return _mm_sub_epi32(a, b); }
+static inline SIMD_TARGET vec shr15 (vec a) { return _mm_srli_epi32(a, 15); }
+static inline SIMD_TARGET vec eq (vec a, vec b) { return _mm_cmpeq_epi32(a, b); }
+static inline SIMD_TARGET vec gt (vec a, vec b) { return _mm_cmpgt_epi32(a, b); }
+
+static inline SIMD_TARGET vec
+mul (vec a, vec b)
+{
+    // Low halves of the products of the even, then the odd lanes
+    const __m128i even = _mm_mul_epu32(a, b);
+    const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32),
+                                      _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(
+        _mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+        _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline SIMD_TARGET vec
+select (vec m, vec a, vec b)
+{
+    return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+static inline SIMD_TARGET vec
+gt_u (vec a, vec b)
+{
+    const __m128i bias = _mm_set1_epi32(0x80000000);
+    return _mm_cmpgt_epi32(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias));
+}
+
+static inline SIMD_TARGET vec min_u (vec a, vec b) { return select(gt_u(a, b), b, a); }
+static inline SIMD_TARGET vec max_u (vec a, vec b) { return select(gt_u(a, b), a, b); }
+
+static inline SIMD_TARGET vec
+splat_alpha (vec a)
+{
+    return _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+static inline SIMD_TARGET vec
+with_alpha (vec c, vec a)
+{
+    return select(_mm_set_epi32(-1, 0, 0, 0), a, c);
+}
+
+static inline SIMD_TARGET vec
+div_clamp (vec x, vec y)
+{
+    // See the SSE4.1 version. The operands fit in 16 bits, so signed
+    // comparisons will do.
+    const vec n = _mm_slli_epi32(x, 15);
+    const vec yy = select(eq(y, set1(0)), set1(1), y);
+    vec q = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(n),
+                                        _mm_cvtepi32_ps(yy)));
+    q = _mm_add_epi32(q, _mm_cmpgt_epi32(mul(q, yy), n));
+    return select(_mm_cmplt_epi32(x, yy), q, set1(fix15_one));
+}
+
+static inline SIMD_TARGET void
+load (const fix15_short_t *p, vec &lo, vec &hi)
+{
+    const __m128i v = _mm_loadu_si128((const __m128i *)p);
+    const __m128i zero = _mm_setzero_si128();
+    lo = _mm_unpacklo_epi16(v, zero);
+    hi = _mm_unpackhi_epi16(v, zero);
+}
+
+static inline SIMD_TARGET void
+store (fix15_short_t *p, vec lo, vec hi)
+{
+    // Sign-extending the low 16 bits lets the signed saturating pack
+    // truncate instead.
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    _mm_storeu_si128((__m128i *)p, _mm_packs_epi32(lo, hi));
+}
+
+#include "fix15xN.hpp"
+#include "compositing_simd_kernels.hpp"
+
+#undef SIMD_TARGET
+
+} // namespace simd_sse2
+
+
+namespace simd_sse41 {
+
+#define SIMD_TARGET __attribute__((target("sse4.1")))
+
+typedef __m128i vec;
+static const int PIXELS_PER_VEC = 1;
+
+static inline SIMD_TARGET vec set1 (uint32_t n) { return _mm_set1_epi32(n); }
+static inline SIMD_TARGET vec add (vec a, vec b) { return _mm_add_epi32(a, b); }
+static inline SIMD_TARGET vec sub (vec a, vec b) { return _mm_sub_epi32(a, b); }
+static inline SIMD_TARGET vec mul (vec a, vec b) { return _mm_mullo_epi32(a, b); }
+static inline SIMD_TARGET vec shr15 (vec a) { return _mm_srli_epi32(a, 15); }
+static inline SIMD_TARGET vec min_u (vec a, vec b) { return _mm_min_epu32(a, b); }
+static inline SIMD_TARGET vec max_u (vec a, vec b) { return _mm_max_epu32(a, b); }
+static inline SIMD_TARGET vec eq (vec a, vec b) { return _mm_cmpeq_epi32(a, b); }
+static inline SIMD_TARGET vec gt (vec a, vec b) { return _mm_cmpgt_epi32(a, b); }
+
+static inline SIMD_TARGET vec
+select (vec m, vec a, vec b)
+{
+    return _mm_blendv_epi8(b, a, m);
+}
+
+static inline SIMD_TARGET vec
+splat_alpha (vec a)
+{
+    return _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+static inline SIMD_TARGET vec
+with_alpha (vec c, vec a)
+{
+    return _mm_blend_epi16(c, a, 0xc0);
+}
+
+static inline SIMD_TARGET vec
+div_clamp (vec x, vec y)
+{
+    // Both operands fit in 16 bits. If x >= y the quotient clamps to
+    // fix15_one, otherwise x<<15 is exact as a float and the rounded float
+    // quotient is at most one too large, which one multiply can detect.
+    const vec n = _mm_slli_epi32(x, 15);
+    const vec yy = _mm_max_epu32(y, set1(1));
+    vec q = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(n),
+                                        _mm_cvtepi32_ps(yy)));
+    q = _mm_add_epi32(q, _mm_cmpgt_epi32(_mm_mullo_epi32(q, yy), n));
+    return _mm_blendv_epi8(set1(fix15_one), q, _mm_cmplt_epi32(x, yy));
+}
+
+static inline SIMD_TARGET void
+load (const fix15_short_t *p, vec &lo, vec &hi)
+{
+    const __m128i v = _mm_loadu_si128((const __m128i *)p);
+    lo = _mm_cvtepu16_epi32(v);
+    hi = _mm_cvtepu16_epi32(_mm_srli_si128(v, 8));
+}
+
+static inline SIMD_TARGET void
+store (fix15_short_t *p, vec lo, vec hi)
+{
+    const __m128i low16 = _mm_set1_epi32(0xffff);
+    lo = _mm_and_si128(lo, low16);
+    hi = _mm_and_si128(hi, low16);
+    _mm_storeu_si128((__m128i *)p, _mm_packus_epi32(lo, hi));
+}
+
+#include "fix15xN.hpp"
+#include "compositing_simd_kernels.hpp"
+
+#undef SIMD_TARGET
+
+} // namespace simd_sse41
+
+
+namespace simd_avx2 {
+
+#define SIMD_TARGET __attribute__((target("avx2")))
+
+typedef __m256i vec;
+static const int PIXELS_PER_VEC = 2;
+
+static inline SIMD_TARGET vec set1 (uint32_t n) { return _mm256_set1_epi32(n); }
+static inline SIMD_TARGET vec add (vec a, vec b) { return _mm256_add_epi32(a, b); }
+static inline SIMD_TARGET vec sub (vec a, vec b) { return _mm256_sub_epi32(a, b); }
+static inline SIMD_TARGET vec mul (vec a, vec b) { return _mm256_mullo_epi32(a, b); }
+static inline SIMD_TARGET vec shr15 (vec a) { return _mm256_srli_epi32(a, 15); }
+static inline SIMD_TARGET vec min_u (vec a, vec b) { return _mm256_min_epu32(a, b); }
+static inline SIMD_TARGET vec max_u (vec a, vec b) { return _mm256_max_epu32(a, b); }
+static inline SIMD_TARGET vec eq (vec a, vec b) { return _mm256_cmpeq_epi32(a, b); }
+static inline SIMD_TARGET vec gt (vec a, vec b) { return _mm256_cmpgt_epi32(a, b); }
+
+static inline SIMD_TARGET vec
+select (vec m, vec a, vec b)
+{
+    return _mm256_blendv_epi8(b, a, m);
+}
+
+static inline SIMD_TARGET vec
+splat_alpha (vec a)
+{
+    return _mm256_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+static inline SIMD_TARGET vec
+with_alpha (vec c, vec a)
+{
+    return _mm256_blend_epi32(c, a, 0x88);
+}
+
+static inline SIMD_TARGET vec
+div_clamp (vec x, vec y)
+{
+    // See the SSE4.1 version
+    const vec n = _mm256_slli_epi32(x, 15);
+    const vec yy = _mm256_max_epu32(y, set1(1));
+    vec q = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(n),
+                                              _mm256_cvtepi32_ps(yy)));
+    q = _mm256_add_epi32(q, _mm256_cmpgt_epi32(_mm256_mullo_epi32(q, yy), n));
+    return _mm256_blendv_epi8(set1(fix15_one), q, _mm256_cmpgt_epi32(yy, x));
+}
+
+static inline SIMD_TARGET void
+load (const fix15_short_t *p, vec &lo, vec &hi)
+{
+    const __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+    hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+}
+
+static inline SIMD_TARGET void
+store (fix15_short_t *p, vec lo, vec hi)
+{
+    // The pack works within 128-bit halves, so the pixels come out
+    // in the order 0, 2, 1, 3 and need to be permuted back.
+    const __m256i low16 = _mm256_set1_epi32(0xffff);
+    lo = _mm256_and_si256(lo, low16);
+    hi = _mm256_and_si256(hi, low16);
+    const __m256i packed = _mm256_packus_epi32(lo, hi);
+    _mm256_storeu_si256((__m256i *)p,
+        _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+#include "fix15xN.hpp"
+#include "compositing_simd_kernels.hpp"
+
+#undef SIMD_TARGET
+
+} // namespace simd_avx2
+
+#endif // SIMD_COMBINE_X86
+
+
+#ifdef SIMD_COMBINE_NEON
+
+namespace simd_neon {
+
+#define SIMD_TARGET
+
+typedef uint32x4_t vec;
+static const int PIXELS_PER_VEC = 1;
+
+static inline vec set1 (uint32_t n) { return vdupq_n_u32(n); }
+static inline vec add (vec a, vec b) { return vaddq_u32(a, b); }
+static inline vec sub (vec a, vec b) { return vsubq_u32(a, b); }
+static inline vec mul (vec a, vec b) { return vmulq_u32(a, b); }
+static inline vec shr15 (vec a) { return vshrq_n_u32(a, 15); }
+static inline vec min_u (vec a, vec b) { return vminq_u32(a, b); }
+static inline vec max_u (vec a, vec b) { return vmaxq_u32(a, b); }
+static inline vec eq (vec a, vec b) { return vceqq_u32(a, b); }
+static inline vec gt (vec a, vec b) { return vcgtq_u32(a, b); }
+static inline vec select (vec m, vec a, vec b) { return vbslq_u32(m, a, b); }
+static inline vec splat_alpha (vec a) { return vdupq_laneq_u32(a, 3); }
+
+static inline vec
+with_alpha (vec c, vec a)
+{
+    static const uint32_t alpha_lane[4] = {0, 0, 0, 0xffffffff};
+    return vbslq_u32(vld1q_u32(alpha_lane), a, c);
+}
+
+static inline vec
+div_clamp (vec x, vec y)
+{
+    // See the SSE4.1 version
+    const vec n = vshlq_n_u32(x, 15);
+    const vec yy = vmaxq_u32(y, set1(1));
+    vec q = vcvtq_u32_f32(vdivq_f32(vcvtq_f32_u32(n), vcvtq_f32_u32(yy)));
+    q = vaddq_u32(q, vcgtq_u32(vmulq_u32(q, yy), n));
+    return vbslq_u32(vcltq_u32(x, yy), q, set1(fix15_one));
+}
+
+static inline void
+load (const fix15_short_t *p, vec &lo, vec &hi)
+{
+    const uint16x8_t v = vld1q_u16(p);
+    lo = vmovl_u16(vget_low_u16(v));
+    hi = vmovl_high_u16(v);
+}
+
+static inline void
+store (fix15_short_t *p, vec lo, vec hi)
+{
+    vst1q_u16(p, vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)));
+}
+
+#include "fix15xN.hpp"
+#include "compositing_simd_kernels.hpp"
+
+#undef SIMD_TARGET
+
+} // namespace simd_neon
+
+#endif // SIMD_COMBINE_NEON
+
+
+// Runtime dispatch
+
+struct SIMDCombineTable
+{
+    const char *variant;
+    SIMDCombineFunc funcs[NumCombineModes][2];
+};
+
+
+static SIMDCombineTable
+simd_combine_table_init ()
+{
+    SIMDCombineTable table = SIMDCombineTable();
+    table.variant = "none";
+#if defined(SIMD_COMBINE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        table.variant = "avx2";
+        simd_avx2::register_kernels(table.funcs);
+    }
+    else if (__builtin_cpu_supports("sse4.1")) {
+        table.variant = "sse4.1";
+        simd_sse41::register_kernels(table.funcs);
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        table.variant = "sse2";
+        simd_sse2::register_kernels(table.funcs);
+    }
+#elif defined(SIMD_COMBINE_NEON)
+    table.variant = "neon";
+    simd_neon::register_kernels(table.funcs);
+#endif
+    return table;
+}
+
+
+static const SIMDCombineTable &
+simd_combine_table ()
+{
+    static const SIMDCombineTable table = simd_combine_table_init();
+    return table;
+}
+
+
+static bool simd_combine_enabled = true;
+
+
+SIMDCombineFunc
+simd_combine_func (enum CombineMode mode, const bool dst_has_alpha)
+{
+    if (!simd_combine_enabled || mode >= NumCombineModes || mode < 0) {
+        return NULL;
+    }
+    return simd_combine_table().funcs[mode][dst_has_alpha ? 1 : 0];
+}
+
+
+const char *
+simd_combine_variant ()
+{
+    return simd_combine_table().variant;
+}
+
+
+void
+simd_combine_set_enabled (const bool enabled)
+{
+    simd_combine_enabled = enabled;
+}
@@ -0,0 +1,51 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+// Vectorized tile combine kernels for Normal, Destination Out, and most of
+// the separable blend modes
+
+#ifndef COMPOSITING_SIMD_HPP
+#define COMPOSITING_SIMD_HPP
+
+#include "fix15.hpp"
+#include "pixops.hpp"
+
+
+// A tile-sized combine operation, with the same contract as the
+// BufferCombineFunc<> it replaces: premultiplied fix15 RGBA in src and dst,
+// results written back into dst.
+
+typedef void (*SIMDCombineFunc) (const fix15_short_t *src,
+                                 fix15_short_t *dst,
+                                 const fix15_short_t opac);
+
+
+// Returns the fastest vectorized kernel the running CPU supports for a mode,
+// or NULL if the generic BufferCombineFunc<> must be used instead.
+//
+// The instruction set is chosen once, at the first call. All kernels produce
+// output which is bit-for-bit identical to the generic code.
+
+SIMDCombineFunc
+simd_combine_func (enum CombineMode mode, const bool dst_has_alpha);
+
+
+// Name of the instruction set chosen at runtime, or "none".
+
+const char *
+simd_combine_variant ();
+
+
+// Allows the vectorized kernels to be turned off, for comparison testing.
+
+void
+simd_combine_set_enabled (const bool enabled);
+
+
+#endif // COMPOSITING_SIMD_HPP
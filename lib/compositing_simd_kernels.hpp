@@ -0,0 +1,191 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+// Instruction-set independent bodies of the vectorized combine kernels.
+//
+// This file is included once per instruction set by compositing_simd.cpp,
+// inside a namespace which already defines SIMD_TARGET, the vector type
+// "vec", PIXELS_PER_VEC, and these lane operations:
+//
+//   set1(n)            broadcast a uint32_t to all lanes
+//   add, sub, mul      wrapping uint32_t arithmetic, as with fix15_t
+//   shr15(a)           logical right shift by the fix15 fraction bits
+//   min_u(a, b)        unsigned minimum
+//   max_u(a, b)        unsigned maximum
+//   eq(a, b)           all bits set in lanes where a == b
+//   gt(a, b)           all bits set in lanes where a > b, for lanes < 2**31
+//   select(m, a, b)    lanes of a where m is set, lanes of b elsewhere
+//   splat_alpha(a)     each pixel's alpha copied to all of its channels
+//   with_alpha(c, a)   the colour channels of c with the alpha of a
+//   div_clamp(x, y)    fix15_short_clamp(fix15_div(x, y)); y==0 is undefined
+//   load(p, lo, hi)    widens 2*PIXELS_PER_VEC uint16_t pixels to 32 bits
+//   store(p, lo, hi)   narrows them back, truncating like a uint16_t store
+//
+// Every lane is a single channel of a single pixel stored in 32 bits, so the
+// arithmetic below is an exact transcription of the scalar fix15 code it
+// replaces. The fix15xN type built on them (fix15xN.hpp) must already be
+// defined too. There is deliberately no include guard.
+
+
+// Normal + svg:src-over, as in the BufferCombineFunc<> specialization in
+// blending.hpp. Works in premultiplied alpha.
+
+template <bool DSTALPHA>
+static SIMD_TARGET void
+combine_normal_src_over (const fix15_short_t * const src,
+                         fix15_short_t * const dst,
+                         const fix15_short_t opac)
+{
+    const vec k_one = set1(fix15_one);
+    const vec k_opac = set1(opac);
+    for (unsigned int i = 0; i < TILE_BUFSIZE; i += 8*PIXELS_PER_VEC) {
+        vec s[2], d[2];
+        load(src + i, s[0], s[1]);
+        load(dst + i, d[0], d[1]);
+        for (int p = 0; p < 2; ++p) {
+            const vec Sa = shr15(mul(splat_alpha(s[p]), k_opac));
+            const vec one_minus_Sa = sub(k_one, Sa);
+            const vec c = shr15(add(mul(s[p], k_opac),
+                                    mul(one_minus_Sa, d[p])));
+            if (DSTALPHA) {
+                const vec a = min_u(add(Sa, shr15(mul(d[p], one_minus_Sa))),
+                                    k_one);
+                d[p] = with_alpha(c, a);
+            }
+            else {
+                d[p] = with_alpha(c, d[p]);
+            }
+        }
+        store(dst + i, d[0], d[1]);
+    }
+}
+
+
+// Separable blend modes + svg:src-over, as done by the generic
+// BufferCombineFunc<> in compositing.hpp: unpremultiply, blend, composite.
+// The blend step is BLENDFUNC's process_channel(), instantiated for fix15xN,
+// and applied to all four channels at once; whatever it makes of the alpha
+// lanes is replaced afterwards. Flattening makes sure all of the fix15xN
+// operations are inlined, since the functor's template is compiled without
+// this namespace's target attribute.
+
+template <bool DSTALPHA, class BLENDFUNC>
+static SIMD_TARGET __attribute__((flatten)) void
+combine_separable_src_over (const fix15_short_t * const src,
+                            fix15_short_t * const dst,
+                            const fix15_short_t opac)
+{
+    // CompositeSourceOver::zero_alpha_has_effect is false
+    if (opac == 0) {
+        return;
+    }
+    const fix15xN k_opac(opac);
+#pragma omp parallel for
+    for (unsigned int i = 0; i < TILE_BUFSIZE; i += 8*PIXELS_PER_VEC) {
+        vec s[2], d[2];
+        load(src + i, s[0], s[1]);
+        load(dst + i, d[0], d[1]);
+        for (int p = 0; p < 2; ++p) {
+            const fix15xN Sp(s[p]);
+            const fix15xN Dp(d[p]);
+
+            // Unpremultiplied source. Zero-alpha pixels are left alone.
+            const fix15xN as(splat_alpha(s[p]));
+            const fix15xN_mask skip = (as == 0);
+            const fix15xN Cs = fix15_div_clamp(Sp, as);
+
+            // Unpremultiplied backdrop
+            const fix15xN Da(splat_alpha(d[p]));
+            fix15xN ab, Cb;
+            if (DSTALPHA) {
+                ab = Da;
+                Cb = fix15_select(ab == 0, 0, fix15_div_clamp(Dp, ab));
+            }
+            else {
+                ab = fix15_one;
+                Cb = Dp;
+            }
+
+            BLENDFUNC::process_channel(Cs, Cb);
+            if (DSTALPHA) {
+                Cb = fix15_sumprods(fix15_one - ab, Cs, ab, Cb);
+            }
+
+            // CompositeSourceOver, which also writes alpha for !DSTALPHA
+            const fix15xN Sa = fix15_mul(as, k_opac);
+            const fix15xN one_minus_Sa = fix15_one - Sa;
+            const fix15xN c = fix15_short_clamp(
+                fix15_sumprods(Sa, Cb, one_minus_Sa, Dp));
+            const fix15xN a = fix15_short_clamp(
+                Sa + fix15_mul(Da, one_minus_Sa));
+            d[p] = fix15_select(skip, Dp, fix15xN(with_alpha(c.v, a.v))).v;
+        }
+        store(dst + i, d[0], d[1]);
+    }
+}
+
+
+// Normal + svg:dst-out, as in the BufferCombineFunc<> specialization in
+// blending.hpp. Works in premultiplied alpha.
+
+template <bool DSTALPHA>
+static SIMD_TARGET void
+combine_normal_dst_out (const fix15_short_t * const src,
+                        fix15_short_t * const dst,
+                        const fix15_short_t opac)
+{
+    const vec k_one = set1(fix15_one);
+    const vec k_opac = set1(opac);
+    for (unsigned int i = 0; i < TILE_BUFSIZE; i += 8*PIXELS_PER_VEC) {
+        vec s[2], d[2];
+        load(src + i, s[0], s[1]);
+        load(dst + i, d[0], d[1]);
+        for (int p = 0; p < 2; ++p) {
+            const vec one_minus_Sa = sub(k_one,
+                                         shr15(mul(splat_alpha(s[p]), k_opac)));
+            const vec c = shr15(mul(d[p], one_minus_Sa));
+            d[p] = DSTALPHA ? c : with_alpha(c, d[p]);
+        }
+        store(dst + i, d[0], d[1]);
+    }
+}
+
+
+template <class BLENDFUNC>
+static void
+register_separable (SIMDCombineFunc funcs[2])
+{
+    funcs[0] = combine_separable_src_over<false, BLENDFUNC>;
+    funcs[1] = combine_separable_src_over<true, BLENDFUNC>;
+}
+
+
+// Fills in the [mode][dst_has_alpha] lookup table with this namespace's
+// kernels. BlendSoftLight's channel function is still scalar-only, and the
+// non-separable and spectral modes work on whole pixels, so those modes
+// use the generic code.
+
+static void
+register_kernels (SIMDCombineFunc funcs[NumCombineModes][2])
+{
+    funcs[CombineNormal][0] = combine_normal_src_over<false>;
+    funcs[CombineNormal][1] = combine_normal_src_over<true>;
+    register_separable<BlendMultiply>(funcs[CombineMultiply]);
+    register_separable<BlendScreen>(funcs[CombineScreen]);
+    register_separable<BlendOverlay>(funcs[CombineOverlay]);
+    register_separable<BlendDarken>(funcs[CombineDarken]);
+    register_separable<BlendLighten>(funcs[CombineLighten]);
+    register_separable<BlendHardLight>(funcs[CombineHardLight]);
+    register_separable<BlendColorBurn>(funcs[CombineColorBurn]);
+    register_separable<BlendColorDodge>(funcs[CombineColorDodge]);
+    register_separable<BlendDifference>(funcs[CombineDifference]);
+    register_separable<BlendExclusion>(funcs[CombineExclusion]);
+    funcs[CombineDestinationOut][0] = combine_normal_dst_out<false>;
+    funcs[CombineDestinationOut][1] = combine_normal_dst_out<true>;
+}
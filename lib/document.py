@@ -66,6 +66,7 @@ CACHE_DOC_SUBDIR_PREFIX = u"doc."
 CACHE_DOC_AUTOSAVE_SUBDIR = u"autosave"
 CACHE_ACTIVITY_FILE = u"active"
 CACHE_UPDATE_INTERVAL = 10  # seconds
+COLD_TILE_CHUNK_SIZE = 200  # tiles examined per idle callback
 
 # Logging and error reporting strings
 _LOAD_FAILED_COMMON_TEMPLATE_LINE = C_(
@@ -326,8 +327,10 @@ class Document (object):
         self._autosave_processor = None
         self._autosave_countdown_id = None
         self._autosave_dirty = False
+        self._tile_compressor = None
         if (not painting_only) and self._owns_cache_dir:
             self._autosave_processor = lib.idletask.Processor()
+            self._tile_compressor = lib.idletask.Processor()
             self.command_stack.stack_updated += self._command_stack_updated_cb
             self.effective_bbox_changed += self._effective_bbox_changed_cb
 
@@ -415,6 +418,7 @@ class Document (object):
             return
         self._stop_cache_updater()
         self._stop_autosave_writes()
+        self._tile_compressor.stop()
         shutil.rmtree(self._cache_dir, ignore_errors=True)
         if os.path.exists(self._cache_dir):
             logger.error(
@@ -514,6 +518,35 @@ class Document (object):
         os.utime(activity_file_path, None)
         if self._autosave_dirty:
             self._start_autosave_countdown()
+        self._queue_cold_tile_compression()
+        return True
+
+    ## Compression of tiles which are not in use
+
+    def _queue_cold_tile_compression(self):
+        """Queue a pass over all layers, compressing unused tile data
+
+        Runs on each tick of the cache updater, so a tile which has not
+        been used for one to two intervals gets compressed.
+
+        """
+        assert not self._painting_only
+        if self._tile_compressor.has_work():
+            return
+        for l in self.layer_stack.deepiter():
+            if isinstance(l, layer.SurfaceBackedLayer):
+                self._tile_compressor.add_work(
+                    self._compress_cold_tiles_cb,
+                    l.iter_compress_cold_tiles(),
+                )
+
+    def _compress_cold_tiles_cb(self, tiles):
+        """Payload: examine a chunk of tiles, returning True if more"""
+        for i in range(COLD_TILE_CHUNK_SIZE):
+            try:
+                next(tiles)
+            except StopIteration:
+                return False
         return True
 
     ## Autosave flag
@@ -1799,8 +1832,14 @@ class Document (object):
         cb = kwargs.get('incompatible_ora_cb', ignore)
         return cb(compat_type, prerel, filename, target_version)
 
-    def load_ora(self, filename, progress=None, **kwargs):
-        """Loads from an OpenRaster file"""
+    def load_ora(self, filename, progress=None, lazy=True, **kwargs):
+        """Loads from an OpenRaster file
+
+        Unless `lazy` is false, the layer PNGs are only decoded when
+        something first needs their pixels, so hidden layers can stay
+        undecoded until they are shown.
+
+        """
         logger.info('load_ora: %r', filename)
         t0 = time.time()
         self.clear()
@@ -1833,6 +1872,7 @@ class Document (object):
             progress,
             x=0, y=0,
             invert_strokemaps=(eotf is None),
+            lazy=lazy,
             **kwargs
         )
         assert len(self.layer_stack) > 0
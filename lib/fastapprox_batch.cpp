@@ -0,0 +1,295 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "fastapprox_batch.hpp"
+
+#include "fastapprox/fastpow.h"
+
+// As in compositing_simd.cpp, the AVX2 kernels are compiled with a function
+// attribute and picked at runtime. SSE2 is part of the x86-64 baseline.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FASTAPPROX_BATCH_AVX2
+#include <immintrin.h>
+#endif
+
+
+// Scalar code, for the odd values at the end and other CPUs
+
+static inline void
+fastlog2_scalar (const float *x, float *out, size_t i, const size_t n)
+{
+    for (; i < n; ++i) {
+        out[i] = fastlog2(x[i]);
+    }
+}
+
+static inline void
+fastpow2_scalar (const float *p, float *out, size_t i, const size_t n)
+{
+    for (; i < n; ++i) {
+        out[i] = fastpow2(p[i]);
+    }
+}
+
+static inline void
+fastpow_scalar (const float *x, const float *p, float *out,
+                size_t i, const size_t n)
+{
+    for (; i < n; ++i) {
+        out[i] = fastpow(x[i], p[i]);
+    }
+}
+
+static inline void
+fastpow_scalar (const float *x, const float p, float *out,
+                size_t i, const size_t n)
+{
+    for (; i < n; ++i) {
+        out[i] = fastpow(x[i], p);
+    }
+}
+
+
+// SSE2, using fastapprox's own vector functions
+
+#ifdef __SSE2__
+
+static void
+fastlog2_sse2 (const float *x, float *out, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(out + i, vfastlog2(_mm_loadu_ps(x + i)));
+    }
+    fastlog2_scalar(x, out, i, n);
+}
+
+static void
+fastpow2_sse2 (const float *p, float *out, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(out + i, vfastpow2(_mm_loadu_ps(p + i)));
+    }
+    fastpow2_scalar(p, out, i, n);
+}
+
+static void
+fastpow_sse2 (const float *x, const float *p, float *out, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(out + i, vfastpow(_mm_loadu_ps(x + i),
+                                        _mm_loadu_ps(p + i)));
+    }
+    fastpow_scalar(x, p, out, i, n);
+}
+
+static void
+fastpow_const_sse2 (const float *x, const float p, float *out,
+                    const size_t n)
+{
+    const v4sf vp = _mm_set1_ps(p);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(out + i, vfastpow(_mm_loadu_ps(x + i), vp));
+    }
+    fastpow_scalar(x, p, out, i, n);
+}
+
+#endif // __SSE2__
+
+
+// AVX2: transcriptions of vfastlog2() and vfastpow2() with eight lanes,
+// keeping the order of the operations of the scalar code.
+
+#ifdef FASTAPPROX_BATCH_AVX2
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+static inline AVX2_TARGET __m256
+fastlog2_avx2_x8 (const __m256 x)
+{
+    const __m256i vx = _mm256_castps_si256(x);
+    const __m256 mx = _mm256_castsi256_ps(_mm256_or_si256(
+        _mm256_and_si256(vx, _mm256_set1_epi32(0x007FFFFF)),
+        _mm256_set1_epi32(0x3f000000)));
+    const __m256 y = _mm256_mul_ps(_mm256_cvtepi32_ps(vx),
+                                   _mm256_set1_ps(1.1920928955078125e-7f));
+    __m256 r = _mm256_sub_ps(y, _mm256_set1_ps(124.22551499f));
+    r = _mm256_sub_ps(r, _mm256_mul_ps(_mm256_set1_ps(1.498030302f), mx));
+    return _mm256_sub_ps(r, _mm256_div_ps(
+        _mm256_set1_ps(1.72587999f),
+        _mm256_add_ps(_mm256_set1_ps(0.3520887068f), mx)));
+}
+
+static inline AVX2_TARGET __m256
+fastpow2_avx2_x8 (const __m256 p)
+{
+    const __m256 offset = _mm256_and_ps(
+        _mm256_cmp_ps(p, _mm256_setzero_ps(), _CMP_LT_OQ),
+        _mm256_set1_ps(1.0f));
+    const __m256 clipp = _mm256_blendv_ps(
+        p, _mm256_set1_ps(-126.0f),
+        _mm256_cmp_ps(p, _mm256_set1_ps(-126.0f), _CMP_LT_OQ));
+    const __m256 w = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(clipp));
+    const __m256 z = _mm256_add_ps(_mm256_sub_ps(clipp, w), offset);
+    __m256 t = _mm256_add_ps(clipp, _mm256_set1_ps(121.2740575f));
+    t = _mm256_add_ps(t, _mm256_div_ps(
+        _mm256_set1_ps(27.7280233f),
+        _mm256_sub_ps(_mm256_set1_ps(4.84252568f), z)));
+    t = _mm256_sub_ps(t, _mm256_mul_ps(_mm256_set1_ps(1.49012907f), z));
+    t = _mm256_mul_ps(_mm256_set1_ps(1 << 23), t);
+    return _mm256_castsi256_ps(_mm256_cvttps_epi32(t));
+}
+
+static AVX2_TARGET void
+fastlog2_avx2 (const float *x, float *out, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(out + i, fastlog2_avx2_x8(_mm256_loadu_ps(x + i)));
+    }
+    fastlog2_scalar(x, out, i, n);
+}
+
+static AVX2_TARGET void
+fastpow2_avx2 (const float *p, float *out, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(out + i, fastpow2_avx2_x8(_mm256_loadu_ps(p + i)));
+    }
+    fastpow2_scalar(p, out, i, n);
+}
+
+static AVX2_TARGET void
+fastpow_avx2 (const float *x, const float *p, float *out, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 l = fastlog2_avx2_x8(_mm256_loadu_ps(x + i));
+        _mm256_storeu_ps(out + i, fastpow2_avx2_x8(
+            _mm256_mul_ps(_mm256_loadu_ps(p + i), l)));
+    }
+    fastpow_scalar(x, p, out, i, n);
+}
+
+static AVX2_TARGET void
+fastpow_const_avx2 (const float *x, const float p, float *out,
+                    const size_t n)
+{
+    const __m256 vp = _mm256_set1_ps(p);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 l = fastlog2_avx2_x8(_mm256_loadu_ps(x + i));
+        _mm256_storeu_ps(out + i, fastpow2_avx2_x8(_mm256_mul_ps(vp, l)));
+    }
+    fastpow_scalar(x, p, out, i, n);
+}
+
+#undef AVX2_TARGET
+
+#endif // FASTAPPROX_BATCH_AVX2
+
+
+// Runtime dispatch
+
+static void
+fastlog2_none (const float *x, float *out, const size_t n)
+{
+    fastlog2_scalar(x, out, 0, n);
+}
+
+static void
+fastpow2_none (const float *p, float *out, const size_t n)
+{
+    fastpow2_scalar(p, out, 0, n);
+}
+
+static void
+fastpow_none (const float *x, const float *p, float *out, const size_t n)
+{
+    fastpow_scalar(x, p, out, 0, n);
+}
+
+static void
+fastpow_const_none (const float *x, const float p, float *out,
+                    const size_t n)
+{
+    fastpow_scalar(x, p, out, 0, n);
+}
+
+
+struct FastApproxBatchTable
+{
+    void (*fastlog2) (const float *, float *, size_t);
+    void (*fastpow2) (const float *, float *, size_t);
+    void (*fastpow) (const float *, const float *, float *, size_t);
+    void (*fastpow_const) (const float *, const float, float *, size_t);
+};
+
+
+static FastApproxBatchTable
+fastapprox_batch_table_init ()
+{
+    FastApproxBatchTable table = {
+        fastlog2_none, fastpow2_none, fastpow_none, fastpow_const_none,
+    };
+#ifdef __SSE2__
+    table.fastlog2 = fastlog2_sse2;
+    table.fastpow2 = fastpow2_sse2;
+    table.fastpow = fastpow_sse2;
+    table.fastpow_const = fastpow_const_sse2;
+#endif
+#ifdef FASTAPPROX_BATCH_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        table.fastlog2 = fastlog2_avx2;
+        table.fastpow2 = fastpow2_avx2;
+        table.fastpow = fastpow_avx2;
+        table.fastpow_const = fastpow_const_avx2;
+    }
+#endif
+    return table;
+}
+
+
+static const FastApproxBatchTable &
+fastapprox_batch_table ()
+{
+    static const FastApproxBatchTable table = fastapprox_batch_table_init();
+    return table;
+}
+
+
+void
+fastlog2_n (const float *x, float *out, size_t n)
+{
+    fastapprox_batch_table().fastlog2(x, out, n);
+}
+
+void
+fastpow2_n (const float *p, float *out, size_t n)
+{
+    fastapprox_batch_table().fastpow2(p, out, n);
+}
+
+void
+fastpow_n (const float *x, const float *p, float *out, size_t n)
+{
+    fastapprox_batch_table().fastpow(x, p, out, n);
+}
+
+void
+fastpow_n (const float *x, const float p, float *out, size_t n)
+{
+    fastapprox_batch_table().fastpow_const(x, p, out, n);
+}
@@ -0,0 +1,46 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+// Array versions of the fastapprox functions
+//
+// Each function applies its fastapprox namesake to "n" values, writing the
+// results to "out", which may be the same array as one of the inputs. The
+// fastest kernel the running CPU supports is chosen at the first call: AVX2
+// does eight values at a time, and SSE2 four. The results are the same as
+// those of the scalar functions, bit for bit, for any non-negative x
+// whose result is a normal float. Results which underflow or overflow
+// are as meaningless as in the scalar code, but may differ from it.
+
+#ifndef FASTAPPROX_BATCH_HPP
+#define FASTAPPROX_BATCH_HPP
+
+#include <stddef.h>
+
+
+// fastlog2(x[i])
+
+void fastlog2_n (const float *x, float *out, size_t n);
+
+
+// fastpow2(p[i])
+
+void fastpow2_n (const float *p, float *out, size_t n);
+
+
+// fastpow(x[i], p[i])
+
+void fastpow_n (const float *x, const float *p, float *out, size_t n);
+
+
+// fastpow(x[i], p), for a single exponent
+
+void fastpow_n (const float *x, const float p, float *out, size_t n);
+
+
+#endif // FASTAPPROX_BATCH_HPP
@@ -28,10 +28,30 @@
 #include "png.h"
 
 #include "lcms2.h"
+#include "zlib.h"
+#include <mypaint-tiled-surface.h>
 #include <math.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "common.hpp"
+#include "pixops.hpp"
+#include "tilepool.hpp"
+#include "tracing.hpp"
+#include "fastapprox/fastpow.h"
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #define NO_IMPORT_ARRAY
 #include <numpy/arrayobject.h>
@@ -55,6 +75,319 @@ png_write_error_callback (png_structp png_save_ptr,
 }
 
 
+// Parallel band compression.
+//
+// Each band is a run of whole rows, filtered and then deflated as a raw
+// deflate stream of its own, primed with the last 32K of filtered data
+// before it. Every band but the last ends on a sync flush, so the pieces
+// concatenate into one valid stream, in the manner of pigz.
+
+static const int PNG_BAND_BYTES = 1 << 17;
+static const int DEFLATE_WINDOW = 1 << 15;
+
+
+static inline uint8_t
+paeth_predictor (int a, int b, int c)
+{
+    const int p = a + b - c;
+    const int pa = abs(p - a);
+    const int pb = abs(p - b);
+    const int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+
+// Filters one row of n bytes with a fixed filter type.
+// prev is the unfiltered row above, all zeros for the first row.
+
+static void
+png_filter_row (const int type, const uint8_t *cur, const uint8_t *prev,
+                uint8_t *out, const int n, const int bpp)
+{
+    int i = 0;
+    switch (type) {
+    case ProgressivePNGWriter::FILTER_NONE:
+        memcpy(out, cur, n);
+        break;
+    case ProgressivePNGWriter::FILTER_SUB:
+        for (; i < bpp; ++i) out[i] = cur[i];
+        for (; i < n; ++i) out[i] = cur[i] - cur[i-bpp];
+        break;
+    case ProgressivePNGWriter::FILTER_UP:
+        for (; i < n; ++i) out[i] = cur[i] - prev[i];
+        break;
+    case ProgressivePNGWriter::FILTER_AVERAGE:
+        for (; i < bpp; ++i) out[i] = cur[i] - (prev[i] >> 1);
+        for (; i < n; ++i) out[i] = cur[i] - ((cur[i-bpp] + prev[i]) >> 1);
+        break;
+    case ProgressivePNGWriter::FILTER_PAETH:
+        for (; i < bpp; ++i) out[i] = cur[i] - prev[i];
+        for (; i < n; ++i) {
+            out[i] = cur[i] - paeth_predictor(cur[i-bpp], prev[i],
+                                              prev[i-bpp]);
+        }
+        break;
+    }
+}
+
+
+// Sum of the filtered bytes taken as signed, libpng's heuristic for
+// choosing a filter adaptively.
+
+static inline uint32_t
+png_filter_cost (const uint8_t *row, const int n)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < n; ++i) {
+        sum += abs((int)(int8_t)row[i]);
+    }
+    return sum;
+}
+
+
+struct PNGBand
+{
+    const uint8_t *rows;    // first unfiltered row; the row above precedes it
+    int num_rows;
+    std::vector<uint8_t> filtered;  // filter type byte + row, for each row
+    std::vector<uint8_t> deflated;
+    uLong adler;
+    bool ok;
+};
+
+
+static void
+png_filter_band (PNGBand &band, const int rowbytes, const int bpp,
+                 const int filter)
+{
+    TRACE_SCOPE("png_filter_band");
+    const int stride = rowbytes + 1;
+    band.filtered.resize((size_t)band.num_rows * stride);
+    std::vector<uint8_t> trial, best;
+    if (filter == ProgressivePNGWriter::FILTER_ADAPTIVE) {
+        trial.resize(rowbytes);
+        best.resize(rowbytes);
+    }
+    for (int r = 0; r < band.num_rows; ++r) {
+        const uint8_t *cur = band.rows + (size_t)r * rowbytes;
+        const uint8_t *prev = cur - rowbytes;
+        uint8_t *out = &band.filtered[(size_t)r * stride];
+        if (filter != ProgressivePNGWriter::FILTER_ADAPTIVE) {
+            out[0] = filter;
+            png_filter_row(filter, cur, prev, out + 1, rowbytes, bpp);
+            continue;
+        }
+        uint32_t best_cost = UINT32_MAX;
+        for (int type = 0; type < ProgressivePNGWriter::FILTER_ADAPTIVE;
+             ++type)
+        {
+            png_filter_row(type, cur, prev, &trial[0], rowbytes, bpp);
+            const uint32_t cost = png_filter_cost(&trial[0], rowbytes);
+            if (cost < best_cost) {
+                best_cost = cost;
+                out[0] = type;
+                best.swap(trial);
+            }
+        }
+        memcpy(out + 1, &best[0], rowbytes);
+    }
+}
+
+
+static void
+png_deflate_band (PNGBand &band, const uint8_t *dict, const size_t dict_len,
+                  const int level, const bool last)
+{
+    TRACE_SCOPE("png_deflate_band");
+    band.ok = false;
+    band.adler = adler32(1L, band.filtered.data(), band.filtered.size());
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)
+        != Z_OK)
+    {
+        return;
+    }
+    if (dict_len > 0 && deflateSetDictionary(&z, dict, dict_len) != Z_OK) {
+        deflateEnd(&z);
+        return;
+    }
+    // The bound is for Z_FINISH; leave room for a sync flush's empty block
+    band.deflated.resize(deflateBound(&z, band.filtered.size()) + 16);
+    z.next_in = band.filtered.data();
+    z.avail_in = band.filtered.size();
+    z.next_out = band.deflated.data();
+    z.avail_out = band.deflated.size();
+    const int ret = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+    band.ok = (z.avail_in == 0) && (z.avail_out > 0)
+        && (last ? ret == Z_STREAM_END : ret == Z_OK);
+    band.deflated.resize(z.total_out);
+    deflateEnd(&z);
+}
+
+
+// Runs task(0) .. task(num_tasks-1) across up to num_threads threads,
+// including the calling one.
+
+template <typename Task>
+static void
+png_run_parallel (const int num_tasks, const int num_threads, Task task)
+{
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < num_tasks; i = next++) {
+            task(i);
+        }
+    };
+    std::vector<std::thread> helpers;
+    const int num_helpers = std::min(num_threads, num_tasks) - 1;
+    for (int i = 0; i < num_helpers; ++i) {
+        helpers.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < helpers.size(); ++i) {
+        helpers[i].join();
+    }
+}
+
+
+// 16-bit output.
+//
+// Strips for 16-bit files are fix15 rgba as rendered, premultiplied for
+// files with alpha, or rgbu for files without. Each row is converted to
+// straight 16-bit samples, byte-swapped to PNG's big-endian order, in a
+// single pass straight into the writer's buffers. With an EOTF other
+// than 1, colour goes through a lookup table of all 2^15+1 fix15 values.
+
+static inline uint32_t
+png_fix15_to_16bit (const uint32_t v)
+{
+    return ((v << 16) - v + (1 << 14)) >> 15;
+}
+
+
+static void
+png_build_lut16 (std::vector<uint16_t> &lut, const float eotf)
+{
+    lut.resize((1 << 15) + 1);
+    for (int v = 0; v <= (1 << 15); ++v) {
+        const float c = powf((float)v / (1 << 15), 1.0f / eotf);
+        lut[v] = (uint16_t)std::min(65535.0f, c * 65535.0f + 0.5f);
+    }
+}
+
+
+static inline void
+png_store_be16 (uint8_t *dst, const uint32_t v)
+{
+    dst[0] = v >> 8;
+    dst[1] = v & 0xff;
+}
+
+
+// Converts w pixels. dst receives 8 bytes per pixel with alpha, or 6
+// without. lut is NULL for an EOTF of 1.
+
+static void
+png_pack_row16 (const uint16_t *src, uint8_t *dst, const int w,
+                const bool has_alpha, const uint16_t *lut)
+{
+    int x = 0;
+#ifdef __SSE2__
+    if (! lut) {
+        // Two pixels per step, as in unpremultiply_row() in pixops.cpp:
+        // truncating the double precision quotient is exact.
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi32(1 << 15);
+        const __m128i half = _mm_set1_epi32(1 << 14);
+        const __m128i bias32 = _mm_set1_epi32(1 << 15);
+        const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+        const __m128i alpha_lane = _mm_set_epi32(-1, 0, 0, 0);
+        for (; x + 2 <= w; x += 2) {
+            const __m128i px = _mm_loadu_si128(
+                (const __m128i *)(src + 4*x)
+            );
+            __m128i q[2];
+            for (int i = 0; i < 2; ++i) {
+                __m128i c = i ? _mm_unpackhi_epi16(px, zero)
+                              : _mm_unpacklo_epi16(px, zero);
+                if (has_alpha) {
+                    const __m128i a = _mm_shuffle_epi32(
+                        c, _MM_SHUFFLE(3, 3, 3, 3)
+                    );
+                    const __m128i num = _mm_add_epi32(
+                        _mm_slli_epi32(c, 15), _mm_srli_epi32(a, 1)
+                    );
+                    const __m128d div = _mm_cvtepi32_pd(a);
+                    const __m128i q_lo = _mm_cvttpd_epi32(
+                        _mm_div_pd(_mm_cvtepi32_pd(num), div));
+                    const __m128i q_hi = _mm_cvttpd_epi32(
+                        _mm_div_pd(
+                            _mm_cvtepi32_pd(_mm_unpackhi_epi64(num, num)),
+                            div
+                        ));
+                    __m128i u = _mm_andnot_si128(
+                        _mm_cmpeq_epi32(a, zero),
+                        _mm_unpacklo_epi64(q_lo, q_hi)
+                    );
+                    // Colour brighter than alpha is bad data: clamp it
+                    const __m128i over = _mm_cmpgt_epi32(u, one);
+                    u = _mm_or_si128(_mm_andnot_si128(over, u),
+                                     _mm_and_si128(over, one));
+                    c = _mm_or_si128(_mm_andnot_si128(alpha_lane, u),
+                                     _mm_and_si128(alpha_lane, c));
+                }
+                q[i] = _mm_srli_epi32(
+                    _mm_add_epi32(
+                        _mm_sub_epi32(_mm_slli_epi32(c, 16), c), half
+                    ),
+                    15
+                );
+            }
+            // Pack to unsigned 16 bits via a signed bias, then swap bytes
+            __m128i v = _mm_xor_si128(
+                _mm_packs_epi32(_mm_sub_epi32(q[0], bias32),
+                                _mm_sub_epi32(q[1], bias32)),
+                bias16
+            );
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            if (has_alpha) {
+                _mm_storeu_si128((__m128i *)(dst + 8*x), v);
+            }
+            else {
+                uint8_t packed[16];
+                _mm_storeu_si128((__m128i *)packed, v);
+                memcpy(dst + 6*x, packed, 6);
+                memcpy(dst + 6*x + 6, packed + 8, 6);
+            }
+        }
+    }
+#endif
+    for (; x < w; ++x) {
+        const uint16_t *p = src + 4*x;
+        const uint32_t one = 1 << 15;
+        const uint32_t a = std::min(one, (uint32_t)p[3]);
+        uint32_t rgb[3] = {p[0], p[1], p[2]};
+        for (int i = 0; i < 3; ++i) {
+            if (has_alpha) {
+                rgb[i] = a ? ((rgb[i] << 15) + a/2) / a : 0;
+            }
+            rgb[i] = std::min(one, rgb[i]);
+        }
+        uint8_t *d = dst + (has_alpha ? 8 : 6) * x;
+        for (int i = 0; i < 3; ++i) {
+            png_store_be16(d + 2*i, lut ? lut[rgb[i]]
+                                        : png_fix15_to_16bit(rgb[i]));
+        }
+        if (has_alpha) {
+            png_store_be16(d + 6, png_fix15_to_16bit(a));
+        }
+    }
+}
+
+
 struct ProgressivePNGWriter::State
 {
     int width;
@@ -64,13 +397,37 @@ struct ProgressivePNGWriter::State
     int y;
     PyObject *file;
     FILE *fp;
+    int bit_depth;      // 8 or 16 bits per sample in the file
+    bool has_alpha;
+    float eotf;
+    std::vector<uint16_t> lut;      // 16-bit EOTF table, if not linear
+    std::vector<uint8_t> packed;    // serial 16-bit mode: the row to write
+
+    // Parallel band mode only
+    int threads;
+    int level;
+    int filter;
+    int bpp;            // bytes per pixel in the file, 3 to 8
+    int rowbytes;
+    int band_rows;
+    std::vector<uint8_t> rows;  // row above, then rows not yet compressed
+    int pending_rows;
+    std::vector<uint8_t> dict;  // last filtered bytes already compressed
+    uLong adler;
+    bool started;       // zlib header written
 
     State()
         : width(0), height(0),
           png_ptr(NULL), info_ptr(NULL),
           y(0),
           file(NULL),
-          fp(NULL)
+          fp(NULL),
+          bit_depth(8), has_alpha(true), eotf(1.0),
+          threads(1), level(2), filter(FILTER_SUB),
+          bpp(4), rowbytes(0), band_rows(1),
+          pending_rows(0),
+          adler(1L),
+          started(false)
     { }
 
     ~State() {
@@ -78,6 +435,10 @@ struct ProgressivePNGWriter::State
     }
 
     bool check_valid();
+    bool is_parallel() const { return threads > 1; }
+    bool compress_bands(const bool last);
+    bool write_rows(const uint8_t *row_p, const int rowcount,
+                    const int rowstride);
 
     void cleanup() {
         if (png_ptr || info_ptr) {
@@ -128,10 +489,100 @@ ProgressivePNGWriter::State::check_valid()
 }
 
 
+// Filters and deflates the pending rows in parallel, and writes them out
+// as IDAT chunks. All pending rows are consumed when last is set,
+// otherwise only whole bands are. Call with the GIL held: it is released
+// while the bands are being compressed, and libpng errors longjmp.
+
+bool
+ProgressivePNGWriter::State::compress_bands(const bool last)
+{
+    const int num_rows = last ? pending_rows
+        : pending_rows - (pending_rows % band_rows);
+    if (num_rows == 0) {
+        return true;
+    }
+    const int num_bands = (num_rows + band_rows - 1) / band_rows;
+    std::vector<PNGBand> bands(num_bands);
+    for (int b = 0; b < num_bands; ++b) {
+        const int first = b * band_rows;
+        bands[b].rows = &rows[(size_t)(first + 1) * rowbytes];
+        bands[b].num_rows = std::min(band_rows, num_rows - first);
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    png_run_parallel(num_bands, threads, [&](int b) {
+        png_filter_band(bands[b], rowbytes, bpp, filter);
+    });
+    // Each band's dictionary is the end of the band before it
+    png_run_parallel(num_bands, threads, [&](int b) {
+        const std::vector<uint8_t> &before =
+            (b == 0) ? dict : bands[b-1].filtered;
+        const size_t dict_len = std::min(before.size(),
+                                         (size_t)DEFLATE_WINDOW);
+        png_deflate_band(
+            bands[b], before.data() + before.size() - dict_len, dict_len,
+            level, last && b == num_bands - 1
+        );
+    });
+    Py_END_ALLOW_THREADS
+
+    std::vector<uint8_t> chunk;
+    for (int b = 0; b < num_bands; ++b) {
+        PNGBand &band = bands[b];
+        if (! band.ok) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "zlib error while compressing PNG data");
+            return false;
+        }
+        chunk.clear();
+        if (! started) {
+            // zlib header: 32K window, deflate; level hint; check bits
+            const int flevel = (level == Z_DEFAULT_COMPRESSION) ? 2
+                : (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+            const int cmf = 0x78;
+            int flg = flevel << 6;
+            flg += 31 - ((cmf << 8) + flg) % 31;
+            chunk.push_back(cmf);
+            chunk.push_back(flg);
+            started = true;
+        }
+        chunk.insert(chunk.end(), band.deflated.begin(), band.deflated.end());
+        adler = adler32_combine(adler, band.adler, band.filtered.size());
+        if (last && b == num_bands - 1) {
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                chunk.push_back((adler >> shift) & 0xff);
+            }
+        }
+        png_write_chunk(png_ptr, (png_const_bytep)"IDAT",
+                        chunk.data(), chunk.size());
+    }
+
+    // Whole bands are longer than the window, and a short final band is
+    // never followed by another, so the last band is all that's needed.
+    const std::vector<uint8_t> &tail = bands[num_bands-1].filtered;
+    dict.insert(dict.end(), tail.begin(), tail.end());
+    if (dict.size() > DEFLATE_WINDOW) {
+        dict.erase(dict.begin(), dict.end() - DEFLATE_WINDOW);
+    }
+
+    // Keep the last row consumed as the row above the next pending one
+    const size_t consumed = (size_t)num_rows * rowbytes;
+    rows.erase(rows.begin(), rows.begin() + consumed);
+    pending_rows -= num_rows;
+    return true;
+}
+
+
 ProgressivePNGWriter::ProgressivePNGWriter(PyObject *file,
                                            const int w, const int h,
                                            const bool has_alpha,
-                                           const bool save_srgb_chunks)
+                                           const bool save_srgb_chunks,
+                                           const int compression_level,
+                                           const int filter,
+                                           const int threads,
+                                           const int bit_depth,
+                                           const float eotf)
     : state(new ProgressivePNGWriter::State())
 {
     state->width = w;
@@ -139,7 +590,48 @@ ProgressivePNGWriter::ProgressivePNGWriter(PyObject *file,
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
 
-    const int bpc = 8;
+    if (bit_depth != 8 && bit_depth != 16) {
+        PyErr_SetString(PyExc_ValueError, "bit_depth must be 8 or 16");
+        state->cleanup();
+        return;
+    }
+    const int bpc = bit_depth;
+
+    if (compression_level < Z_DEFAULT_COMPRESSION || compression_level > 9) {
+        PyErr_SetString(
+            PyExc_ValueError,
+            "compression_level must be in the range -1 to 9"
+        );
+        state->cleanup();
+        return;
+    }
+    if (filter < FILTER_NONE || filter > FILTER_ADAPTIVE) {
+        PyErr_SetString(PyExc_ValueError, "unknown filter strategy");
+        state->cleanup();
+        return;
+    }
+    state->level = compression_level;
+    state->filter = filter;
+    state->threads = threads;
+    if (threads <= 0) {
+        state->threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    state->bit_depth = bit_depth;
+    state->has_alpha = has_alpha;
+    state->eotf = eotf;
+    if (bit_depth == 16 && eotf != 1.0f) {
+        png_build_lut16(state->lut, eotf);
+    }
+    state->bpp = (has_alpha ? 4 : 3) * (bit_depth / 8);
+    state->rowbytes = w * state->bpp;
+    state->band_rows = std::max(1, PNG_BAND_BYTES
+                                   / std::max(1, state->rowbytes));
+    if (state->is_parallel()) {
+        state->rows.assign(state->rowbytes, 0);
+    }
+    else if (bit_depth == 16) {
+        state->packed.resize(state->rowbytes);
+    }
 
     state->file = file;
     Py_INCREF(file);
@@ -225,33 +717,112 @@ ProgressivePNGWriter::ProgressivePNGWriter(PyObject *file,
     }
 
     // default (all filters enabled):                 1350ms, 3.4MB
-    //png_set_filter(png_ptr, 0, PNG_FILTER_NONE);  // 790ms, 3.8MB
-    //png_set_filter(png_ptr, 0, PNG_FILTER_PAETH); // 980ms, 3.5MB
-    png_set_filter(png_ptr, 0, PNG_FILTER_SUB);     // 760ms, 3.4MB
-
-    //png_set_compression_level(png_ptr, 0); // 0.49s, 32MB
-    //png_set_compression_level(png_ptr, 1); // 0.98s, 9.6MB
-    png_set_compression_level(png_ptr, 2);   // 1.08s, 9.4MB
-    //png_set_compression_level(png_ptr, 9); // 18.6s, 9.3MB
+    // PNG_FILTER_NONE:                              790ms, 3.8MB
+    // PNG_FILTER_PAETH:                             980ms, 3.5MB
+    // PNG_FILTER_SUB:                               760ms, 3.4MB
+    static const int libpng_filters[] = {
+        PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+        PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS
+    };
+    png_set_filter(png_ptr, 0, libpng_filters[filter]);
+
+    // level 0: 0.49s, 32MB
+    // level 1: 0.98s, 9.6MB
+    // level 2: 1.08s, 9.4MB
+    // level 9: 18.6s, 9.3MB
+    png_set_compression_level(png_ptr, compression_level);
 
     png_write_info(png_ptr, info_ptr);
 
-    if (!has_alpha) {
+    if (!has_alpha && !state->is_parallel() && bit_depth == 8) {
         // input array format format is rgbu
         png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
     }
 }
 
 
+// Writes rows laid out as write() takes them. Call with the GIL held.
+// Returns false with an exception set on failure, after cleaning up.
+
+bool
+ProgressivePNGWriter::State::write_rows(const uint8_t *row_p,
+                                        const int rowcount,
+                                        const int rowstride)
+{
+    TRACE_SCOPE("ProgressivePNGWriter::write_rows");
+    const uint16_t *lut16 = lut.empty() ? NULL : &lut[0];
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        if (! PyErr_Occurred()) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "libpng error during write()");
+        }
+        cleanup();
+        return false;
+    }
+    if (y + rowcount > height) {
+        PyErr_SetString(PyExc_RuntimeError, "too many pixel rows written");
+        cleanup();
+        return false;
+    }
+    if (is_parallel()) {
+        size_t pos = rows.size();
+        rows.resize(pos + (size_t)rowcount * rowbytes);
+        for (int row = 0; row < rowcount; row++) {
+            uint8_t *dst = &rows[pos];
+            if (bit_depth == 16) {
+                png_pack_row16((const uint16_t *)row_p, dst, width,
+                               has_alpha, lut16);
+            }
+            else if (bpp == 4) {
+                memcpy(dst, row_p, rowbytes);
+            }
+            else {
+                // drop the unused 4th byte of rgbu input
+                for (int x = 0; x < width; ++x) {
+                    dst[x*3+0] = row_p[x*4+0];
+                    dst[x*3+1] = row_p[x*4+1];
+                    dst[x*3+2] = row_p[x*4+2];
+                }
+            }
+            pos += rowbytes;
+            row_p += rowstride;
+        }
+        pending_rows += rowcount;
+        y += rowcount;
+        const bool last = (y == height);
+        if (last || pending_rows >= threads * band_rows) {
+            if (! compress_bands(last)) {
+                cleanup();
+                return false;
+            }
+        }
+        return true;
+    }
+    for (int row = 0; row < rowcount; row++) {
+        if (bit_depth == 16) {
+            png_pack_row16((const uint16_t *)row_p, &packed[0], width,
+                           has_alpha, lut16);
+            png_write_row(png_ptr, &packed[0]);
+        }
+        else {
+            png_write_row(png_ptr, (png_bytep)row_p);
+        }
+        if (! check_valid()) {
+            cleanup();
+            return false;
+        }
+        row_p += rowstride;
+        ++y;
+    }
+    return true;
+}
+
+
 PyObject *
 ProgressivePNGWriter::write(PyObject *arr_obj)
 {
+    TRACE_SCOPE("ProgressivePNGWriter::write");
     PyArrayObject* arr = (PyArrayObject*)arr_obj;
-    int rowcount = 0;
-    int rowstride = 0;
-    png_bytep rowdata = NULL;
-    png_bytep row_p = NULL;
-    int row = 0;
     char *err_text = NULL;
     PyObject *err_type = PyExc_RuntimeError;
 
@@ -285,39 +856,34 @@ ProgressivePNGWriter::write(PyObject *arr_obj)
         err_text = "strip must contain RGBA data (must be HxWx4)";
         goto errexit;
     }
-    if (PyArray_TYPE(arr) != NPY_UINT8) {
+    if (state->bit_depth == 16) {
+        if (PyArray_TYPE(arr) != NPY_UINT16) {
+            err_type = PyExc_ValueError;
+            err_text = "strip must contain uint16 fix15 RGBA only";
+            goto errexit;
+        }
+        if (PyArray_STRIDE(arr, 1) != 4 * sizeof(uint16_t)
+            || PyArray_STRIDE(arr, 2) != sizeof(uint16_t))
+        {
+            err_type = PyExc_ValueError;
+            err_text = "strip rows must be contiguous";
+            goto errexit;
+        }
+    }
+    else if (PyArray_TYPE(arr) != NPY_UINT8) {
         err_type = PyExc_ValueError;
         err_text = "strip must contain uint8 RGBA only";
         goto errexit;
     }
-    assert(PyArray_STRIDE(arr, 1) == 4);
-    assert(PyArray_STRIDE(arr, 2) == 1);
-
-    if (setjmp(png_jmpbuf(state->png_ptr))) {
-        if (PyErr_Occurred()) {
-            state->cleanup();
-            return NULL;
-        }
-        err_type = PyExc_RuntimeError;
-        err_text = "libpng error during write()";
-        goto errexit;
+    else {
+        assert(PyArray_STRIDE(arr, 1) == 4);
+        assert(PyArray_STRIDE(arr, 2) == 1);
     }
-    rowcount = PyArray_DIM(arr, 0);
-    rowstride = PyArray_STRIDE(arr, 0);
-    rowdata = (png_bytep)PyArray_DATA(arr);
-    row_p = (png_bytep)rowdata;
-    for (row=0; row<rowcount; row++) {
-        png_write_row(state->png_ptr, row_p);
-        if (! state->check_valid()) {
-            state->cleanup();
-            return NULL;
-        }
-        row_p += rowstride;
-        if (++(state->y) > state->height) {
-            err_type = PyExc_RuntimeError;
-            err_text = "too many pixel rows written";
-            goto errexit;
-        }
+
+    if (! state->write_rows((const uint8_t *)PyArray_DATA(arr),
+                            PyArray_DIM(arr, 0), PyArray_STRIDE(arr, 0)))
+    {
+        return NULL;
     }
     Py_RETURN_NONE;
 
@@ -333,9 +899,274 @@ ProgressivePNGWriter::write(PyObject *arr_obj)
 }
 
 
+// Rendered export.
+//
+// write_rendered() is a producer/consumer pipeline. The calling thread
+// takes a tile row's sources from Python, and queues its tiles for a pool
+// of render threads, up to PNG_RENDER_STRIPS_AHEAD rows ahead of the
+// writing. The render threads composite each tile and convert it into
+// its strip, which the calling thread writes out as soon as all of its
+// tiles are done, while rows below it are still rendering.
+
+static const int PNG_RENDER_STRIPS_AHEAD = 3;
+
+#define N MYPAINT_TILE_SIZE
+
+
+struct PNGRenderStrip
+{
+    std::vector<RenderOpSource> sources;  // num_sources for each tile
+    std::vector<PyObject *> refs;
+    std::vector<uint8_t> pixels;    // N rows, as write() takes them
+    int tiles_left;
+};
+
+
+struct PNGRenderPipeline
+{
+    const std::vector<RenderOp> &program;
+    size_t num_sources;
+    int max_depth;
+    int num_tiles;          // tile columns in a row
+    int rowstride;          // bytes between rows of strip pixels
+    int bit_depth;
+    bool has_alpha;
+    float eotf;
+
+    std::mutex lock;
+    std::condition_variable work_ready;
+    std::condition_variable strip_done;
+    std::deque<std::pair<PNGRenderStrip *, int> > tasks;
+    bool stopping;
+
+    PNGRenderPipeline(const std::vector<RenderOp> &program)
+        : program(program), num_sources(0), max_depth(0), num_tiles(0),
+          rowstride(0), bit_depth(8), has_alpha(true), eotf(1.0),
+          stopping(false)
+    { }
+
+    void worker();
+    void render(PNGRenderStrip &strip, int tile, RenderScratch &scratch,
+                uint16_t *buf);
+};
+
+
+void
+PNGRenderPipeline::render(PNGRenderStrip &strip, const int tile,
+                          RenderScratch &scratch, uint16_t *buf)
+{
+    TRACE_SCOPE("PNGRenderPipeline::render");
+    const int tile_rowbytes = N * 4 * sizeof(uint16_t);
+    memset(buf, 0, N * tile_rowbytes);
+    render_ops_tile(program, &strip.sources[tile * num_sources], buf, true,
+                    scratch);
+    uint8_t *dst = &strip.pixels[(size_t)tile * N * 4 * (bit_depth / 8)];
+    if (bit_depth == 16) {
+        for (int y = 0; y < N; ++y) {
+            memcpy(dst + (size_t)y * rowstride, buf + y * N * 4,
+                   tile_rowbytes);
+        }
+    }
+    else if (has_alpha) {
+        tile_convert_rgba16_to_rgba8_c(buf, tile_rowbytes, dst, rowstride,
+                                       eotf);
+    }
+    else {
+        tile_convert_rgbu16_to_rgbu8_c(buf, tile_rowbytes, dst, rowstride,
+                                       eotf);
+    }
+}
+
+
+void
+PNGRenderPipeline::worker()
+{
+    RenderScratch scratch(max_depth);
+    std::vector<uint16_t> buf(N * N * 4);
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        work_ready.wait(guard, [&]() { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+            return;
+        }
+        PNGRenderStrip *strip = tasks.front().first;
+        const int tile = tasks.front().second;
+        tasks.pop_front();
+        guard.unlock();
+        render(*strip, tile, scratch, &buf[0]);
+        guard.lock();
+        if (--strip->tiles_left == 0) {
+            strip_done.notify_all();
+        }
+    }
+}
+
+
+PyObject *
+ProgressivePNGWriter::write_rendered(PyObject *program_obj,
+                                     PyObject *rows,
+                                     int x_offset, int y_offset)
+{
+    TRACE_SCOPE("ProgressivePNGWriter::write_rendered");
+    if (! state) {
+        PyErr_SetString(
+            PyExc_RuntimeError,
+            "writer object is not ready to write (internal state lost)"
+        );
+        return NULL;
+    }
+    if (! state->check_valid()) {
+        state->cleanup();
+        return NULL;
+    }
+    if (x_offset < 0 || x_offset >= N || y_offset < 0 || y_offset >= N) {
+        PyErr_SetString(PyExc_ValueError,
+                        "offsets must be within the first tile");
+        return NULL;
+    }
+
+    std::vector<RenderOp> program;
+    PNGRenderPipeline pipe(program);
+    if (! render_ops_parse_program(program_obj, program, pipe.num_sources,
+                                   pipe.max_depth))
+    {
+        return NULL;
+    }
+    pipe.num_tiles = (x_offset + state->width + N - 1) / N;
+    pipe.bit_depth = state->bit_depth;
+    pipe.rowstride = pipe.num_tiles * N * 4 * (state->bit_depth / 8);
+    pipe.has_alpha = state->has_alpha;
+    pipe.eotf = state->eotf;
+    if (state->bit_depth == 8) {
+        tile_convert_prepare(state->eotf);
+    }
+
+    PyObject *iter = PyObject_GetIter(rows);
+    if (! iter) {
+        return NULL;
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < state->threads; ++i) {
+        workers.push_back(std::thread(&PNGRenderPipeline::worker, &pipe));
+    }
+
+    // Strips being rendered, or waiting to be written, in order
+    std::deque<PNGRenderStrip *> ring;
+    int rows_queued = 0;      // rows of the image covered by queued strips
+    const int rows_wanted = state->height - state->y;
+    bool ok = true;
+    while (ok) {
+        while (ok && rows_queued < rows_wanted
+               && ring.size() < (size_t)PNG_RENDER_STRIPS_AHEAD)
+        {
+            PyObject *item = PyIter_Next(iter);
+            if (! item) {
+                if (! PyErr_Occurred()) {
+                    PyErr_SetString(PyExc_ValueError,
+                                    "rows ran out before the image's end");
+                }
+                ok = false;
+                break;
+            }
+            PNGRenderStrip *strip = new PNGRenderStrip();
+            PyObject *seq = PySequence_Fast(item, "rows must be sequences");
+            Py_DECREF(item);
+            if (! seq) {
+                delete strip;
+                ok = false;
+                break;
+            }
+            if (PySequence_Fast_GET_SIZE(seq) != pipe.num_tiles) {
+                PyErr_Format(PyExc_ValueError,
+                             "rows must have sources for %d tiles",
+                             pipe.num_tiles);
+                ok = false;
+            }
+            for (int t = 0; ok && t < pipe.num_tiles; ++t) {
+                ok = render_ops_parse_sources(
+                    PySequence_Fast_GET_ITEM(seq, t), pipe.num_sources, t,
+                    strip->sources, strip->refs
+                );
+            }
+            Py_DECREF(seq);
+            if (! ok) {
+                for (size_t i = 0; i < strip->refs.size(); ++i) {
+                    Py_DECREF(strip->refs[i]);
+                }
+                delete strip;
+                break;
+            }
+            strip->pixels.resize((size_t)N * pipe.rowstride);
+            strip->tiles_left = pipe.num_tiles;
+            rows_queued += (ring.empty() && rows_queued == 0)
+                ? N - y_offset : N;
+            ring.push_back(strip);
+            std::lock_guard<std::mutex> guard(pipe.lock);
+            for (int t = 0; t < pipe.num_tiles; ++t) {
+                pipe.tasks.push_back(std::make_pair(strip, t));
+            }
+            pipe.work_ready.notify_all();
+        }
+        if (! ok || ring.empty()) {
+            break;
+        }
+
+        // Write out the oldest strip once it is complete
+        PNGRenderStrip *strip = ring.front();
+        Py_BEGIN_ALLOW_THREADS
+        {
+            std::unique_lock<std::mutex> guard(pipe.lock);
+            pipe.strip_done.wait(guard, [&]() {
+                return strip->tiles_left == 0;
+            });
+        }
+        Py_END_ALLOW_THREADS
+        const int first = (state->y == state->height - rows_wanted)
+            ? y_offset : 0;
+        const int count = std::min(N - first, state->height - state->y);
+        ok = state->write_rows(
+            &strip->pixels[(size_t)first * pipe.rowstride
+                           + x_offset * 4 * (state->bit_depth / 8)],
+            count, pipe.rowstride
+        );
+        ring.pop_front();
+        for (size_t i = 0; i < strip->refs.size(); ++i) {
+            Py_DECREF(strip->refs[i]);
+        }
+        delete strip;
+    }
+    Py_DECREF(iter);
+
+    // Stop the workers, dropping anything still queued
+    Py_BEGIN_ALLOW_THREADS
+    {
+        std::lock_guard<std::mutex> guard(pipe.lock);
+        pipe.tasks.clear();
+        pipe.stopping = true;
+        pipe.work_ready.notify_all();
+    }
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+    Py_END_ALLOW_THREADS
+    for (size_t s = 0; s < ring.size(); ++s) {
+        for (size_t i = 0; i < ring[s]->refs.size(); ++i) {
+            Py_DECREF(ring[s]->refs[i]);
+        }
+        delete ring[s];
+    }
+    if (! ok) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
 PyObject *
 ProgressivePNGWriter::close()
 {
+    TRACE_SCOPE("ProgressivePNGWriter::close");
     if (! state) {
         PyErr_SetString(
             PyExc_RuntimeError,
@@ -352,7 +1183,17 @@ ProgressivePNGWriter::close()
         PyErr_SetString(PyExc_RuntimeError, "libpng error during close()");
         return NULL;
     }
-    png_write_end (state->png_ptr, NULL);
+    if (state->is_parallel()) {
+        // IDATs were written by hand, so libpng doesn't know about them
+        if (state->y == state->height) {
+            png_write_chunk(state->png_ptr, (png_const_bytep)"IEND",
+                            NULL, 0);
+            png_write_flush(state->png_ptr);
+        }
+    }
+    else {
+        png_write_end (state->png_ptr, NULL);
+    }
     if (state->y != state->height) {
         state->cleanup();
         PyErr_SetString(
@@ -404,47 +1245,81 @@ log_lcms2_error (cmsContext context_id, cmsUInt32Number err_code,
 }
 
 
-/** load_png_fast_progressive:
- *
- * @filename: filename to load, in the system encoding
- * @get_buffer_callback: a Python callable returning writeable arrays
- * @convert_to_srgb: apply colorspace conversions, to sRGB display pixels
- * returns: a dict of flags describing what was read.
- *
- * Read a PNG progressively as 8bit RGBA. The callback must have the signature
- *
- *   numpy_array = callback(full_image_width, full_image_height)
- *
- * @get_buffer_callback  must return a writeable array of the image width.  If
- * the height is smaller than the image height, the callback will be called
- * again until the full image has been processed. The buffer will be written
- * with 8-bit RGBA data
- *
- */
+// Common setup for the PNG loaders: opens the file, has libpng expand
+// whatever it contains to RGBA, and works out the colour transform into
+// sRGB, if any. The outcome is described by the public members.
 
-PyObject *
-load_png_fast_progressive (char *filename,
-                           PyObject *get_buffer_callback,
-                           bool convert_to_srgb)
+struct PNGReader
 {
-    // Note: we are not using the method that libpng calls "Reading PNG
-    // files progressively". That method would involve feeding the data
-    // into libpng piece by piece, which is not necessary if we can give
-    // libpng a simple FILE pointer.
+    FILE *fp;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    uint32_t width;
+    uint32_t height;
+    png_byte bit_depth;     // 16 only when converting to sRGB
+    bool convert_to_srgb;   // input_buffer_to_nparray must be applied
+
+    // Textual description of what processing was applied and why
+    char *cm_processing;
+
+    cmsHPROFILE input_buffer_profile;
+    cmsHPROFILE nparray_data_profile;
+    cmsHTRANSFORM input_buffer_to_nparray;
+    cmsToneCurve *gamma_transfer_func;
+
+    PNGReader()
+        : fp(NULL), png_ptr(NULL), info_ptr(NULL),
+          width(0), height(0), bit_depth(0),
+          convert_to_srgb(false),
+          cm_processing(NULL),
+          input_buffer_profile(NULL), nparray_data_profile(NULL),
+          input_buffer_to_nparray(NULL), gamma_transfer_func(NULL)
+    { }
+
+    ~PNGReader();
+
+    // Returns false with an exception set on failure.
+    // transform_flags are passed on to cmsCreateTransform().
+    bool begin(const char *filename, bool convert_to_srgb,
+               cmsUInt32Number transform_flags);
+
+    // Bytes per pixel of the rows libpng delivers
+    int input_bytes_per_pixel() const { return (bit_depth == 8) ? 4 : 8; }
+
+    // Converts one decoded row into 8-bit RGBA, applying the colour
+    // transform. Safe to call from several threads if the transform was
+    // created with cmsFLAGS_NOCACHE.
+    void transform_row(const uint8_t *input_row, uint8_t *rgba_row) const;
+};
+
+
+PNGReader::~PNGReader()
+{
+    if (png_ptr || info_ptr) {
+        png_destroy_read_struct (&png_ptr, &info_ptr, NULL);
+    }
+    // libpng's style is to free internally allocated stuff like the icc
+    // tables in png_destroy_*(). I think.
+    if (fp)
+        fclose(fp);
+    if (input_buffer_profile)
+        cmsCloseProfile(input_buffer_profile);
+    if (nparray_data_profile)
+        cmsCloseProfile(nparray_data_profile);
+    if (input_buffer_to_nparray)
+        cmsDeleteTransform(input_buffer_to_nparray);
+    if (gamma_transfer_func)
+        cmsFreeToneCurve(gamma_transfer_func);
+}
 
-    png_structp png_ptr = NULL;
-    png_infop info_ptr = NULL;
-    PyObject *result = NULL;
-    FILE *fp = NULL;
-    uint32_t width, height;
-    uint32_t rows_left;
+
+bool
+PNGReader::begin (const char *filename, bool convert_to_srgb,
+                  cmsUInt32Number transform_flags)
+{
     png_byte color_type;
-    png_byte bit_depth;
     bool have_alpha;
 
-    // Textual description of what processing was applied and why
-    char *cm_processing = NULL;
-
     // ICC profile-based colour conversion data.
     png_charp icc_profile_name = NULL;
     int icc_compression_type = 0;
@@ -474,12 +1349,9 @@ load_png_fast_progressive (char *filename,
     double generic_rgb_blue_x  = 15000 / PNG_cHRM_scale;
     double generic_rgb_blue_y  =  6000 / PNG_cHRM_scale;
 
-    cmsHPROFILE input_buffer_profile = NULL;
-    cmsHPROFILE nparray_data_profile = cmsCreate_sRGBProfile();
-    cmsHTRANSFORM input_buffer_to_nparray = NULL;
-    cmsToneCurve *gamma_transfer_func = NULL;
     cmsUInt32Number input_buffer_format = 0;
 
+    nparray_data_profile = cmsCreate_sRGBProfile();
     cmsSetLogErrorHandler(log_lcms2_error);
 
 #ifdef _WIN32
@@ -510,24 +1382,24 @@ load_png_fast_progressive (char *filename,
 #endif
     if (!fp) {
         PyErr_SetFromErrno(PyExc_IOError);
-        goto cleanup;
+        return false;
     }
 
     png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, (png_voidp)NULL,
                                       png_read_error_callback, NULL);
     if (!png_ptr) {
         PyErr_SetString(PyExc_MemoryError, "png_create_read_struct() failed");
-        goto cleanup;
+        return false;
     }
 
     info_ptr = png_create_info_struct(png_ptr);
     if (!info_ptr) {
         PyErr_SetString(PyExc_MemoryError, "png_create_info_struct() failed");
-        goto cleanup;
+        return false;
     }
 
     if (setjmp(png_jmpbuf(png_ptr))) {
-        goto cleanup;
+        return false;
     }
 
     png_init_io(png_ptr, fp);
@@ -544,7 +1416,7 @@ load_png_fast_progressive (char *filename,
             input_buffer_profile = cmsOpenProfileFromMem(icc_profile, icc_proflen);
             if (! input_buffer_profile) {
                 PyErr_SetString(PyExc_MemoryError, "cmsOpenProfileFromMem() failed");
-                goto cleanup;
+                return false;
             }
             cmsColorSpaceSignature cs_sig = cmsGetColorSpace(input_buffer_profile);
             if (cs_sig != cmsSigRgbData) {
@@ -657,13 +1529,14 @@ load_png_fast_progressive (char *filename,
             }
         }
     } //convert_to_srgb
+    this->convert_to_srgb = convert_to_srgb;
 
     if (png_get_interlace_type (png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
         PyErr_SetString(
             PyExc_RuntimeError,
             "Interlaced PNG files are not supported!"
         );
-        goto cleanup;
+        return false;
     }
 
     // Set PNG loader flags
@@ -712,7 +1585,7 @@ load_png_fast_progressive (char *filename,
                 "Failed to convince libpng to convert "
                 "to 8 or 16 bits per channel"
             );
-            goto cleanup;
+            return false;
         }
     }
     else {
@@ -722,7 +1595,7 @@ load_png_fast_progressive (char *filename,
                 "Failed to convince libpng to convert "
                 "to 8 bits per channel"
             );
-            goto cleanup;
+            return false;
         }
     } //convert_to_srgb
     if (png_get_color_type(png_ptr, info_ptr) != PNG_COLOR_TYPE_RGB_ALPHA) {
@@ -731,7 +1604,7 @@ load_png_fast_progressive (char *filename,
             "Failed to convince libpng to convert "
             "to RGBA (wrong color_type)"
         );
-        goto cleanup;
+        return false;
     }
     if (png_get_channels(png_ptr, info_ptr) != 4) {
         PyErr_SetString(
@@ -739,7 +1612,7 @@ load_png_fast_progressive (char *filename,
             "Failed to convince libpng to convert "
             "to RGBA (wrong number of channels)"
         );
-        goto cleanup;
+        return false;
     }
 
     if (convert_to_srgb && input_buffer_profile) {
@@ -761,12 +1634,83 @@ load_png_fast_progressive (char *filename,
             input_buffer_profile, input_buffer_format,
             nparray_data_profile, TYPE_RGBA_8,
             INTENT_PERCEPTUAL,
-            0
+            transform_flags
         );
     } //convert_to_srgb
 
     width = png_get_image_width(png_ptr, info_ptr);
     height = png_get_image_height(png_ptr, info_ptr);
+    return true;
+}
+
+
+void
+PNGReader::transform_row (const uint8_t *input_row, uint8_t *rgba_row) const
+{
+    // Really minimal fake colour management. Just remaps to sRGB.
+    cmsDoTransform(
+        input_buffer_to_nparray,
+        input_row,
+        rgba_row,
+        width
+    );
+    // lcms2 ignores alpha, so copy that verbatim
+    // If it's 8bpc RGBA, use A.
+    // If it's 16bpc RrGgBbAa, use A.
+    const int input_bytes = input_bytes_per_pixel();
+    for (uint32_t i=0; i<width; ++i) {
+        const uint32_t rgba_alpha_byte = (i*4) + 3;
+        const uint32_t input_alpha_byte =
+            (i*input_bytes) + ((bit_depth==8) ? 3 : 6);
+        rgba_row[rgba_alpha_byte] = input_row[input_alpha_byte];
+    }
+}
+
+
+/** load_png_fast_progressive:
+ *
+ * @filename: filename to load, in the system encoding
+ * @get_buffer_callback: a Python callable returning writeable arrays
+ * @convert_to_srgb: apply colorspace conversions, to sRGB display pixels
+ * returns: a dict of flags describing what was read.
+ *
+ * Read a PNG progressively as 8bit RGBA. The callback must have the signature
+ *
+ *   numpy_array = callback(full_image_width, full_image_height)
+ *
+ * @get_buffer_callback  must return a writeable array of the image width.  If
+ * the height is smaller than the image height, the callback will be called
+ * again until the full image has been processed. The buffer will be written
+ * with 8-bit RGBA data
+ *
+ */
+
+PyObject *
+load_png_fast_progressive (char *filename,
+                           PyObject *get_buffer_callback,
+                           bool convert_to_srgb)
+{
+    TRACE_SCOPE("load_png_fast_progressive");
+
+    // Note: we are not using the method that libpng calls "Reading PNG
+    // files progressively". That method would involve feeding the data
+    // into libpng piece by piece, which is not necessary if we can give
+    // libpng a simple FILE pointer.
+
+    PNGReader png;
+    uint32_t width, height;
+    uint32_t rows_left;
+
+    if (! png.begin(filename, convert_to_srgb, 0)) {
+        return NULL;
+    }
+    if (setjmp(png_jmpbuf(png.png_ptr))) {
+        return NULL;
+    }
+    convert_to_srgb = png.convert_to_srgb;
+
+    width = png.width;
+    height = png.height;
     rows_left = height;
 
     while (rows_left) {
@@ -774,9 +1718,8 @@ load_png_fast_progressive (char *filename,
         uint32_t rows = 0;
         uint32_t row = 0;
         // The input buffer is only used when doing color conversions
-        const uint8_t input_buf_bytes_per_pixel = (bit_depth==8) ? 4 : 8;
         const uint32_t input_buf_row_stride = sizeof(png_byte) * width
-                                              * input_buf_bytes_per_pixel;
+                                              * png.input_bytes_per_pixel();
         png_byte *input_buffer = NULL;
         // When not converting between colour spaces, the PNG data is
         // written directly to the output rows instead.
@@ -788,7 +1731,7 @@ load_png_fast_progressive (char *filename,
         obj = PyObject_CallFunction(get_buffer_callback, "ii", width, height);
         if (!obj) {
             PyErr_Format(PyExc_RuntimeError, "Get-buffer callback failed");
-            goto cleanup;
+            return NULL;
         }
         PyArrayObject* pyarr = (PyArrayObject*)obj;
 #ifdef HEAVY_DEBUG
@@ -808,7 +1751,7 @@ load_png_fast_progressive (char *filename,
                          "Attempt to read %d rows from the PNG, "
                          "but only %d are left",
                          rows, rows_left);
-            goto cleanup;
+            return NULL;
         }
 
         row_pointers = (png_bytep *)malloc(rows * sizeof(png_bytep));
@@ -828,7 +1771,7 @@ load_png_fast_progressive (char *filename,
         }
 
         // Populate the strip of memory with pixels decoded from the PNG stream
-        png_read_rows(png_ptr, row_pointers, NULL, rows);
+        png_read_rows(png.png_ptr, row_pointers, NULL, rows);
         rows_left -= rows;
 
         if (convert_to_srgb) {
@@ -836,24 +1779,7 @@ load_png_fast_progressive (char *filename,
             for (row=0; row<rows; row++) {
                 uint8_t *pyarr_row = (uint8_t *)PyArray_DATA(pyarr)
                                    + row*PyArray_STRIDE(pyarr, 0);
-                uint8_t *input_row = row_pointers[row];
-                // Really minimal fake colour management. Just remaps to sRGB.
-                cmsDoTransform(
-                    input_buffer_to_nparray,
-                    input_row,
-                    pyarr_row,
-                    width
-                );
-                // lcms2 ignores alpha, so copy that verbatim
-                // If it's 8bpc RGBA, use A.
-                // If it's 16bpc RrGgBbAa, use A.
-                for (uint32_t i=0; i<width; ++i) {
-                    const uint32_t pyarr_alpha_byte = (i*4) + 3;
-                    const uint32_t buf_alpha_byte =
-                        (i*input_buf_bytes_per_pixel)
-                        + ((bit_depth==8) ? 3 : 6);
-                    pyarr_row[pyarr_alpha_byte] = input_row[buf_alpha_byte];
-                }
+                png.transform_row(row_pointers[row], pyarr_row);
             }
             free(input_buffer);
         }
@@ -861,34 +1787,606 @@ load_png_fast_progressive (char *filename,
         Py_DECREF(obj);
     } //while (rows_left)
 
-    png_read_end(png_ptr, NULL);
+    png_read_end(png.png_ptr, NULL);
 
-    result = Py_BuildValue(
+    return Py_BuildValue(
         "{s:i,s:i,s:s,s:b}",
         "width", width,
         "height", height,
-        "cm_transform_desc", cm_processing,
+        "cm_transform_desc", png.cm_processing,
         "cm_transformed_to_srgb", convert_to_srgb
     );
+}
 
-cleanup:
-    if (info_ptr || info_ptr) {
-        png_destroy_read_struct (&png_ptr, &info_ptr, NULL);
+
+// Tile-aligned loading.
+//
+// The main thread decodes one tile row's worth of PNG rows at a time,
+// and worker threads turn each such band into rgba16 tiles while it goes
+// on to the next. Finished bands are handed to Python in order.
+
+
+static inline int
+floor_div (const int a, const int b)
+{
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+
+// libpng reports errors by longjmp()ing, which must not land in a frame
+// with live C++ objects changed since the setjmp().
+
+static bool
+png_read_rows_safely (png_structp png_ptr, png_bytepp rows, const int n)
+{
+    TRACE_SCOPE("png_read_rows");
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        return false;
     }
-    // libpng's style is to free internally allocated stuff like the icc
-    // tables in png_destroy_*(). I think.
-    if (fp)
-        fclose(fp);
-    if (convert_to_srgb) {
-        if (input_buffer_profile)
-            cmsCloseProfile(input_buffer_profile);
-        if (nparray_data_profile)
-            cmsCloseProfile(nparray_data_profile);
-        if (input_buffer_to_nparray)
-            cmsDeleteTransform(input_buffer_to_nparray);
-        if (gamma_transfer_func)
-            cmsFreeToneCurve(gamma_transfer_func);
+    png_read_rows(png_ptr, rows, NULL, n);
+    return true;
+}
+
+
+static bool
+png_read_end_safely (png_structp png_ptr)
+{
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        return false;
+    }
+    png_read_end(png_ptr, NULL);
+    return true;
+}
+
+struct PNGTileBand
+{
+    int ty;
+    int first_row;      // row of the band's tiles where image data starts
+    int num_rows;
+    std::vector<uint8_t> input;     // rows as decoded by libpng
+    std::vector<PyObject *> tiles;  // NxNx4 uint16 arrays, one per column
+    std::vector<bool> nonempty;
+    bool done;
+};
+
+
+struct PNGTileLoader
+{
+    const PNGReader &png;
+    int x;              // image position relative to its first tile
+    int num_tiles;      // tile columns covered by the image
+    uint16_t lut[256];  // 8 bit colour channel to fix15, before alpha
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<PNGTileBand *> queue;
+    bool stopping;
+
+    PNGTileLoader(const PNGReader &png, int x, int num_tiles, float eotf)
+        : png(png), x(x), num_tiles(num_tiles), stopping(false)
+    {
+        // The same conversion as tile_convert_rgba8_to_rgba16()
+        for (int i = 0; i < 256; ++i) {
+            if (eotf == 1.0) {
+                lut[i] = (i * (1<<15) + 255/2) / 255;
+            }
+            else {
+                lut[i] = fastpow((float)i/255.0, eotf) * (1<<15) + 0.5;
+            }
+        }
+    }
+
+    void convert(PNGTileBand &band) const;
+    void worker();
+};
+
+
+void
+PNGTileLoader::convert (PNGTileBand &band) const
+{
+    TRACE_SCOPE("PNGTileLoader::convert");
+    const int input_stride = png.width * png.input_bytes_per_pixel();
+    std::vector<uint8_t> rgba8;
+    if (png.convert_to_srgb) {
+        rgba8.resize(png.width * 4);
+    }
+    for (int r = 0; r < band.num_rows; ++r) {
+        const uint8_t *src = &band.input[(size_t)r * input_stride];
+        if (png.convert_to_srgb) {
+            png.transform_row(src, &rgba8[0]);
+            src = &rgba8[0];
+        }
+        const int tile_y = band.first_row + r;
+        int col = 0;   // column within the image
+        for (int i = 0; i < num_tiles && col < (int)png.width; ++i) {
+            const int tile_x = (i == 0) ? x : 0;
+            const int n = std::min(N - tile_x, (int)png.width - col);
+            PyArrayObject *tile = (PyArrayObject *)band.tiles[i];
+            uint16_t *dst = (uint16_t *)((char *)PyArray_DATA(tile)
+                                         + tile_y * PyArray_STRIDE(tile, 0))
+                            + tile_x * 4;
+            const uint8_t *src_p = src + col * 4;
+            uint8_t any_alpha = 0;
+            for (int j = 0; j < n; ++j, src_p += 4, dst += 4) {
+                const uint32_t a = (src_p[3] * (1<<15) + 255/2) / 255;
+                // premultiply alpha (with rounding)
+                dst[0] = (lut[src_p[0]] * a + (1<<15)/2) / (1<<15);
+                dst[1] = (lut[src_p[1]] * a + (1<<15)/2) / (1<<15);
+                dst[2] = (lut[src_p[2]] * a + (1<<15)/2) / (1<<15);
+                dst[3] = a;
+                any_alpha |= src_p[3];
+            }
+            if (any_alpha) {
+                band.nonempty[i] = true;
+            }
+            col += n;
+        }
+    }
+}
+
+
+void
+PNGTileLoader::worker ()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        while (queue.empty() && !stopping) {
+            cond.wait(guard);
+        }
+        if (queue.empty()) {
+            return;
+        }
+        PNGTileBand *band = queue.front();
+        queue.pop_front();
+        guard.unlock();
+        convert(*band);
+        guard.lock();
+        band->done = true;
+        cond.notify_all();
+    }
+}
+
+
+// Hands a finished band's nonempty tiles to Python, and drops the rest.
+
+static bool
+deliver_tile_band (PNGTileBand &band, PyObject *tiles_callback,
+                   const PNGReader &png, const int tx0)
+{
+    PyObject *tiles = PyDict_New();
+    bool ok = (tiles != NULL);
+    for (size_t i = 0; i < band.tiles.size(); ++i) {
+        if (ok && band.nonempty[i]) {
+            PyObject *tx = PyLong_FromLong(tx0 + i);
+            ok = tx && (PyDict_SetItem(tiles, tx, band.tiles[i]) == 0);
+            Py_XDECREF(tx);
+        }
+        Py_DECREF(band.tiles[i]);
+    }
+    band.tiles.clear();
+    if (ok) {
+        PyObject *res = PyObject_CallFunction(tiles_callback, "iiiO",
+                                              png.width, png.height,
+                                              band.ty, tiles);
+        ok = (res != NULL);
+        Py_XDECREF(res);
+    }
+    Py_XDECREF(tiles);
+    return ok;
+}
+
+
+// Reduces the bands of a load to one mipmap level as they come in.
+//
+// Each level's tiles are built from the four below them in the same way
+// as MyPaintSurface builds its mipmaps: a tile exists if any of its
+// children do, it is their quadrants downscaled, and four children of a
+// single colour make a tile of that colour. Only the tile row being
+// built is kept for each level, so no level is ever held in full.
+
+struct PNGMipmapReducer
+{
+    struct Tile {
+        PyObject *rgba;     // NxNx4 uint16 array, or NULL if empty
+        int num_children;
+        bool constant;      // a single colour, namely...
+        uint64_t colour;    // ...this pixel
+    };
+
+    struct Row {
+        bool active;
+        int ty;
+        std::vector<Tile> tiles;
+    };
+
+    PyObject *tiles_callback;
+    const PNGReader &png;
+    const int level;
+    std::vector<int> tx0;   // first tile column, by level
+    std::vector<Row> rows;  // rows[k] is being built for level k+1
+
+    PNGMipmapReducer(PyObject *tiles_callback, const PNGReader &png,
+                     int level, int tx0_base, int num_tiles)
+        : tiles_callback(tiles_callback), png(png), level(level),
+          tx0(level + 1), rows(level)
+    {
+        int tx1 = tx0_base + num_tiles - 1;
+        tx0[0] = tx0_base;
+        for (int k = 0; k < level; ++k) {
+            tx0[k+1] = floor_div(tx0[k], 2);
+            tx1 = floor_div(tx1, 2);
+            rows[k].active = false;
+            rows[k].tiles.resize(tx1 - tx0[k+1] + 1);
+        }
+    }
+
+    ~PNGMipmapReducer()
+    {
+        for (size_t k = 0; k < rows.size(); ++k) {
+            release(rows[k].tiles);
+        }
+    }
+
+    static void release (std::vector<Tile> &tiles);
+    static bool is_uniform (PyObject *rgba, uint64_t &colour);
+
+    bool add_band (PNGTileBand &band);
+    bool add (const int k, const int ty, std::vector<Tile> &children);
+    bool flush (const int k);
+    bool finish ();
+};
+
+
+void
+PNGMipmapReducer::release (std::vector<Tile> &tiles)
+{
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        Py_XDECREF(tiles[i].rgba);
+        tiles[i].rgba = NULL;
+        tiles[i].num_children = 0;
+    }
+}
+
+
+// The test tile_summarize() makes, which the tiles of a normal load
+// pass through before they become constant ones.
+
+bool
+PNGMipmapReducer::is_uniform (PyObject *rgba, uint64_t &colour)
+{
+    const uint16_t *p = (const uint16_t *)PyArray_DATA((PyArrayObject *)rgba);
+    memcpy(&colour, p, sizeof(colour));
+    for (int i = 1; i < N*N; ++i) {
+        uint64_t pixel;
+        memcpy(&pixel, p + 4*i, sizeof(pixel));
+        if (pixel != colour) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Takes over a finished band's nonempty tiles, and drops the rest.
+
+bool
+PNGMipmapReducer::add_band (PNGTileBand &band)
+{
+    std::vector<Tile> tiles(band.tiles.size());
+    for (size_t i = 0; i < band.tiles.size(); ++i) {
+        tiles[i].num_children = 0;
+        if (band.nonempty[i]) {
+            tiles[i].rgba = band.tiles[i];
+            tiles[i].constant = is_uniform(tiles[i].rgba, tiles[i].colour);
+        }
+        else {
+            tiles[i].rgba = NULL;
+            Py_DECREF(band.tiles[i]);
+        }
+    }
+    band.tiles.clear();
+    return add(0, band.ty, tiles);
+}
+
+
+// Downscales a row of level k tiles into the row being built above them.
+// The children's references are used up.
+
+bool
+PNGMipmapReducer::add (const int k, const int ty, std::vector<Tile> &children)
+{
+    Row &row = rows[k];
+    const int pty = floor_div(ty, 2);
+    bool ok = true;
+    if (row.active && row.ty != pty) {
+        ok = flush(k);
+    }
+    row.active = true;
+    row.ty = pty;
+    const int dst_y = (ty - 2*pty) * (N/2);
+    const int row_bytes = N * 4 * sizeof(uint16_t);
+    for (size_t i = 0; ok && i < children.size(); ++i) {
+        const Tile &child = children[i];
+        if (! child.rgba) {
+            continue;
+        }
+        const int tx = tx0[k] + i;
+        const int ptx = floor_div(tx, 2);
+        Tile &dst = row.tiles[ptx - tx0[k+1]];
+        if (! dst.rgba) {
+            dst.rgba = tile_pool_new(TilePoolRGBA16);
+            if (! dst.rgba) {
+                ok = false;
+                break;
+            }
+        }
+        tile_downscale_rgba16_c(
+            (const uint16_t *)PyArray_DATA((PyArrayObject *)child.rgba),
+            row_bytes,
+            (uint16_t *)PyArray_DATA((PyArrayObject *)dst.rgba),
+            row_bytes,
+            (tx - 2*ptx) * (N/2), dst_y
+        );
+        if (dst.num_children == 0) {
+            dst.constant = child.constant;
+            dst.colour = child.colour;
+        }
+        else if (! child.constant || child.colour != dst.colour) {
+            dst.constant = false;
+        }
+        ++dst.num_children;
+    }
+    release(children);
+    return ok;
+}
+
+
+// Finishes the row being built for level k+1, and passes it on.
+
+bool
+PNGMipmapReducer::flush (const int k)
+{
+    Row &row = rows[k];
+    row.active = false;
+    std::vector<Tile> tiles(row.tiles);
+    for (size_t i = 0; i < row.tiles.size(); ++i) {
+        row.tiles[i].rgba = NULL;
+        row.tiles[i].num_children = 0;
+    }
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        Tile &t = tiles[i];
+        if (! t.rgba) {
+            continue;
+        }
+        // Downscaled tiles count as mixed, as in _regenerate_mipmaps()
+        t.constant = t.constant && (t.num_children == 4);
+        if (t.constant) {
+            uint16_t *p = (uint16_t *)PyArray_DATA((PyArrayObject *)t.rgba);
+            for (int j = 0; j < N*N; ++j) {
+                memcpy(p + 4*j, &t.colour, sizeof(t.colour));
+            }
+        }
+        t.num_children = 0;
+    }
+    if (k + 1 < level) {
+        return add(k + 1, row.ty, tiles);
+    }
+
+    PyObject *dict = PyDict_New();
+    bool ok = (dict != NULL);
+    for (size_t i = 0; ok && i < tiles.size(); ++i) {
+        if (tiles[i].rgba) {
+            PyObject *tx = PyLong_FromLong(tx0[level] + i);
+            ok = tx && (PyDict_SetItem(dict, tx, tiles[i].rgba) == 0);
+            Py_XDECREF(tx);
+        }
+    }
+    release(tiles);
+    if (ok) {
+        PyObject *res = PyObject_CallFunction(tiles_callback, "iiiO",
+                                              png.width, png.height,
+                                              row.ty, dict);
+        ok = (res != NULL);
+        Py_XDECREF(res);
+    }
+    Py_XDECREF(dict);
+    return ok;
+}
+
+
+// Passes on the last row of each level, bottom level first.
+
+bool
+PNGMipmapReducer::finish ()
+{
+    for (int k = 0; k < level; ++k) {
+        if (rows[k].active && ! flush(k)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/** load_png_fast_to_tiles:
+ *
+ * @filename: filename to load, in the system encoding
+ * @tiles_callback: a Python callable receiving tiles
+ * @x: X coordinate of the image's top left pixel
+ * @y: Y coordinate of the image's top left pixel
+ * @convert_to_srgb: apply colorspace conversions, to sRGB display pixels
+ * @eotf: as for tile_convert_rgba8_to_rgba16()
+ * @threads: number of conversion threads, 0 for one per CPU
+ * @mipmap_level: if above 0, pass on the tiles of this mipmap level
+ * returns: a dict of flags describing what was read.
+ *
+ * Read a PNG straight into premultiplied rgba16 tiles. The callback must
+ * have the signature
+ *
+ *   callback(full_image_width, full_image_height, ty, tiles)
+ *
+ * and is called once for each tile row the image touches, from top to
+ * bottom. tiles is a dict mapping tile X coordinates to NxNx4 uint16
+ * arrays; it only holds the tiles with some nonzero alpha in them, and
+ * the callback may keep them.
+ *
+ * With a mipmap_level above 0, the tiles and tile rows are those of that
+ * level instead: what MyPaintSurface's mipmaps would build from the tiles
+ * of a normal load. They are reduced band by band as the PNG is decoded,
+ * without the full-size image ever being held. The image dimensions
+ * passed to the callback are still those of the PNG.
+ *
+ */
+
+PyObject *
+load_png_fast_to_tiles (char *filename,
+                        PyObject *tiles_callback,
+                        int x, int y,
+                        bool convert_to_srgb,
+                        float eotf,
+                        int threads,
+                        int mipmap_level)
+{
+    TRACE_SCOPE("load_png_fast_to_tiles");
+    PNGReader png;
+
+    if (mipmap_level < 0) {
+        PyErr_SetString(PyExc_ValueError, "mipmap_level must not be negative");
+        return NULL;
+    }
+
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // Rows are transformed in several threads at once
+    if (! png.begin(filename, convert_to_srgb, cmsFLAGS_NOCACHE)) {
+        return NULL;
+    }
+
+    const int tx0 = floor_div(x, N);
+    const int ty0 = floor_div(y, N);
+    const int x_in_tile = x - tx0 * N;
+    const int num_tiles = floor_div(x + (int)png.width - 1, N) - tx0 + 1;
+    const int input_stride = png.width * png.input_bytes_per_pixel();
+    PNGTileLoader loader(png, x_in_tile, num_tiles, eotf);
+    PNGMipmapReducer reducer(tiles_callback, png, mipmap_level,
+                             tx0, num_tiles);
+
+    // At most this many bands are decoded but not yet delivered
+    const int max_bands = threads * 2;
+    std::deque<PNGTileBand *> bands;
+    std::vector<std::thread> workers;
+    if (threads > 1) {
+        for (int i = 0; i < threads; ++i) {
+            workers.push_back(std::thread(&PNGTileLoader::worker, &loader));
+        }
     }
 
-    return result;
+    bool ok = true;
+    uint32_t row = 0;
+    int ty = ty0;
+    png_bytep row_pointers[N];
+
+    while (ok && row < png.height) {
+        PNGTileBand *band = new PNGTileBand();
+        band->ty = ty;
+        band->first_row = (row == 0) ? (y - ty0 * N) : 0;
+        band->num_rows = std::min(N - band->first_row,
+                                  (int)(png.height - row));
+        band->done = false;
+        band->input.resize((size_t)band->num_rows * input_stride);
+        bands.push_back(band);
+        for (int i = 0; i < num_tiles && ok; ++i) {
+            PyObject *tile = tile_pool_new(TilePoolRGBA16);
+            ok = (tile != NULL);
+            if (ok) {
+                band->tiles.push_back(tile);
+                band->nonempty.push_back(false);
+            }
+        }
+        if (! ok) {
+            break;
+        }
+
+        for (int r = 0; r < band->num_rows; ++r) {
+            row_pointers[r] = &band->input[(size_t)r * input_stride];
+        }
+        if (! png_read_rows_safely(png.png_ptr, row_pointers,
+                                   band->num_rows)) {
+            ok = false;
+            break;
+        }
+        row += band->num_rows;
+        ++ty;
+
+        if (workers.empty()) {
+            loader.convert(*band);
+            band->done = true;
+        }
+        else {
+            std::lock_guard<std::mutex> guard(loader.lock);
+            loader.queue.push_back(band);
+            loader.cond.notify_all();
+        }
+
+        // Deliver what's ready, in order, waiting only if too far ahead
+        while (ok && !bands.empty()) {
+            PNGTileBand *first = bands.front();
+            const bool wait = (row == png.height)
+                || ((int)bands.size() > max_bands);
+            {
+                std::unique_lock<std::mutex> guard(loader.lock);
+                if (! first->done && ! wait) {
+                    break;
+                }
+                Py_BEGIN_ALLOW_THREADS
+                while (! first->done) {
+                    loader.cond.wait(guard);
+                }
+                Py_END_ALLOW_THREADS
+            }
+            bands.pop_front();
+            if (mipmap_level > 0) {
+                ok = reducer.add_band(*first);
+            }
+            else {
+                ok = deliver_tile_band(*first, tiles_callback, png, tx0);
+            }
+            delete first;
+        }
+    }
+    if (ok) {
+        ok = png_read_end_safely(png.png_ptr);
+    }
+    if (ok) {
+        ok = reducer.finish();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(loader.lock);
+        loader.stopping = true;
+        loader.cond.notify_all();
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+    Py_END_ALLOW_THREADS
+    for (size_t i = 0; i < bands.size(); ++i) {
+        for (size_t j = 0; j < bands[i]->tiles.size(); ++j) {
+            Py_DECREF(bands[i]->tiles[j]);
+        }
+        delete bands[i];
+    }
+    if (! ok) {
+        return NULL;
+    }
+
+    return Py_BuildValue(
+        "{s:i,s:i,s:s,s:b}",
+        "width", png.width,
+        "height", png.height,
+        "cm_transform_desc", png.cm_processing,
+        "cm_transformed_to_srgb", png.convert_to_srgb
+    );
 }
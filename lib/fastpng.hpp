@@ -22,15 +22,55 @@
 
 
 // Writes a PNG file progressively in strips
+//
+// With threads > 1 (or 0, meaning one per CPU), rows are collected into
+// bands which are filtered and deflated concurrently, each band continuing
+// the previous one's dictionary, and the pieces are stitched into a single
+// zlib stream in the IDAT chunks. The output is the same for any thread
+// count greater than one. Otherwise libpng does all the work serially.
+//
+// 16-bit files are written from fix15 strips as rendered. Unpremultiplying,
+// scaling to 16 bits, the EOTF and byte order are all dealt with here.
+//
+// write_rendered() composites the image itself, in worker threads which
+// run while earlier rows are being compressed. "program" is a layer
+// stack's program for tile_render_ops_many(), and "rows" an iterable
+// giving a tuple of per-tile sources for each tile row, as that takes
+// them, for all of the tile columns the image spans. The image starts
+// x_offset and y_offset pixels into the first tile row. Tiles are
+// rendered with alpha into transparency, then converted like the output
+// of tile_convert_rgba16_to_rgba8() or tile_convert_rgbu16_to_rgbu8()
+// with the writer's EOTF, or kept as fix15 for 16-bit files.
 
 class ProgressivePNGWriter
 {
 public:
+    // Row filter strategies. The first five are the PNG filter types;
+    // FILTER_ADAPTIVE picks the best of them for each row.
+    enum {
+        FILTER_NONE = 0,
+        FILTER_SUB = 1,
+        FILTER_UP = 2,
+        FILTER_AVERAGE = 3,
+        FILTER_PAETH = 4,
+        FILTER_ADAPTIVE = 5
+    };
+
     ProgressivePNGWriter(PyObject *file,
                          const int w, const int h,
                          const bool has_alpha,
-                         const bool save_srgb_chunks);
-    PyObject *write(PyObject *arr);  // write a h*w*4 uint8 numpy array
+                         const bool save_srgb_chunks,
+                         const int compression_level = 2,
+                         const int filter = FILTER_SUB,
+                         const int threads = 1,
+                         const int bit_depth = 8,
+                         const float eotf = 1.0);
+    // Write a h*w*4 numpy array: uint8 for 8-bit files, or fix15 uint16
+    // for 16-bit ones, premultiplied if the file has alpha.
+    PyObject *write(PyObject *arr);
+    // Render the rest of the image and write it, as described below
+    PyObject *write_rendered(PyObject *program, PyObject *rows,
+                             int x_offset, int y_offset);
     PyObject *close();   // finalize write
     ~ProgressivePNGWriter();
 private:
@@ -47,4 +87,19 @@ load_png_fast_progressive (char *filename,
                            PyObject *get_buffer_callback,
                            bool convert_to_srgb);
 
+
+// Load a file straight into premultiplied 15-bit RGBA tiles, converting
+// bands of tile rows in worker threads while libpng decodes the next.
+// The tiles are passed to a callback one tile row at a time, optionally
+// reduced on the fly to a mipmap level for previews.
+
+PyObject *
+load_png_fast_to_tiles (char *filename,
+                        PyObject *tiles_callback,
+                        int x, int y,
+                        bool convert_to_srgb,
+                        float eotf,
+                        int threads = 0,
+                        int mipmap_level = 0);
+
 #endif //FASTPNG_HPP
@@ -9,9 +9,15 @@
 
 #include "blur.hpp"
 #include "fill_constants.hpp"
+#include "../tracing.hpp"
 
+#include <algorithm>
 #include <cmath>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // Generate gaussian multiplicands used for blurring.
 // They are stored and used with fixed-point arithmetic
 static const std::vector<fix15_short_t>
@@ -38,55 +44,153 @@ blur_factors(int r)
     return factors;
 }
 
-// Allocate memory for input and intermediate buffers
-GaussBlurrer::GaussBlurrer(int r)
-    : factors(blur_factors(r)), radius((factors.size() - 1) / 2)
+// Radii of three successive box blurs approximating a gaussian with the
+// same sigma as the one of blur_factors, following
+// "Fast Almost-Gaussian Filtering" (Kovesi, 2010).
+static const std::vector<int>
+box_blur_radii(int r)
+{
+    const int n = 3;
+    const double sigma = 0.3 * r + 0.3;
+    const double var12 = 12 * sigma * sigma;
+
+    int lower = floor(sqrt(var12 / n + 1));
+    if (lower % 2 == 0) lower--;
+    const int upper = lower + 2;
+    // Number of boxes of the lower width, making the variances match
+    const int num_lower = round(
+        (var12 - n * lower * lower - 4 * n * lower - 3 * n) /
+        (-4 * lower - 4));
+
+    std::vector<int> radii;
+    for (int i = 0; i < n; ++i) {
+        radii.push_back(((i < num_lower ? lower : upper) - 1) / 2);
+    }
+    return radii;
+}
+
+// Lay out the input and intermediate buffers in one scratch buffer
+GaussBlurrer::GaussBlurrer(int r, bool fast)
+    : factors(blur_factors(r)), radius((factors.size() - 1) / 2), fast(fast),
+      box_radii(box_blur_radii(r)),
+      full_stride(ScratchBuffer::row_stride<chan_t>(N + radius * 2)),
+      vertical_stride(ScratchBuffer::row_stride<chan_t>(N)),
+      buffer(
+          sizeof(chan_t) *
+          ((N + radius * 2) * (full_stride + vertical_stride) +
+           (fast ? (N + radius * 2) * vertical_stride + 2 * full_stride : 0))),
+      column_sums(fast ? N : 0), has_input(false)
 {
     // Suppress uninitialization warning, the output
     // array is always fully populated before use
     const int width = N + radius * 2;
+    chan_t* mem = buffer.data<chan_t>();
     // Output from 3x3-grid,
     // input to horizontal blur (Y x X) = (d x d)
-    input_full = new chan_t*[width];
-    for (int i = 0; i < width; ++i) {
-        input_full[i] = new chan_t[width];
+    for (int i = 0; i < width; ++i, mem += full_stride) {
+        input_full_rows.push_back(mem);
     }
+    input_full = input_full_rows.data();
     // Output for horizontal blur,
     // input to vertical blur (Y x X) = (d x N)
-    input_vertical = new chan_t*[width];
-    for (int i = 0; i < width; ++i) {
-        input_vertical[i] = new chan_t[N];
+    for (int i = 0; i < width; ++i, mem += vertical_stride) {
+        input_vertical_rows.push_back(mem);
     }
-}
-
-GaussBlurrer::~GaussBlurrer()
-{
-    const int width = N + radius * 2;
-    for (int i = 0; i < width; ++i) {
-        delete[] input_full[i];
-        delete[] input_vertical[i];
+    input_vertical = input_vertical_rows.data();
+    if (fast) {
+        for (int i = 0; i < width; ++i, mem += vertical_stride) {
+            box_rows.push_back(mem);
+        }
+        box_line[0] = mem;
+        box_line[1] = mem + full_stride;
     }
-    delete[] input_full;
-    delete[] input_vertical;
 }
 
 PyObject*
-GaussBlurrer::blur(bool can_update, GridVector input_grid)
+GaussBlurrer::blur(
+    bool can_update, GridVector input_grid, TileMap& blurred, coord tile_coord)
 {
-    initiate(can_update, input_grid);
+    // Uniformly constant input, leaving the input array as it was
+    PyObject* uniform = uniform_nine_grid(input_grid);
+    if (uniform) {
+        has_input = false;
+        return uniform;
+    }
+
+    initiate(can_update && has_input, input_grid);
+    has_input = true;
 
     if (input_is_fully_opaque()) return ConstTiles::ALPHA_OPAQUE();
 
     if (input_is_fully_transparent()) return ConstTiles::ALPHA_TRANSPARENT();
 
-    int r = radius;
-
     // Create output buffer
-    PixelBuffer<chan_t> out_buf = new_alpha_tile();
+    PixelBuffer<chan_t> out_buf = blurred.add_new(tile_coord.x, tile_coord.y);
+
+    if (fast)
+        box_blur(out_buf);
+    else
+        gauss_blur(out_buf);
+
+    return nullptr;
+}
+
+#ifdef __SSE2__
+// Add fix15_mul(in, factor) for 8 values to two vectors of 32 bit sums.
+// The 16 bit multiplications give the low and high halves of the products.
+static inline void
+mul_accumulate(__m128i in, __m128i factor, __m128i& lo, __m128i& hi)
+{
+    const __m128i p_lo = _mm_mullo_epi16(in, factor);
+    const __m128i p_hi = _mm_mulhi_epu16(in, factor);
+    lo = _mm_add_epi32(lo, _mm_srli_epi32(_mm_unpacklo_epi16(p_lo, p_hi), 15));
+    hi = _mm_add_epi32(hi, _mm_srli_epi32(_mm_unpackhi_epi16(p_lo, p_hi), 15));
+}
+
+// Apply fix15_short_clamp to the 8 sums, and store them
+static inline void
+clamp_store(chan_t* dst, __m128i lo, __m128i hi)
+{
+    const __m128i one = _mm_set1_epi32(fix15_one);
+    const __m128i lo_over = _mm_cmpgt_epi32(lo, one);
+    const __m128i hi_over = _mm_cmpgt_epi32(hi, one);
+    lo = _mm_or_si128(_mm_and_si128(lo_over, one), _mm_andnot_si128(lo_over, lo));
+    hi = _mm_or_si128(_mm_and_si128(hi_over, one), _mm_andnot_si128(hi_over, hi));
+    // The pack saturates to the signed range, which fix15_one is outside
+    // of, so the values are offset into that range and back.
+    const __m128i packed =
+        _mm_packs_epi32(_mm_sub_epi32(lo, one), _mm_sub_epi32(hi, one));
+    _mm_storeu_si128(
+        (__m128i*)dst, _mm_xor_si128(packed, _mm_set1_epi16((short)0x8000)));
+}
+#endif
+
+void
+GaussBlurrer::gauss_blur(PixelBuffer<chan_t>& out_buf)
+{
+    TRACE_SCOPE("GaussBlurrer::gauss_blur");
+    const int r = radius;
+    int x_simd = 0;
 
     // Blur each row from input to intermediate buffer
+#ifdef __SSE2__
+    x_simd = N - N % 8;
     for (int y = 0; y < N + 2 * r; ++y) {
-        for (int x = 0; x < N; ++x) {
+        for (int x = 0; x < x_simd; x += 8) {
+            __m128i lo = _mm_setzero_si128();
+            __m128i hi = _mm_setzero_si128();
+            const chan_t* const in = input_full[y] + x;
+            for (int i = 0; i < 2 * r + 1; i++) {
+                mul_accumulate(
+                    _mm_loadu_si128((const __m128i*)(in + i)),
+                    _mm_set1_epi16(factors[i]), lo, hi);
+            }
+            clamp_store(input_vertical[y] + x, lo, hi);
+        }
+    }
+#endif
+    for (int y = 0; y < N + 2 * r; ++y) {
+        for (int x = x_simd; x < N; ++x) {
             fix15_t blurred = 0;
             for (int xoffs = -r; xoffs < r + 1; xoffs++) {
                 fix15_t in = input_full[y][x + xoffs + r];
@@ -97,7 +201,22 @@ GaussBlurrer::blur(bool can_update, GridVector input_grid)
     }
 
     // Blur each column from intermediate to output buffer
-    for (int x = 0; x < N; ++x) {
+#ifdef __SSE2__
+    for (int y = 0; y < N; ++y) {
+        chan_t* const out_row = &out_buf(0, y);
+        for (int x = 0; x < x_simd; x += 8) {
+            __m128i lo = _mm_setzero_si128();
+            __m128i hi = _mm_setzero_si128();
+            for (int i = 0; i < 2 * r + 1; i++) {
+                mul_accumulate(
+                    _mm_loadu_si128((const __m128i*)(input_vertical[y + i] + x)),
+                    _mm_set1_epi16(factors[i]), lo, hi);
+            }
+            clamp_store(out_row + x, lo, hi);
+        }
+    }
+#endif
+    for (int x = x_simd; x < N; ++x) {
         for (int y = 0; y < N; ++y) {
             fix15_t blurred = 0;
             for (int yoffs = -r; yoffs < r + 1; yoffs++) {
@@ -107,13 +226,101 @@ GaussBlurrer::blur(bool can_update, GridVector input_grid)
             out_buf(x, y) = fix15_short_clamp(blurred);
         }
     }
+}
 
-    return out_buf.array_ob;
+// Multiplier turning a sum of w values into their rounded mean,
+// as (sum * multiplier + 2^31) >> 32
+static inline uint64_t
+mean_multiplier(int w)
+{
+    return ((1ull << 32) + w / 2) / w;
+}
+
+/*
+  Box blur a line: out[i] = mean of in[i .. i + 2h], for i in [0, n)
+*/
+static void
+box_blur_line(const chan_t* in, chan_t* out, int n, int h)
+{
+    const uint64_t mul = mean_multiplier(2 * h + 1);
+    fix15_t sum = 0;
+    for (int i = 0; i < 2 * h; ++i) {
+        sum += in[i];
+    }
+    for (int i = 0; i < n; ++i) {
+        sum += in[i + 2 * h];
+        out[i] = (sum * mul + (1u << 31)) >> 32;
+        sum -= in[i];
+    }
+}
+
+/*
+  Box blur the N columns of a set of rows:
+  out[i][x] = mean of in[i .. i + 2h][x], for i in [0, n)
+*/
+static void
+box_blur_columns(
+    chan_t* const* in, chan_t* const* out, int n, int h, fix15_t* sums)
+{
+    const uint64_t mul = mean_multiplier(2 * h + 1);
+    std::fill(sums, sums + N, 0);
+    for (int i = 0; i < 2 * h; ++i) {
+        for (int x = 0; x < N; ++x) {
+            sums[x] += in[i][x];
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        const chan_t* const add = in[i + 2 * h];
+        const chan_t* const sub = in[i];
+        chan_t* const dst = out[i];
+        for (int x = 0; x < N; ++x) {
+            const fix15_t sum = sums[x] + add[x];
+            dst[x] = (sum * mul + (1u << 31)) >> 32;
+            sums[x] = sum - sub[x];
+        }
+    }
+}
+
+/*
+  Approximate the gaussian blur with three box blurs in either direction.
+  Every box blur shrinks the region of valid output by its radius on
+  either side, until only the output tile is left.
+*/
+void
+GaussBlurrer::box_blur(PixelBuffer<chan_t>& out_buf)
+{
+    TRACE_SCOPE("GaussBlurrer::box_blur");
+    const int width = N + 2 * radius;
+    const int h0 = box_radii[0];
+    const int h1 = box_radii[1];
+    const int h2 = box_radii[2];
+    // Unused margin of the input, when the boxes do not span the radius
+    const int margin = radius - (h0 + h1 + h2);
+
+    for (int y = 0; y < width; ++y) {
+        box_blur_line(input_full[y], box_line[0], width - 2 * h0, h0);
+        box_blur_line(
+            box_line[0], box_line[1], width - 2 * (h0 + h1), h1);
+        box_blur_line(box_line[1] + margin, input_vertical[y], N, h2);
+    }
+
+    chan_t** const rows = box_rows.data();
+    box_blur_columns(input_vertical, rows, width - 2 * h0, h0,
+                     column_sums.data());
+    box_blur_columns(rows, input_vertical, width - 2 * (h0 + h1), h1,
+                     column_sums.data());
+    box_blur_columns(input_vertical + margin, rows, N, h2,
+                     column_sums.data());
+
+    for (int y = 0; y < N; ++y) {
+        std::copy(rows[y], rows[y] + N, &out_buf(0, y));
+    }
 }
 
 void
 GaussBlurrer::initiate(bool can_update, GridVector input)
 {
+    TRACE_SCOPE("GaussBlurrer::initiate");
     init_from_nine_grid(radius, input_full, can_update, input);
 }
 
@@ -133,50 +340,48 @@ GaussBlurrer::input_is_fully_transparent()
 /*
   Blur a strand of tiles, from top to bottom. This function
   is very similar to morph_strand, but does not need to keep
-  track of separate update flags. In fact, since the blur
-  function always writes its input array before checking if it
-  can skip the actual op, subsequent blurs can always update
-  the input array.
+  track of separate update flags. In fact, since the blurrer
+  keeps track of whether its input array holds the previous
+  tile's input, subsequent blurs can always ask to update it.
 */
 void
 blur_strand(
-    Strand& strand, AtomicDict& tiles, GaussBlurrer& bucket,
-    AtomicDict& blurred, Controller& status_controller)
+    Strand& strand, const TileMap& tiles, GaussBlurrer& bucket,
+    TileMap& blurred, Controller& status_controller)
 {
     bool can_update = false;
-    PyObject* tile_coord;
+    coord tile_coord;
     while (status_controller.running() && strand.pop(tile_coord)) {
         GridVector grid = nine_grid(tile_coord, tiles);
 
-        PyObject* result = bucket.blur(can_update, grid);
+        PyObject* result = bucket.blur(can_update, grid, blurred, tile_coord);
         can_update = true;
+        if (result) status_controller.inc_skipped(1);
 
-        // Add morphed tile unless it is completely transparent
-        bool is_empty = result == ConstTiles::ALPHA_TRANSPARENT();
-        bool is_full = result == ConstTiles::ALPHA_OPAQUE();
-        if (!is_empty) blurred.set(tile_coord, result, !is_full);
+        // New tiles are already in the result, of the constant
+        // tiles only add the opaque one (skipping transparent tiles)
+        if (result == ConstTiles::ALPHA_OPAQUE())
+            blurred.set(tile_coord.x, tile_coord.y, result);
     }
 }
 
 void
 blur_worker(
-    int radius, StrandQueue& queue, AtomicDict tiles,
-    std::promise<AtomicDict> result, Controller& status_controller)
+    int radius, bool fast, WorkerStrands& queue, const TileMap& tiles,
+    TileMap& blurred, Controller& status_controller)
 {
-    AtomicDict blurred;
-    GaussBlurrer bucket(radius);
+    GaussBlurrer bucket(radius, fast);
     Strand strand;
     while (status_controller.running() && queue.pop(strand)) {
         blur_strand(strand, tiles, bucket, blurred, status_controller);
         status_controller.inc_processed(strand.size());
     }
-    result.set_value(blurred);
 }
 
 void
 blur(
     int radius, PyObject* blurred, PyObject* tiles, PyObject* strands,
-    Controller& status_controller)
+    Controller& status_controller, bool fast)
 {
     if (radius <= 0 || !PyDict_Check(tiles) || !PyList_CheckExact(strands)) {
         printf("Invalid blur parameters!\n");
@@ -185,7 +390,12 @@ blur(
 
     const int min_strands_per_worker = 2;
     StrandQueue work_queue(strands);
+    auto worker = [fast](
+                      int radius, WorkerStrands& queue, const TileMap& tiles,
+                      TileMap& result, Controller& status_controller) {
+        blur_worker(radius, fast, queue, tiles, result, status_controller);
+    };
     process_strands(
-        blur_worker, radius, min_strands_per_worker, std::ref(work_queue),
-        AtomicDict(tiles), AtomicDict(blurred), status_controller);
+        worker, radius, min_strands_per_worker, work_queue, tiles, blurred,
+        status_controller);
 }
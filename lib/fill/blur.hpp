@@ -19,13 +19,20 @@
   The blur is performed in two passes. First the full input is blurred
   horizontally, writing the output to an intermediate array. Secondly the
   intermediate array is blurred vertically, writing the output into a new tile.
+
+  In fast mode, each pass is instead made up of three box blurs, computed
+  with running sums, which together approximate the gaussian at a cost per
+  pixel that does not depend on the radius.
 */
 class GaussBlurrer
 {
   public:
-    explicit GaussBlurrer(int radius);
-    ~GaussBlurrer();
-    PyObject* blur(bool can_update, GridVector input);
+    explicit GaussBlurrer(int radius, bool fast = false);
+    // Blur the middle tile of the input, returning the constant tile
+    // the result is equal to, or nullptr if it was added to "blurred"
+    PyObject* blur(
+        bool can_update, GridVector input, TileMap& blurred,
+        coord tile_coord);
 
   private:
     // Read in-data from the tiles of input to the input_full array
@@ -34,12 +41,31 @@ class GaussBlurrer
     // to the tiles in the most recent call to initiate
     bool input_is_fully_opaque();
     bool input_is_fully_transparent();
+    // Blur input_full into the output tile, with either method
+    void gauss_blur(PixelBuffer<chan_t>& dst);
+    void box_blur(PixelBuffer<chan_t>& dst);
     // Blur factors used to calculate the value of every blurred pixel
     // based on its horizontal
     const std::vector<fix15_short_t> factors;
     const int radius;
+    // Whether to approximate the gaussian with box blurs,
+    // and the radii of those boxes (summing to at most radius)
+    const bool fast;
+    const std::vector<int> box_radii;
+    // Row lengths in the scratch buffer, holding both arrays
+    const int full_stride;
+    const int vertical_stride;
+    ScratchBuffer buffer;
+    std::vector<chan_t*> input_full_rows;
+    std::vector<chan_t*> input_vertical_rows;
     chan_t** input_full;
     chan_t** input_vertical;
+    // Fast mode only: rows for the intermediate box blurs
+    std::vector<chan_t*> box_rows;
+    chan_t* box_line[2];
+    std::vector<fix15_t> column_sums;
+    // Whether the input array holds the input of the previous tile
+    bool has_input;
 };
 
 
@@ -17,13 +17,17 @@
   new blurred tiles to the given dictionary. Tiles in the output
   dictionary are not guaranteed to be unique; the constant fully
   opaque tile will be used wherever possible.
+
+  If fast is true, the gaussian is approximated by repeated box blurs,
+  making the cost independent of the radius.
 */
 void blur(
     int radius, // Nominal blur radius (real radius may be larger or smaller)
     PyObject* blurred, // Dictionary holding the result of the operation
     PyObject* tiles, // Input tiles, NxNx1 uint16 numpy arrays
     PyObject* strands, // List of lists of vertically contiguous coordinates
-    Controller& status_controller // cancellation and status data
+    Controller& status_controller, // cancellation and status data
+    bool fast = false // approximate the blur with box blurs
     );
 
 #endif //BLUR_SWIG_HPP
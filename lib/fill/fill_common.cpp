@@ -9,68 +9,187 @@
 
 #include "fill_common.hpp"
 #include "fill_constants.hpp"
+#include "../tilepool.hpp"
+#include "../tracing.hpp"
 
-PixelBuffer<chan_t> new_alpha_tile()
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+TileMap::TileMap(PyObject* dict)
 {
-    npy_intp dims[] = {N, N};
-    PyGILState_STATE s = PyGILState_Ensure();
-    PixelBuffer<chan_t> alpha_buf(PyArray_EMPTY(2, dims, NPY_USHORT, 0));
-    PyGILState_Release(s);
-    return alpha_buf;
+    PyObject* key;
+    PyObject* tile;
+    Py_ssize_t pos = 0;
+    tiles.reserve(PyDict_Size(dict));
+    while (PyDict_Next(dict, &pos, &key, &tile)) {
+        int x, y;
+        if (PyArg_ParseTuple(key, "ii", &x, &y)) {
+            Entry entry = {PixelBuffer<chan_t>(tile), nullptr};
+            put(TileMap::key(x, y), entry);
+        }
+    }
+    PyErr_Clear();
 }
 
-AtomicDict::AtomicDict()
+// Returns the block of an owned tile to the pool
+static void
+release_block(void* block)
 {
-    PyGILState_STATE s = PyGILState_Ensure();
-    dict = PyDict_New();
-    PyGILState_Release(s);
+    if (block) tile_pool_give(TilePoolAlpha16, block);
 }
 
-AtomicDict::AtomicDict(PyObject* d) : dict(d)
+TileMap::~TileMap()
 {
-    PyGILState_STATE s = PyGILState_Ensure();
-    Py_INCREF(dict);
-    PyGILState_Release(s);
+    for (auto& item : tiles) {
+        release_block(item.second.block);
+    }
 }
 
-AtomicDict::AtomicDict(const AtomicDict& original)
+void
+TileMap::put(uint64_t k, const Entry& entry)
 {
-    dict = original.dict;
-    PyGILState_STATE s = PyGILState_Ensure();
-    Py_INCREF(dict);
-    PyGILState_Release(s);
+    auto it = tiles.find(k);
+    if (it != tiles.end()) {
+        release_block(it->second.block);
+        it->second = entry;
+    } else {
+        tiles.emplace(k, entry);
+    }
 }
 
-AtomicDict::~AtomicDict()
+void
+TileMap::set(int x, int y, PyObject* tile)
 {
-    PyGILState_STATE s = PyGILState_Ensure();
-    Py_DECREF(dict);
-    PyGILState_Release(s);
+    Entry entry = {PixelBuffer<chan_t>(tile), nullptr};
+    put(key(x, y), entry);
 }
 
-PyObject*
-AtomicDict::get(PyObject* key)
+PixelBuffer<chan_t>
+TileMap::add_new(int x, int y)
 {
-    PyGILState_STATE s = PyGILState_Ensure();
-    PyObject* item = PyDict_GetItem(dict, key);
-    PyGILState_Release(s);
-    return item;
+    // Pool blocks are cache-aligned like ScratchBuffer memory
+    void* block = tile_pool_take(TilePoolAlpha16);
+    if (!block) throw std::bad_alloc();
+    chan_t* data = static_cast<chan_t*>(block);
+    Entry entry = {PixelBuffer<chan_t>(data), block};
+    put(key(x, y), entry);
+    return entry.tile;
 }
 
 void
-AtomicDict::set(PyObject* key, PyObject* item, bool transfer_ownership)
+TileMap::merge(TileMap& other)
 {
-    PyGILState_STATE s = PyGILState_Ensure();
-    PyDict_SetItem(dict, key, item);
-    if (transfer_ownership) Py_DECREF(item);
-    PyGILState_Release(s);
+    for (auto& item : other.tiles) {
+        put(item.first, item.second);
+    }
+    other.tiles.clear();
 }
 
-void AtomicDict::merge(AtomicDict& other)
+bool
+TileMap::to_dict(PyObject* dict)
 {
-    PyGILState_STATE s = PyGILState_Ensure();
-    PyDict_Update(dict, other.dict);
-    PyGILState_Release(s);
+    bool ok = true;
+    for (auto& item : tiles) {
+        Entry& entry = item.second;
+        PyObject* tile = entry.tile.array_ob;
+        if (entry.block) {
+            // Handed over: on failure, the block went back to the pool
+            tile = tile_pool_wrap(TilePoolAlpha16, entry.block);
+            entry.block = nullptr;
+            if (!tile) {
+                ok = false;
+                break;
+            }
+        } else {
+            Py_INCREF(tile);
+        }
+        const int x = (int32_t)(item.first >> 32);
+        const int y = (int32_t)(uint32_t)item.first;
+        PyObject* key = Py_BuildValue("ii", x, y);
+        ok = key && PyDict_SetItem(dict, key, tile) == 0;
+        Py_XDECREF(key);
+        Py_DECREF(tile);
+        if (!ok) break;
+    }
+    // Free whatever was not handed over
+    for (auto& item : tiles) {
+        release_block(item.second.block);
+    }
+    tiles.clear();
+    return ok;
+}
+
+/*
+  Per-thread free lists of scratch blocks. Only a few are kept, the
+  largest ones, which is enough for a fill stage's per-worker buffers.
+*/
+struct ScratchArena {
+    struct Block {
+        void* block;
+        void* aligned;
+        size_t capacity;
+    };
+    static const size_t max_free_blocks = 4;
+    std::vector<Block> free_blocks;
+
+    ~ScratchArena()
+    {
+        for (size_t i = 0; i < free_blocks.size(); ++i) {
+            free(free_blocks[i].block);
+        }
+    }
+    static ScratchArena& for_this_thread()
+    {
+        static thread_local ScratchArena arena;
+        return arena;
+    }
+};
+
+ScratchBuffer::ScratchBuffer(size_t bytes)
+{
+    // Reuse the smallest free block that is large enough
+    std::vector<ScratchArena::Block>& free_blocks =
+        ScratchArena::for_this_thread().free_blocks;
+    int best = -1;
+    for (size_t i = 0; i < free_blocks.size(); ++i) {
+        if (free_blocks[i].capacity >= bytes &&
+            (best < 0 || free_blocks[i].capacity < free_blocks[best].capacity))
+            best = i;
+    }
+    if (best >= 0) {
+        block = free_blocks[best].block;
+        aligned = free_blocks[best].aligned;
+        capacity = free_blocks[best].capacity;
+        free_blocks.erase(free_blocks.begin() + best);
+        return;
+    }
+    block = malloc(bytes + alignment - 1);
+    if (!block) throw std::bad_alloc();
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(block);
+    aligned = reinterpret_cast<void*>(
+        (addr + alignment - 1) / alignment * alignment);
+    capacity = bytes;
+}
+
+ScratchBuffer::~ScratchBuffer()
+{
+    std::vector<ScratchArena::Block>& free_blocks =
+        ScratchArena::for_this_thread().free_blocks;
+    ScratchArena::Block released = {block, aligned, capacity};
+    free_blocks.push_back(released);
+    if (free_blocks.size() > ScratchArena::max_free_blocks) {
+        // Drop the smallest
+        size_t smallest = 0;
+        for (size_t i = 1; i < free_blocks.size(); ++i) {
+            if (free_blocks[i].capacity < free_blocks[smallest].capacity)
+                smallest = i;
+        }
+        free(free_blocks[smallest].block);
+        free_blocks.erase(free_blocks.begin() + smallest);
+    }
 }
 
 /*
@@ -83,6 +202,14 @@ copy_rectangular_slice(
     PixelBuffer<chan_t> input_buf, chan_t** input, const int px_x,
     const int px_y)
 {
+    // Tiles are practically always C-contiguous: copy whole row sections
+    if (input_buf.has_packed_rows()) {
+        for (int y_i = 0; y_i < h; ++y_i) {
+            const chan_t* const src = &input_buf(px_x, px_y + y_i);
+            std::copy(src, src + w, input[y + y_i] + x);
+        }
+        return;
+    }
     PixelRef<chan_t> in_px = input_buf.get_pixel(px_x, px_y);
     for (int y_i = y; y_i < y + h; ++y_i) {
         for (int x_i = x; x_i < x + w; ++x_i) {
@@ -95,33 +222,23 @@ copy_rectangular_slice(
 }
 
 GridVector
-nine_grid(PyObject* tile_coord, AtomicDict& tiles)
+nine_grid(coord tile_coord, const TileMap& tiles)
 {
     const int num_tiles = 9;
     const int offs[]{-1, 0, 1};
 
-    int x, y;
+    // Read once, the constant tile is never modified
+    static const PixelBuffer<chan_t> empty(ConstTiles::ALPHA_TRANSPARENT());
 
-    PyGILState_STATE gstate;
-    gstate = PyGILState_Ensure();
-
-    PyArg_ParseTuple(tile_coord, "ii", &x, &y);
     std::vector<PixelBuffer<chan_t>> grid;
+    grid.reserve(num_tiles);
 
     for (int i = 0; i < num_tiles; ++i) {
-        int _x = x + offs[i % 3];
-        int _y = y + offs[i / 3];
-        PyObject* c = Py_BuildValue("ii", _x, _y);
-        PyObject* tile = tiles.get(c);
-        Py_DECREF(c);
-        if (tile)
-            grid.push_back(PixelBuffer<chan_t>(tile));
-        else
-            grid.push_back(
-                PixelBuffer<chan_t>(ConstTiles::ALPHA_TRANSPARENT()));
+        int _x = tile_coord.x + offs[i % 3];
+        int _y = tile_coord.y + offs[i / 3];
+        const PixelBuffer<chan_t>* tile = tiles.get(_x, _y);
+        grid.push_back(tile ? *tile : empty);
     }
-    PyGILState_Release(gstate);
-
     return grid;
 }
 
@@ -164,49 +281,270 @@ init_from_nine_grid(
 #undef E
 }
 
+PyObject*
+uniform_nine_grid(const GridVector& grid)
+{
+    PyObject* const tile = grid[0].array_ob;
+    if (tile != ConstTiles::ALPHA_TRANSPARENT() &&
+        tile != ConstTiles::ALPHA_OPAQUE())
+        return nullptr;
+    for (size_t i = 1; i < grid.size(); ++i) {
+        if (grid[i].array_ob != tile) return nullptr;
+    }
+    return tile;
+}
+
+StrandQueue::StrandQueue(PyObject* items) : total_coords(0)
+{
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    const Py_ssize_t num_strands = PyList_GET_SIZE(items);
+    strands.resize(num_strands);
+    for (Py_ssize_t i = 0; i < num_strands; ++i) {
+        PyObject* strand = PyList_GET_ITEM(items, i);
+        const Py_ssize_t length = PyList_GET_SIZE(strand);
+        std::vector<coord>& coords = strands[i];
+        coords.reserve(length);
+        for (Py_ssize_t j = 0; j < length; ++j) {
+            int x, y;
+            if (PyArg_ParseTuple(PyList_GET_ITEM(strand, j), "ii", &x, &y))
+                coords.push_back(coord(x, y));
+        }
+        total_coords += coords.size();
+    }
+    PyErr_Clear();
+    PyGILState_Release(gstate);
+    distribute(1);
+}
+
+void
+StrandQueue::split(size_t max_length)
+{
+    if (max_length == 0) return;
+    std::vector<std::vector<coord>> pieces;
+    pieces.reserve(strands.size() + total_coords / max_length);
+    for (auto& strand : strands) {
+        if (strand.size() <= max_length) {
+            pieces.push_back(std::move(strand));
+            continue;
+        }
+        // Equal pieces, rather than a short remainder at the end
+        const size_t num_pieces =
+            (strand.size() + max_length - 1) / max_length;
+        for (size_t i = 0; i < num_pieces; ++i) {
+            pieces.emplace_back(
+                strand.begin() + strand.size() * i / num_pieces,
+                strand.begin() + strand.size() * (i + 1) / num_pieces);
+        }
+    }
+    strands.swap(pieces);
+    distribute(1);
+}
+
+void
+StrandQueue::distribute(int num_workers)
+{
+    const size_t num_strands = strands.size();
+    shares.clear();
+    for (int i = 0; i < num_workers; ++i) {
+        std::unique_ptr<Share> share(new Share);
+        share->begin = num_strands * i / num_workers;
+        share->end = num_strands * (i + 1) / num_workers;
+        shares.push_back(std::move(share));
+    }
+}
+
+bool
+StrandQueue::pop(Strand& strand, int worker)
+{
+    const int num_shares = shares.size();
+    {
+        Share& own = *shares[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (own.begin < own.end) {
+            strand = Strand(strands[own.begin++]);
+            return true;
+        }
+    }
+    // Steal from the back, away from where the owner is working
+    for (int i = 1; i < num_shares; ++i) {
+        Share& other = *shares[(worker + i) % num_shares];
+        std::lock_guard<std::mutex> guard(other.lock);
+        if (other.begin < other.end) {
+            strand = Strand(strands[--other.end]);
+            return true;
+        }
+    }
+    return false;
+}
+
+int64_t
+Controller::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void
+Controller::reset()
+{
+    tiles_processed = 0;
+    tiles_skipped = 0;
+    busy_max_us = 0;
+    busy_mean_us = 0;
+    stage_start = now();
+}
+
+void
+Controller::add_worker_times(const std::vector<double>& seconds)
+{
+    if (seconds.empty()) return;
+    double max = 0;
+    double sum = 0;
+    for (double t : seconds) {
+        max = MAX(max, t);
+        sum += t;
+    }
+    busy_max_us.fetch_add((int64_t)(max * 1e6), std::memory_order_relaxed);
+    busy_mean_us.fetch_add(
+        (int64_t)(sum * 1e6 / seconds.size()), std::memory_order_relaxed);
+}
+
+double
+Controller::worker_imbalance()
+{
+    const int64_t mean = busy_mean_us;
+    return mean > 0 ? (double)busy_max_us / mean : 1.0;
+}
+
+FillWorkerPool&
+FillWorkerPool::instance()
+{
+    static FillWorkerPool pool;
+    return pool;
+}
+
+FillWorkerPool::FillWorkerPool() : stopping(false)
+{
+    const int num_threads = MAX(1, (int)std::thread::hardware_concurrency());
+    for (int i = 0; i < num_threads; ++i) {
+        threads.push_back(std::thread(&FillWorkerPool::thread_main, this));
+    }
+}
+
+FillWorkerPool::~FillWorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(tasks_mutex);
+        stopping = true;
+    }
+    tasks_cond.notify_all();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+}
+
+void
+FillWorkerPool::thread_main()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(tasks_mutex);
+            tasks_cond.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void
+FillWorkerPool::run(int num_tasks, const std::function<void(int)>& task)
+{
+    // Completion is tracked in shared state, so that no task touches
+    // this stack frame after the last one has let it return.
+    struct Batch {
+        std::mutex mutex;
+        std::condition_variable done;
+        int remaining;
+    };
+    std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+    batch->remaining = num_tasks;
+    {
+        std::lock_guard<std::mutex> guard(tasks_mutex);
+        for (int i = 0; i < num_tasks; ++i) {
+            tasks.push_back([batch, &task, i] {
+                task(i);
+                std::lock_guard<std::mutex> guard(batch->mutex);
+                if (--batch->remaining == 0) batch->done.notify_all();
+            });
+        }
+    }
+    tasks_cond.notify_all();
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->done.wait(lock, [&batch] { return batch->remaining == 0; });
+}
+
 int
 num_strand_workers(int num_strands, int min_strands_per_worker)
 {
-    int max_threads = std::thread::hardware_concurrency();
+    int max_threads = FillWorkerPool::instance().size();
     int max_by_strands = num_strands / min_strands_per_worker;
     return MAX(1, MIN(max_threads, max_by_strands));
 }
 
+// Strands are not cut into pieces shorter than this
+static const size_t MIN_STRAND_PIECE = 8;
+
 void
 process_strands(
     worker_function worker, int offset, int min_strands_per_worker,
-    StrandQueue& strands, AtomicDict tiles, AtomicDict result,
+    StrandQueue& strands, PyObject* tiles, PyObject* result,
     Controller& status_controller)
 {
+    TRACE_SCOPE("process_strands");
+    // Cut up long strands, so that a few tall columns of tiles can still
+    // be spread over all threads. Each piece costs a full update of the
+    // worker's input data, so the pieces are kept fairly long.
+    const size_t max_threads = FillWorkerPool::instance().size();
+    strands.split(std::max(
+        MIN_STRAND_PIECE,
+        strands.num_coords() / (max_threads * min_strands_per_worker)));
     int num_threads =
         num_strand_workers(strands.size(), min_strands_per_worker);
+    strands.distribute(num_threads);
 
-    std::vector<std::thread> threads(num_threads);
-    std::vector<std::future<AtomicDict>> futures(num_threads);
+    // Read the input once, so the workers never need to touch it
+    const TileMap input(tiles);
+    std::vector<TileMap> results(num_threads);
 
     PyEval_InitThreads();
 
-    // Create worker threads
-    for (int i = 0; i < num_threads; ++i) {
-        std::promise<AtomicDict> promise;
-        futures[i] = promise.get_future();
-        threads[i] = std::thread(
-            worker, offset, std::ref(strands), tiles, std::move(promise),
-            std::ref(status_controller));
-    }
     // Release the lock to let the workers work
     Py_BEGIN_ALLOW_THREADS
 
-    for (int i = 0; i < num_threads; ++i)
-    {
-        // Wait for the output from the threads
-        // and merge it into the final result
-        futures[i].wait();
-        AtomicDict thread_result = futures[i].get();
-        result.merge(thread_result);
-        threads[i].join();
+    std::vector<double> busy(num_threads);
+    FillWorkerPool::instance().run(num_threads, [&](int i) {
+        TRACE_SCOPE("process_strands worker");
+        const auto start = std::chrono::steady_clock::now();
+        WorkerStrands worker_strands(strands, i);
+        worker(offset, worker_strands, input, results[i], status_controller);
+        busy[i] = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    });
+    status_controller.add_worker_times(busy);
+
+    // Merge the output from the workers
+    for (int i = 1; i < num_threads; ++i) {
+        results[0].merge(results[i]);
     }
 
     // Reclaim the lock before returning
     Py_END_ALLOW_THREADS
+
+    // Hand the tiles over to the final result
+    if (!results[0].to_dict(result)) PyErr_Print();
 }
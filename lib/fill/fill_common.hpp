@@ -15,12 +15,22 @@
 #include <mypaint-config.h>
 
 #include <Python.h>
-#include <vector>
-#include <future>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "../common.hpp"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #define NO_IMPORT_ARRAY
 #include <numpy/arrayobject.h>
@@ -153,6 +163,11 @@ class PixelBuffer
         this->y_stride = PyArray_STRIDE(arr_buf, 0) / sizeof(C);
         this->buffer = reinterpret_cast<C*>(PyArray_BYTES(arr_buf));
     }
+    // Wrap native tile memory, with no array object
+    explicit PixelBuffer(C* data)
+        : array_ob(nullptr), x_stride(1), y_stride(N), buffer(data)
+    {
+    }
     static PixelBuffer<C> create_threadsafe(PyObject* buf)
     {
         PyGILState_STATE gstate;
@@ -168,6 +183,30 @@ class PixelBuffer
     }
     bool is_uniform()
     {
+#ifdef __SSE2__
+        if (x_stride == 1 && y_stride == N && 16 % sizeof(C) == 0) {
+            // Compare the whole tile against a vector of copies of the
+            // first pixel, 64 bytes at a time
+            C pattern[16 / sizeof(C)];
+            for (size_t i = 0; i < 16 / sizeof(C); ++i) {
+                pattern[i] = buffer[0];
+            }
+            const __m128i first = _mm_loadu_si128((const __m128i*)pattern);
+            const __m128i* v = (const __m128i*)buffer;
+            const int num_vectors = N * N * sizeof(C) / 16;
+            for (int i = 0; i < num_vectors; i += 4) {
+                __m128i eq = _mm_and_si128(
+                    _mm_cmpeq_epi8(_mm_loadu_si128(v + i), first),
+                    _mm_cmpeq_epi8(_mm_loadu_si128(v + i + 1), first));
+                eq = _mm_and_si128(
+                    eq, _mm_and_si128(
+                            _mm_cmpeq_epi8(_mm_loadu_si128(v + i + 2), first),
+                            _mm_cmpeq_epi8(_mm_loadu_si128(v + i + 3), first)));
+                if (_mm_movemask_epi8(eq) != 0xffff) return false;
+            }
+            return true;
+        }
+#endif
         PixelRef<C> px = get_pixel(0, 0);
         C first = px.read();
         px.move_x(1);
@@ -179,6 +218,8 @@ class PixelBuffer
     {
         return *(buffer + y * y_stride + x * x_stride);
     }
+    // Whether the pixels of each row are adjacent in memory
+    bool has_packed_rows() const { return x_stride == 1; }
 
   private:
     int x_stride;
@@ -187,103 +228,186 @@ class PixelBuffer
 };
 
 /*
-  Create a new alpha tile and return it wrapped in a PixelBuffer.
-  This function is GIL-threadsafe.
-  NOTE: This allocates a new numpy array which requires manual
-  reference counting.
+  A strand is a sequence of vertically contiguous tile coordinates
+  e.g. {(3, 4), (3, 5), (3, 6)}, which is processed from top to bottom.
+
+  The coordinates are owned by the StrandQueue the strand came from.
 */
-PixelBuffer<chan_t> new_alpha_tile();
+class Strand
+{
+  public:
+    Strand() : coords(nullptr), index(0) {}
+    explicit Strand(const std::vector<coord>& coords)
+        : coords(&coords), index(0)
+    {
+    }
+    bool pop(coord& item)
+    {
+        if (!coords || index >= coords->size()) return false;
+        item = (*coords)[index++];
+        return true;
+    }
+    Py_ssize_t size() { return coords ? coords->size() : 0; }
+
+  private:
+    const std::vector<coord>* coords;
+    size_t index;
+};
 
 /*
-  GIL-safe queue for strands used by worker processes
+  Queue of strands, shared by the workers of a single operation
 
-  This structure wraps a python list and provides an
-  access-only interface that can be called from multiple
-  threads.
+  The Python list of strands (lists of coordinate tuples) is read once,
+  when the queue is created, so workers taking strands from it never
+  need the GIL.
 
-  WARNING: The list reference is borrowed, not owned!
-  It is up to the user to ensure that the list is not garbage
-  collected during the lifetime of any wrapper using it.
+  Each worker is given a contiguous share of the strands, which it works
+  through from the front. Workers that run out steal strands from the
+  back of the other shares, so uneven strands don't leave threads idle.
+  Strands too long to be shared out evenly can be split beforehand; each
+  piece just starts without the state carried down from the tile above.
 */
-template <typename T>
-class AtomicQueue
+class StrandQueue
 {
   public:
-    // Create an empty queue (for declarations)
-    explicit AtomicQueue() {}
-    // Create a queue from a pointer to a PyList.
-    explicit AtomicQueue(PyObject* items)
-    {
-        PyGILState_STATE gstate = PyGILState_Ensure();
-        index = 0;
-        num_strands = PyList_GET_SIZE(items);
-        this->items = items;
-        PyGILState_Release(gstate);
-    }
+    // Read the strands from a PyList of PyLists, with the GIL held
+    explicit StrandQueue(PyObject* strands);
     // Prevent copy construction (all workers should share it)
-    AtomicQueue(AtomicQueue&) = delete;
-    bool pop(T& item)
+    StrandQueue(StrandQueue&) = delete;
+    // Cut strands longer than max_length into pieces no longer than that
+    void split(size_t max_length);
+    // Split the strands into shares for the given number of workers
+    void distribute(int num_workers);
+    // Get the next strand for a worker, returns false when none are left
+    bool pop(Strand& strand, int worker);
+    // Get the size of the queue
+    Py_ssize_t size() { return strands.size(); }
+    // Get the number of coordinates in all of the strands
+    size_t num_coords() { return total_coords; }
+
+  private:
+    struct Share {
+        std::mutex lock;
+        size_t begin;
+        size_t end;
+    };
+    std::vector<std::vector<coord>> strands;
+    std::vector<std::unique_ptr<Share>> shares;
+    size_t total_coords;
+};
+
+/*
+  A single worker's handle on a shared StrandQueue
+*/
+class WorkerStrands
+{
+  public:
+    WorkerStrands(StrandQueue& queue, int worker)
+        : queue(queue), worker(worker)
     {
-        PyGILState_STATE gstate;
-        gstate = PyGILState_Ensure();
-        if (index >= num_strands) {
-            PyGILState_Release(gstate);
-            return false;
-        } else {
-            item = T(PyList_GET_ITEM(items, index));
-            ++index;
-            PyGILState_Release(gstate);
-            return true;
-        }
     }
-    // Get the size of the queue
-    Py_ssize_t size() { return num_strands; }
+    bool pop(Strand& strand) { return queue.pop(strand, worker); }
+    Py_ssize_t size() { return queue.size(); }
 
   private:
-    PyObject* items;
-    Py_ssize_t index;
-    Py_ssize_t num_strands;
+    StrandQueue& queue;
+    const int worker;
 };
 
 /*
-  A strand is a sequence of vertically contiguous tile coordinates
-  e.g. {(3, 4), (3, 5), (3, 6)}
+  Map of tile coordinates to alpha tiles, used by the fill workers
+  instead of Python dictionaries, so that they never need the GIL.
+
+  Tiles are either borrowed numpy arrays (including the constant tiles),
+  or new tiles in cache-aligned memory owned by the map. Python
+  dictionaries are only read or written at the boundary, with the
+  GIL held, at which point owned tiles are handed over as numpy arrays,
+  without copying them.
+
+  There is no locking: any number of workers can read from a map that
+  none of them writes to, while each worker writes its results to a map
+  of its own, to be merged once all of them have finished.
 */
-using Strand = AtomicQueue<PyObject*>;
-using StrandQueue = AtomicQueue<Strand>;
+class TileMap
+{
+  public:
+    TileMap() {}
+    // Borrow the tiles of a coord->tile dictionary, with the GIL held.
+    // The dictionary must outlive the map, and not be modified meanwhile.
+    explicit TileMap(PyObject* tiles);
+    TileMap(const TileMap&) = delete;
+    TileMap& operator=(const TileMap&) = delete;
+    // Free the owned tiles that were not handed over
+    ~TileMap();
+    // Pack a tile coordinate into a key
+    static uint64_t key(int x, int y)
+    {
+        return ((uint64_t)(uint32_t)x << 32) | (uint32_t)y;
+    }
+    // Get the tile at the coordinate, or nullptr if there is none
+    const PixelBuffer<chan_t>* get(int x, int y) const
+    {
+        auto it = tiles.find(key(x, y));
+        return it == tiles.end() ? nullptr : &it->second.tile;
+    }
+    // Add a borrowed tile, e.g. a constant tile, replacing any existing one
+    void set(int x, int y, PyObject* tile);
+    // Add a new owned tile with undefined content, replacing any existing
+    // one, and return it to be written to.
+    PixelBuffer<chan_t> add_new(int x, int y);
+    // Move the tiles of another map into this one, replacing
+    // tiles in this map if the coordinates exist in both.
+    void merge(TileMap& other);
+    // Add the tiles to a dictionary, with the GIL held, leaving the
+    // map empty. Returns false, with an exception set, on failure.
+    bool to_dict(PyObject* dict);
+    // Get the number of tiles in the map
+    size_t size() const { return tiles.size(); }
+
+  private:
+    struct Entry {
+        PixelBuffer<chan_t> tile;
+        void* block; // allocation holding the owned tile, or nullptr
+    };
+    void put(uint64_t k, const Entry& entry);
+    std::unordered_map<uint64_t, Entry> tiles;
+};
 
 /*
-  GIL-threadsafe PyDict wrapper
+  Cache-aligned scratch memory for the working buffers of fill operations
 
-  Note: Ownership of the PyDict IS handled by the wrapper,
-  ensuring its validity as long as reference counting is handled
-  correctly by other users of the PyDict.
+  The memory comes from an arena belonging to the creating thread, and
+  goes back to the arena of the destroying thread, to be reused by the
+  next operation instead of being freed. Since the fill workers are
+  long-lived pool threads, repeated fills allocate almost nothing.
 */
-class AtomicDict
+class ScratchBuffer
 {
   public:
-    // Create a new PyDict dictionary
-    AtomicDict();
-    // Borrow an existing PyDict
-    explicit AtomicDict(PyObject* d);
-    // Custom copy constructor for reference consistency
-    AtomicDict(const AtomicDict&);
-    // Relinquish ownership of wrapped dictionary
-    ~AtomicDict();
-    // Get an item from the dictionary
-    PyObject* get(PyObject* key);
-    // Add an item to the dictionary associated to the given key,
-    // overriding existing items, if the key already exists
-    // If transfer_ownership is true, the input's refcount is decremented
-    void set(PyObject* key, PyObject* item, bool transfer_ownership = false);
-    // Merge another dictionary into this one, overriding items
-    // in this dictionary if the keys exist in both.
-    void merge(AtomicDict&);
-    // Get the size of the dictionary
-    Py_ssize_t size();
+    // Alignment of the buffer, and recommended row alignment within it
+    static const size_t alignment = 64;
+
+    explicit ScratchBuffer(size_t bytes);
+    ScratchBuffer(const ScratchBuffer&) = delete;
+    ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+    ~ScratchBuffer();
+    template <typename T>
+    T* data()
+    {
+        return static_cast<T*>(aligned);
+    }
+    // Round a row length up, so that rows of T stay cache-aligned
+    template <typename T>
+    static int row_stride(int length)
+    {
+        const int per_line = alignment / sizeof(T);
+        return (length + per_line - 1) / per_line * per_line;
+    }
 
   private:
-    PyObject* dict;
+    void* block; // as allocated, for freeing
+    void* aligned;
+    size_t capacity;
 };
 
 typedef std::vector<PixelBuffer<chan_t>> GridVector;
@@ -291,7 +415,7 @@ typedef std::vector<PixelBuffer<chan_t>> GridVector;
 /*
   For the given tile coordinate, return a vector of pixel buffers for
   the tiles of the coordinate and its 8 neighbours. If a neighbouring
-  tile does not exist in the given tile dictionary, the constant empty
+  tile does not exist in the given tile map, the constant empty
   alpha tile takes its place.
 
   Order of tiles in vector, where 4 is the tile of the input coordinate:
@@ -300,7 +424,7 @@ typedef std::vector<PixelBuffer<chan_t>> GridVector;
   6 7 8
 */
 GridVector
-nine_grid(PyObject* tile_coord, AtomicDict& tiles);
+nine_grid(coord tile_coord, const TileMap& tiles);
 
 /*
    Read sections from a nine-grid of tiles to a single array
@@ -310,6 +434,13 @@ nine_grid(PyObject* tile_coord, AtomicDict& tiles);
 void init_from_nine_grid(
     int radius, chan_t** input, bool from_above, GridVector grid);
 
+/*
+  If all tiles of a nine-grid are the same constant tile, return it,
+  otherwise return nullptr. Morphing or blurring such a neighbourhood
+  gives that tile back, which is found without reading any pixels.
+*/
+PyObject* uniform_nine_grid(const GridVector& grid);
+
 /*
   Helper function for checking if all items in
   a quadratic array equals the given value.
@@ -328,38 +459,97 @@ all_equal_to(T** arr, int dim, T val)
 /*
   Used to track operation progress (such as number of tiles filled/morphed etc.)
   and permit cancellation of operations. Instances are shared between threads.
+
+  Besides the tile counts, some figures on the current stage are kept, for
+  finding out where the time of long fills goes: the time since the stage
+  began (the last reset), the number of tiles for which the actual operation
+  could be skipped (constant results found by shortcuts), and how evenly the
+  work was shared by the worker threads.
+
+  All members are atomic, so none of the calls ever block.
 */
 class Controller {
 public:
     Controller(Controller&) = delete;
-    Controller() : run(true), tiles_processed(0) {}
+    Controller()
+        : run(true), tiles_processed(0), tiles_skipped(0), stage_start(now()),
+          busy_max_us(0), busy_mean_us(0)
+    {
+    }
     void stop() { run = false; }
-    bool running() { return run; }
+    bool running() { return run.load(std::memory_order_relaxed); }
     void inc_processed(int incr)
     {
-        inc_mutex.lock();
-        tiles_processed += incr;
-        inc_mutex.unlock();
+        tiles_processed.fetch_add(incr, std::memory_order_relaxed);
     }
     int num_processed() { return tiles_processed; }
-    void reset() { tiles_processed = 0; }
+    void inc_skipped(int incr)
+    {
+        tiles_skipped.fetch_add(incr, std::memory_order_relaxed);
+    }
+    int num_skipped() { return tiles_skipped; }
+    // Record the busy times of the workers of one parallel run
+    void add_worker_times(const std::vector<double>& seconds);
+    // Ratio of the longest worker time to the mean one, summed over the
+    // parallel runs of the stage: 1.0 means perfectly even shares
+    double worker_imbalance();
+    // Seconds since the stage began
+    double stage_seconds() { return (now() - stage_start) * 1e-9; }
+    // Begin a new stage, clearing the counters
+    void reset();
 private:
+    static int64_t now();
     // Whether to keep running or not
-    bool run;
+    std::atomic<bool> run;
     // The number of tiles processed for the current stage
-    int tiles_processed;
-    // tiles_processed incrementation mutex
-    // GIL is not used as mutex here since Python API access is not required
-    // and it is unnecessary to block this on activity in the GUI thread
-    std::mutex inc_mutex;
+    std::atomic<int> tiles_processed;
+    // The number of those tiles that were found by shortcuts
+    std::atomic<int> tiles_skipped;
+    // Steady clock time of the last reset, in nanoseconds
+    std::atomic<int64_t> stage_start;
+    // Sums of the longest and mean worker times of the parallel runs
+    std::atomic<int64_t> busy_max_us;
+    std::atomic<int64_t> busy_mean_us;
+};
+
+/*
+  Persistent pool of worker threads, shared by all fill stages
+
+  Threads are started on first use, one per hardware thread, and then
+  wait for work for the rest of the process' lifetime. This saves
+  starting a new set of threads for every blur and morph call of a
+  multi-stage fill.
+*/
+class FillWorkerPool
+{
+  public:
+    static FillWorkerPool& instance();
+    FillWorkerPool(FillWorkerPool&) = delete;
+    ~FillWorkerPool();
+    // Run task(0) .. task(num_tasks - 1) on the pool's threads,
+    // returning once all of them have finished.
+    // Do not call with the GIL held if the tasks need it.
+    void run(int num_tasks, const std::function<void(int)>& task);
+    // Get the number of threads in the pool
+    int size() { return threads.size(); }
+
+  private:
+    FillWorkerPool();
+    void thread_main();
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex tasks_mutex;
+    std::condition_variable tasks_cond;
+    bool stopping;
 };
 
 /*
-  Worker, processing strands of tiles from a distributed workload
+  Worker, processing strands of tiles from a distributed workload,
+  adding its output tiles to a result map of its own
 */
 using worker_function = std::function<void(
-    int offset, StrandQueue& input_strands, AtomicDict input_tiles,
-    std::promise<AtomicDict> result, Controller& status_controller)>;
+    int offset, WorkerStrands& input_strands, const TileMap& input_tiles,
+    TileMap& result, Controller& status_controller)>;
 
 /*
   Return the recommended amount of worker threads, based on
@@ -370,11 +560,13 @@ num_strand_workers(int num_strands, int min_strands_per_worker);
 
 /*
   Process a set of strands using a given worker function, potentially
-  using multiple threads, and merge the result into the provided dictionary.
+  using multiple threads from the FillWorkerPool, and add the result
+  to the provided dictionary. Called with the GIL held, which is
+  released while the workers run.
 */
 void process_strands(
     worker_function worker, int offset, int min_strands_per_worker,
-    StrandQueue& strands, AtomicDict tiles, AtomicDict result,
+    StrandQueue& strands, PyObject* tiles, PyObject* result,
     Controller& status_controller);
 
 #endif //FILL_COMMON_HPP
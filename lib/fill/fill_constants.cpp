@@ -9,22 +9,132 @@
 
 #include "fill_constants.hpp"
 
+#include <algorithm>
+#include <map>
+#include <utility>
+
 PyObject* ConstTiles::_ALPHA_TRANSPARENT = nullptr;
 PyObject* ConstTiles::_ALPHA_OPAQUE = nullptr;
 
+enum TileLayout { LAYOUT_ALPHA, LAYOUT_RGBA16, LAYOUT_RGBA8 };
+
+// Interned tiles by layout and value: one channel value in each
+// 16 bits, red in the lowest ones. Holds a reference to each tile,
+// along with when it was last handed out.
+struct InternedTile
+{
+    PyObject* tile;
+    uint64_t last_use;
+};
+typedef std::map<std::pair<int, uint64_t>, InternedTile> InternedTiles;
+static InternedTiles interned_tiles;
+static uint64_t use_clock = 0;
+
+template <typename C>
+static void
+fill_tile(PyObject* arr, int channels, const uint64_t value)
+{
+    C px[4];
+    for (int c = 0; c < channels; ++c) {
+        px[c] = (C)(value >> (16 * c));
+    }
+    C* data = (C*)PyArray_DATA((PyArrayObject*)arr);
+    if (channels == 1) {
+        std::fill(data, data + N * N, px[0]);
+        return;
+    }
+    for (int i = 0; i < N * N; ++i, data += channels) {
+        std::copy(px, px + channels, data);
+    }
+}
+
+static PyObject*
+new_constant_tile(int layout, const uint64_t value)
+{
+    npy_intp dims[] = {N, N, 4};
+    const bool alpha = layout == LAYOUT_ALPHA;
+    PyObject* arr = PyArray_EMPTY(
+        alpha ? 2 : 3, dims, layout == LAYOUT_RGBA8 ? NPY_UINT8 : NPY_UINT16,
+        false);
+    if (!arr) return nullptr;
+    if (layout == LAYOUT_RGBA8)
+        fill_tile<uint8_t>(arr, 4, value);
+    else
+        fill_tile<chan_t>(arr, alpha ? 1 : 4, value);
+    PyArray_CLEARFLAGS((PyArrayObject*)arr, NPY_ARRAY_WRITEABLE);
+    return arr;
+}
+
+// Drop the least recently used tile, other than the alpha constants,
+// which are compared against by pointer and must stay interned.
+static void
+evict_oldest()
+{
+    InternedTiles::iterator oldest = interned_tiles.end();
+    for (auto it = interned_tiles.begin(); it != interned_tiles.end(); ++it) {
+        const auto& key = it->first;
+        if (key.first == LAYOUT_ALPHA &&
+            (key.second == 0 || key.second == fix15_one))
+            continue;
+        if (oldest == interned_tiles.end() ||
+            it->second.last_use < oldest->second.last_use)
+            oldest = it;
+    }
+    if (oldest == interned_tiles.end()) return;
+    PyObject* tile = oldest->second.tile;
+    interned_tiles.erase(oldest);
+    Py_DECREF(tile);
+}
+
+// Returns a new reference, or nullptr with an exception set
+static PyObject*
+constant_tile(int layout, const uint64_t value)
+{
+    const auto key = std::make_pair(layout, value);
+    InternedTiles::iterator it = interned_tiles.find(key);
+    PyObject* tile = nullptr;
+    if (it != interned_tiles.end()) {
+        tile = it->second.tile;
+        it->second.last_use = ++use_clock;
+    } else {
+        tile = new_constant_tile(layout, value);
+        if (!tile) return nullptr;
+        if (interned_tiles.size() >= ConstTiles::MAX_INTERNED) {
+            evict_oldest();
+        }
+        interned_tiles[key] = {tile, ++use_clock};
+    }
+    Py_INCREF(tile);
+    return tile;
+}
+
+static bool
+check_channels(const int* values, int num, int max)
+{
+    for (int i = 0; i < num; ++i) {
+        if (values[i] < 0 || values[i] > max) {
+            PyErr_SetString(PyExc_ValueError, "channel value out of range");
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t
+pack_channels(const int* values, int num)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < num; ++i) {
+        value |= (uint64_t)values[i] << (16 * i);
+    }
+    return value;
+}
+
 void
 ConstTiles::init()
 {
-    npy_intp dims[] = {N, N};
-    PyObject* empty = PyArray_ZEROS(2, dims, NPY_USHORT, false);
-    PyObject* full = PyArray_EMPTY(2, dims, NPY_USHORT, false);
-    PixelBuffer<chan_t> buf{full};
-    PixelRef<chan_t> ref = buf.get_pixel(0, 0);
-    for (int i = 0; i < N * N; ++i, ref.move_x(1)) {
-        ref.write(fix15_one);
-    }
-    _ALPHA_TRANSPARENT = empty;
-    _ALPHA_OPAQUE = full;
+    _ALPHA_TRANSPARENT = constant_tile(LAYOUT_ALPHA, 0);
+    _ALPHA_OPAQUE = constant_tile(LAYOUT_ALPHA, fix15_one);
 }
 
 PyObject*
@@ -41,3 +151,34 @@ ConstTiles::ALPHA_OPAQUE()
     return _ALPHA_OPAQUE;
 }
 
+PyObject*
+ConstTiles::alpha(int value)
+{
+    if (!check_channels(&value, 1, fix15_one)) return nullptr;
+    return constant_tile(LAYOUT_ALPHA, value);
+}
+
+PyObject*
+ConstTiles::rgba16(int r, int g, int b, int a)
+{
+    const int values[] = {r, g, b, a};
+    if (!check_channels(values, 4, fix15_one)) return nullptr;
+    return constant_tile(LAYOUT_RGBA16, pack_channels(values, 4));
+}
+
+PyObject*
+ConstTiles::rgba8(int r, int g, int b, int a)
+{
+    const int values[] = {r, g, b, a};
+    if (!check_channels(values, 4, 255)) return nullptr;
+    return constant_tile(LAYOUT_RGBA8, pack_channels(values, 4));
+}
+
+bool
+ConstTiles::is_interned(PyObject* tile)
+{
+    for (const auto& entry : interned_tiles) {
+        if (entry.second.tile == tile) return true;
+    }
+    return false;
+}
@@ -20,8 +20,21 @@
   representation of 1, whereas the constant transparent
   tile is filled with 0.
 
-  Both tiles should be treated as read-only, although
-  this is not explicitly enforced.
+  Both tiles are interned alpha tiles (see below), and
+  their arrays are flagged as not writeable.
+
+  Tiles of a single value can be had for the alpha (NxN uint16),
+  rgba16 (NxNx4 uint16) and rgba8 (NxNx4 uint8) layouts. Each value is
+  interned: the same read-only array is returned every time, so areas
+  of one colour or alpha need not cost any pixel memory per tile. Code
+  wanting to write to such a tile has to copy it first. At most
+  MAX_INTERNED values are held; past that, the least recently used
+  value is dropped from the table (the two alpha constants never are).
+  Arrays already handed out stay valid, but the value gets a new array
+  the next time it is asked for.
+
+  The functions returning interned tiles return new references, and
+  must be called with the GIL held.
 */
 class ConstTiles
 {
@@ -29,6 +42,14 @@ class ConstTiles
     static PyObject* ALPHA_OPAQUE();
     static PyObject* ALPHA_TRANSPARENT();
 
+    static PyObject* alpha(int value);
+    static PyObject* rgba16(int r, int g, int b, int a);
+    static PyObject* rgba8(int r, int g, int b, int a);
+    // Whether the array is one of the interned tiles
+    static bool is_interned(PyObject* tile);
+
+    static const int MAX_INTERNED = 256;
+
   private:
     static void init();
     static PyObject* _ALPHA_OPAQUE;
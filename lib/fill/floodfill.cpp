@@ -8,56 +8,15 @@
  */
 
 #include "floodfill.hpp"
+#include "fill_constants.hpp"
+#include "../tilepool.hpp"
 
 #include <cmath>
 #include <vector>
 
-/*
-  Returns a list [(start, end)] of segments corresponding
-  to contiguous occurrences of "true" in the given boolean array.
-  This is the representation that is passed between the Python
-  and C++ parts of the fill algorithm, representing, along with a
-  direction marker, sequences of fill seeds to be handled.
-*/
-static inline PyObject*
-to_seeds(const bool edge[N])
-{
-    PyObject* seg_list = PyList_New(0);
-
-    bool contiguous = false;
-    int seg_start = 0;
-    int seg_end = 0;
-
-    for (int c = 0; c < N; ++c) {
-        if (edge[c]) {
-            if (!contiguous) { // a new segment begins
-                seg_start = c;
-                seg_end = c;
-                contiguous = true;
-            } else { // segment continues
-                seg_end++;
-            }
-        } else if (contiguous) { // segment ends
-            PyObject* segment = Py_BuildValue("ii", seg_start, seg_end);
-            PyList_Append(seg_list, segment);
-            Py_DECREF(segment);
-#ifdef HEAVY_DEBUG
-            assert(segment->ob_refcnt == 1);
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
-            contiguous = false;
-        }
-    }
-    if (contiguous) {
-        PyObject* segment = Py_BuildValue("ii", seg_start, seg_end);
-        PyList_Append(seg_list, segment);
-        Py_DECREF(segment);
-#ifdef HEAVY_DEBUG
-        assert(segment->ob_refcnt == 1);
-#endif
-    }
-
-    return seg_list;
-}
 
 static inline chan_t
 clamped_div(chan_t a, chan_t b)
@@ -81,6 +40,37 @@ Filler::Filler(int targ_r, int targ_g, int targ_b, int targ_a, double tol)
       target_color_premultiplied(rgba((chan_t)targ_r, targ_g, targ_b, targ_a)),
       tolerance((fix15_t)(MIN(1.0, MAX(0.0, tol)) * fix15_one))
 {
+    // The fill alphas for all color distances in the valid range
+    if (tolerance != 0) {
+        dist_alphas.resize(fix15_one + 1);
+        for (fix15_t dist = 0; dist <= fix15_one; ++dist) {
+            dist_alphas[dist] = tolerance_alpha(dist);
+        }
+    }
+}
+
+// Compare with adjustable tolerance of mismatches.
+chan_t
+Filler::tolerance_alpha(fix15_t dist) const
+{
+    static const fix15_t onepointfive = fix15_one + fix15_halve(fix15_one);
+    dist = fix15_div(dist, tolerance);
+    if (dist > onepointfive) { // aa < 0, but avoid underflow
+        return 0;
+    } else {
+        fix15_t aa = onepointfive - dist;
+        if (aa < fix15_halve(fix15_one))
+            return fix15_short_clamp(fix15_double(aa));
+        else
+            return fix15_one;
+    }
+}
+
+inline chan_t
+Filler::dist_alpha(fix15_t dist) const
+{
+    // Distances are only out of range for invalid pixel data
+    return dist <= fix15_one ? dist_alphas[dist] : tolerance_alpha(dist);
 }
 
 /*
@@ -92,7 +82,7 @@ Filler::Filler(int targ_r, int targ_g, int targ_b, int targ_a, double tol)
   should be filled.
 */
 chan_t
-Filler::pixel_fill_alpha(const rgba& px)
+Filler::pixel_fill_alpha(const rgba& px) const
 {
     fix15_t dist;
 
@@ -108,20 +98,91 @@ Filler::pixel_fill_alpha(const rgba& px)
         dist = target_color.max_diff(
             straightened(px.red, px.green, px.blue, px.alpha));
 
-    // Compare with adjustable tolerance of mismatches.
-    static const fix15_t onepointfive = fix15_one + fix15_halve(fix15_one);
-    dist = fix15_div(dist, tolerance);
-    if (dist > onepointfive) { // aa < 0, but avoid underflow
-        return 0;
-    } else {
-        fix15_t aa = onepointfive - dist;
-        if (aa < fix15_halve(fix15_one))
-            return fix15_short_clamp(fix15_double(aa));
-        else
-            return fix15_one;
+    return dist_alpha(dist);
+}
+
+/*
+  Evaluates a row of n contiguous source pixels, writing their fill
+  alphas to dst. The results are the same as for pixel_fill_alpha.
+*/
+void
+Filler::fill_alpha_row(const rgba* src, chan_t* dst, int n) const
+{
+    int i = 0;
+#ifdef __SSE2__
+    if (tolerance != 0 && target_color.alpha != 0) {
+        // Opaque pixels are their own straightened colors, clamped,
+        // so their distances can be calculated two at a time without
+        // any division. Pairs with other pixels are left to the
+        // scalar version.
+        const rgba& t = target_color;
+        const __m128i target = _mm_set_epi16(
+            t.alpha, t.blue, t.green, t.red, t.alpha, t.blue, t.green, t.red);
+        const __m128i one = _mm_set1_epi16((short)fix15_one);
+        for (; i + 2 <= n; i += 2) {
+            if (src[i].alpha != fix15_one || src[i + 1].alpha != fix15_one) {
+                dst[i] = pixel_fill_alpha(src[i]);
+                dst[i + 1] = pixel_fill_alpha(src[i + 1]);
+                continue;
+            }
+            const __m128i px = _mm_loadu_si128((const __m128i*)(src + i));
+            const __m128i straight = _mm_sub_epi16(px, _mm_subs_epu16(px, one));
+            __m128i diff = _mm_or_si128(
+                _mm_subs_epu16(target, straight),
+                _mm_subs_epu16(straight, target));
+            // Per-pixel maximum, the differences are at most fix15_one, so
+            // they are offset to compare them as signed 16-bit integers
+            diff = _mm_xor_si128(diff, one);
+            diff = _mm_max_epi16(
+                diff, _mm_shufflehi_epi16(
+                          _mm_shufflelo_epi16(diff, _MM_SHUFFLE(2, 3, 0, 1)),
+                          _MM_SHUFFLE(2, 3, 0, 1)));
+            diff = _mm_max_epi16(
+                diff, _mm_shufflehi_epi16(
+                          _mm_shufflelo_epi16(diff, _MM_SHUFFLE(1, 0, 3, 2)),
+                          _MM_SHUFFLE(1, 0, 3, 2)));
+            diff = _mm_xor_si128(diff, one);
+            dst[i] = dist_alpha(_mm_extract_epi16(diff, 0));
+            dst[i + 1] = dist_alpha(_mm_extract_epi16(diff, 4));
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = pixel_fill_alpha(src[i]);
     }
 }
 
+/*
+  Lazily calculated fill alphas of the rows of a source tile,
+  so that each row is evaluated at most once per fill.
+*/
+class FillAlphaRows
+{
+  public:
+    FillAlphaRows(const Filler& filler, PixelBuffer<rgba>& src)
+        : filler(filler), src(src)
+    {
+        for (int y = 0; y < N; ++y) {
+            computed[y] = false;
+        }
+    }
+    const chan_t* row(int y)
+    {
+        if (!computed[y]) {
+            filler.fill_alpha_row(&src(0, y), alphas[y], N);
+            computed[y] = true;
+        }
+        return alphas[y];
+    }
+    chan_t operator()(int x, int y) { return row(y)[x]; }
+
+  private:
+    const Filler& filler;
+    PixelBuffer<rgba>& src;
+    chan_t alphas[N][N];
+    bool computed[N];
+};
+
 /*
   Helper function for the fill algorithm, enqueues the source pixel (at (x,y))
   if the corresponding destination pixel is not already filled, the source
@@ -133,13 +194,13 @@ Filler::pixel_fill_alpha(const rgba& px)
 */
 bool
 Filler::check_enqueue(
-    const int x, const int y, bool check, const rgba& src_pixel,
-    const chan_t& dst_pixel)
+    std::queue<coord>& queue, const int x, const int y, bool check,
+    FillAlphaRows& alphas, const chan_t& dst_pixel) const
 {
     if (dst_pixel != 0) return true;
-    bool match = pixel_fill_alpha(src_pixel) > 0;
+    bool match = alphas(x, y) > 0;
     if (match && check) {
-        seed_queue.push(coord(x, y));
+        queue.push(coord(x, y));
         return false;
     }
     return !match;
@@ -171,145 +232,17 @@ Filler::tile_uniformity(bool empty_tile, PyObject* src_arr)
 }
 
 void
-Filler::queue_seeds(
-    PyObject* seeds, PixelBuffer<rgba>& src, PixelBuffer<chan_t> dst)
-{
-    Py_ssize_t num_seeds = PySequence_Size(seeds);
-    for (Py_ssize_t i = 0; i < num_seeds; ++i) {
-        PyObject* seed_tuple = PySequence_GetItem(seeds, i);
-        int x;
-        int y;
-        PyArg_ParseTuple(seed_tuple, "ii", &x, &y);
-        Py_DECREF(seed_tuple);
-        if (!dst(x, y) && pixel_fill_alpha(src(x, y)) > 0) {
-            seed_queue.push(coord(x, y));
-        }
-    }
-}
-
-/*
-  Generate and queue pixel coordinates based on a list of ranges, a direction
-  of origin indicating the edge the ranges apply to, and source and destination
-  tiles to determine if the coordinates can be, or have already been, filled.
-
-  The input coordinates are marked in a boolean array, used to (potentially)
-  exclude input seeds from output seeds.
-*/
-void
-Filler::queue_ranges(
-    edge origin, PyObject* seeds, bool input_marks[N], PixelBuffer<rgba>& src,
-    PixelBuffer<chan_t>& dst)
+Filler::fill_queued(
+    std::queue<coord>& queue, FillAlphaRows& alphas, PixelBuffer<chan_t>& dst,
+    edge_mask edge_marks[4], int min_x, int min_y, int max_x, int max_y) const
 {
-#ifdef HEAVY_DEBUG
-    assert(PySequence_Check(seeds));
-#endif
-    // The tile edge and direction determined by where the seed segments
-    // originates, left-to-right or top-to-bottom
-    int x_base = (origin == edges::east) * (N - 1);
-    int y_base = (origin == edges::south) * (N - 1);
-    int x_offs = (origin + 1) % 2;
-    int y_offs = origin % 2;
-
-    for (int i = 0; i < PySequence_Size(seeds); ++i) {
-
-        int seg_start;
-        int seg_end;
-        PyObject* segment = PySequence_GetItem(seeds, i);
-
-#ifdef HEAVY_DEBUG
-        assert(PyTuple_CheckExact(segment));
-        assert(PySequence_Size(segment) == 2);
-#endif
-        if (!PyArg_ParseTuple(segment, "ii", &seg_start, &seg_end)) {
-            Py_DECREF(segment);
-            continue;
-        }
-        Py_DECREF(segment);
-#ifdef HEAVY_DEBUG
-        assert(segment->ob_refcnt == 1);
-#endif
-
-        // Check all pixels in the segment, adding the first
-        // of every contiguous section to the queue
-
-        bool contiguous = false;
-
-        for (int n = seg_start, x = x_base + x_offs * n,
-                 y = y_base + y_offs * n;
-             n <= seg_end; ++n, x += x_offs, y += y_offs) {
-
-            input_marks[n] = true; // mark incoming segment to avoid reseeding
-
-            if (!dst(x, y) && pixel_fill_alpha(src(x, y)) > 0) {
-                if (!contiguous) {
-                    seed_queue.push(coord(x, y));
-                    contiguous = true;
-                }
-            } else {
-                contiguous = false;
-            }
-        }
-    }
-}
-
-/*
-  Four-way fill algorithm using segments to represent
-  sequences of input and output seeds.
-
-  Parameters src_o and dst_o should be N x N numpy arrays
-  of types rgba (chan_t[4]) and chan_t respectively.
-  The fill produces alpha values with reference to src_o and
-  writes those alpha values to dst_o.
-
-  The seed coordinates are derived from a list of tuples denoting
-  ranges, which along with the seed origin parameter are used to
-  determine the in-tile pixel coordinates.
-
-  The bounds defined by the min/max,x/y parameters limit the fill
-  within the tile, if they are more constrained than (0, 0, N-1, N-1)
-*/
-PyObject*
-Filler::fill(
-    PyObject* src_o, PyObject* dst_o, PyObject* seeds, edge seed_origin,
-    int min_x, int min_y, int max_x, int max_y)
-{
-    // Sanity checks (not really necessary)
-    if (min_x > max_x || min_y > max_y) return Py_BuildValue("[()()()()]");
-    if (min_x < 0) min_x = 0;
-    if (min_y < 0) min_y = 0;
-    if (max_x > (N - 1)) max_x = (N - 1);
-    if (max_y > (N - 1)) max_y = (N - 1);
-
-    PixelBuffer<rgba> src(src_o);
-    PixelBuffer<chan_t> dst(dst_o);
-
-#ifdef HEAVY_DEBUG
-    assert(PySequence_Check(seeds));
-#endif
-
-    // Store input seed positions to filter them out
-    // prior to constructing the output seed segment lists
-    bool input_seeds[N] = {0,};
-
-    if (seed_origin == edges::none) { // Initial seeds, a list of coordinates
-        queue_seeds(seeds, src, dst);
-    } else {
-        queue_ranges(seed_origin, seeds, input_seeds, src, dst);
-    } // Seed queue populated
-
-    // 0-initialized arrays used to mark points reached on
-    // the tile boundaries to potentially create new seed segments.
-    // Ordered left-to-right / top-to-bottom, for n/s, e/w respectively
-    bool _n[N] = {0,}, _e[N] = {0,}, _s[N] = {0,}, _w[N] = {0,};
-    bool* edge_marks[] = {_n, _e, _s, _w};
-
     // Fill loop
-    while (!seed_queue.empty()) {
+    while (!queue.empty()) {
 
-        int x0 = seed_queue.front().x;
-        int y = seed_queue.front().y;
+        int x0 = queue.front().x;
+        int y = queue.front().y;
 
-        seed_queue.pop();
+        queue.pop();
 
         // skip if we're outside the bbox range
         if (y < min_y || y > max_y) continue;
@@ -322,16 +255,16 @@ Filler::fill(
                 x0 + i; // include starting coordinate when moving left
             const int x_delta = i * 2 - 1; // first scan left, then right
 
-            PixelRef<rgba> src_px = src.get_pixel(x_start, y);
+            const chan_t* row = alphas.row(y);
             PixelRef<chan_t> dst_px = dst.get_pixel(x_start, y);
 
             for (int x = x_start; x >= min_x && x <= max_x;
-                 x += x_delta, src_px.move_x(x_delta), dst_px.move_x(x_delta)) {
+                 x += x_delta, dst_px.move_x(x_delta)) {
                 if (dst_px.read()) {
                     break;
                 } // Pixel is already filled
 
-                chan_t alpha = pixel_fill_alpha(src_px.read());
+                chan_t alpha = row[x];
 
                 if (alpha <= 0) // Colors are too different
                 {
@@ -342,45 +275,148 @@ Filler::fill(
 
                 if (y > 0) {
                     look_above = check_enqueue( //check/enqueue above
-                        x, y-1, look_above, src_px.above(), dst_px.above());
+                        queue, x, y-1, look_above, alphas, dst_px.above());
                 } else {
-                    _n[x] = true; // On northern edge
+                    edge_marks[edges::north] |= (edge_mask)1 << x;
                 }
                 if (y < (N - 1)) {
                     look_below = check_enqueue( // check/enqueue below
-                        x, y+1, look_below, src_px.below(), dst_px.below());
+                        queue, x, y+1, look_below, alphas, dst_px.below());
                 } else {
-                    _s[x] = true; // On southern edge
+                    edge_marks[edges::south] |= (edge_mask)1 << x;
                 }
 
                 if (x == 0) {
-                    _w[y] = true; // On western edge
+                    edge_marks[edges::west] |= (edge_mask)1 << y;
                 } else if (x == (N - 1)) {
-                    _e[y] = true; // On eastern edge
+                    edge_marks[edges::east] |= (edge_mask)1 << y;
                 }
             }
         }
     }
+}
 
-    if (seed_origin != edges::none) {
-        // Remove incoming seeds from outgoing seeds
-        bool* edge = edge_marks[seed_origin];
-        for (int n = 0; n < N; ++n) {
-            edge[n] = edge[n] && !input_seeds[n];
+/*
+  Four-way fill algorithm using bit masks to represent
+  sets of input and output seeds along the tile edges.
+
+  Parameters src_o and dst_o should be N x N numpy arrays
+  of types rgba (chan_t[4]) and chan_t respectively.
+  The fill produces alpha values with reference to src_o and
+  writes those alpha values to dst_o.
+
+  For initial fills (seed_origin == edges::none), the seeds are a list
+  of (x, y) in-tile coordinates. Otherwise the seeds are an edge mask
+  for the edge given by the seed origin parameter.
+
+  The bounds defined by the min/max,x/y parameters limit the fill
+  within the tile, if they are more constrained than (0, 0, N-1, N-1)
+
+  Returns the overflows as a list of edge masks, in the order n, e, s, w
+*/
+PyObject*
+Filler::fill(
+    PyObject* src_o, PyObject* dst_o, PyObject* seeds, edge seed_origin,
+    int min_x, int min_y, int max_x, int max_y)
+{
+    // Sanity checks (not really necessary)
+    if (min_x > max_x || min_y > max_y) return Py_BuildValue("[iiii]", 0, 0, 0, 0);
+    if (min_x < 0) min_x = 0;
+    if (min_y < 0) min_y = 0;
+    if (max_x > (N - 1)) max_x = (N - 1);
+    if (max_y > (N - 1)) max_y = (N - 1);
+
+    PixelBuffer<rgba> src(src_o);
+    PixelBuffer<chan_t> dst(dst_o);
+
+    std::vector<coord> seed_coords;
+    edge_mask seed_edges[4] = {0, 0, 0, 0};
+
+    if (seed_origin == edges::none) { // Initial seeds, a list of coordinates
+        Py_ssize_t num_seeds = PySequence_Size(seeds);
+        for (Py_ssize_t i = 0; i < num_seeds; ++i) {
+            PyObject* seed_tuple = PySequence_GetItem(seeds, i);
+            int x;
+            int y;
+            PyArg_ParseTuple(seed_tuple, "ii", &x, &y);
+            Py_DECREF(seed_tuple);
+            seed_coords.push_back(coord(x, y));
         }
+    } else {
+        seed_edges[seed_origin] = PyLong_AsUnsignedLongLong(seeds);
+        if (PyErr_Occurred()) return NULL;
     }
 
+    edge_mask overflows[4];
+    fill(
+        src, dst, seed_coords, seed_edges, overflows, min_x, min_y, max_x,
+        max_y);
+
     return Py_BuildValue(
-        "[NNNN]", to_seeds(_n), to_seeds(_e), to_seeds(_s), to_seeds(_w));
+        "[KKKK]", (unsigned long long)overflows[edges::north],
+        (unsigned long long)overflows[edges::east],
+        (unsigned long long)overflows[edges::south],
+        (unsigned long long)overflows[edges::west]);
+}
+
+/*
+  Same fill as above, with the seeds on all edges given as masks.
+  The incoming seeds are excluded from the outgoing seeds on the
+  same edge, since those pixels were filled when they were sent.
+*/
+void
+Filler::fill(
+    PixelBuffer<rgba>& src, PixelBuffer<chan_t>& dst,
+    const std::vector<coord>& seeds, const edge_mask seed_edges[4],
+    edge_mask overflows[4], int min_x, int min_y, int max_x, int max_y) const
+{
+    FillAlphaRows alphas(*this, src);
+    std::queue<coord> queue;
+    for (size_t i = 0; i < seeds.size(); ++i) {
+        const coord& c = seeds[i];
+        if (!dst(c.x, c.y) && alphas(c.x, c.y) > 0) {
+            queue.push(c);
+        }
+    }
+    for (int e = 0; e < 4; ++e) {
+        if (!seed_edges[e]) continue;
+        // Queue the first pixel of every contiguous section of
+        // seeds, left->right or top->down along the edge
+        const int x_base = (e == edges::east) * (N - 1);
+        const int y_base = (e == edges::south) * (N - 1);
+        const int x_offs = (e + 1) % 2;
+        const int y_offs = e % 2;
+        bool contiguous = false;
+        for (int n = 0; n < N; ++n) {
+            const int x = x_base + x_offs * n;
+            const int y = y_base + y_offs * n;
+            if ((seed_edges[e] >> n) & 1 && !dst(x, y) && alphas(x, y) > 0) {
+                if (!contiguous) {
+                    queue.push(coord(x, y));
+                    contiguous = true;
+                }
+            } else {
+                contiguous = false;
+            }
+        }
+    }
+
+    // Marks of the points reached on the tile boundaries
+    edge_mask edge_marks[4] = {0, 0, 0, 0};
+    fill_queued(queue, alphas, dst, edge_marks, min_x, min_y, max_x, max_y);
+
+    for (int e = 0; e < 4; ++e) {
+        overflows[e] = edge_marks[e] & ~seed_edges[e];
+    }
 }
 
 void
 Filler::flood(PyObject* src_arr, PyObject* dst_arr)
 {
-    PixelRef<rgba> src_px = PixelBuffer<rgba>(src_arr).get_pixel(0, 0);
-    PixelRef<chan_t> dst_px = PixelBuffer<chan_t>(dst_arr).get_pixel(0, 0);
-    for (int i = 0; i < N * N; ++i, src_px.move_x(1), dst_px.move_x(1)) {
-        dst_px.write(pixel_fill_alpha(src_px.read()));
+    PixelBuffer<rgba> src(src_arr);
+    PixelBuffer<chan_t> dst(dst_arr);
+    for (int y = 0; y < N; ++y) {
+        fill_alpha_row(&src(0, y), &dst(0, y), N);
     }
 }
 
@@ -389,10 +425,18 @@ rgba_tile_from_alpha_tile(
     PyObject* src, double fill_r, double fill_g, double fill_b, int min_x,
     int min_y, int max_x, int max_y)
 {
-    npy_intp dims[] = {N, N, 4};
+    // Constant alpha tiles give constant rgba tiles, which are shared
+    const bool whole_tile =
+        min_x <= 0 && min_y <= 0 && max_x >= N - 1 && max_y >= N - 1;
+    if (src == ConstTiles::ALPHA_TRANSPARENT()) {
+        return ConstTiles::rgba16(0, 0, 0, 0);
+    } else if (src == ConstTiles::ALPHA_OPAQUE() && whole_tile) {
+        const rgba px(fill_r, fill_g, fill_b, fix15_one);
+        return ConstTiles::rgba16(px.red, px.green, px.blue, px.alpha);
+    }
     // A zeroed array is used instead of an empty, since
     // less than the entire output tile may be written to.
-    PyObject* dst_arr = PyArray_ZEROS(3, dims, NPY_USHORT, 0);
+    PyObject* dst_arr = tile_pool_new(TilePoolRGBA16);
     PixelBuffer<rgba> dst_buf(dst_arr);
     PixelBuffer<chan_t> src_buf(src);
     for (int y = min_y; y <= max_y; ++y) {
@@ -11,6 +11,8 @@
 #define FLOODFILL_HPP
 
 #include <queue>
+#include <stdint.h>
+#include <vector>
 
 #include "fill_common.hpp"
 
@@ -25,6 +27,19 @@ struct edges {
 
 typedef edges::edge edge;
 
+/*
+  Set of pixels along a tile edge, bit n being pixel n, in the order
+  left-to-right / top-to-bottom for n/s, e/w edges respectively.
+*/
+typedef uint64_t edge_mask;
+#ifndef SWIG
+static_assert(N <= 64, "edge masks hold one bit per pixel of a tile edge");
+#endif /* #ifndef SWIG */
+
+#ifndef SWIG
+class FillAlphaRows;
+#endif /* #ifndef SWIG */
+
 /*
   Implements the pixel threshold test function and uses it in the
   fill, alpha flooding, and tile uniformity/fillability methods
@@ -35,13 +50,14 @@ class Filler
     const rgba target_color;
     const rgba target_color_premultiplied;
     const fix15_t tolerance;
-    std::queue<coord> seed_queue;
+    // Fill alphas indexed by color distance, unless tolerance is 0
+    std::vector<chan_t> dist_alphas;
 
   public:
     Filler(int targ_r, int targ_g, int targ_b, int targ_a, double tol);
-    // Perform a scanline fill based on the rgba src tile and seed coordinates,
-    // writing the resulting fill alphas to the dst tile and returning
-    // any new overflows
+    // Perform a scanline fill based on the rgba src tile and seed coordinates
+    // or an edge mask of seeds, writing the resulting fill alphas to the dst
+    // tile and returning any new overflows as edge masks
     PyObject* fill(
         PyObject* src, PyObject* dst, PyObject* seeds, edge direction,
         int min_x, int min_y, int max_x, int max_y);
@@ -52,28 +68,41 @@ class Filler
     // (all pixels having the same rgba color)), and if it is
     // returning the fill alpha for that color, otherwise Py_None
     PyObject* tile_uniformity(bool is_empty, PyObject* src);
+#ifndef SWIG
+    // Native counterpart of fill, used by the parallel fill driver.
+    // Seeds are given as in-tile coordinates and as incoming edge masks
+    // indexed by edge, and the overflows are returned as edge masks
+    // in the same way. This can be called concurrently.
+    void fill(
+        PixelBuffer<rgba>& src, PixelBuffer<chan_t>& dst,
+        const std::vector<coord>& seeds, const edge_mask seed_edges[4],
+        edge_mask overflows[4], int min_x, int min_y, int max_x,
+        int max_y) const;
+#endif /* #ifndef SWIG */
 
-  private:
     // Pixel threshold test - the return value indicates the alpha value of the
     // filled pixel, where an alpha of 0 indicates that the pixel should not be
     // filled (and the fill not propagated through that pixel).
-    chan_t pixel_fill_alpha(const rgba& src_px);
-    // Queue seeds from a python list of (x, y) coordinate tuples
-    void queue_seeds(
-        PyObject* seeds, PixelBuffer<rgba>& src, PixelBuffer<chan_t> dst);
-    // Queue seeds from a python list of [start, end] range tuples
-    // paired with an input origin direction indicating the side of
-    // the tile that the ranges apply to.
-    // Ranges are left->right, top->down, and end-inclusive.
-    void queue_ranges(
-        edge direction, PyObject* seeds, bool marks[N],
-        PixelBuffer<rgba>& src, PixelBuffer<chan_t>& dst);
+    chan_t pixel_fill_alpha(const rgba& src_px) const;
+    // The same test for a row of n contiguous pixels
+    void fill_alpha_row(const rgba* src, chan_t* dst, int n) const;
+
+  private:
+    // Fill alpha for a distance from the target color
+    chan_t tolerance_alpha(fix15_t dist) const;
+    chan_t dist_alpha(fix15_t dist) const;
     // Check if a pixel is a valid fill candidate (unfilled & within threshold)
     // Put it in the seed queue if true.
     // Return value means: "enqueue valid neighbours on same row".
     bool check_enqueue(
-        const int x, const int y, bool check, const rgba& src_px,
-        const chan_t& dst_px);
+        std::queue<coord>& queue, const int x, const int y, bool check,
+        FillAlphaRows& alphas, const chan_t& dst_px) const;
+    // Fill from the queued seeds, marking the filled pixels
+    // on the edges of the tile in the n, e, s, w masks.
+    void fill_queued(
+        std::queue<coord>& queue, FillAlphaRows& alphas,
+        PixelBuffer<chan_t>& dst, edge_mask edge_marks[4], int min_x,
+        int min_y, int max_x, int max_y) const;
 };
 
 /*
@@ -103,6 +132,9 @@ class GapClosingFiller
 /*
   Create and return an N x N rgba tile based on an rgb color
   and a N x N tile of alpha values
+
+  For the constant alpha tiles, the result is a shared read-only
+  tile (see ConstTiles), unless the opaque one is only partially used.
 */
 PyObject* rgba_tile_from_alpha_tile(
     PyObject* src, double fill_r, double fill_g, double fill_b, int min_x,
@@ -19,7 +19,7 @@
 static bool
 all_max_dist(chan_t seeds[N])
 {
-    for (int i = 0; i < N + 10; ++i) {
+    for (int i = 0; i < N; ++i) {
         if (seeds[i] != MAX_GAP) return false;
     }
     return true;
@@ -27,51 +27,39 @@ all_max_dist(chan_t seeds[N])
 
 // Gap closing requires each seed to keep track of the maximum
 // detected distance it encountered on its path, hence ranges
-// are not used here.
+// are not used here. The seeds reaching an edge are returned as
+// (origin, mask, distances), where the bits of the mask mark the
+// seeded pixels and the uint16 array holds their distances, both
+// in the order left->right / top->down along the edge.
 static inline PyObject*
-simple_seeds(chan_t seeds[N], edge e)
+edge_seeds(chan_t seeds[N], edge e)
 {
+    // This value is queued for a neighbouring tile, so the direction
+    // is inverted to be interpreted as "coming from this direction"
+    edge inverted = edge((e + 2) % 4);
+
     // For large fills (perhaps accidentally so, when leaking through)
     // these shortcuts are used to potentially skip large areas of
     // empty tiles without detected gaps
     if (all_max_dist(seeds)) {
-        // This value is queued for a neighbouring tile, so the direction
-        // is inverted to be interpreted as "coming from this direction"
-        edge inverted = edge((e + 2) % 4);
         return Py_BuildValue("(i)", inverted);
     }
 
-    // Fall back to creating seed tuples in a list.
-    PyObject* list = PyList_New(0);
+    edge_mask mask = 0;
+    for (int i = 0; i < N; ++i) {
+        if (seeds[i] != 0) mask |= (edge_mask)1 << i;
+    }
+    if (!mask) return PyTuple_New(0);
 
+    npy_intp dims[] = {N};
+    PyObject* distances = PyArray_EMPTY(1, dims, NPY_USHORT, 0);
+    chan_t* dist_data = reinterpret_cast<chan_t*>(PyArray_DATA(
+        reinterpret_cast<PyArrayObject*>(distances)));
     for (int i = 0; i < N; ++i) {
-        chan_t d = seeds[i];
-        if (d == 0) continue;
-
-        PyObject* seed;
-        switch (e) {
-        case edges::north:
-            seed = Py_BuildValue("iii", i, N - 1, d);
-            break;
-        case edges::east:
-            seed = Py_BuildValue("iii", 0, i, d);
-            break;
-        case edges::south:
-            seed = Py_BuildValue("iii", i, 0, d);
-            break;
-        case edges::west:
-            seed = Py_BuildValue("iii", N - 1, i, d);
-            break;
-        default:
-            throw;
-        }
-        PyList_Append(list, seed);
-        Py_DECREF(seed);
-#ifdef HEAVY_DEBUG
-        assert(seed->ob_refcnt == 1);
-#endif
+        dist_data[i] = seeds[i];
     }
-    return list;
+    return Py_BuildValue(
+        "(iKN)", inverted, (unsigned long long)mask, distances);
 }
 
 /*
@@ -130,28 +118,41 @@ queue_gc_seeds(
         east[y] = curr_dist;
 }
 
+// Read seeds either from a list of (x, y, distance) tuples, or from
+// the edge formats created by edge_seeds: (origin,) for a full edge of
+// seeds with infinite distances and (origin, mask, distances).
 static void
-populate_gc_queue(std::queue<gc_coord>& queue, PyObject* seeds)
+read_gc_seeds(PyObject* seeds, std::vector<gc_coord>& seed_pts)
 {
     if (PyTuple_CheckExact(seeds)) {
-        edge origin;
-        PyArg_ParseTuple(seeds, "i", &origin);
+        int origin;
+        unsigned long long mask = 0;
+        PyObject* distances = NULL;
+        if (!PyArg_ParseTuple(seeds, "i|KO", &origin, &mask, &distances)) {
+            PyErr_Clear();
+            return;
+        }
+        if (!distances) mask = ~(edge_mask)0;
+        const chan_t* dist_data =
+            distances ? reinterpret_cast<chan_t*>(PyArray_DATA(
+                            reinterpret_cast<PyArrayObject*>(distances)))
+                      : NULL;
 
         int x_base = (origin == edges::east) * (N - 1);
         int y_base = (origin == edges::south) * (N - 1);
         int x_offs = (origin + 1) % 2;
         int y_offs = origin % 2;
         for (int i = 0; i < N; ++i) {
+            if (!((mask >> i) & 1)) continue;
             const int x = x_base + (x_offs * i);
             const int y = y_base + (y_offs * i);
-            gc_coord seed = gc_coord(x, y, MAX_GAP);
+            gc_coord seed = gc_coord(x, y, dist_data ? dist_data[i] : MAX_GAP);
             seed.is_seed = true;
-            queue.push(seed);
+            seed_pts.push_back(seed);
         }
         return;
     }
 
-    // Populate the queue
     for (int i = 0; i < PySequence_Size(seeds); ++i) {
 
         gc_coord seed_pt;
@@ -163,7 +164,17 @@ populate_gc_queue(std::queue<gc_coord>& queue, PyObject* seeds)
 #ifdef HEAVY_DEBUG
         assert(tuple->ob_refcnt == 1);
 #endif
-        queue.push(seed_pt);
+        seed_pts.push_back(seed_pt);
+    }
+}
+
+static void
+populate_gc_queue(std::queue<gc_coord>& queue, PyObject* seeds)
+{
+    std::vector<gc_coord> seed_pts;
+    read_gc_seeds(seeds, seed_pts);
+    for (size_t i = 0; i < seed_pts.size(); ++i) {
+        queue.push(seed_pts[i]);
     }
 }
 
@@ -281,9 +292,9 @@ GapClosingFiller::fill(
     }
 
     return Py_BuildValue(
-        "[NNNNNi]", simple_seeds(north, edges::north),
-        simple_seeds(east, edges::east), simple_seeds(south, edges::south),
-        simple_seeds(west, edges::west), f_edge_list, pixels_filled);
+        "[NNNNNi]", edge_seeds(north, edges::north),
+        edge_seeds(east, edges::east), edge_seeds(south, edges::south),
+        edge_seeds(west, edges::west), f_edge_list, pixels_filled);
 }
 
 // Based on coordinates of places where the initial fill stopped due
@@ -297,18 +308,11 @@ GapClosingFiller::unseep(
     PixelBuffer<chan_t> dst(dst_arr);
 
     std::queue<gc_coord> queue;
+    std::vector<gc_coord> seed_pts;
+    read_gc_seeds(seeds, seed_pts);
     // Populate the queue
-    for (int i = 0; i < PySequence_Size(seeds); ++i) {
-
-        gc_coord seed_pt;
-        PyObject* tuple = PySequence_GetItem(seeds, i);
-        PyArg_ParseTuple(
-            tuple, "iii", &(seed_pt.x), &(seed_pt.y), &seed_pt.distance);
-        seed_pt.is_seed = true;
-        Py_DECREF(tuple);
-#ifdef HEAVY_DEBUG
-        assert(tuple->ob_refcnt == 1);
-#endif
+    for (size_t i = 0; i < seed_pts.size(); ++i) {
+        gc_coord& seed_pt = seed_pts[i];
 
         // Don't queue initial track_seep seeds that were filled from another
         // direction. Initial seeds are created during the fill process,
@@ -368,7 +372,7 @@ GapClosingFiller::unseep(
         queue_gc_seeds(queue, c, curr_dist, north, east, south, west);
     }
     return Py_BuildValue(
-        "[NNNNi]", simple_seeds(north, edges::north),
-        simple_seeds(east, edges::east), simple_seeds(south, edges::south),
-        simple_seeds(west, edges::west), pixels_erased);
+        "[NNNNi]", edge_seeds(north, edges::north),
+        edge_seeds(east, edges::east), edge_seeds(south, edges::south),
+        edge_seeds(west, edges::west), pixels_erased);
 }
@@ -35,15 +35,39 @@ upd_dist(coord lc, PixelBuffer<chan_t>& dists, int new_dst)
     }
 }
 
-using rot_op = std::function<coord(int x, int y, int x_offset, int y_offset)>;
+// Coordinate reflection/rotation, selecting the octant searched by
+// dist_search. These are template arguments, so that they are inlined
+// into the search loops.
+static inline coord
+top_right(int x, int y, int x_offset, int y_offset)
+{
+    return coord(x + x_offset, y + y_offset);
+}
+static inline coord
+top_centr(int x, int y, int x_offset, int y_offset)
+{
+    return coord(x - y_offset, y - x_offset);
+}
+static inline coord
+bot_centr(int x, int y, int x_offset, int y_offset)
+{
+    return coord(x - y_offset, y + x_offset);
+}
+static inline coord
+bot_right(int x, int y, int x_offset, int y_offset)
+{
+    return coord(x + x_offset, y - y_offset);
+}
+
+typedef coord rot_op(int x, int y, int x_offset, int y_offset);
 
 // Search an octant with a radius of _dist_ pixels, marking any gaps
 // that are found. The octant searched is determined by the rotation
 // function provided.
-bool
+template <rot_op op>
+static bool
 dist_search(
-    int x, int y, int dist, chan_t** alphas, PixelBuffer<chan_t>& dists,
-    rot_op op)
+    int x, int y, int dist, chan_t** alphas, PixelBuffer<chan_t>& dists)
 {
 
     // int d_lim = 1 + (dist * dist);
@@ -89,28 +113,6 @@ dist_search(
     return gap_found;
 }
 
-// Coordinate reflection/rotation
-coord
-top_right(int x, int y, int x_offset, int y_offset)
-{
-    return coord(x + x_offset, y + y_offset);
-}
-coord
-top_centr(int x, int y, int x_offset, int y_offset)
-{
-    return coord(x - y_offset, y - x_offset);
-}
-coord
-bot_centr(int x, int y, int x_offset, int y_offset)
-{
-    return coord(x - y_offset, y + x_offset);
-}
-coord
-bot_right(int x, int y, int x_offset, int y_offset)
-{
-    return coord(x + x_offset, y - y_offset);
-}
-
 /* Search for gaps in the 9-grid of flooded alpha tiles,
    a gap being defined as a
  */
@@ -138,16 +140,16 @@ find_gaps(
             if (rb.input[y][x] ==
                 0) { // Search for gaps in relation to this pixel
                 if (y >= r) {
-                    gaps_found |= dist_search(
-                        x, y, rb.distance, rb.input, radiuses, top_right);
-                    gaps_found |= dist_search(
-                        x, y, rb.distance, rb.input, radiuses, top_centr);
+                    gaps_found |= dist_search<top_right>(
+                        x, y, rb.distance, rb.input, radiuses);
+                    gaps_found |= dist_search<top_centr>(
+                        x, y, rb.distance, rb.input, radiuses);
                 }
                 if (y < N + r) {
-                    gaps_found |= dist_search(
-                        x, y, rb.distance, rb.input, radiuses, bot_centr);
-                    gaps_found |= dist_search(
-                        x, y, rb.distance, rb.input, radiuses, bot_right);
+                    gaps_found |= dist_search<bot_centr>(
+                        x, y, rb.distance, rb.input, radiuses);
+                    gaps_found |= dist_search<bot_right>(
+                        x, y, rb.distance, rb.input, radiuses);
                 }
             }
         }
@@ -0,0 +1,221 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "morph_blur.hpp"
+#include "blur_swig.hpp"
+#include "fill_constants.hpp"
+#include "morphology_swig.hpp"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <utility>
+
+// Number of tile rows blurred at a time. Strands are cut at the band
+// edges, so taller bands make the per-strand setup cost rarer, at the
+// price of more morphed tiles held at a time.
+static const int BAND_ROWS = 16;
+
+// The x coordinates of the tiles in a dictionary, by row
+typedef std::map<int, std::set<int>> TileRows;
+
+// Tile coordinates in the order of lib.morphology.strand_partition:
+// by column, top to bottom
+typedef std::set<std::pair<int, int>> TileCoords;
+
+/*
+  All of the functions below are called with the GIL held
+*/
+
+static PyObject*
+get_tile(PyObject* tiles, int x, int y)
+{
+    PyObject* c = Py_BuildValue("ii", x, y);
+    PyObject* tile = PyDict_GetItem(tiles, c);
+    Py_DECREF(c);
+    return tile;
+}
+
+static bool
+is_full(PyObject* tiles, int x, int y)
+{
+    return get_tile(tiles, x, y) == ConstTiles::ALPHA_OPAQUE();
+}
+
+static bool
+neighbours_full(PyObject* tiles, int x, int y)
+{
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            if ((dx || dy) && !is_full(tiles, x + dx, y + dy)) return false;
+        }
+    }
+    return true;
+}
+
+static TileRows
+tile_rows(PyObject* tiles)
+{
+    TileRows rows;
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(tiles, &pos, &key, &value)) {
+        int x, y;
+        if (PyArg_ParseTuple(key, "ii", &x, &y)) rows[y].insert(x);
+    }
+    PyErr_Clear();
+    return rows;
+}
+
+/*
+  Get the coordinates in rows [y0, y1] to process for the tiles of
+  the given rows; unless only the tiles themselves are processed,
+  their neighbours are included as well.
+*/
+static TileCoords
+band_coords(const TileRows& rows, int y0, int y1, bool with_neighbours)
+{
+    TileCoords coords;
+    const int reach = with_neighbours ? 1 : 0;
+    auto it = rows.lower_bound(y0 - reach);
+    for (; it != rows.end() && it->first <= y1 + reach; ++it) {
+        const int y = it->first;
+        for (int x : it->second) {
+            for (int dy = -reach; dy <= reach; ++dy) {
+                if (y + dy < y0 || y + dy > y1) continue;
+                for (int dx = -reach; dx <= reach; ++dx) {
+                    coords.insert(std::make_pair(x + dx, y + dy));
+                }
+            }
+        }
+    }
+    return coords;
+}
+
+/*
+  The native counterpart of lib.morphology.strand_partition: fully opaque
+  tiles needing no processing are added to the output directly, and the
+  lists of vertically contiguous coordinates of the others are returned.
+*/
+static PyObject*
+partition(
+    const TileCoords& coords, PyObject* tiles, bool dilating, PyObject* dst)
+{
+    PyObject* strands = PyList_New(0);
+    PyObject* strand = nullptr;
+    std::pair<int, int> prev;
+    for (const auto& c : coords) {
+        const int x = c.first, y = c.second;
+        if (is_full(tiles, x, y) && (dilating || neighbours_full(tiles, x, y))) {
+            PyObject* key = Py_BuildValue("ii", x, y);
+            PyDict_SetItem(dst, key, ConstTiles::ALPHA_OPAQUE());
+            Py_DECREF(key);
+            strand = nullptr;
+            continue;
+        }
+        if (!strand || prev.first != x || prev.second + 1 != y) {
+            strand = PyList_New(0);
+            PyList_Append(strands, strand);
+            Py_DECREF(strand);
+        }
+        PyObject* key = Py_BuildValue("ii", x, y);
+        PyList_Append(strand, key);
+        Py_DECREF(key);
+        prev = c;
+    }
+    return strands;
+}
+
+// Add the coordinates that made it into the output to its rows
+static void
+record_rows(const TileCoords& coords, PyObject* tiles, TileRows& rows)
+{
+    for (const auto& c : coords) {
+        if (get_tile(tiles, c.first, c.second)) {
+            rows[c.second].insert(c.first);
+        }
+    }
+}
+
+// Remove the tiles of all rows above the given one
+static void
+drop_rows(PyObject* tiles, TileRows& rows, int y_limit)
+{
+    while (!rows.empty() && rows.begin()->first < y_limit) {
+        const int y = rows.begin()->first;
+        for (int x : rows.begin()->second) {
+            PyObject* key = Py_BuildValue("ii", x, y);
+            PyDict_DelItem(tiles, key);
+            Py_DECREF(key);
+        }
+        rows.erase(rows.begin());
+    }
+    PyErr_Clear();
+}
+
+void
+morph_blur(
+    int offset, int radius, PyObject* blurred, PyObject* tiles,
+    Controller& status_controller, bool fast)
+{
+    if (offset == 0 || offset > N || offset < -N || radius <= 0 ||
+        !PyDict_Check(tiles) || !PyDict_Check(blurred)) {
+        printf("Invalid morph_blur parameters!\n");
+        return;
+    }
+    const bool dilating = offset > 0;
+
+    TileRows input_rows = tile_rows(tiles);
+    if (input_rows.empty()) return;
+
+    // Dilation may spread to the rows adjoining the input,
+    // and the blur to those adjoining the morphed tiles.
+    const int morph_y0 = input_rows.begin()->first - (dilating ? 1 : 0);
+    const int morph_y1 = input_rows.rbegin()->first + (dilating ? 1 : 0);
+    const int blur_y0 = morph_y0 - 1;
+    const int blur_y1 = morph_y1 + 1;
+
+    PyObject* morphed = PyDict_New();
+    TileRows morphed_rows;
+    int next_morph_y = morph_y0;
+
+    for (int y0 = blur_y0; y0 <= blur_y1; y0 += BAND_ROWS) {
+        if (!status_controller.running()) break;
+        const int y1 = std::min(y0 + BAND_ROWS - 1, blur_y1);
+
+        // Morph the rows up to the one below the band
+        const int morph_to = std::min(y1 + 1, morph_y1);
+        if (next_morph_y <= morph_to) {
+            TileCoords coords =
+                band_coords(input_rows, next_morph_y, morph_to, dilating);
+            PyObject* strands = partition(coords, tiles, dilating, morphed);
+            if (PyList_GET_SIZE(strands) > 0) {
+                morph(offset, morphed, tiles, strands, status_controller);
+            }
+            Py_DECREF(strands);
+            record_rows(coords, morphed, morphed_rows);
+            next_morph_y = morph_to + 1;
+        }
+        // The next morph starts with the row after the one it morphed
+        drop_rows(tiles, input_rows, next_morph_y - 1);
+
+        TileCoords coords = band_coords(morphed_rows, y0, y1, true);
+        PyObject* strands = partition(coords, morphed, false, blurred);
+        if (PyList_GET_SIZE(strands) > 0) {
+            blur(radius, blurred, morphed, strands, status_controller, fast);
+        }
+        Py_DECREF(strands);
+        // The next band needs the morphed row above it
+        drop_rows(morphed, morphed_rows, y1);
+    }
+    Py_DECREF(morphed);
+    // Leave no input behind, even when cancelled
+    drop_rows(tiles, input_rows, blur_y1 + 1);
+}
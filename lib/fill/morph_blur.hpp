@@ -0,0 +1,37 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MORPH_BLUR_HPP
+#define MORPH_BLUR_HPP
+
+#include "fill_common.hpp"
+
+/*
+  Dilate or erode the input tiles, and then blur the result, adding the
+  blurred tiles to the given dictionary. The result is the same as that of
+  running morph() and then blur(), with the tiles partitioned the same way
+  as lib.morphology does.
+
+  The two operations are run together over bands of tile rows, each band
+  being blurred as soon as the morphed rows around it are done. Morphed
+  tiles are dropped once the band below them has been blurred, as are the
+  input tiles once no more morphs need them: the input dictionary is
+  emptied in the process, and no more than a few bands of tiles are held
+  at any time, instead of the whole morphed fill.
+*/
+void morph_blur(
+    int offset, // Radius to grow (if > 0) or shrink (if < 0)
+    int radius, // Nominal blur radius
+    PyObject* blurred, // Dictionary holding the result of the operation
+    PyObject* tiles, // Input tiles, NxNx1 uint16 numpy arrays (consumed)
+    Controller& status_controller, // cancellation and status data
+    bool fast = false // approximate the blur with box blurs
+    );
+
+#endif //MORPH_BLUR_HPP
@@ -9,10 +9,17 @@
 
 #include "morphology.hpp"
 #include "fill_constants.hpp"
+#include "../tracing.hpp"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <tuple>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*
   Get the width of a horizontal chord, located at a given vertical distance
   from the center of the circle for a circular structuring element with the
@@ -29,23 +36,43 @@ chord_width(int radius, int y_offset)
     return 1 + 2 * hw;
 }
 
-Morpher::Morpher(int radius)
-    : radius(radius), height(radius * 2 + 1), se_chords(height)
+/*
+  Get the distinct chord lengths of a circular structuring element, in
+  increasing order, preceded by the power-of-two lengths needed to
+  build up the first one.
+*/
+static std::vector<int>
+chord_lengths(int radius)
 {
-    // Create structuring element
-
+    std::vector<int> lengths;
     int fst_length = chord_width(radius, radius);
 
     for (int pad = 1; pad < fst_length; pad *= 2) {
-        se_lengths.push_back(pad);
+        lengths.push_back(pad);
     }
-    // Go through the first half of the circle and populate the indices,
-    // adding new unique chords as necessary
     for (int y = -radius; y <= 0; ++y) {
         int length = chord_width(radius, y);
-        if (se_lengths.back() != length) se_lengths.push_back(length);
+        if (lengths.back() != length) lengths.push_back(length);
+    }
+    return lengths;
+}
+
+Morpher::Morpher(int radius)
+    : radius(radius), height(radius * 2 + 1), se_chords(height),
+      se_lengths(chord_lengths(radius)),
+      stride(ScratchBuffer::row_stride<chan_t>(N + 2 * radius)),
+      buffer(
+          sizeof(chan_t) * stride *
+          (N + 2 * radius + height * se_lengths.size()))
+{
+    // Create structuring element: go through the first half of the
+    // circle and populate the indices of its chords' lengths
+    size_t len_i = 0;
+    for (int y = -radius; y <= 0; ++y) {
+        int length = chord_width(radius, y);
+        while (se_lengths[len_i] != length) len_i++;
         int x_offset = (length - 1) / -2;
-        se_chords[y + radius] = chord(x_offset, se_lengths.size() - 1);
+        se_chords[y + radius] = chord(x_offset, len_i);
     }
 
     // Copy the mirrored indices from the first half to the second
@@ -54,40 +81,17 @@ Morpher::Morpher(int radius)
     }
 
     const int width = N + 2 * radius;
-
-    // Allocate input space
-    input = new chan_t*[width];
-    for (int i = 0; i < width; ++i) {
-        input[i] = new chan_t[width];
-    }
-    // Allocate lookup table
     const int num_types = se_lengths.size();
-    lookup_table = new chan_t**[height];
-    for (int h = 0; h < height; ++h) {
-        lookup_table[h] = new chan_t*[width];
-        for (int w = 0; w < width; ++w) {
-            lookup_table[h][w] = new chan_t[num_types];
-        }
-    }
-}
-Morpher::~Morpher()
-{
-    const int width = N + 2 * radius;
 
-    // Free input
-    for (int i = 0; i < width; ++i) {
-        delete[] input[i];
+    // Lay out the input rows, followed by the lookup table rows
+    chan_t* mem = buffer.data<chan_t>();
+    for (int i = 0; i < width; ++i, mem += stride) {
+        input_rows.push_back(mem);
     }
-    delete[] input;
-
-    // Free lookup table
-    for (int h = 0; h < height; ++h) {
-        for (int w = 0; w < width; ++w) {
-            delete[] lookup_table[h][w];
-        }
-        delete lookup_table[h];
+    input = input_rows.data();
+    for (int h = 0; h < height; ++h, mem += stride * num_types) {
+        lut_rows.push_back(mem);
     }
-    delete[] lookup_table;
 }
 
 /*
@@ -96,32 +100,26 @@ Morpher::~Morpher()
 void
 Morpher::rotate_lut()
 {
-    chan_t** first = lookup_table[0];
-    for (int y = 0; y < height - 1; ++y) {
-        lookup_table[y] = lookup_table[y + 1];
-    }
-    lookup_table[height - 1] = first;
+    std::rotate(lut_rows.begin(), lut_rows.begin() + 1, lut_rows.end());
 }
 
 template <op cmp>
 void
 Morpher::populate_row(int y_row, int y_px)
 {
-    const int r = radius;
+    const int width = N + 2 * radius;
+    chan_t* const row = lut_rows[y_row];
 
-    for (int x = 0; x < N + 2 * r; ++x) {
-        lookup_table[y_row][x][0] = input[y_px][x];
-    }
+    std::copy(input[y_px], input[y_px] + width, row);
     int prev_len = 1;
     for (size_t len_i = 1; len_i < se_lengths.size(); len_i++) {
         const int len = se_lengths[len_i];
         const int len_diff = len - prev_len;
         prev_len = len;
-        for (int x = 0; x <= N + 2 * r - len; ++x) {
-            chan_t ext_v =
-                cmp(lookup_table[y_row][x][len_i - 1],
-                    lookup_table[y_row][x + len_diff][len_i - 1]);
-            lookup_table[y_row][x][len_i] = ext_v;
+        const chan_t* const prev = row + (len_i - 1) * stride;
+        chan_t* const curr = row + len_i * stride;
+        for (int x = 0; x <= width - len; ++x) {
+            curr[x] = cmp(prev[x], prev[x + len_diff]);
         }
     }
 }
@@ -149,10 +147,9 @@ lim_search(chan_t lim, PixelBuffer<chan_t>& buf, int cx, int cy, int w)
   entire tile if a limit valued pixel (or pixels) is found.
 */
 template <chan_t lim>
-bool
-Morpher::can_skip(PixelBuffer<chan_t> buf)
+static bool
+can_skip_morph(int r, PixelBuffer<chan_t>& buf)
 {
-    const int r = radius;
     const int max_search_radius = 15;
 #define SQRT2 1.4142135623730951
     const int r_limit = (N * SQRT2) / 2;
@@ -183,10 +180,18 @@ Morpher::can_skip(PixelBuffer<chan_t> buf)
     return false;
 }
 
+template <chan_t lim>
+bool
+Morpher::can_skip(PixelBuffer<chan_t> buf)
+{
+    return can_skip_morph<lim>(radius, buf);
+}
+
 template <chan_t init, chan_t lim, op cmp>
 void
 Morpher::morph(bool can_update, PixelBuffer<chan_t>& dst)
 {
+    TRACE_SCOPE("Morpher::morph");
     const int r = radius;
 
     if (can_update) {
@@ -197,13 +202,18 @@ Morpher::morph(bool can_update, PixelBuffer<chan_t>& dst)
             populate_row<cmp>(dy, dy);
         }
     }
+    // Position of each chord's values in its lookup table row
+    std::vector<int> chord_offsets(height);
+    for (int c = 0; c < height; ++c) {
+        const chord& ch = se_chords[c];
+        chord_offsets[c] = ch.length_index * stride + ch.x_offset + r;
+    }
     PixelRef<chan_t> dst_px = dst.get_pixel(0, 0);
     for (int y = 0; y < N; ++y) {
         for (int x = 0; x < N; ++x) {
             chan_t ext = init;
             for (int c = 0; c < height; ++c) {
-                chord& ch = se_chords[c];
-                ext = cmp(ext, lookup_table[c][x + ch.x_offset + r][ch.length_index]);
+                ext = cmp(ext, lut_rows[c][x + chord_offsets[c]]);
                 if (ext == lim) break;
             }
             dst_px.write(ext);
@@ -219,6 +229,249 @@ Morpher::morph(bool can_update, PixelBuffer<chan_t>& dst)
 void
 Morpher::initiate(bool can_update, GridVector grid)
 {
+    TRACE_SCOPE("Morpher::initiate");
+    init_from_nine_grid(radius, input, can_update, grid);
+}
+
+/*
+  Pick the half-lengths (a, b) of the orthogonal and diagonal segments
+  whose sum best approximates the circular structuring element of the given
+  radius. The sum is the octagon |x| <= a + 2b, |y| <= a + 2b and
+  |x| + |y| <= 2a + 2b. Its reach along the axes is kept equal to the
+  radius, so the bounding boxes of morphed shapes are the same as with
+  the circle.
+*/
+static std::pair<int, int>
+octagon_segments(int radius)
+{
+    std::pair<int, int> best(radius, 0);
+    int best_diff = -1;
+    for (int b = 0; 2 * b <= radius; ++b) {
+        const int a = radius - 2 * b;
+        int diff = 0;
+        for (int y = 0; y <= radius; ++y) {
+            const int circle_hw = (chord_width(radius, y) - 1) / 2;
+            const int octagon_hw = std::min(radius, 2 * (a + b) - y);
+            diff += abs(circle_hw - octagon_hw);
+        }
+        if (best_diff < 0 || diff < best_diff) {
+            best_diff = diff;
+            best = std::make_pair(a, b);
+        }
+    }
+    return best;
+}
+
+LineMorpher::LineMorpher(int radius)
+    : radius(radius),
+      stride(ScratchBuffer::row_stride<chan_t>(N + 2 * radius)),
+      work_stride(ScratchBuffer::row_stride<chan_t>(3 * (N + 2 * radius))),
+      buffer(
+          sizeof(chan_t) * (N + 2 * radius) *
+          (stride + 2 * work_stride + 2 * 8))
+{
+    std::tie(orth_reach, diag_reach) = octagon_segments(radius);
+
+    const int width = N + 2 * radius;
+    chan_t* mem = buffer.data<chan_t>();
+    for (int i = 0; i < width; ++i, mem += stride) {
+        input_rows.push_back(mem);
+    }
+    input = input_rows.data();
+
+    // The work arrays are read outside of the regions that hold valid
+    // data (in ways that do not affect the valid outputs), so they
+    // are cleared to keep those reads defined.
+    std::fill(mem, mem + 2 * width * work_stride, 0);
+    for (int w = 0; w < 2; ++w) {
+        for (int i = 0; i < width; ++i, mem += work_stride) {
+            work_rows[w].push_back(mem + width);
+        }
+    }
+    prefix = mem;
+    suffix = mem + 8 * width;
+    in_shear.resize(width);
+    out_shear.resize(width);
+}
+
+/*
+  van Herk/Gil-Werman running extremum along the columns of a region:
+
+  out[y][x] = cmp over t in [-k, k] of in[y + t][x]
+
+  for x in [x0, x1) and y in [y0, y1). The rows from y0 - k are split into
+  blocks of 2k + 1. Every window of that size then covers the end of one
+  block and the start of the next, so its extremum is that of a suffix and
+  a prefix of running extrema within the blocks.
+
+  Columns are processed eight at a time with SSE2, in which case the values
+  are offset by 0x8000 to make the signed 16 bit min/max order them as
+  unsigned values.
+*/
+template <op cmp>
+void
+LineMorpher::column_pass(
+    chan_t* const* in, chan_t* const* out, int x0, int x1, int y0, int y1,
+    int k)
+{
+    const int w = 2 * k + 1;
+    const int len = y1 - y0 + 2 * k;
+    chan_t* const* src = in + y0 - k;
+    int x = x0;
+#ifdef __SSE2__
+    const bool dilating = cmp(0, fix15_one) == fix15_one;
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+#define LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+#define STORE(p, v) _mm_storeu_si128((__m128i*)(p), v)
+#define EXT(a, b) (dilating ? _mm_max_epi16(a, b) : _mm_min_epi16(a, b))
+    for (; x + 8 <= x1; x += 8) {
+        __m128i v = bias;
+        for (int i = 0, pos = 0; i < len; ++i, ++pos) {
+            const __m128i p = _mm_xor_si128(LOAD(src[i] + x), bias);
+            if (pos == w) pos = 0;
+            v = pos == 0 ? p : EXT(v, p);
+            STORE(prefix + 8 * i, v);
+        }
+        for (int i = len - 1; i >= 0; --i) {
+            const __m128i p = _mm_xor_si128(LOAD(src[i] + x), bias);
+            v = (i == len - 1 || i % w == w - 1) ? p : EXT(v, p);
+            STORE(suffix + 8 * i, v);
+        }
+        for (int s = 0; s < y1 - y0; ++s) {
+            const __m128i e =
+                EXT(LOAD(suffix + 8 * s), LOAD(prefix + 8 * (s + 2 * k)));
+            STORE(out[y0 + s] + x, _mm_xor_si128(e, bias));
+        }
+    }
+#undef EXT
+#undef STORE
+#undef LOAD
+#endif
+    for (; x < x1; ++x) {
+        chan_t v = 0;
+        for (int i = 0, pos = 0; i < len; ++i, ++pos) {
+            if (pos == w) pos = 0;
+            v = pos == 0 ? src[i][x] : cmp(v, src[i][x]);
+            prefix[i] = v;
+        }
+        for (int i = len - 1; i >= 0; --i) {
+            v = (i == len - 1 || i % w == w - 1) ? src[i][x]
+                                                 : cmp(v, src[i][x]);
+            suffix[i] = v;
+        }
+        for (int s = 0; s < y1 - y0; ++s) {
+            out[y0 + s][x] = cmp(suffix[s], prefix[s + 2 * k]);
+        }
+    }
+}
+
+/*
+  Same as column_pass, but along the rows:
+
+  out[y][x] = cmp over t in [-k, k] of in[y][x + t]
+*/
+template <op cmp>
+void
+LineMorpher::row_pass(
+    chan_t* const* in, chan_t* const* out, int x0, int x1, int y0, int y1,
+    int k)
+{
+    const int w = 2 * k + 1;
+    const int len = x1 - x0 + 2 * k;
+    for (int y = y0; y < y1; ++y) {
+        const chan_t* const src = in[y] + x0 - k;
+        chan_t* const dst = out[y] + x0;
+        chan_t v = 0;
+        for (int i = 0, pos = 0; i < len; ++i, ++pos) {
+            if (pos == w) pos = 0;
+            v = pos == 0 ? src[i] : cmp(v, src[i]);
+            prefix[i] = v;
+        }
+        for (int i = len - 1; i >= 0; --i) {
+            v = (i == len - 1 || i % w == w - 1) ? src[i] : cmp(v, src[i]);
+            suffix[i] = v;
+        }
+        for (int s = 0; s < x1 - x0; ++s) {
+            dst[s] = cmp(suffix[s], prefix[s + 2 * k]);
+        }
+    }
+}
+
+/*
+  Running extremum along the diagonals (dir = 1) or the anti-diagonals
+  (dir = -1) of a region of the work arrays:
+
+  out[y][x] = cmp over t in [-k, k] of in[y + t][x + dir * t]
+
+  Shearing the row pointers turns the diagonals into columns that can be
+  handled by column_pass. The sheared columns covering the region also
+  cover the triangles beside it, which end up in the row padding.
+*/
+template <op cmp>
+void
+LineMorpher::diagonal_pass(
+    chan_t* const* in, chan_t* const* out, int dir, int x0, int x1, int y0,
+    int y1, int k)
+{
+    for (int y = y0 - k; y < y1 + k; ++y) {
+        in_shear[y] = in[y] + dir * y;
+    }
+    for (int y = y0; y < y1; ++y) {
+        out_shear[y] = out[y] + dir * y;
+    }
+    if (dir > 0) {
+        x0 -= y1 - 1;
+        x1 -= y0;
+    } else {
+        x0 += y0;
+        x1 += y1 - 1;
+    }
+    column_pass<cmp>(in_shear.data(), out_shear.data(), x0, x1, y0, y1, k);
+}
+
+template <chan_t lim>
+bool
+LineMorpher::can_skip(PixelBuffer<chan_t> buf)
+{
+    return can_skip_morph<lim>(radius, buf);
+}
+
+/*
+  Morph by the four segments in turn, each pass shrinking the region of
+  valid values towards the output tile in the middle of the input.
+*/
+template <chan_t init, chan_t lim, op cmp>
+void
+LineMorpher::morph(bool, PixelBuffer<chan_t>& dst)
+{
+    TRACE_SCOPE("LineMorpher::morph");
+    const int r = radius;
+    const int a = orth_reach;
+    const int b = diag_reach;
+    chan_t* const* w0 = work_rows[0].data();
+    chan_t* const* w1 = work_rows[1].data();
+
+    column_pass<cmp>(input, w0, r - a - 2 * b, r + N + a + 2 * b,
+                     r - 2 * b, r + N + 2 * b, a);
+    row_pass<cmp>(w0, w1, r - 2 * b, r + N + 2 * b,
+                  r - 2 * b, r + N + 2 * b, a);
+    diagonal_pass<cmp>(w1, w0, 1, r - b, r + N + b, r - b, r + N + b, b);
+    diagonal_pass<cmp>(w0, w1, -1, r, r + N, r, r + N, b);
+
+    PixelRef<chan_t> dst_px = dst.get_pixel(0, 0);
+    for (int y = 0; y < N; ++y) {
+        const chan_t* const row = w1[r + y] + r;
+        for (int x = 0; x < N; ++x) {
+            dst_px.write(row[x]);
+            dst_px.move_x(1);
+        }
+    }
+}
+
+void
+LineMorpher::initiate(bool can_update, GridVector grid)
+{
+    TRACE_SCOPE("LineMorpher::initiate");
     init_from_nine_grid(radius, input, can_update, grid);
 }
 
@@ -229,22 +482,27 @@ Morpher::initiate(bool can_update, GridVector grid)
 
   Returns a pair, where the first item indicates whether the input
   array can be partially updated for the subsequent tile, and the
-  second item is a pointer to the (potentially new) tile resulting
-  from the operation.
+  second item is the constant tile the result is equal to, or nullptr
+  if the result was written to a new tile, added to "morphed".
  */
-template <chan_t init, chan_t lim, op cmp>
+template <typename Bucket, chan_t init, chan_t lim, op cmp>
 static std::pair<bool, PyObject*>
 generic_morph(
-    Morpher& mb, bool update_input, bool update_lut, GridVector input)
+    Bucket& mb, bool update_input, bool update_lut, GridVector input,
+    TileMap& morphed, coord tile_coord)
 {
     // Run a quick check, only run for large radiuses
-    if (mb.can_skip<lim>(input[4])) {
+    if (mb.template can_skip<lim>(input[4])) {
         if (lim == 0)
             return std::make_pair(false, ConstTiles::ALPHA_TRANSPARENT());
         else
             return std::make_pair(false, ConstTiles::ALPHA_OPAQUE());
     }
 
+    // Uniformly constant input, leaving the input array as it was
+    PyObject* uniform = uniform_nine_grid(input);
+    if (uniform) return std::make_pair(false, uniform);
+
     mb.initiate(update_input, input);
 
     // Check the entire input before running an actual
@@ -256,11 +514,11 @@ generic_morph(
     else if (mb.input_fully_opaque())
         return std::make_pair(true, ConstTiles::ALPHA_OPAQUE());
 
-    PixelBuffer<chan_t> dst_buf = new_alpha_tile();
+    PixelBuffer<chan_t> dst_buf = morphed.add_new(tile_coord.x, tile_coord.y);
 
-    mb.morph<init, lim, cmp>(update_lut, dst_buf);
+    mb.template morph<init, lim, cmp>(update_lut, dst_buf);
 
-    return std::make_pair(true, dst_buf.array_ob);
+    return std::make_pair(true, nullptr);
 }
 
 inline chan_t
@@ -275,65 +533,70 @@ min(chan_t a, chan_t b)
     return a < b ? a : b;
 }
 
+template <typename Bucket>
 std::pair<bool, PyObject*>
-dilate(Morpher& mb, bool update_input, bool update_lut, GridVector input)
+dilate(
+    Bucket& mb, bool update_input, bool update_lut, GridVector input,
+    TileMap& morphed, coord tile_coord)
 {
-    return generic_morph<0, fix15_one, max>(
-        mb, update_input, update_lut, input);
+    return generic_morph<Bucket, 0, fix15_one, max>(
+        mb, update_input, update_lut, input, morphed, tile_coord);
 }
 
+template <typename Bucket>
 std::pair<bool, PyObject*>
-erode(Morpher& mb, bool update_input, bool update_lut, GridVector input)
+erode(
+    Bucket& mb, bool update_input, bool update_lut, GridVector input,
+    TileMap& morphed, coord tile_coord)
 {
-    return generic_morph<fix15_one, 0, min>(
-        mb, update_input, update_lut, input);
+    return generic_morph<Bucket, fix15_one, 0, min>(
+        mb, update_input, update_lut, input, morphed, tile_coord);
 }
 
 // Morph a single strand of tiles, storing
-// the output tiles in a Python dictionary "morphed"
+// the output tiles in the tile map "morphed"
+template <typename Bucket>
 void
 morph_strand(
     int offset, // Dilation/erosion radius (+/-)
-    Strand& strand, AtomicDict tiles, Morpher& bucket, AtomicDict morphed,
+    Strand& strand, const TileMap& tiles, Bucket& bucket, TileMap& morphed,
     Controller& status_controller)
 {
-    auto op = offset > 0 ? dilate : erode;
+    auto op = offset > 0 ? dilate<Bucket> : erode<Bucket>;
     bool update_input = false;
     bool update_lut = false;
 
-    PyObject* tile_coord;
+    coord tile_coord;
     while (status_controller.running() && strand.pop(tile_coord)) {
         GridVector grid = nine_grid(tile_coord, tiles);
-        auto result = op(bucket, update_input, update_lut, grid);
+        auto result =
+            op(bucket, update_input, update_lut, grid, morphed, tile_coord);
         update_input = result.first;
 
-        // Add morphed tile unless it is completely transparent
-        bool empty_result = result.second == ConstTiles::ALPHA_TRANSPARENT();
-        bool full_result = result.second == ConstTiles::ALPHA_OPAQUE();
-
         // A constant tile being returned implies no morph was performed,
         // hence the lookup table must be fully populated for the next tile.
-        update_lut = !(empty_result || full_result);
+        update_lut = result.second == nullptr;
+        if (result.second) status_controller.inc_skipped(1);
 
-        // Only add non-transparent tiles to result, and only transfer ownership
-        // for non-constant tiles (don't decref const tiles out of existence)
-        if (!empty_result) morphed.set(tile_coord, result.second, !full_result);
+        // New tiles are already in the result, of the constant
+        // tiles only add the opaque one (skipping transparent tiles)
+        if (result.second == ConstTiles::ALPHA_OPAQUE())
+            morphed.set(tile_coord.x, tile_coord.y, result.second);
     }
 }
 
+template <typename Bucket>
 void
 morph_worker(
-    int offset, StrandQueue& queue, AtomicDict tiles,
-    std::promise<AtomicDict> result, Controller& status_controller)
+    int offset, WorkerStrands& queue, const TileMap& tiles, TileMap& morphed,
+    Controller& status_controller)
 {
-    AtomicDict morphed;
-    Morpher bucket(abs(offset));
+    Bucket bucket(abs(offset));
     Strand strand;
     while (status_controller.running() && queue.pop(strand)) {
         morph_strand(offset, strand, tiles, bucket, morphed, status_controller);
         status_controller.inc_processed(strand.size());
     }
-    result.set_value(morphed);
 }
 
 // Entry point to morphological operations,
@@ -350,9 +613,13 @@ morph(
     }
     const int min_strands_per_worker = 4;
     StrandQueue work_queue (strands);
+    // The cost of the chord-based morph grows with the radius, that of the
+    // line based one does not (but it only approximates the circle).
+    auto worker = abs(offset) < LINE_MORPH_MIN_RADIUS ? morph_worker<Morpher>
+                                                      : morph_worker<LineMorpher>;
     process_strands(
-        morph_worker, offset, min_strands_per_worker, work_queue,
-        AtomicDict(tiles), AtomicDict(morphed), status_controller);
+        worker, offset, min_strands_per_worker, work_queue, tiles, morphed,
+        status_controller);
 }
 
 bool
@@ -366,3 +633,15 @@ Morpher::input_fully_transparent()
 {
     return all_equal_to<chan_t>(input, 2 * radius + N, 0);
 }
+
+bool
+LineMorpher::input_fully_opaque()
+{
+    return all_equal_to<chan_t>(input, 2 * radius + N, fix15_one);
+}
+
+bool
+LineMorpher::input_fully_transparent()
+{
+    return all_equal_to<chan_t>(input, 2 * radius + N, 0);
+}
@@ -38,19 +38,22 @@ typedef chan_t op(chan_t, chan_t);
 
   Circular structuring element data - radius/height/chords
 
-  Lookup table (height x N x unique_chord_lengths) for linear(-ish) morph
+  Lookup table (height x unique_chord_lengths x N) for linear(-ish) morph
 
   Input array (N + radius*2)^2 storing the pixels necessary to perform morph
   for the given radius - rotated/updated whenever possible.
 
   Output array to store morphed alpha values (consider removing/replacing).
+
+  The input array and lookup table live in a single scratch buffer, with
+  cache-aligned rows. Each lookup table row holds the values for every
+  chord length, one after the other, for one y-offset.
 */
 
 class Morpher
 {
   public:
     explicit Morpher(int radius);
-    ~Morpher();
     template <chan_t init, chan_t lim, op cmp>
     void morph(bool can_update, PixelBuffer<chan_t>& dst);
     template <chan_t lim>
@@ -68,7 +71,72 @@ class Morpher
     int height; // structuring element height
     std::vector<chord> se_chords; // structuring element chords
     std::vector<int> se_lengths; // structuring element chord lengths
-    chan_t*** lookup_table; // lookup table for UW algorithm (y-offset, x, type)
+    int stride; // distance between rows, and lookup table types
+    ScratchBuffer buffer; // memory for the input and lookup table
+    std::vector<chan_t*> lut_rows; // lookup table for UW algorithm (y-offset)
+    std::vector<chan_t*> input_rows;
+    chan_t** input; // input 2d array populated by 3x3 input tile grid
+};
+
+/*
+  Alternate engine for large radii, with the same interface as Morpher.
+
+  The circular structuring element is approximated by an octagon: the
+  Minkowski sum of a horizontal, a vertical and two diagonal line segments.
+  Morphing by each of the segments in turn is a one-dimensional running
+  extremum which, using the van Herk/Gil-Werman algorithm, costs a constant
+  three comparisons per pixel regardless of the segment length.
+
+  The segment lengths are picked to minimise the number of pixels by which
+  the octagon differs from the circle used by Morpher, so results of the two
+  engines differ slightly along the edges of the morphed shapes.
+
+  Besides the input array, the scratch buffer holds two work arrays whose
+  rows are padded on both sides, so that the diagonal passes can address
+  them through sheared row pointers.
+*/
+
+// Radius from which morph() uses the LineMorpher instead of the Morpher
+const int LINE_MORPH_MIN_RADIUS = 32;
+
+class LineMorpher
+{
+  public:
+    explicit LineMorpher(int radius);
+    template <chan_t init, chan_t lim, op cmp>
+    void morph(bool can_update, PixelBuffer<chan_t>& dst);
+    template <chan_t lim>
+    bool can_skip(PixelBuffer<chan_t> buf);
+    void initiate(bool can_update, GridVector input);
+    bool input_fully_opaque();
+    bool input_fully_transparent();
+
+  private:
+    template <op cmp>
+    void column_pass(
+        chan_t* const* in, chan_t* const* out, int x0, int x1, int y0, int y1,
+        int k);
+    template <op cmp>
+    void row_pass(
+        chan_t* const* in, chan_t* const* out, int x0, int x1, int y0, int y1,
+        int k);
+    template <op cmp>
+    void diagonal_pass(
+        chan_t* const* in, chan_t* const* out, int dir, int x0, int x1, int y0,
+        int y1, int k);
+
+    int radius;
+    int orth_reach; // half-length of the horizontal and vertical segments
+    int diag_reach; // half-length of the diagonal segments (in pixels)
+    int stride; // distance between input rows
+    int work_stride; // distance between work rows
+    ScratchBuffer buffer; // memory for the input, work and extrema arrays
+    std::vector<chan_t*> input_rows;
+    std::vector<chan_t*> work_rows[2]; // start of the unpadded work rows
+    std::vector<chan_t*> in_shear; // sheared row pointers for diagonal passes
+    std::vector<chan_t*> out_shear;
+    chan_t* prefix; // running extrema, from the starts of windows
+    chan_t* suffix; // running extrema, from the ends of windows
     chan_t** input; // input 2d array populated by 3x3 input tile grid
 };
 
@@ -0,0 +1,587 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "parallel_fill.hpp"
+#include "fill_constants.hpp"
+#include "../tilepool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <unordered_map>
+
+// All pixels of a tile edge
+static const edge_mask FULL_EDGE =
+    N < 64 ? ((edge_mask)1 << (N % 64)) - 1 : ~(edge_mask)0;
+
+// Tile coordinate offsets of the neighbours, indexed by edge
+static const int EDGE_DX[] = {0, 1, 0, -1};
+static const int EDGE_DY[] = {-1, 0, 1, 0};
+enum { EDGE_N, EDGE_E, EDGE_S, EDGE_W };
+
+// Finest mipmap level whose tiles are looked at for constant blocks.
+// Each level adds a lookup for every few tiles of the fill, which
+// blocks of fewer tiles than this rarely pay back.
+static const int MIN_BLOCK_LEVEL = 2;
+
+// Index of the mipmap tile at a level covering tile index t
+static inline int
+block_index(int t, int level)
+{
+    return t >= 0 ? t >> level : ~(~t >> level);
+}
+
+/*
+  Fill state of a single tile of the frontier.
+
+  The pending seeds are merged into the masks by whichever worker
+  fills the neighbouring tile, while the rest of the state is only
+  touched by the worker holding the tile, of which there is at most
+  one at any time: the queued flag is set from when the tile is put
+  in the frontier until it has been processed.
+*/
+struct FrontierTile {
+    FrontierTile(int tx, int ty)
+        : tx(tx), ty(ty), queued(false), final(false), visited(false),
+          src(NULL), dst(NULL)
+    {
+        for (int e = 0; e < 4; ++e) {
+            pending[e].store(0);
+        }
+    }
+    const int tx;
+    const int ty;
+    // Incoming seeds, indexed by the edge they arrive on
+    std::atomic<edge_mask> pending[4];
+    std::atomic<bool> queued;
+    // Set when the tile turned out to be uniform, no more work needed
+    std::atomic<bool> final;
+    bool visited;
+    // Initial in-tile seeds
+    std::vector<coord> seeds;
+    // Owned references, dst may be NULL if nothing was filled
+    PyObject* src;
+    PyObject* dst;
+};
+
+/*
+  A block of tiles below a constant mipmap tile, that the fill reached
+  and filled as a whole
+*/
+struct FilledBlock {
+    int tx, ty; // top left tile
+    int size; // width and height in tiles
+    PyObject* dst; // Owned reference to the shared alpha tile
+};
+
+/*
+  Tile dictionary and frontier shared by the workers of one fill
+*/
+class FrontierFill
+{
+  public:
+    FrontierFill(
+        Filler& filler, PyObject* src_getter, PyObject* empty_src, int min_tx,
+        int min_ty, int max_tx, int max_ty, int min_px, int min_py,
+        int max_px, int max_py, Controller& controller,
+        PyObject* mipmap_getter, int max_level)
+        : filler(filler), src_getter(src_getter), empty_src(empty_src),
+          min_tx(min_tx), min_ty(min_ty), max_tx(max_tx), max_ty(max_ty),
+          min_px(min_px), min_py(min_py), max_px(max_px), max_py(max_py),
+          no_tile_crossing(
+              min_px == 0 && min_py == 0 && max_px == N - 1 &&
+              max_py == N - 1),
+          controller(controller),
+          mipmap_getter(mipmap_getter != Py_None ? mipmap_getter : NULL),
+          max_level(max_level), blocks(std::max(max_level + 1, 0)), busy(0),
+          failed(false), err_type(NULL), err_value(NULL), err_traceback(NULL)
+    {
+    }
+    FrontierFill(FrontierFill&) = delete;
+    // Call with the GIL held
+    ~FrontierFill();
+    // Read the initial seeds and put their tiles in the frontier,
+    // with the GIL held. Returns false on error.
+    bool seed(PyObject* seed_lists);
+    // Process frontier tiles until the fill is done or cancelled
+    void work();
+    // Build the dictionary of filled tiles, with the GIL held.
+    // Returns NULL and restores the exception if any worker failed.
+    PyObject* result();
+
+  private:
+    FrontierTile* tile(int tx, int ty);
+    void push(FrontierTile* t);
+    // Pass seeds to the tile at (tx, ty), arriving on the given edge
+    void send(int tx, int ty, int edge, edge_mask seeds);
+    void process(FrontierTile& t);
+    bool first_visit(
+        FrontierTile& t, const edge_mask in[4], edge_mask out[4]);
+    // Handle a tile lying in a constant block, returns false otherwise
+    bool visit_block(FrontierTile& t);
+    // Fill alpha of the constant mipmap tile mx, my of a level, or -1 if
+    // it is not constant. first is set for the one caller to be told
+    // first of a fillable block, which is then to fill it.
+    int block_alpha(int level, int mx, int my, bool& first);
+    void fill_block(int level, int mx, int my, chan_t alpha);
+    bool running() { return controller.running() && !failed; }
+
+    // Whether all tiles of the block are inside and none crossing
+    bool block_inside(int level, int mx, int my)
+    {
+        const int size = 1 << level;
+        const int x0 = mx * size, y0 = my * size;
+        return x0 >= min_tx + (min_px != 0) && y0 >= min_ty + (min_py != 0) &&
+               x0 + size - 1 <= max_tx - (max_px != N - 1) &&
+               y0 + size - 1 <= max_ty - (max_py != N - 1);
+    }
+
+    // Same as the methods of lib.fill_common.TileBoundingBox
+    bool outside(int tx, int ty)
+    {
+        return tx < min_tx || tx > max_tx || ty < min_ty || ty > max_ty;
+    }
+    bool crossing(int tx, int ty)
+    {
+        return !no_tile_crossing &&
+               ((tx == min_tx && min_px != 0) ||
+                (ty == min_ty && min_py != 0) ||
+                (tx == max_tx && max_px != (N - 1)) ||
+                (ty == max_ty && max_py != (N - 1)));
+    }
+
+    // Fill alpha of a uniform source tile, or -1 if it is not uniform
+    int uniform_alpha(PyObject* src);
+    // New reference to a uniform alpha tile, call with the GIL held
+    PyObject* uniform_tile(chan_t alpha);
+    // Store the current exception, call with the GIL held
+    void fail();
+
+    const Filler& filler;
+    PyObject* src_getter;
+    PyObject* empty_src;
+    const int min_tx, min_ty, max_tx, max_ty;
+    const int min_px, min_py, max_px, max_py;
+    const bool no_tile_crossing;
+    Controller& controller;
+    PyObject* mipmap_getter;
+    const int max_level;
+
+    struct BlockState {
+        int alpha;
+        bool filled;
+    };
+    // Mipmap tiles looked at so far, by level and coordinate
+    std::vector<std::unordered_map<uint64_t, BlockState>> blocks;
+    std::vector<FilledBlock> filled_blocks;
+    std::mutex blocks_mutex;
+
+    std::unordered_map<uint64_t, std::unique_ptr<FrontierTile>> tiles;
+    std::mutex tiles_mutex;
+
+    std::deque<FrontierTile*> frontier;
+    std::mutex frontier_mutex;
+    std::condition_variable frontier_cond;
+    // Number of workers currently processing a tile
+    int busy;
+
+    // Only accessed with the GIL held
+    std::map<chan_t, PyObject*> uniform_tiles;
+
+    std::atomic<bool> failed;
+    PyObject* err_type;
+    PyObject* err_value;
+    PyObject* err_traceback;
+};
+
+FrontierFill::~FrontierFill()
+{
+    for (auto& item : tiles) {
+        Py_XDECREF(item.second->src);
+        Py_XDECREF(item.second->dst);
+    }
+    for (auto& item : uniform_tiles) {
+        Py_DECREF(item.second);
+    }
+    for (auto& block : filled_blocks) {
+        Py_DECREF(block.dst);
+    }
+    Py_XDECREF(err_type);
+    Py_XDECREF(err_value);
+    Py_XDECREF(err_traceback);
+}
+
+static inline uint64_t
+tile_key(int tx, int ty)
+{
+    return ((uint64_t)(uint32_t)tx << 32) | (uint32_t)ty;
+}
+
+FrontierTile*
+FrontierFill::tile(int tx, int ty)
+{
+    const uint64_t key = tile_key(tx, ty);
+    std::lock_guard<std::mutex> guard(tiles_mutex);
+    std::unique_ptr<FrontierTile>& t = tiles[key];
+    if (!t) t.reset(new FrontierTile(tx, ty));
+    return t.get();
+}
+
+void
+FrontierFill::push(FrontierTile* t)
+{
+    if (t->queued.exchange(true)) return;
+    {
+        std::lock_guard<std::mutex> guard(frontier_mutex);
+        frontier.push_back(t);
+    }
+    frontier_cond.notify_one();
+}
+
+void
+FrontierFill::send(int tx, int ty, int edge, edge_mask seeds)
+{
+    if (outside(tx, ty)) return;
+    FrontierTile* adj = tile(tx, ty);
+    if (adj->final) return;
+    adj->pending[edge].fetch_or(seeds);
+    push(adj);
+}
+
+bool
+FrontierFill::seed(PyObject* seed_lists)
+{
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(seed_lists, &pos, &key, &value)) {
+        int tx, ty;
+        if (!PyArg_ParseTuple(key, "ii", &tx, &ty)) return false;
+        FrontierTile* t = tile(tx, ty);
+        Py_ssize_t num_seeds = PySequence_Size(value);
+        if (num_seeds < 0) return false;
+        for (Py_ssize_t i = 0; i < num_seeds; ++i) {
+            PyObject* seed_tuple = PySequence_GetItem(value, i);
+            int x, y;
+            bool valid = seed_tuple && PyArg_ParseTuple(seed_tuple, "ii", &x, &y);
+            Py_XDECREF(seed_tuple);
+            if (!valid) return false;
+            t->seeds.push_back(coord(x, y));
+        }
+        push(t);
+    }
+    return true;
+}
+
+void
+FrontierFill::work()
+{
+    std::unique_lock<std::mutex> lock(frontier_mutex);
+    while (true) {
+        frontier_cond.wait(lock, [this] {
+            return !frontier.empty() || busy == 0 || !running();
+        });
+        if (frontier.empty() || !running()) break;
+        FrontierTile* t = frontier.front();
+        frontier.pop_front();
+        ++busy;
+        lock.unlock();
+
+        process(*t);
+        // Seeds may have arrived since processing started,
+        // without the tile being put back in the frontier
+        t->queued.store(false);
+        for (int e = 0; e < 4; ++e) {
+            if (t->pending[e].load() && !t->final) {
+                push(t);
+                break;
+            }
+        }
+
+        lock.lock();
+        if (--busy == 0) frontier_cond.notify_all();
+    }
+    // Let the other workers see that there is nothing left to do
+    frontier_cond.notify_all();
+}
+
+void
+FrontierFill::process(FrontierTile& t)
+{
+    edge_mask in[4];
+    for (int e = 0; e < 4; ++e) {
+        in[e] = t.pending[e].exchange(0);
+    }
+    if (t.final) return;
+
+    edge_mask out[4] = {0, 0, 0, 0};
+    if (!t.visited) {
+        t.visited = true;
+        controller.inc_processed(1);
+        if (!first_visit(t, in, out)) return;
+    }
+
+    if (!t.final) {
+        PixelBuffer<rgba> src(t.src);
+        PixelBuffer<chan_t> dst(t.dst);
+        const bool crosses = crossing(t.tx, t.ty);
+        filler.fill(
+            src, dst, t.seeds, in, out,
+            crosses && t.tx == min_tx ? min_px : 0,
+            crosses && t.ty == min_ty ? min_py : 0,
+            crosses && t.tx == max_tx ? max_px : N - 1,
+            crosses && t.ty == max_ty ? max_py : N - 1);
+        t.seeds.clear();
+    }
+
+    // Merge the overflows into the seeds of the neighbours
+    for (int e = 0; e < 4; ++e) {
+        if (!out[e]) continue;
+        send(t.tx + EDGE_DX[e], t.ty + EDGE_DY[e], (e + 2) % 4, out[e]);
+    }
+}
+
+/*
+  Fetch the source tile and create the output tile, handling
+  uniform tiles directly, like lib.floodfill._TileFillSkipper.
+  Overflows from uniform tiles cover their entire edges, except
+  for the seeds that came in on them.
+*/
+bool
+FrontierFill::first_visit(
+    FrontierTile& t, const edge_mask in[4], edge_mask out[4])
+{
+    if (mipmap_getter && visit_block(t)) return true;
+    if (!running()) return false;
+
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    t.src = PyObject_CallFunction(src_getter, "ii", t.tx, t.ty);
+    if (t.src && !PyArray_Check(t.src)) {
+        PyErr_SetString(PyExc_TypeError, "source tiles must be arrays");
+        Py_CLEAR(t.src);
+    }
+    if (!t.src) fail();
+    PyGILState_Release(gstate);
+    if (!t.src) return false;
+
+    const int alpha = crossing(t.tx, t.ty) ? -1 : uniform_alpha(t.src);
+    if (alpha == 0) {
+        t.final = true;
+        return true;
+    }
+
+    gstate = PyGILState_Ensure();
+    if (alpha < 0) {
+        t.dst = tile_pool_new(TilePoolAlpha16);
+    } else if (alpha == fix15_one) {
+        t.dst = ConstTiles::ALPHA_OPAQUE();
+        Py_INCREF(t.dst);
+    } else {
+        t.dst = uniform_tile(alpha);
+    }
+    PyGILState_Release(gstate);
+
+    if (alpha > 0) {
+        t.final = true;
+        for (int e = 0; e < 4; ++e) {
+            out[e] = FULL_EDGE & ~in[e];
+        }
+    }
+    return true;
+}
+
+/*
+  Look for the coarsest constant mipmap tile above the tile. A block
+  that can't be filled is like a tile that can't be filled: nothing
+  is done with any of its tiles. The first tile of a fillable block
+  to be reached fills all of it, the other tiles reached later are
+  already done.
+*/
+bool
+FrontierFill::visit_block(FrontierTile& t)
+{
+    for (int level = max_level; level >= MIN_BLOCK_LEVEL; --level) {
+        const int mx = block_index(t.tx, level);
+        const int my = block_index(t.ty, level);
+        if (!block_inside(level, mx, my)) continue;
+        bool first = false;
+        const int alpha = block_alpha(level, mx, my, first);
+        if (alpha < 0) continue;
+        t.final = true;
+        if (first) fill_block(level, mx, my, alpha);
+        return true;
+    }
+    return false;
+}
+
+int
+FrontierFill::block_alpha(int level, int mx, int my, bool& first)
+{
+    const uint64_t key = tile_key(mx, my);
+    {
+        std::lock_guard<std::mutex> guard(blocks_mutex);
+        auto it = blocks[level].find(key);
+        if (it != blocks[level].end()) {
+            BlockState& state = it->second;
+            if (state.alpha > 0 && !state.filled) state.filled = first = true;
+            return state.alpha;
+        }
+    }
+
+    // Look the mipmap tile up without keeping the other workers waiting
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    PyObject* src =
+        PyObject_CallFunction(mipmap_getter, "iii", level, mx, my);
+    if (src && src != Py_None && !PyArray_Check(src)) {
+        PyErr_SetString(PyExc_TypeError, "mipmap tiles must be arrays");
+        Py_CLEAR(src);
+    }
+    if (!src) fail();
+    PyGILState_Release(gstate);
+    const int alpha = (src && src != Py_None) ? uniform_alpha(src) : -1;
+    if (src) {
+        gstate = PyGILState_Ensure();
+        Py_DECREF(src);
+        PyGILState_Release(gstate);
+    }
+
+    std::lock_guard<std::mutex> guard(blocks_mutex);
+    BlockState& state =
+        blocks[level].emplace(key, BlockState{alpha, false}).first->second;
+    if (state.alpha > 0 && !state.filled) state.filled = first = true;
+    return state.alpha;
+}
+
+/*
+  Fill all tiles of the block, and overflow along its edges like the
+  uniform tiles of its perimeter would have.
+*/
+void
+FrontierFill::fill_block(int level, int mx, int my, chan_t alpha)
+{
+    const int size = 1 << level;
+    const int x0 = mx * size, y0 = my * size;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    PyObject* dst;
+    if (alpha == fix15_one) {
+        dst = ConstTiles::ALPHA_OPAQUE();
+        Py_INCREF(dst);
+    } else {
+        dst = uniform_tile(alpha);
+    }
+    PyGILState_Release(gstate);
+    {
+        std::lock_guard<std::mutex> guard(blocks_mutex);
+        filled_blocks.push_back(FilledBlock{x0, y0, size, dst});
+    }
+    // The tile that was reached has been counted already
+    controller.inc_processed(size * size - 1);
+
+    for (int i = 0; i < size; ++i) {
+        send(x0 + i, y0 - 1, EDGE_S, FULL_EDGE);
+        send(x0 + size, y0 + i, EDGE_W, FULL_EDGE);
+        send(x0 + i, y0 + size, EDGE_N, FULL_EDGE);
+        send(x0 - 1, y0 + i, EDGE_E, FULL_EDGE);
+    }
+}
+
+int
+FrontierFill::uniform_alpha(PyObject* src)
+{
+    if (src == empty_src) {
+        return filler.pixel_fill_alpha(rgba((chan_t)0, 0, 0, 0));
+    }
+    PixelBuffer<rgba> buf(src);
+    if (buf.is_uniform()) {
+        return filler.pixel_fill_alpha(buf(0, 0));
+    }
+    return -1;
+}
+
+PyObject*
+FrontierFill::uniform_tile(chan_t alpha)
+{
+    PyObject*& tile = uniform_tiles[alpha];
+    if (!tile) {
+        tile = tile_pool_new(TilePoolAlpha16, false);
+        PixelRef<chan_t> px = PixelBuffer<chan_t>(tile).get_pixel(0, 0);
+        for (int i = 0; i < N * N; ++i, px.move_x(1)) {
+            px.write(alpha);
+        }
+    }
+    Py_INCREF(tile);
+    return tile;
+}
+
+void
+FrontierFill::fail()
+{
+    if (err_type) {
+        PyErr_Clear();
+    } else {
+        PyErr_Fetch(&err_type, &err_value, &err_traceback);
+    }
+    failed = true;
+}
+
+PyObject*
+FrontierFill::result()
+{
+    if (failed) {
+        PyErr_Restore(err_type, err_value, err_traceback);
+        err_type = err_value = err_traceback = NULL;
+        return NULL;
+    }
+    PyObject* filled = PyDict_New();
+    for (auto& block : filled_blocks) {
+        for (int y = 0; y < block.size; ++y) {
+            for (int x = 0; x < block.size; ++x) {
+                PyObject* key =
+                    Py_BuildValue("ii", block.tx + x, block.ty + y);
+                PyDict_SetItem(filled, key, block.dst);
+                Py_DECREF(key);
+            }
+        }
+    }
+    for (auto& item : tiles) {
+        FrontierTile& t = *item.second;
+        if (!t.dst) continue;
+        PyObject* key = Py_BuildValue("ii", t.tx, t.ty);
+        PyDict_SetItem(filled, key, t.dst);
+        Py_DECREF(key);
+    }
+    return filled;
+}
+
+PyObject*
+parallel_fill(
+    Filler& filler, PyObject* src_getter, PyObject* empty_src,
+    PyObject* seed_lists, int min_tx, int min_ty, int max_tx, int max_ty,
+    int min_px, int min_py, int max_px, int max_py,
+    Controller& status_controller, PyObject* mipmap_getter, int max_level)
+{
+    FrontierFill fill(
+        filler, src_getter, empty_src, min_tx, min_ty, max_tx, max_ty,
+        min_px, min_py, max_px, max_py, status_controller, mipmap_getter,
+        max_level);
+    if (!fill.seed(seed_lists)) return NULL;
+
+    PyEval_InitThreads();
+
+    // Release the lock to let the workers work
+    Py_BEGIN_ALLOW_THREADS
+
+    FillWorkerPool& pool = FillWorkerPool::instance();
+    pool.run(pool.size(), [&fill](int) { fill.work(); });
+
+    // Reclaim the lock before returning
+    Py_END_ALLOW_THREADS
+
+    return fill.result();
+}
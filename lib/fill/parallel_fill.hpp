@@ -0,0 +1,55 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef PARALLEL_FILL_HPP
+#define PARALLEL_FILL_HPP
+
+#include "fill_common.hpp"
+#include "floodfill.hpp"
+
+/*
+  Run a complete scanline fill, keeping the frontier of tiles
+  to process on the C++ side and filling independent tiles
+  concurrently on the FillWorkerPool.
+
+  The source tile for a coordinate is retrieved by calling
+  src_getter(tx, ty), which must return an NxNx4 uint16 array;
+  if the returned array is empty_src, it is treated as empty.
+  Seeds are given as a dictionary of tile coordinates to lists
+  of in-tile (x, y) pixel coordinates, and the tile/pixel bounds
+  correspond to those of a lib.fill_common.TileBoundingBox.
+
+  If a mipmap_getter is given (not None), the fill is run coarse to
+  fine: when a tile is first reached, mipmap_getter(level, mx, my)
+  is asked for the mipmap tiles covering it, from max_level down to
+  the finest level still worth the lookup. It must return a source
+  tile only if every source tile in the 2**level square block below
+  the mipmap tile is that same constant tile, and None otherwise.
+  The first such block found is filled as a whole with one shared
+  uniform alpha tile, seeds being passed on only along its edges,
+  and none of its tiles are fetched or scanned. The result is the
+  same as that of filling the tiles one by one.
+
+  Returns a dictionary of coordinate->alpha tile mappings
+  for the tiles reached by the fill, or NULL with an exception
+  set if src_getter or mipmap_getter fails.
+*/
+PyObject* parallel_fill(
+    Filler& filler, // Threshold test, never modified by the fill
+    PyObject* src_getter, // Callable (tx, ty) -> source tile
+    PyObject* empty_src, // The special transparent source tile
+    PyObject* seed_lists, // {(tx, ty): [(x, y), ...], ...}
+    int min_tx, int min_ty, int max_tx, int max_ty, // Tile bounds
+    int min_px, int min_py, int max_px, int max_py, // Pixel bounds
+    Controller& status_controller, // cancellation and status data
+    PyObject* mipmap_getter, // Callable (level, mx, my) -> tile, or None
+    int max_level // Coarsest mipmap level to look at
+    );
+
+#endif //PARALLEL_FILL_HPP
@@ -0,0 +1,184 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "tile_occupancy.hpp"
+#include "fill_constants.hpp"
+
+#include <algorithm>
+#include <climits>
+
+static const int WORD_BITS = 64;
+
+static inline int
+word_index(int y)
+{
+    return y >> 6; // rounds towards negative infinity
+}
+
+static inline int
+lowest_bit(uint64_t w)
+{
+    return __builtin_ctzll(w);
+}
+
+static inline int
+highest_bit(uint64_t w)
+{
+    return WORD_BITS - 1 - __builtin_clzll(w);
+}
+
+static void
+set_item(PyObject* dict, int x, int y, PyObject* tile)
+{
+    PyObject* key = Py_BuildValue("ii", x, y);
+    PyDict_SetItem(dict, key, tile);
+    Py_DECREF(key);
+}
+
+TileOccupancy::TileOccupancy(PyObject* tiles) : count(0)
+{
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(tiles, &pos, &key, &value)) {
+        int x, y;
+        if (!PyArg_ParseTuple(key, "ii", &x, &y)) continue;
+        set(occupied, x, y);
+        if (value == ConstTiles::ALPHA_OPAQUE()) set(full, x, y);
+        count++;
+    }
+    PyErr_Clear();
+}
+
+void
+TileOccupancy::set(Columns& columns, int x, int y)
+{
+    columns[x][word_index(y)] |= Word(1) << (y & (WORD_BITS - 1));
+}
+
+TileOccupancy::Word
+TileOccupancy::get(const Columns& columns, int x, int i)
+{
+    auto column = columns.find(x);
+    if (column == columns.end()) return 0;
+    auto word = column->second.find(i);
+    return word == column->second.end() ? 0 : word->second;
+}
+
+// Rows of column x that are set, or have a set row above or below them
+TileOccupancy::Word
+TileOccupancy::spread(const Columns& columns, int x, int i)
+{
+    const Word w = get(columns, x, i);
+    const Word above = (w << 1) | (get(columns, x, i - 1) >> (WORD_BITS - 1));
+    const Word below = (w >> 1) | (get(columns, x, i + 1) << (WORD_BITS - 1));
+    return w | above | below;
+}
+
+// Rows of column x that are set, as are the rows above and below them
+TileOccupancy::Word
+TileOccupancy::core(const Columns& columns, int x, int i)
+{
+    const Word w = get(columns, x, i);
+    if (!w) return 0;
+    const Word above = (w << 1) | (get(columns, x, i - 1) >> (WORD_BITS - 1));
+    const Word below = (w >> 1) | (get(columns, x, i + 1) << (WORD_BITS - 1));
+    return w & above & below;
+}
+
+void
+TileOccupancy::complement_adjacent(PyObject* tiles)
+{
+    // Collect first, so that added words don't spread any further
+    Columns added;
+    for (const auto& column : occupied) {
+        const int x = column.first;
+        for (const auto& word : column.second) {
+            for (int ax = x - 1; ax <= x + 1; ++ax) {
+                for (int ai = word.first - 1; ai <= word.first + 1; ++ai) {
+                    const Word dilated = spread(occupied, ax - 1, ai) |
+                                         spread(occupied, ax, ai) |
+                                         spread(occupied, ax + 1, ai);
+                    const Word missing = dilated & ~get(occupied, ax, ai);
+                    if (missing) added[ax][ai] |= missing;
+                }
+            }
+        }
+    }
+    PyObject* empty = ConstTiles::ALPHA_TRANSPARENT();
+    for (const auto& column : added) {
+        const int x = column.first;
+        for (const auto& word : column.second) {
+            occupied[x][word.first] |= word.second;
+            for (Word bits = word.second; bits; bits &= bits - 1) {
+                const int y = word.first * WORD_BITS + lowest_bit(bits);
+                set_item(tiles, x, y, empty);
+                count++;
+            }
+        }
+    }
+}
+
+PyObject*
+TileOccupancy::strands(bool dilating, PyObject* final_tiles)
+{
+    PyObject* result = PyList_New(0);
+    PyObject* strand = nullptr;
+    int prev_x = 0, prev_y = 0;
+    for (const auto& column : occupied) {
+        const int x = column.first;
+        for (const auto& word : column.second) {
+            const int i = word.first;
+            Word done = get(full, x, i);
+            if (done && !dilating) {
+                done &= core(full, x - 1, i) & core(full, x, i) &
+                        core(full, x + 1, i);
+            }
+            for (Word bits = word.second; bits; bits &= bits - 1) {
+                const int b = lowest_bit(bits);
+                const int y = i * WORD_BITS + b;
+                if (done & (Word(1) << b)) {
+                    set_item(final_tiles, x, y, ConstTiles::ALPHA_OPAQUE());
+                    strand = nullptr;
+                    continue;
+                }
+                if (!strand || prev_x != x || prev_y + 1 != y) {
+                    strand = PyList_New(0);
+                    PyList_Append(result, strand);
+                    Py_DECREF(strand);
+                }
+                PyObject* key = Py_BuildValue("ii", x, y);
+                PyList_Append(strand, key);
+                Py_DECREF(key);
+                prev_x = x;
+                prev_y = y;
+            }
+        }
+    }
+    return result;
+}
+
+PyObject*
+TileOccupancy::bbox()
+{
+    if (occupied.empty()) Py_RETURN_NONE;
+    int min_y = INT_MAX;
+    int max_y = INT_MIN;
+    for (const auto& column : occupied) {
+        const auto& top = *column.second.begin();
+        const auto& bottom = *column.second.rbegin();
+        const int y0 = top.first * WORD_BITS + lowest_bit(top.second);
+        const int y1 = bottom.first * WORD_BITS + highest_bit(bottom.second);
+        min_y = std::min(min_y, y0);
+        max_y = std::max(max_y, y1);
+    }
+    return Py_BuildValue(
+        "iiii", occupied.begin()->first, min_y, occupied.rbegin()->first,
+        max_y);
+}
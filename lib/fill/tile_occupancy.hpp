@@ -0,0 +1,82 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TILE_OCCUPANCY_HPP
+#define TILE_OCCUPANCY_HPP
+
+#include "fill_common.hpp"
+
+#ifndef SWIG
+#include <map>
+#include <stdint.h>
+#endif
+
+/*
+  Sparse occupancy bitmap of the coordinates of a dictionary of alpha
+  tiles, with a second bitmap marking which of them are the constant
+  opaque tile.
+
+  Each column of tiles is stored as a map of 64-row words, so walking the
+  coordinates by column, top to bottom, gives them in the order of
+  sorted(tiles), and neighbourhood tests are done a word at a time.
+
+  This is the native replacement for building the strands of the morph
+  and blur stages in Python (see lib.morphology). All methods must be
+  called with the GIL held.
+*/
+class TileOccupancy
+{
+  public:
+    // Read the coordinates of a dictionary of alpha tiles
+    explicit TileOccupancy(PyObject* tiles);
+
+    /*
+      Add the transparent tile to the dictionary for each coordinate
+      adjoining one of its tiles (in all eight directions) that is not
+      in it already, so that every tile has a full neighbourhood.
+      The new coordinates are added to the bitmap as well.
+    */
+    void complement_adjacent(PyObject* tiles);
+
+    /*
+      Partition the tiles the way lib.morphology.strand_partition does:
+      fully opaque tiles needing no further processing are added to
+      final_tiles, and the others are returned as a list of strands,
+      lists of vertically contiguous coordinates ordered top to bottom.
+
+      Opaque tiles need no processing when all of their neighbours are
+      opaque as well, or when dilating.
+    */
+    PyObject* strands(bool dilating, PyObject* final_tiles);
+
+    // The (min_tx, min_ty, max_tx, max_ty) bounds of the tiles, or None
+    PyObject* bbox();
+
+    // Get the number of coordinates in the set
+    int size() { return count; }
+
+#ifndef SWIG
+  private:
+    typedef uint64_t Word;
+    // Words of a column by row index (ty >> 6); zero words are not kept
+    typedef std::map<int, Word> Column;
+    typedef std::map<int, Column> Columns;
+
+    static void set(Columns& columns, int x, int y);
+    static Word get(const Columns& columns, int x, int i);
+    static Word spread(const Columns& columns, int x, int i);
+    static Word core(const Columns& columns, int x, int i);
+
+    Columns occupied;
+    Columns full;
+    int count;
+#endif /* #ifndef SWIG */
+};
+
+#endif //TILE_OCCUPANCY_HPP
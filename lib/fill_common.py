@@ -30,9 +30,19 @@ _EMPTY_TILE = lib.mypaintlib.ConstTiles.ALPHA_TRANSPARENT()
 _EMPTY_TILE.flags.writeable = False
 
 
+def new_alpha_tile(zeroed=True):
+    """Return a new NxN uint16 tile from the tile pool"""
+    return lib.mypaintlib.tile_pool_new(
+        lib.mypaintlib.TilePoolAlpha16, zeroed,
+    )
+
+
 def new_full_tile(value, dimensions=(N, N), value_type='uint16'):
     """Return a new tile filled with the given value"""
-    tile = numpy.empty(dimensions, value_type)
+    if dimensions == (N, N) and value_type == 'uint16':
+        tile = new_alpha_tile(zeroed=False)
+    else:
+        tile = numpy.empty(dimensions, value_type)
     tile.fill(value)
     return tile
 
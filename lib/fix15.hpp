@@ -77,6 +77,44 @@ fix15_div (const fix15_t a, const fix15_t b)
 }
 
 
+/* Branch-free building blocks
+
+These have overloads of the same names for the vector type defined in
+fix15xN.hpp, so that code templated on the arithmetic type can be
+instantiated both for fix15_t and for several pixels' channels at once.
+Templated code should compute both alternatives and pick one with
+fix15_select(), rather than branch on a comparison.
+*/
+
+// a if m is true, otherwise b.
+static inline fix15_t
+fix15_select (const bool m, const fix15_t a, const fix15_t b)
+{
+    return m ? a : b;
+}
+
+static inline fix15_t
+fix15_min (const fix15_t a, const fix15_t b)
+{
+    return (a < b) ? a : b;
+}
+
+static inline fix15_t
+fix15_max (const fix15_t a, const fix15_t b)
+{
+    return (a > b) ? a : b;
+}
+
+// fix15_short_clamp(fix15_div(a, b)), for operands of up to 16 bits. The
+// quotient is only calculated when it is below fix15_one, so an unused
+// result with b == 0 is harmless.
+static inline fix15_t
+fix15_div_clamp (const fix15_t a, const fix15_t b)
+{
+    return (a >= b) ? fix15_one : fix15_div(a, b);
+}
+
+
 /* int15_sqrt:
 
 Square root using the http://en.wikipedia.org/wiki/Babylonian_method . For
@@ -0,0 +1,151 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+// A vector of fix15_t, with the same arithmetic as fix15.hpp.
+//
+// This file is included once per instruction set by compositing_simd.cpp,
+// inside a namespace which defines SIMD_TARGET, the vector type "vec" and
+// the lane operations listed in compositing_simd_kernels.hpp. There is
+// deliberately no include guard.
+//
+// Each lane is one fix15_t, and every function below does to each lane what
+// its namesake in fix15.hpp does to a single value, bit for bit. This lets
+// code templated on its arithmetic type, like the process_channel() members
+// of the blend functors in blending.hpp, be instantiated for fix15xN as well
+// as for fix15_t: argument-dependent lookup picks these overloads from the
+// instruction set's namespace. Such code must be written without branches,
+// using fix15_select() where the scalar code would use an if statement.
+//
+// Comparisons are signed, and are only exact for lanes below 2**31, which
+// holds for any meaningful fix15 value.
+
+
+// Result of a lane-wise comparison: all bits set in lanes where it holds
+
+struct fix15xN_mask
+{
+    vec m;
+
+    SIMD_TARGET explicit fix15xN_mask (const vec &m_) : m(m_) {}
+};
+
+
+struct fix15xN
+{
+    vec v;
+
+    SIMD_TARGET fix15xN () {}
+    SIMD_TARGET explicit fix15xN (const vec &v_) : v(v_) {}
+
+    // Constants are broadcast, so "x - fix15_one" works as for fix15_t.
+    SIMD_TARGET fix15xN (const fix15_t n) : v(set1(n)) {}
+};
+
+
+/* Arithmetic, wrapping like uint32_t */
+
+static inline SIMD_TARGET fix15xN
+operator+ (const fix15xN &a, const fix15xN &b)
+{
+    return fix15xN(add(a.v, b.v));
+}
+
+static inline SIMD_TARGET fix15xN
+operator- (const fix15xN &a, const fix15xN &b)
+{
+    return fix15xN(sub(a.v, b.v));
+}
+
+static inline SIMD_TARGET fix15xN
+fix15_mul (const fix15xN &a, const fix15xN &b)
+{
+    return fix15xN(shr15(mul(a.v, b.v)));
+}
+
+static inline SIMD_TARGET fix15xN
+fix15_sumprods (const fix15xN &a1, const fix15xN &a2,
+                const fix15xN &b1, const fix15xN &b2)
+{
+    return fix15xN(shr15(add(mul(a1.v, a2.v), mul(b1.v, b2.v))));
+}
+
+static inline SIMD_TARGET fix15xN
+fix15_double (const fix15xN &n)
+{
+    return fix15xN(add(n.v, n.v));
+}
+
+static inline SIMD_TARGET fix15xN
+fix15_short_clamp (const fix15xN &n)
+{
+    return fix15xN(min_u(n.v, set1(fix15_one)));
+}
+
+static inline SIMD_TARGET fix15xN
+fix15_div_clamp (const fix15xN &a, const fix15xN &b)
+{
+    return fix15xN(div_clamp(a.v, b.v));
+}
+
+static inline SIMD_TARGET fix15xN
+fix15_min (const fix15xN &a, const fix15xN &b)
+{
+    return fix15xN(min_u(a.v, b.v));
+}
+
+static inline SIMD_TARGET fix15xN
+fix15_max (const fix15xN &a, const fix15xN &b)
+{
+    return fix15xN(max_u(a.v, b.v));
+}
+
+
+/* Comparisons and selection */
+
+static inline SIMD_TARGET fix15xN_mask
+operator> (const fix15xN &a, const fix15xN &b)
+{
+    return fix15xN_mask(gt(a.v, b.v));
+}
+
+static inline SIMD_TARGET fix15xN_mask
+operator< (const fix15xN &a, const fix15xN &b)
+{
+    return fix15xN_mask(gt(b.v, a.v));
+}
+
+static inline SIMD_TARGET fix15xN_mask
+operator== (const fix15xN &a, const fix15xN &b)
+{
+    return fix15xN_mask(eq(a.v, b.v));
+}
+
+static inline SIMD_TARGET fix15xN_mask
+operator! (const fix15xN_mask &m)
+{
+    return fix15xN_mask(eq(m.m, set1(0)));
+}
+
+static inline SIMD_TARGET fix15xN_mask
+operator<= (const fix15xN &a, const fix15xN &b)
+{
+    return !(a > b);
+}
+
+static inline SIMD_TARGET fix15xN_mask
+operator>= (const fix15xN &a, const fix15xN &b)
+{
+    return !(a < b);
+}
+
+static inline SIMD_TARGET fix15xN
+fix15_select (const fix15xN_mask &m, const fix15xN &a, const fix15xN &b)
+{
+    return fix15xN(select(m.m, a.v, b.v));
+}
@@ -12,6 +12,7 @@ import logging
 
 import numpy as np
 import threading
+import weakref
 
 from gi.repository import GLib
 
@@ -39,8 +40,15 @@ _EMPTY_RGBA = None
 _GAPLESS_TILE = fc.new_full_tile(INF_DIST)
 _GAPLESS_TILE.flags.writeable = False
 
+# Number of queued combine operations run in each tile_combine_many() call
+# when compositing fill results. Bounds the memory held by queued src tiles.
+_COMPOSITE_BATCH_SIZE = 256
+
 EDGE = myplib.edges
 
+# Edge mask of seeds for all pixels of a tile edge, see Filler.fill()
+_FULL_EDGE = (1 << N) - 1
+
 
 class GapClosingOptions:
     """Container of parameters for gap closing fill operations
@@ -59,8 +67,9 @@ def enqueue_overflows(queue, tile_coord, seeds, tiles_bbox, *p):
     :type queue: list
     :param tile_coord: the 2d coordinate in the middle of the seed coordinates
     :type tile_coord: (int, int)
-    :param seeds: 4-tuple of seed lists for n, e, s, w, relative to tile_coord
-    :type seeds: (list, list, list, list)
+    :param seeds: 4-tuple of seeds for n, e, s, w, relative to tile_coord;
+        edge masks or gap closing edge seeds, which are false when empty
+    :type seeds: tuple
     :param tiles_bbox: the bounding box of the fill operation
     :type tiles_bbox: lib.fill_common.TileBoundingBox
     :param p: tuples of length >= 4, items added to queue items w. same index
@@ -144,6 +153,8 @@ class FillHandler:
         # Separate "keep running" flag checked in Python code
         self.run = True
         self.stage = None
+        # Figures for each finished stage, see set_stage()
+        self.stats = []
         self.set_stage(self.FILL)
         # When morphing, blurring or compositing,
         # this is the total amount of tiles to process
@@ -160,7 +171,16 @@ class FillHandler:
         self.controller.inc_processed(1)
 
     def set_stage(self, stage, num_tiles_to_process=None):
-        """Change stage, updating strings and tile data"""
+        """Change stage, updating strings and tile data
+
+        The figures of the stage being left are appended to the stats,
+        as a dict with the stage's index, its wall time in seconds, the
+        number of tiles processed, how many of those were found by
+        shortcuts, and the throughput and worker imbalance (the ratio
+        of the busiest worker's time to the mean, for the native stages).
+        """
+        if self.stage is not None:
+            self._record_stats()
         self.stage = stage
         self.controller.reset()
         self.stage_string = self.STAGE_STRINGS[stage]
@@ -169,13 +189,35 @@ class FillHandler:
             self.stage_string += (
                 " " + self.TILES_TEMPLATE.format(t=num_tiles_to_process))
 
+    def _record_stats(self):
+        ctrl = self.controller
+        seconds = ctrl.stage_seconds()
+        processed = ctrl.num_processed()
+        stats = dict(
+            stage=self.stage,
+            seconds=seconds,
+            processed=processed,
+            skipped=ctrl.num_skipped(),
+            tiles_per_second=processed / seconds if seconds > 0 else 0.0,
+            imbalance=ctrl.worker_imbalance(),
+        )
+        self.stats.append(stats)
+        logger.debug(
+            "Fill stage %d: %.3fs, %d tiles (%d skipped), "
+            "%.0f tiles/s, worker imbalance %.2f",
+            stats["stage"], seconds, processed, stats["skipped"],
+            stats["tiles_per_second"], stats["imbalance"],
+        )
+
     @property
     def progress_string(self):
         """Progress for the current stage"""
         if self.stage == self.FILL:
             return self.TILES_TEMPLATE.format(t=self.tiles_processed)
         elif self.stage < self.FINISHING:
-            return str(int(100*self.tiles_processed/self.tiles_max)) + "%"
+            # The tile count can only be estimated for some stages
+            done = min(self.tiles_processed, self.tiles_max)
+            return str(int(100*done/self.tiles_max)) + "%"
         else:
             return ""
 
@@ -201,7 +243,8 @@ class FloodFillArguments(object):
 
     def __init__(
             self, target_pos, seeds, color, tolerance, offset, feather,
-            gap_closing_options, mode, lock_alpha, opacity, framed, bbox
+            gap_closing_options, mode, lock_alpha, opacity, framed, bbox,
+            fast_feather=False
     ):
         """ Create a new fill argument set
         :param target_pos: pixel coordinate of target color
@@ -228,6 +271,8 @@ class FloodFillArguments(object):
         :type framed: bool
         :param bbox: Bounding box: limits the fill
         :type bbox: lib.helpers.Rect or equivalent 4-tuple
+        :param fast_feather: approximate the feathering with box blurs
+        :type fast_feather: bool
         """
         self.target_pos = target_pos
         self.seeds = seeds
@@ -241,6 +286,7 @@ class FloodFillArguments(object):
         self.opacity = opacity
         self.framed = framed
         self.bbox = bbox
+        self.fast_feather = fast_feather
 
     def skip_empty_dst(self):
         """If true, compositing to empty tiles does nothing"""
@@ -252,6 +298,20 @@ class FloodFillArguments(object):
              ]
         )
 
+    def flood_key(self):
+        """Key for the arguments deciding the tiles flooded
+
+        Fills with the same key on an unchanged source flood the same
+        tiles, whatever their offset, feather, color or blend mode.
+        """
+        gc = self.gap_closing_options
+        if gc:
+            gc = (gc.max_gap_size, gc.retract_seeps)
+        return (
+            tuple(self.target_pos), frozenset(self.seeds), self.tolerance,
+            gc, tuple(self.bbox),
+        )
+
     def no_op(self):
         """If true, compositing will never alter the output layer
 
@@ -264,6 +324,59 @@ class FloodFillArguments(object):
         )
 
 
+class _FloodCache (object):
+    """Keeps the flooded tiles of the most recent fill
+
+    Trying out fill settings usually means filling, undoing and filling
+    again with a different offset or feather. When a fill floods the same
+    source in the same state, with the same flood arguments, as the last
+    one, the flood is skipped and only the later stages are run again.
+
+    Only sources with a revision token (see
+    `lib.tiledsurface.MyPaintSurface.revision`) are cached. Undoing a fill
+    restores the token along with the layer content.
+    """
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._src = None
+        self._key = None
+        self._tiles = None
+
+    @staticmethod
+    def _full_key(src, args):
+        revision = getattr(src, "revision", None)
+        if revision is None:
+            return None
+        return (revision, args.flood_key())
+
+    def get(self, src, args):
+        """Copy of the cached tiles for a fill, or None"""
+        key = self._full_key(src, args)
+        with self._lock:
+            if key is None or self._src is None or self._src() is not src:
+                return None
+            if self._key != key:
+                return None
+            return dict(self._tiles)
+
+    def put(self, src, args, revision, tiles):
+        """Cache the tiles flooded from src at the given revision"""
+        if revision is None:
+            return
+        with self._lock:
+            self._src = weakref.ref(src)
+            self._key = (revision, args.flood_key())
+            self._tiles = dict(tiles)
+
+    def clear(self):
+        with self._lock:
+            self._src = self._key = self._tiles = None
+
+
+_flood_cache = _FloodCache()
+
+
 def flood_fill(src, fill_args, dst):
     """Top-level fill interface
     Delegates actual fill in separate thread and returns a FillHandler
@@ -309,37 +422,52 @@ def _flood_fill(src, args, dst, handler):
     offset = lib.helpers.clamp(args.offset, -TILE_SIZE, TILE_SIZE)
     feather = lib.helpers.clamp(args.feather, 0, TILE_SIZE)
 
-    # Initial parameters
-    target_color = get_target_color(
-        src, *starting_coordinates(*args.target_pos)
-    )
-    filler = myplib.Filler(*(target_color + (tolerance,)))
-    seed_lists = seeds_by_tile(args.seeds)
+    filled = _flood_cache.get(src, args)
+    if filled is None:
+        revision = getattr(src, "revision", None)
 
-    fill_args = (handler, src, seed_lists, tiles_bbox, filler)
+        # Initial parameters
+        target_color = get_target_color(
+            src, *starting_coordinates(*args.target_pos)
+        )
+        filler = myplib.Filler(*(target_color + (tolerance,)))
+        seed_lists = seeds_by_tile(args.seeds)
 
-    if args.gap_closing_options:
-        fill_args += (args.gap_closing_options,)
-        filled = gap_closing_fill(*fill_args)
-    else:
-        filled = scanline_fill(*fill_args)
+        fill_args = (handler, src, seed_lists, tiles_bbox, filler)
 
-    # Dilate/Erode (Grow/Shrink)
-    if offset != 0 and handler.run:
-        filled = lib.morphology.morph(handler, offset, filled)
+        if args.gap_closing_options:
+            fill_args += (args.gap_closing_options,)
+            filled = gap_closing_fill(*fill_args)
+        else:
+            filled = parallel_scanline_fill(*fill_args)
 
-    # Feather (Gaussian blur)
-    if feather != 0 and handler.run:
-        filled = lib.morphology.blur(handler, feather, filled)
+        # The later stages consume or extend the dict they are given
+        if handler.run:
+            _flood_cache.put(src, args, revision, filled)
+
+    # Dilate/Erode (Grow/Shrink) and feather (Gaussian blur), the two
+    # can be done in a single pass, without keeping all morphed tiles
+    if offset != 0 and feather != 0 and handler.run:
+        filled = lib.morphology.morph_blur(
+            handler, offset, feather, filled, args.fast_feather
+        )
+    elif offset != 0 and handler.run:
+        filled = lib.morphology.morph(handler, offset, filled)
+    elif feather != 0 and handler.run:
+        filled = lib.morphology.blur(
+            handler, feather, filled, args.fast_feather
+        )
 
     # When dilating or blurring the fill, only respect the
     # bounding box limits if they are set by an active frame
     trim_result = args.framed and (offset > 0 or feather != 0)
     if handler.run:
-        composite(
-            handler, args,
-            trim_result, filled, tiles_bbox, dst
-        )
+        # Queued combine jobs write to the tiles after their requests end
+        with dst.in_use():
+            composite(
+                handler, args,
+                trim_result, filled, tiles_bbox, dst
+            )
 
 
 def update_bbox(bbox, tx, ty):
@@ -371,9 +499,11 @@ def composite(
 
     fill_col = fill_args.color
 
-    # Prepare opaque color rgba tile for copying
+    # Prepare opaque color rgba tile for copying,
+    # this is a shared constant tile
     full_rgba = myplib.rgba_tile_from_alpha_tile(
         _FULL_TILE, *(fill_col + (0, 0, N-1, N-1)))
+    full_color = tuple(full_rgba[0, 0])
 
     # Bounding box of tiles that need updating
     dst_changed_bbox = None
@@ -384,7 +514,10 @@ def composite(
     lock_alpha = fill_args.lock_alpha
     opacity = fill_args.opacity
 
-    tile_combine = myplib.tile_combine
+    # Combine operations are queued up and run in batches, in parallel
+    # and without holding the GIL. The dst tile arrays stay valid because
+    # the destination is a MyPaintSurface.
+    jobs = []
 
     # Composite filled tiles into the destination surface
     for tile_coord, src_tile in iteritems(filled):
@@ -392,6 +525,10 @@ def composite(
         if not handler.run:
             break
 
+        if len(jobs) >= _COMPOSITE_BATCH_SIZE:
+            myplib.tile_combine_many(jobs)
+            jobs = []
+
         handler.inc_processed()
 
         # Omit tiles outside of the bounding box _if_ the frame is enabled
@@ -404,20 +541,22 @@ def composite(
         if skip_empty_dst and tile_coord not in dst_tiles:
             continue
 
+        # Under certain conditions, shared tiles and dict manipulation
+        # can be used instead of compositing operations.
+        cut_off = trim_result and tiles_bbox.crossing(tile_coord)
+        full_inner = src_tile is _FULL_TILE and not cut_off
+        if full_inner and mode == myplib.CombineNormal and opacity == 1.0:
+            dst_changed_bbox = update_bbox(dst_changed_bbox, *tile_coord)
+            dst.set_constant_tile(tile_coord[0], tile_coord[1], full_color)
+            continue
+
         with dst.tile_request(*tile_coord, readonly=False) as dst_tile:
 
             # Only at this point might the bounding box need to be updated
             dst_changed_bbox = update_bbox(dst_changed_bbox, *tile_coord)
 
-            # Under certain conditions, direct copies and dict manipulation
-            # can be used instead of compositing operations.
-            cut_off = trim_result and tiles_bbox.crossing(tile_coord)
-            full_inner = src_tile is _FULL_TILE and not cut_off
             if full_inner:
-                if mode == myplib.CombineNormal and opacity == 1.0:
-                    myplib.tile_copy_rgba16_into_rgba16(full_rgba, dst_tile)
-                    continue
-                elif mode == myplib.CombineDestinationOut and opacity == 1.0:
+                if mode == myplib.CombineDestinationOut and opacity == 1.0:
                     dst_tiles.pop(tile_coord)
                     continue
                 elif mode == myplib.CombineDestinationIn and opacity == 1.0:
@@ -438,10 +577,12 @@ def composite(
             if lock_alpha and mode != myplib.CombineSourceAtop:
                 mask = np.copy(dst_tile)
                 mask_mode = myplib.CombineDestinationAtop
-                tile_combine(mode, src_tile_rgba, dst_tile, True, opacity)
-                tile_combine(mask_mode, mask, dst_tile, True, 1.0)
+                jobs.append((mode, src_tile_rgba, dst_tile, True, opacity))
+                jobs.append((mask_mode, mask, dst_tile, True, 1.0))
             else:
-                tile_combine(mode, src_tile_rgba, dst_tile, True, opacity)
+                jobs.append((mode, src_tile_rgba, dst_tile, True, opacity))
+
+    myplib.tile_combine_many(jobs)
 
     # Handle dst-out and dst-atop: clear untouched tiles
     if mode in [myplib.CombineDestinationIn, myplib.CombineDestinationAtop]:
@@ -520,7 +661,7 @@ def scanline_fill(handler, src, seed_lists, tiles_bbox, filler):
             if overflows is None:
                 if tile_coord not in filled:
                     handler.inc_processed()
-                    filled[tile_coord] = np.zeros((N, N), 'uint16')
+                    filled[tile_coord] = fc.new_alpha_tile()
                 overflows = filler.fill(
                     src_tile, filled[tile_coord], seeds,
                     from_dir, *tiles_bbox.tile_bounds(tile_coord)
@@ -531,15 +672,52 @@ def scanline_fill(handler, src, seed_lists, tiles_bbox, filler):
     return filled
 
 
+def parallel_scanline_fill(
+        handler, src, seed_lists, tiles_bbox, filler, coarse=True):
+    """ Perform a scanline fill and return the filled tiles
+
+    Same as scanline_fill, but with the tile frontier kept in C++,
+    filling independent tiles concurrently.
+
+    The result only differs from that of scanline_fill for uniform
+    tiles, whose overflows are only held back for the seeds they
+    received, instead of for entire edges.
+
+    If coarse is true and the source keeps mipmaps, whole blocks of
+    tiles of a single shared colour are filled at once, found from the
+    coarser mipmap levels (see MyPaintSurface.constant_mipmap_tile()).
+    Only the tiles around them are fetched and scanned, so filling a
+    large area of one colour costs about as much as its outline.
+
+    :returns: a dictionary of coord->tile mappings for the filled tiles
+    """
+
+    def get_src_tile(tx, ty):
+        with src.tile_request(tx, ty, readonly=True) as src_tile:
+            return src_tile
+
+    get_mipmap_tile = None
+    if coarse:
+        get_mipmap_tile = getattr(src, "constant_mipmap_tile", None)
+
+    bb = tiles_bbox
+    return myplib.parallel_fill(
+        filler, get_src_tile, _EMPTY_RGBA, seed_lists,
+        bb.min_tx, bb.min_ty, bb.max_tx, bb.max_ty,
+        bb.min_px, bb.min_py, bb.max_px, bb.max_py,
+        handler.controller, get_mipmap_tile, myplib.MAX_MIPMAP_LEVEL
+    )
+
+
 class _TileFillSkipper:
     """Provides checking for, and handling of, uniform tiles"""
 
     FULL_OVERFLOWS = [
-        ((), [(0, N-1)], [(0, N-1)], [(0, N-1)]),         # from north
-        ([(0, N-1)], (), [(0, N-1)], [(0, N-1)]),         # from east
-        ([(0, N-1)], [(0, N-1)], (), [(0, N-1)]),         # from south
-        ([(0, N-1)], [(0, N-1)], [(0, N-1)], ()),         # from west
-        ([(0, N-1)], [(0, N-1)], [(0, N-1)], [(0, N-1)])  # from within
+        (0, _FULL_EDGE, _FULL_EDGE, _FULL_EDGE),           # from north
+        (_FULL_EDGE, 0, _FULL_EDGE, _FULL_EDGE),           # from east
+        (_FULL_EDGE, _FULL_EDGE, 0, _FULL_EDGE),           # from south
+        (_FULL_EDGE, _FULL_EDGE, _FULL_EDGE, 0),           # from west
+        (_FULL_EDGE, _FULL_EDGE, _FULL_EDGE, _FULL_EDGE)   # from within
     ]
 
     def __init__(self, tiles_bbox, filler, final):
@@ -646,7 +824,7 @@ def gap_closing_fill(
             # Create new output tile if not already present
             if tile_coord not in filled:
                 handler.inc_processed()
-                filled[tile_coord] = np.zeros((N, N), 'uint16')
+                filled[tile_coord] = fc.new_alpha_tile()
             # Run the gap-closing fill for the tile
             result = gc_filler.fill(
                 alpha_t, dist_t, filled[tile_coord], seeds, *px_bounds
@@ -727,10 +905,10 @@ class _GCTileHandler(object):
                 )
                 if can_skip_fill:
                     self.final.add(tile_coord)
-                    if isinstance(seeds, list):
-                        overflows = self.OVERFLOWS[EDGE.none]
-                    else:
+                    if is_full_edge(seeds):
                         overflows = self.OVERFLOWS[seeds[0]]
+                    else:
+                        overflows = self.OVERFLOWS[EDGE.none]
                     return _FULL_TILE, _GAPLESS_TILE, overflows
             else:
                 self.distances[tile_coord] = self._dist_data
@@ -777,7 +955,7 @@ class _GCTileHandler(object):
                     elif alpha:
                         alpha_tiles[ntc] = fc.new_full_tile(alpha)
                     else:
-                        alpha_tile = np.empty((N, N), 'uint16')
+                        alpha_tile = fc.new_alpha_tile(zeroed=False)
                         self._filler.flood(src_tile, alpha_tile)
                         alpha_tiles[ntc] = alpha_tile
             tile = alpha_tiles[ntc]
@@ -843,9 +1021,19 @@ def complement_gc_seeds(seeds, distance_tile):
         return seeds, False
 
 
+def is_full_edge(seeds):
+    """Check if the seeds are the edge constant - a full edge of seeds"""
+    return isinstance(seeds, tuple) and len(seeds) == 1
+
+
 def gc_seeds_skippable(seeds):
+    if isinstance(seeds, tuple):
+        # Edge seeds: (origin,) or (origin, mask, distances)
+        return (
+            is_full_edge(seeds) or
+            bool((seeds[2] == INF_DIST).any())  # one seed can fill everything
+        )
     return (
-        isinstance(seeds, tuple) or  # edge constant - a full edge of seeds
         len(seeds[0]) == 2 or  # initial seeds
         any([s[2] == INF_DIST for s in seeds])  # one seed can fill everything
     )
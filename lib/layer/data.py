@@ -26,6 +26,7 @@ from random import randint
 import uuid
 import struct
 import contextlib
+import functools
 
 from lib.brush import BrushInfo
 from lib.gettext import C_
@@ -40,6 +41,7 @@ import lib.mypaintlib
 from . import core
 import lib.layer.error
 import lib.autosave
+import lib.tilelog
 import lib.xml
 import lib.feedback
 from . import rendering
@@ -100,6 +102,9 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         else:
             self._surface = surface
 
+        # Incremental autosave writer, see lib.tilelog
+        self._autosave_tile_log = None
+
     @classmethod
     def new_from_surface_backed_layer(cls, src):
         """Clone from another SurfaceBackedLayer
@@ -134,7 +139,7 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
     ## Loading
 
     def load_from_openraster(self, orazip, elem, cache_dir, progress,
-                             x=0, y=0, **kwargs):
+                             x=0, y=0, lazy=False, **kwargs):
         """Loads layer flags and bitmap/surface data from a .ora zipfile
 
         The normal behaviour is to load the surface data directly from
@@ -142,6 +147,10 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         method also checks the src attribute's suffix against
         ALLOWED_SUFFIXES before attempting to load the surface.
 
+        If `lazy` is true, only the undecoded data is read from the
+        zipfile, and it is decoded when the surface's tiles are first
+        needed. Subclasses may ignore this.
+
         See: _load_surface_from_orazip_member()
 
         """
@@ -187,16 +196,28 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
             src,
             progress,
             x, y,
+            lazy=lazy,
         )
 
     def _load_surface_from_orazip_member(self, orazip, cache_dir,
-                                         src, progress, x, y):
+                                         src, progress, x, y, lazy=False):
         """Loads the surface from a member of an OpenRaster zipfile
 
         Intended strictly for override by subclasses which need to first
         extract and then keep the file around afterwards.
 
         """
+        if lazy and not self._surface.looped:
+            data = lib.pixbuf.read_from_zipfile(
+                datazip=orazip,
+                filename=src,
+                progress=progress,
+            )
+            self._surface.set_pending_load(
+                functools.partial(self._decode_surface_tiles, data, src, x, y),
+                bbox=_png_bbox(data, x, y),
+            )
+            return
         pixbuf = lib.pixbuf.load_from_zipfile(
             datazip=orazip,
             filename=src,
@@ -204,6 +225,21 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         )
         self.load_surface_from_pixbuf(pixbuf, x=x, y=y)
 
+    @staticmethod
+    def _decode_surface_tiles(data, src, x, y):
+        """Decodes the data kept by a lazy load: returns a tiledict"""
+        t0 = time.time()
+        if PY3:
+            datafp = BytesIO(data)
+        else:
+            datafp = StringIO(data)
+        pixbuf = lib.pixbuf.load_from_stream(datafp)
+        arr = helpers.gdkpixbuf2numpy(pixbuf)
+        surface = tiledsurface.Surface()
+        surface.load_from_numpy(arr, x, y)
+        logger.debug("Decoded %r on demand in %.3fs", src, time.time() - t0)
+        return dict(surface.tiledict)
+
     def load_from_openraster_dir(self, oradir, elem, cache_dir, progress,
                                  x=0, y=0, **kwargs):
         """Loads layer flags and data from an OpenRaster-style dir"""
@@ -259,6 +295,10 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         make copies to manage.
 
         """
+        if os.path.splitext(src)[1].lower() == lib.tilelog.SUFFIX:
+            # Written by autosave, see queue_autosave()
+            self._surface.load_tile_log(os.path.join(oradir, src), x, y)
+            return
         self.load_surface_from_pixbuf_file(
             os.path.join(oradir, src),
             x, y,
@@ -427,6 +467,15 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         # standardizes looped layer data, that code should be moved
         # here.
 
+        # Other layers save just the tiles changed since the last
+        # autosave, into a tile log. Its tiles stay where they are, so
+        # that needs the requested save bbox to be tile-aligned.
+        ref_x, ref_y = bbox[0:2]
+        if not (self._surface.looped or ref_x % N or ref_y % N):
+            return self._queue_autosave_tile_log(
+                oradir, taskproc, manifest, bbox,
+            )
+
         png_basename = self.autosave_uuid + ".png"
         png_relpath = os.path.join("data", png_basename)
         png_path = os.path.join(oradir, png_relpath)
@@ -453,6 +502,24 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         elem.attrib["src"] = png_relpath
         return elem
 
+    def _queue_autosave_tile_log(self, oradir, taskproc, manifest, bbox):
+        """Queues an update of the layer's autosave tile log"""
+        log_basename = self.autosave_uuid + lib.tilelog.SUFFIX
+        log_relpath = os.path.join("data", log_basename)
+        log_path = os.path.join(oradir, log_relpath)
+        writer = self._autosave_tile_log
+        if writer is None or writer.filename != log_path:
+            writer = lib.tilelog.TileLogWriter(log_path)
+            self._autosave_tile_log = writer
+        if self.autosave_dirty or not os.path.exists(log_path):
+            sshot = self._surface.save_snapshot()
+            taskproc.add_work(writer.update_task(sshot.tiledict))
+            self.autosave_dirty = False
+        manifest.add(log_relpath)
+        elem = self._get_stackxml_element("layer", -bbox[0], -bbox[1])
+        elem.attrib["src"] = log_relpath
+        return elem
+
     @staticmethod
     def _make_refname(prefix, path, suffix, sep='-'):
         """Internal: standardized filename for something with a path"""
@@ -538,6 +605,19 @@ class SurfaceBackedLayer (core.LayerBase, lib.autosave.Autosaveable):
         removed, total = self._surface.remove_empty_tiles()
         return (removed, total)
 
+    def iter_compress_cold_tiles(self):
+        """Compresses tiles which are not in use (generator)
+
+        Layers which can't be seen have all of their tiles compressed.
+        See lib.tiledsurface.MyPaintSurface.iter_compress_cold_tiles().
+
+        """
+        surface = self._surface
+        if not isinstance(surface, tiledsurface.MyPaintSurface):
+            return iter(())
+        hidden = not (self.visible and self.branch_visible)
+        return surface.iter_compress_cold_tiles(all_tiles=hidden)
+
 
 class SurfaceBackedLayerMove (object):
     """Move object wrapper for surface-backed layers
@@ -657,11 +737,12 @@ class FileBackedLayer (SurfaceBackedLayer, core.ExternallyEditable):
         raise NotImplementedError
 
     def _load_surface_from_orazip_member(self, orazip, cache_dir,
-                                         src, progress, x, y):
+                                         src, progress, x, y, lazy=False):
         """Loads the surface from a member of an OpenRaster zipfile
 
         This override retains a managed copy of the extracted file in
-        the REVISIONS_SUBDIR of the cache folder.
+        the REVISIONS_SUBDIR of the cache folder. It always loads the
+        surface straight away.
 
         """
         # Extract a copy of the file, and load that
@@ -1293,7 +1374,7 @@ class SimplePaintingLayer (SurfaceBackedLayer):
 
     ## Class constants
 
-    ALLOWED_SUFFIXES = [".png"]
+    ALLOWED_SUFFIXES = [".png", lib.tilelog.SUFFIX]
 
     DEFAULT_NAME = C_(
         "layer default names",
@@ -1440,6 +1521,7 @@ class StrokemappedPaintingLayer (SimplePaintingLayer):
         #: List of strokemap.StrokeShape instances (not stroke.Stroke),
         #: ordered by depth.
         self.strokes = []
+        self._stroke_index = lib.strokemap.StrokeMapIndex()
 
     def clear(self):
         """Clear both the surface and the strokemap"""
@@ -1623,9 +1705,7 @@ class StrokemappedPaintingLayer (SimplePaintingLayer):
     def get_stroke_info_at(self, x, y):
         """Get the stroke at the given point"""
         x, y = int(x), int(y)
-        for s in reversed(self.strokes):
-            if s.touches_pixel(x, y):
-                return s
+        return self._stroke_index.pick(self.strokes, x, y)
 
     def get_last_stroke_info(self):
         if not self.strokes:
@@ -1852,6 +1932,30 @@ class StrokemappedPaintingLayerMove (SurfaceBackedLayerMove):
         self._layer.autosave_dirty = True
 
 
+## Loading helpers
+
+
+def _png_bbox(data, x, y):
+    """The area a PNG's pixels will cover, read from its header
+
+    :param bytes data: the PNG file's data
+    :returns: (x, y, w, h), or None if the data is not a PNG
+
+    >>> import zipfile
+    >>> with zipfile.ZipFile("tests/smallimage.ora") as orazip:
+    ...     data = orazip.read("data/layer000.png")
+    >>> _png_bbox(data, 10, 20)
+    (10, 20, 128, 64)
+    >>> _png_bbox(b"GIF89a", 0, 0) is None
+    True
+
+    """
+    if data[12:16] != b"IHDR":
+        return None
+    w, h = struct.unpack(">II", data[16:24])
+    return (x, y, w, h)
+
+
 ## Module testing
 
 
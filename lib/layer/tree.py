@@ -33,6 +33,7 @@ import lib.mypaintlib
 import lib.tiledsurface as tiledsurface
 from lib.tiledsurface import TileAccessible
 from lib.tiledsurface import TileBlittable
+from lib.surface import TileRenderable
 import lib.helpers as helpers
 from lib.observable import event
 import lib.pixbuf
@@ -50,6 +51,13 @@ from lib.pycompat import xrange
 
 logger = logging.getLogger(__name__)
 
+# Number of tiles rendered at a time by RootLayerStack.render()
+_RENDER_BATCH_SIZE = 64
+
+# Number of tiles whose partial stack renderings are kept, see
+# _PartialStackCache. Each takes up to two fix15 tiles.
+_PARTIAL_CACHE_SIZE = 256
+
 
 ## Class defs
 
@@ -126,6 +134,7 @@ class RootLayerStack (group.LayerStack):
         super(RootLayerStack, self).__init__(**kwargs)
         self.doc = doc
         self._render_cache = lib.cache.LRUCache(capacity=cache_size)
+        self._partial_cache = _PartialStackCache()
         # Background
         default_bg = (255, 255, 255)
         self._default_background = default_bg
@@ -196,6 +205,7 @@ class RootLayerStack (group.LayerStack):
     def _render_cache_clear(self, *_ignored):
         """Clears all rendered tiles from the cache."""
         self._render_cache.clear()
+        self._partial_cache.clear()
 
     # Global ops:
 
@@ -458,91 +468,104 @@ class RootLayerStack (group.LayerStack):
                 use_cache = spec.cacheable()
         key2 = (id(opaque_base_tile), dst_has_alpha)
 
-        # Rendering loop.
-        # Keep this as tight as possible, and consider C++ parallelization.
-        tiledims = (tiledsurface.N, tiledsurface.N, 4)
-        dst_has_alpha_orig = dst_has_alpha
-        for tx, ty in tiles:
-            dst_8bpc_orig = None
-            dst_has_alpha = dst_has_alpha_orig
-            key1 = (tx, ty, mipmap_level)
-            cache_hit = False
-
-            with surface.tile_request(tx, ty, readonly=False) as dst:
-
-                # Twirl out any 8bpc target here,
-                # if the render cache is empty for this tile.
-                if target_surface_is_8bpc:
-                    dst_8bpc_orig = dst
-                    dst = None
-                    if use_cache:
-                        dst = self._render_cache_get(key1, key2)
+        # Rendering loop. Tiles are rendered to fix15 in batches, and
+        # then written to the target surface.
+        over_opaque_base = dst_has_alpha and opaque_base_tile is not None
+        program = self._compile_ops_list(ops)
+        # Display renders are mostly repeated while the current layer
+        # is painted, so the rest of the stack can be kept rendered.
+        partial_plan = None
+        if use_cache:
+            partial_plan = self._partial_cache.prepare(
+                self, ops, spec, dst_has_alpha,
+            )
+        for start in xrange(0, len(tiles), _RENDER_BATCH_SIZE):
+            batch = tiles[start:start + _RENDER_BATCH_SIZE]
+
+            # Render what the cache does not have
+            cached = {}
+            rendered = {}
+            for tx, ty in batch:
+                if use_cache:
+                    hit = self._render_cache_get((tx, ty, mipmap_level), key2)
+                    if hit is not None:
+                        cached[(tx, ty)] = hit
+                        continue
+                if target_surface_is_8bpc or over_opaque_base:
+                    dst = tiledsurface.new_tile_array()
+                else:
+                    # The ops are run over what the target tile holds
+                    with surface.tile_request(tx, ty, readonly=True) as src:
+                        dst = np.copy(src)
+                rendered[(tx, ty)] = dst
+            jobs = [(tx, ty, dst) for (tx, ty), dst in rendered.items()]
+            if partial_plan is not None:
+                self._partial_cache.render_batch(
+                    self, partial_plan, jobs, mipmap_level,
+                )
+            else:
+                self._process_ops_batch(
+                    ops, program, jobs,
+                    dst_has_alpha, mipmap_level,
+                )
 
+            for tx, ty in batch:
+                with surface.tile_request(tx, ty, readonly=False) as target:
+                    dst = rendered.get((tx, ty))
                     if dst is None:
-                        dst = np.zeros(tiledims, dtype='uint16')
+                        # An already 8pbc tile from the cache.
+                        # It will match dst_has_alpha already.
+                        target[:] = cached[(tx, ty)]
                     else:
-                        cache_hit = True  # note: dtype is now uint8
-
-                if not cache_hit:
-                    # Render to dst.
-                    # dst is a fix15 rgba tile
-
-                    dst_over_opaque_base = None
-                    if dst_has_alpha and opaque_base_tile is not None:
-                        dst_over_opaque_base = dst
-                        lib.mypaintlib.tile_copy_rgba16_into_rgba16(
-                            opaque_base_tile,
-                            dst_over_opaque_base,
+                        self._render_finish_tile(
+                            dst, target, target_surface_is_8bpc,
+                            dst_has_alpha, opaque_base_tile,
                         )
-                        dst = np.zeros(tiledims, dtype='uint16')
-
-                    # Process the ops list.
-                    self._process_ops_list(
-                        ops,
-                        dst, dst_has_alpha,
-                        tx, ty, mipmap_level,
-                    )
-
-                    if dst_over_opaque_base is not None:
-                        dst_has_alpha = False
-                        lib.mypaintlib.tile_combine(
-                            lib.mypaintlib.CombineNormal,
-                            dst, dst_over_opaque_base,
-                            False, 1.0,
-                        )
-                        dst = dst_over_opaque_base
-
-                # If the target tile is fix15 already, we're done.
-                if dst_8bpc_orig is None:
-                    continue
-
-                # Untwirl into the target 8bpc tile.
-                if not cache_hit:
-                    # Rendering just happened.
-                    # Convert to 8bpc, and maybe store.
-                    if dst_has_alpha:
-                        conv = lib.mypaintlib.tile_convert_rgba16_to_rgba8
-                    else:
-                        conv = lib.mypaintlib.tile_convert_rgbu16_to_rgbu8
-                    conv(dst, dst_8bpc_orig, eotf())
-
-                    if use_cache:
-                        self._render_cache_set(key1, key2, dst_8bpc_orig)
-                else:
-                    # An already 8pbc dst was loaded from the cache.
-                    # It will match dst_has_alpha already.
-                    dst_8bpc_orig[:] = dst
+                        if use_cache:
+                            key1 = (tx, ty, mipmap_level)
+                            self._render_cache_set(key1, key2, target)
+
+                    # Display filtering only happens when rendering
+                    # 8bpc for the screen.
+                    if target_surface_is_8bpc and filter is not None:
+                        filter(target)
+                progress += 1
+        progress.close()
 
-                dst = dst_8bpc_orig
+    @staticmethod
+    def _render_finish_tile(dst, target, target_is_8bpc,
+                            dst_has_alpha, opaque_base_tile):
+        """Writes a fix15 tile rendered by render() to its target tile"""
+        if dst_has_alpha and opaque_base_tile is not None:
+            # Composite the rendering over the opaque base
+            if target_is_8bpc:
+                base = np.empty(dst.shape, dtype='uint16')
+            else:
+                base = target
+            lib.mypaintlib.tile_copy_rgba16_into_rgba16(
+                opaque_base_tile,
+                base,
+            )
+            lib.mypaintlib.tile_combine(
+                lib.mypaintlib.CombineNormal,
+                dst, base,
+                False, 1.0,
+            )
+            dst_has_alpha = False
+            dst = base
+        elif not target_is_8bpc:
+            lib.mypaintlib.tile_copy_rgba16_into_rgba16(dst, target)
 
-                # Display filtering only happens when rendering
-                # 8bpc for the screen.
-                if filter is not None:
-                    filter(dst)
+        # If the target tile is fix15, we're done.
+        if not target_is_8bpc:
+            return
 
-            # end tile_request
-            progress += 1
-        progress.close()
+        # Convert to 8bpc
+        if dst_has_alpha:
+            conv = lib.mypaintlib.tile_convert_rgba16_to_rgba8
+        else:
+            conv = lib.mypaintlib.tile_convert_rgbu16_to_rgbu8
+        conv(dst, target, eotf())
 
     def render_layer_preview(self, layer, size=256, bbox=None, **options):
         """Render a standardized thumbnail/preview of a specific layer.
@@ -684,8 +707,7 @@ class RootLayerStack (group.LayerStack):
         dst_is_8bpc = (dst.dtype == 'uint8')
         if dst_is_8bpc:
             dst_8bpc_orig = dst
-            tiledims = (tiledsurface.N, tiledsurface.N, 4)
-            dst = np.zeros(tiledims, dtype='uint16')
+            dst = tiledsurface.new_tile_array()
 
         self._process_ops_list(ops, dst, dst_has_alpha, tx, ty, mipmap_level)
 
@@ -714,13 +736,70 @@ class RootLayerStack (group.LayerStack):
         h = max(min_size, h)
         return (x, y, w, h)
 
+    @staticmethod
+    def _compile_ops_list(ops):
+        """Prepares a list of ops for running natively, if possible
+
+        :returns: (program, surfaces), or None
+        :rtype: tuple
+
+        The program is for lib.mypaintlib.tile_render_ops_many(), and
+        the surfaces are the sources of its COMPOSITE and BLIT ops, in
+        order. Only ops on MyPaintSurfaces can be run natively; if any
+        others are present, None is returned and the ops must be run
+        by _process_ops_list().
+
+        """
+        program = []
+        surfaces = []
+        for (opcode, opdata, mode, opacity) in ops:
+            if opcode in (rendering.Opcode.COMPOSITE, rendering.Opcode.BLIT):
+                if not isinstance(opdata, tiledsurface.MyPaintSurface):
+                    return None
+                surfaces.append(opdata)
+            elif opcode not in (rendering.Opcode.PUSH, rendering.Opcode.POP):
+                return None
+            if mode is None:
+                mode = 0
+            if opacity is None:
+                opacity = 1.0
+            program.append((opcode, mode, opacity))
+        return (program, surfaces)
+
+    def _process_ops_batch(self, ops, program, tiles, dst_has_alpha,
+                           mipmap_level):
+        """Process a list of ops to render several tiles. fix15 data only!
+
+        :param program: the ops, compiled by _compile_ops_list()
+        :param list tiles: (tx, ty, dst) for each tile
+
+        The tiles are rendered in parallel, without the GIL,
+        unless the ops need running in Python.
+
+        """
+        if program is None:
+            for tx, ty, dst in tiles:
+                self._process_ops_list(
+                    ops, dst, dst_has_alpha,
+                    tx, ty, mipmap_level,
+                )
+            return
+        program, surfaces = program
+        jobs = []
+        for tx, ty, dst in tiles:
+            sources = tuple(
+                s.get_render_source(tx, ty, mipmap_level) for s in surfaces
+            )
+            jobs.append((dst, dst_has_alpha, sources))
+        lib.mypaintlib.tile_render_ops_many(program, jobs)
+
     @staticmethod
     def _process_ops_list(ops, dst, dst_has_alpha, tx, ty, mipmap_level):
         """Process a list of ops to render a tile. fix15 data only!"""
         # FIXME: should this be expanded to cover caching and 8bpc
         # targets? It would save on some code duplication elsewhere.
-        # On the other hand, this is sort of what a parallelized,
-        # GIL-holding C++ loop body might look like.
+        # See also lib.mypaintlib.tile_render_ops_many(), which runs
+        # the same ops for batches of tiles in render().
 
         stack = []
         for (opcode, opdata, mode, opacity) in ops:
@@ -737,8 +816,7 @@ class RootLayerStack (group.LayerStack):
                 )
             elif opcode == rendering.Opcode.PUSH:
                 stack.append((dst, dst_has_alpha))
-                tiledims = (tiledsurface.N, tiledsurface.N, 4)
-                dst = np.zeros(tiledims, dtype='uint16')
+                dst = tiledsurface.new_tile_array()
                 dst_has_alpha = True
             elif opcode == rendering.Opcode.POP:
                 src = dst
@@ -2019,9 +2097,8 @@ class RootLayerStack (group.LayerStack):
         logger.debug("Normalize: bd_ops = %r", bd_ops)
         logger.debug("Normalize: src_ops = %r", src_ops)
         dstsurf = dstlayer._surface
-        tiledims = (tiledsurface.N, tiledsurface.N, 4)
         for tx, ty in tiles:
-            bd = np.zeros(tiledims, dtype='uint16')
+            bd = tiledsurface.new_tile_array()
             with dstsurf.tile_request(tx, ty, readonly=False) as dst:
                 self._process_ops_list(bd_ops, bd, True, tx, ty, 0)
                 lib.mypaintlib.tile_copy_rgba16_into_rgba16(bd, dst)
@@ -2704,7 +2781,7 @@ class RootLayerStackSnapshot (group.LayerStackSnapshot):
         layer.current_path = self.current_path
 
 
-class _TileRenderWrapper (TileAccessible, TileBlittable):
+class _TileRenderWrapper (TileAccessible, TileBlittable, TileRenderable):
     """Adapts a RootLayerStack to support RO tile_request()s.
 
     The wrapping is very minimal.
@@ -2758,8 +2835,7 @@ class _TileRenderWrapper (TileAccessible, TileBlittable):
             if (self._spec.solo or bg_hidden) and self._all_empty(tx, ty):
                 dst = tiledsurface.transparent_tile.rgba
             else:
-                tiledims = (tiledsurface.N, tiledsurface.N, 4)
-                dst = np.zeros(tiledims, 'uint16')
+                dst = tiledsurface.new_tile_array()
                 self._root.render_single_tile(
                     dst, True,
                     tx, ty, 0,
@@ -2783,20 +2859,207 @@ class _TileRenderWrapper (TileAccessible, TileBlittable):
 
     def blit_tile_into(self, dst, dst_has_alpha, tx, ty, **kwargs):
         """Copy a rendered tile into a fix15 or 8bpp array."""
-        assert dst.dtype == 'uint8'
         with self.tile_request(tx, ty, readonly=True) as src:
             assert src.dtype == 'uint16'
+            if dst.dtype == 'uint16':
+                lib.mypaintlib.tile_copy_rgba16_into_rgba16(src, dst)
+                return
+            assert dst.dtype == 'uint8'
             if dst_has_alpha:
                 conv = lib.mypaintlib.tile_convert_rgba16_to_rgba8
             else:
                 conv = lib.mypaintlib.tile_convert_rgbu16_to_rgbu8
             conv(src, dst, eotf())
 
+    def get_render_program(self):
+        """The wrapped stack's ops, compiled for native rendering"""
+        return self._root._compile_ops_list(self._ops)
+
     def __getattr__(self, attr):
         """Pass through calls to other methods"""
         return getattr(self._root, attr)
 
 
+class _PartialStackCache (object):
+    """Renderings of the parts of the stack below and above the current layer
+
+    While a layer is being painted, the tiles it covers are rendered
+    again and again, with nothing else in the stack changing. The ops
+    are split around the top-level item holding the current layer's
+    surface: the layer itself, or the outermost group containing it.
+    What the ops before that item render ("below") is kept for each
+    tile.  So is a flattened rendering of the ops after it ("above"),
+    if all of those are composited in normal mode, which lets them be
+    composited as one tile. Rendering a tile then takes a copy, the
+    item's own ops, and a single combine.
+
+    The kept tiles stay valid while the ops below and above are the
+    same, and their surfaces have the same revisions; structural
+    changes to the stack clear them too. Because src-over is
+    associative, the flattened "above" gives the same result as
+    compositing its layers one by one, up to fix15 rounding.
+
+    """
+
+    def __init__(self, capacity=_PARTIAL_CACHE_SIZE):
+        super(_PartialStackCache, self).__init__()
+        self._tiles = lib.cache.LRUCache(capacity=capacity)
+        self._signature = None
+
+    def clear(self):
+        """Forgets all kept tiles"""
+        self._tiles.clear()
+        self._signature = None
+
+    @staticmethod
+    def _ops_signature(ops):
+        return tuple(
+            (opcode, id(opdata), getattr(opdata, "revision", None),
+             mode, opacity)
+            for (opcode, opdata, mode, opacity) in ops
+        )
+
+    @staticmethod
+    def _split_ops(ops, surface):
+        """Finds the top-level item holding a surface's COMPOSITE op
+
+        :returns: (start, end) indices of the item in ops, or None
+
+        """
+        depth = 0
+        item_start = 0
+        start = None
+        for i, (opcode, opdata, mode, opacity) in enumerate(ops):
+            if depth == 0:
+                item_start = i
+            if opcode == rendering.Opcode.PUSH:
+                depth += 1
+            elif opcode == rendering.Opcode.POP:
+                depth -= 1
+            elif opdata is surface and start is None:
+                start = item_start
+            if depth == 0 and start is not None:
+                return (start, i + 1)
+        return None
+
+    @staticmethod
+    def _is_flattenable(ops):
+        """True if all top-level items of ops are normal mode composites"""
+        depth = 0
+        for (opcode, opdata, mode, opacity) in ops:
+            if opcode == rendering.Opcode.PUSH:
+                depth += 1
+                continue
+            if opcode == rendering.Opcode.POP:
+                depth -= 1
+            elif depth > 0:
+                continue
+            elif opcode != rendering.Opcode.COMPOSITE:
+                return False
+            if depth == 0 and mode != lib.mypaintlib.CombineNormal:
+                return False
+        return True
+
+    def prepare(self, stack, ops, spec, dst_has_alpha):
+        """Splits the ops for rendering around the current layer
+
+        :param RootLayerStack stack: the stack being rendered
+        :param list ops: its render ops for the spec
+        :param lib.layer.rendering.Spec spec: a cacheable spec
+        :param bool dst_has_alpha: as for the whole render
+        :returns: a plan for render_batch(), or None if not worthwhile
+
+        Kept tiles are dropped if they no longer match the ops.
+
+        """
+        surface = getattr(spec.current, "_surface", None)
+        if surface is None:
+            return None
+        split = self._split_ops(ops, surface)
+        if split is None:
+            return None
+        start, end = split
+        below = ops[:start]
+        item = ops[start:end]
+        above = ops[end:]
+        if len(below) + len(above) < 2:
+            return None
+        flatten = bool(above) and self._is_flattenable(above)
+        signature = (
+            id(surface), dst_has_alpha, flatten,
+            self._ops_signature(below),
+            self._ops_signature(above),
+        )
+        if signature != self._signature:
+            self._tiles.clear()
+            self._signature = signature
+        return (
+            (below, stack._compile_ops_list(below)),
+            (item, stack._compile_ops_list(item)),
+            (above, stack._compile_ops_list(above)),
+            flatten, dst_has_alpha,
+        )
+
+    def render_batch(self, stack, plan, tiles, mipmap_level):
+        """Renders a batch of tiles using the kept partial renderings
+
+        :param RootLayerStack stack: the stack being rendered
+        :param plan: as returned by prepare()
+        :param list tiles: (tx, ty, dst) for each tile, dst zeroed
+
+        Missing renderings of the parts below and above are made
+        first, as batches of their own.
+
+        """
+        below, item, above, flatten, dst_has_alpha = plan
+        entries = []
+        missing = []
+        for tx, ty, dst in tiles:
+            key = (tx, ty, mipmap_level)
+            entry = self._tiles.get(key)
+            if entry is None:
+                entry = (
+                    tiledsurface.new_tile_array(),
+                    tiledsurface.new_tile_array() if flatten else None,
+                )
+                missing.append((tx, ty, entry))
+            entries.append(entry)
+        if missing:
+            stack._process_ops_batch(
+                below[0], below[1],
+                [(tx, ty, e[0]) for (tx, ty, e) in missing],
+                dst_has_alpha, mipmap_level,
+            )
+            if flatten:
+                # Isolated, like a group
+                stack._process_ops_batch(
+                    above[0], above[1],
+                    [(tx, ty, e[1]) for (tx, ty, e) in missing],
+                    True, mipmap_level,
+                )
+            for (tx, ty, entry) in missing:
+                self._tiles[(tx, ty, mipmap_level)] = entry
+
+        for (tx, ty, dst), (below_tile, above_tile) in zip(tiles, entries):
+            lib.mypaintlib.tile_copy_rgba16_into_rgba16(below_tile, dst)
+        stack._process_ops_batch(
+            item[0], item[1], tiles,
+            dst_has_alpha, mipmap_level,
+        )
+        if flatten:
+            lib.mypaintlib.tile_combine_many([
+                (lib.mypaintlib.CombineNormal, above_tile, dst,
+                 dst_has_alpha, 1.0)
+                for (tx, ty, dst), (below_tile, above_tile)
+                in zip(tiles, entries)
+            ])
+        elif above[0]:
+            stack._process_ops_batch(
+                above[0], above[1], tiles,
+                dst_has_alpha, mipmap_level,
+            )
+
+
 ## Layer path tuple functions
 
 
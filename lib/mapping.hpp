@@ -20,12 +20,17 @@
 
 #include <mypaint-mapping.h>
 
+#include <cstddef>
+#include <vector>
+
 // user-defined mappings
 // (the curves you can edit in the brush settings)
 class MappingWrapper {
 
 public:
-  MappingWrapper(int inputs_) {
+  MappingWrapper(int inputs_)
+    : points(inputs_), luts(inputs_), compiled(false), lut_valid(false)
+  {
       c_mapping = mypaint_mapping_new(inputs_);
   }
   ~MappingWrapper() {
@@ -35,11 +40,21 @@ public:
   void set_n (int input, int n)
   {
       mypaint_mapping_set_n(c_mapping, input, n);
+      if (input >= 0 && input < (int)points.size()) {
+          points[input].resize(n);
+      }
+      invalidate();
   }
 
   void set_point (int input, int index, float x, float y)
   {
       mypaint_mapping_set_point(c_mapping, input, index, x, y);
+      if (input >= 0 && input < (int)points.size()
+          && index >= 0 && index < (int)points[input].size()) {
+          points[input][index].x = x;
+          points[input][index].y = y;
+      }
+      invalidate();
   }
 
   bool is_constant()
@@ -47,18 +62,165 @@ public:
     return mypaint_mapping_is_constant(c_mapping);
   }
 
+  // In compiled mode, each curve gets a lookup table the first time it is
+  // needed, from which its value is found with one multiply-add.
+  void set_compiled (bool compiled)
+  {
+      this->compiled = compiled;
+      invalidate();
+  }
+
+  bool get_compiled ()
+  {
+      return compiled;
+  }
+
+  // Drops the lookup tables. Called by set_n() and set_point().
+  void invalidate ()
+  {
+      lut_valid = false;
+  }
+
   float calculate (float * data)
   {
+      if (compiled) {
+          return calculate_compiled(data);
+      }
       return mypaint_mapping_calculate(c_mapping, data);
   }
 
   // used in python for the global pressure mapping
   float calculate_single_input (float input)
   {
+      if (compiled) {
+          return calculate_compiled(&input);
+      }
       return mypaint_mapping_calculate_single_input(c_mapping, input);
   }
+
 private:
+  static const int LUT_SIZE = 256;
+
+  struct ControlPoint {
+      float x, y;
+  };
+
+  // The segments of a curve as lines y = y0 + slope * (x - x0), ending at
+  // x1, and for each of LUT_SIZE equal cells over the range of the control
+  // points, the segment at its start. Lookups step over the few control
+  // points within a cell, so the results are those of libmypaint, which
+  // also extends the outermost segments beyond the control points.
+  struct CompiledCurve {
+      bool used;
+      bool exact; // control points out of order: don't use the table
+      float x_min, scale;
+      std::vector<float> x0, x1, y0, slope;
+      std::vector<unsigned short> cells;
+  };
+
+  // Same piecewise linear evaluation as mypaint_mapping_calculate(), for
+  // a single input
+  static float
+  evaluate (const std::vector<ControlPoint> &p, float x)
+  {
+      float x0 = p[0].x, y0 = p[0].y;
+      float x1 = p[1].x, y1 = p[1].y;
+      for (size_t i = 2; i < p.size() && x > x1; i++) {
+          x0 = x1; y0 = y1;
+          x1 = p[i].x; y1 = p[i].y;
+      }
+      if (x0 == x1 || y0 == y1) {
+          return y0;
+      }
+      return (y1*(x - x0) + y0*(x1 - x)) / (x1 - x0);
+  }
+
+  static void
+  compile_curve (const std::vector<ControlPoint> &p, CompiledCurve &c)
+  {
+      c.used = p.size() >= 2;
+      c.exact = false;
+      if (! c.used) {
+          return;
+      }
+      const size_t n_segs = p.size() - 1;
+      c.x0.resize(n_segs);
+      c.x1.resize(n_segs);
+      c.y0.resize(n_segs);
+      c.slope.resize(n_segs);
+      for (size_t i = 0; i < n_segs; ++i) {
+          const ControlPoint &a = p[i], &b = p[i+1];
+          if (b.x < a.x) {
+              c.exact = true;
+              return;
+          }
+          const bool flat = (a.x == b.x || a.y == b.y);
+          c.x0[i] = a.x;
+          c.x1[i] = b.x;
+          c.y0[i] = a.y;
+          c.slope[i] = flat ? 0 : (b.y - a.y) / (b.x - a.x);
+      }
+      c.x_min = p.front().x;
+      const float range = p.back().x - c.x_min;
+      c.scale = range > 0 ? LUT_SIZE / range : 0;
+      c.cells.resize(LUT_SIZE);
+      size_t seg = 0;
+      for (int i = 0; i < LUT_SIZE; ++i) {
+          const float x = c.x_min + i * range / LUT_SIZE;
+          while (seg + 1 < n_segs && x > c.x1[seg]) {
+              seg++;
+          }
+          c.cells[i] = seg;
+      }
+  }
+
+  void compile ()
+  {
+      for (size_t j = 0; j < points.size(); ++j) {
+          compile_curve(points[j], luts[j]);
+      }
+      lut_valid = true;
+  }
+
+  float calculate_compiled (const float * data)
+  {
+      if (! lut_valid) {
+          compile();
+      }
+      float result = 0;
+      for (size_t j = 0; j < luts.size(); ++j) {
+          const CompiledCurve &c = luts[j];
+          if (! c.used) {
+              continue;
+          }
+          const float x = data[j];
+          if (c.exact) {
+              result += evaluate(points[j], x);
+              continue;
+          }
+          const float f = (x - c.x_min) * c.scale;
+          int cell = 0;
+          if (f >= LUT_SIZE) {
+              cell = LUT_SIZE - 1;
+          }
+          else if (f > 0) {
+              cell = (int)f;
+          }
+          size_t seg = c.cells[cell];
+          const size_t last = c.x1.size() - 1;
+          while (seg < last && x > c.x1[seg]) {
+              seg++;
+          }
+          result += c.y0[seg] + c.slope[seg] * (x - c.x0[seg]);
+      }
+      return result;
+  }
+
   MyPaintMapping *c_mapping;
+  std::vector<std::vector<ControlPoint>> points;
+  std::vector<CompiledCurve> luts;
+  bool compiled;
+  bool lut_valid;
 };
 
 #endif //MAPPING_HPP
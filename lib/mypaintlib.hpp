@@ -19,14 +19,21 @@
 
 #include "pixops.hpp"
 #include "colorring.hpp"
+#include "colorchanger_cache.hpp"
 #include "colorchanger_wash.hpp"
 #include "colorchanger_crossed_bowl.hpp"
 #include "gdkpixbuf2numpy.hpp"
 #include "fastpng.hpp"
+#include "strokeindex.hpp"
+#include "tilepool.hpp"
+#include "tracing.hpp"
 #include "fill/fill_constants.hpp"
 #include "fill/fill_common.hpp"
 #include "fill/floodfill.hpp"
 #include "fill/gap_detection.hpp"
 #include "fill/blur.hpp"
 #include "fill/morphology.hpp"
+#include "fill/morph_blur.hpp"
+#include "fill/parallel_fill.hpp"
+#include "fill/tile_occupancy.hpp"
 #include "brushsettings.hpp"
@@ -13,7 +13,6 @@
 %include "std_vector.i"
 namespace std {
    %template(IntVector) vector<int>;
-   %template(RectVector) vector<vector<int>>;
    %template(DoubleVector) vector<double>;
 }
 
@@ -31,6 +30,9 @@ typedef struct { int x, y, w, h; } Rect;
 %include "colorchanger_wash.hpp"
 %include "colorchanger_crossed_bowl.hpp"
 %include "fastpng.hpp"
+%include "strokeindex.hpp"
+%include "tilepool.hpp"
+%include "tracing.hpp"
 
 %include "fill/fill_constants.hpp"
 %include "fill/floodfill.hpp"
@@ -42,11 +44,17 @@ public:
     void stop();
     void inc_processed(int incr);
     int num_processed();
+    int num_skipped();
+    double stage_seconds();
+    double worker_imbalance();
     void reset();
 };
 
 %include "fill/morphology_swig.hpp"
 %include "fill/blur_swig.hpp"
+%include "fill/morph_blur.hpp"
+%include "fill/parallel_fill.hpp"
+%include "fill/tile_occupancy.hpp"
 %include "brushsettings.hpp"
 
 %include "gdkpixbuf2numpy.hpp"
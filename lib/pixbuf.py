@@ -172,6 +172,55 @@ def load_from_zipfile(datazip, filename, progress=None):
     if progress.items is not None:
         raise ValueError("progress argument must be unsized")
 
+    datafp, info = _open_zipfile_member(datazip, filename)
+    progress.items = info.file_size
+    pixbuf = load_from_stream(datafp, progress=progress)
+    datafp.close()
+    progress.close()
+    return pixbuf
+
+
+def read_from_zipfile(datazip, filename, progress=None):
+    """Read the undecoded data of a pixbuf's zipfile entry
+
+    :param zipfile.ZipFile datazip: ZipFile object opened for extracting
+    :param unicode filename: pixbuf entry (file name) in the zipfile
+    :param progress: Provides UI feedback. Must be unsized or None.
+    :type progress: lib.feedback.Progress or None
+    :rtype: bytes
+    :returns: the data, for load_from_stream() to decode later
+
+    This is what load_from_zipfile() does before it decodes anything,
+    so the data is read in the same way, and from the same entries.
+
+    >>> import zipfile
+    >>> with zipfile.ZipFile("tests/smallimage.ora", mode="r") as z:
+    ...     data = read_from_zipfile(z, "Thumbnails/thumbnail.png")
+    >>> data[1:4] == b"PNG"
+    True
+
+    """
+    if not progress:
+        progress = lib.feedback.Progress()
+    if progress.items is not None:
+        raise ValueError("progress argument must be unsized")
+
+    datafp, info = _open_zipfile_member(datazip, filename)
+    progress.items = info.file_size
+    chunks = []
+    while True:
+        buf = datafp.read(LOAD_CHUNK_SIZE)
+        if buf == b"":
+            break
+        chunks.append(buf)
+        progress += len(buf)
+    datafp.close()
+    progress.close()
+    return b"".join(chunks)
+
+
+def _open_zipfile_member(datazip, filename):
+    """Open a zipfile entry for reading: returns (fp, zipinfo)"""
     try:
         datafp = datazip.open(filename, mode='r')
         info = datazip.getinfo(filename)
@@ -184,12 +233,7 @@ def load_from_zipfile(datazip, filename, progress=None):
                        'filename that does not have the utf-8 '
                        'flag set: %r', filename)
         info = datazip.getinfo(filename_enc)
-
-    progress.items = info.file_size
-    pixbuf = load_from_stream(datafp, progress=progress)
-    datafp.close()
-    progress.close()
-    return pixbuf
+    return datafp, info
 
 
 ## Module testing
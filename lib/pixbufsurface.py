@@ -17,6 +17,7 @@ from logging import getLogger
 from gi.repository import GdkPixbuf
 from gi.repository import Gdk
 import cairo
+import numpy as np
 
 from . import mypaintlib
 from . import helpers
@@ -187,6 +188,88 @@ class Surface (TileAccessible, TileBlittable):
         pixbuf.copy_area(0, 0, self.w, self.h, self.epixbuf, dx, dy)
 
 
+class CairoSurface (TileAccessible):
+    """Tile-accessible 8bpc staging area for a cairo image surface.
+
+    Tiles are rendered into RGBA arrays, like those of Surface, but are
+    then written straight into a cairo.ImageSurface by flush(), all in
+    one native batch. Display redraws use this instead of Surface: no
+    GdkPixbuf needs to be made and wrapped, and painting the result
+    takes no further conversion like Gdk.cairo_set_source_pixbuf()'s.
+
+    """
+
+    def __init__(self, x, y, w, h):
+        super(CairoSurface, self).__init__()
+        assert w > 0 and h > 0
+        self.x, self.y, self.w, self.h = x, y, w, h
+        tx0 = x // N
+        ty0 = y // N
+        tx1 = (x + w - 1) // N
+        ty1 = (y + h - 1) // N
+        self._tiles = [
+            (tx, ty)
+            for ty in range(ty0, ty1 + 1)
+            for tx in range(tx0, tx1 + 1)
+        ]
+        self._tile_arrays = {}
+        try:
+            self.cairo_surface = cairo.ImageSurface(
+                cairo.FORMAT_ARGB32, w, h,
+            )
+        except Exception:
+            logger.exception("cairo.ImageSurface() failed")
+            raise AllocationError(_POSSIBLE_OOM_USERTEXT)
+
+    def get_bbox(self):
+        return lib.surface.get_tiles_bbox(self.get_tiles())
+
+    def get_tiles(self):
+        return self._tiles
+
+    @contextlib.contextmanager
+    def tile_request(self, tx, ty, readonly):
+        """Access memory by tile (lib.surface.TileAccessible impl.)
+
+        Tiles read as transparent until written, and are only copied
+        into the cairo surface by flush().
+
+        """
+        arr = self._tile_arrays.get((tx, ty))
+        if arr is None:
+            arr = mypaintlib.tile_pool_new(mypaintlib.TilePoolRGBA8)
+            self._tile_arrays[(tx, ty)] = arr
+        yield arr
+
+    def fill(self, rgba):
+        """Fills the whole cairo surface with a colour
+
+        :param tuple rgba: Components of the colour, in [0, 1]
+
+        Tiles written by flush() replace it.
+
+        """
+        cr = cairo.Context(self.cairo_surface)
+        cr.set_operator(cairo.OPERATOR_SOURCE)
+        cr.set_source_rgba(*rgba)
+        cr.paint()
+
+    def flush(self):
+        """Writes the tiles requested so far into the cairo surface"""
+        surf = self.cairo_surface
+        surf.flush()
+        jobs = [
+            (arr, tx * N - self.x, ty * N - self.y)
+            for ((tx, ty), arr) in self._tile_arrays.items()
+        ]
+        mypaintlib.tile_rgba8_to_cairo_many(
+            jobs, surf.get_data(),
+            surf.get_width(), surf.get_height(), surf.get_stride(),
+        )
+        surf.mark_dirty()
+        self._tile_arrays.clear()
+
+
 def render_as_pixbuf(surface, x=None, y=None, w=None, h=None,
                      alpha=False, mipmap_level=0,
                      progress=None,
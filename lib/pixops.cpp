@@ -12,7 +12,10 @@
 #include "common.hpp"
 #include "compositing.hpp"
 #include "blending.hpp"
+#include "compositing_simd.hpp"
 #include "fastapprox/fastpow.h"
+#include "fastapprox_batch.hpp"
+#include "tracing.hpp"
 
 #include <mypaint-tiled-surface.h>
 
@@ -24,13 +27,47 @@
 #include <numpy/arrayobject.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 void
 tile_downscale_rgba16_c(const uint16_t *src, int src_strides, uint16_t *dst,
                         int dst_strides, int dst_x, int dst_y)
 {
+#ifdef __SSE2__
+  // Two output pixels at a time. Each input channel is quartered before
+  // summing, exactly like the scalar code below, so the sums fit in 16 bits.
+  for (int y=0; y<MYPAINT_TILE_SIZE/2; y++) {
+    const uint16_t * src_p = (const uint16_t*)((const char *)src + (2*y)*src_strides);
+    const uint16_t * src_p2 = src_p + 4*MYPAINT_TILE_SIZE;
+    uint16_t * dst_p = (uint16_t*)((char *)dst + (y+dst_y)*dst_strides);
+    dst_p += 4*dst_x;
+    for(int x=0; x<MYPAINT_TILE_SIZE/2; x+=2) {
+      const __m128i a0 = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)src_p), 2);
+      const __m128i a1 = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src_p+8)), 2);
+      const __m128i b0 = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)src_p2), 2);
+      const __m128i b1 = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src_p2+8)), 2);
+      const __m128i v0 = _mm_add_epi16(a0, b0);  // pixels 0, 1
+      const __m128i v1 = _mm_add_epi16(a1, b1);  // pixels 2, 3
+      const __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(v0, v1),
+                                        _mm_unpackhi_epi64(v0, v1));
+      _mm_storeu_si128((__m128i *)dst_p, sum);
+      src_p += 16;
+      src_p2 += 16;
+      dst_p += 8;
+    }
+  }
+#else
   for (int y=0; y<MYPAINT_TILE_SIZE/2; y++) {
     uint16_t * src_p = (uint16_t*)((char *)src + (2*y)*src_strides);
     uint16_t * dst_p = (uint16_t*)((char *)dst + (y+dst_y)*dst_strides);
@@ -44,6 +81,7 @@ tile_downscale_rgba16_c(const uint16_t *src, int src_strides, uint16_t *dst,
       dst_p += 4;
     }
   }
+#endif
 }
 
 void tile_downscale_rgba16(PyObject *src, PyObject *dst, int dst_x, int dst_y) {
@@ -175,6 +213,138 @@ static void precalculate_dithering_noise_if_required()
   }
 }
 
+
+// 8-bit output lookup tables for EOTFs other than 1.0
+//
+// The EOTF conversions below cost a fastpow() per channel. Their colour
+// dithering noise is a few millionths of an output step, so the result
+// really only depends on the 15-bit input value and can be looked up.
+// The tables are made with the noise's mean value. They differ from
+// evaluating each pixel by one step in about one case in ten thousand,
+// where fastpow() lands right on a rounding boundary.
+
+static const uint32_t eotf_lut_max_index = 1<<15;
+static const int eotf_lut_size = eotf_lut_max_index + 1;
+static const int eotf_lut_max_tables = 16;
+static const uint32_t dithering_noise_mean = (1<<15) * 2/256 + (1<<15) * 5/256/2;
+
+struct EOTFLookupTable
+{
+  float EOTF;
+  bool rounded;  // round to nearest, instead of truncating
+  uint8_t out[eotf_lut_size];
+};
+
+// Out of range input is clamped, rather than read past a table's end
+
+static inline uint32_t
+eotf_lut_index (const uint32_t v)
+{
+  return v < eotf_lut_max_index ? v : eotf_lut_max_index;
+}
+
+// Returns the table for an EOTF, making it on first use, or NULL if too
+// many different EOTFs have been used already.
+
+static const uint8_t *
+eotf_lookup_table (const float EOTF, const bool rounded)
+{
+  static std::mutex tables_lock;
+  static std::vector<EOTFLookupTable *> tables;
+  std::lock_guard<std::mutex> guard(tables_lock);
+  for (size_t i = 0; i < tables.size(); ++i) {
+    if (tables[i]->EOTF == EOTF && tables[i]->rounded == rounded) {
+      return tables[i]->out;
+    }
+  }
+  if (tables.size() >= (size_t)eotf_lut_max_tables) {
+    return NULL;
+  }
+  // Same expressions as the per-pixel code
+  EOTFLookupTable *table = new EOTFLookupTable;
+  table->EOTF = EOTF;
+  table->rounded = rounded;
+  const float add = (float)dithering_noise_mean / (1<<30);
+  std::vector<float> values(eotf_lut_size);
+  for (int i = 0; i < eotf_lut_size; ++i) {
+    const float c = (float)i / (1<<15);
+    values[i] = c + add;
+  }
+  fastpow_n(&values[0], 1.0/EOTF, &values[0], eotf_lut_size);
+  for (int i = 0; i < eotf_lut_size; ++i) {
+    if (rounded) {
+      table->out[i] = (values[i] ) * 255 + 0.5;
+    }
+    else {
+      table->out[i] = uint8_t(values[i] * 255);
+    }
+  }
+  tables.push_back(table);
+  return table->out;
+}
+
+
+void
+tile_convert_prepare (const float EOTF)
+{
+  precalculate_dithering_noise_if_required();
+  if (EOTF != 1.0) {
+    eotf_lookup_table(EOTF, false);
+    eotf_lookup_table(EOTF, true);
+  }
+}
+
+
+// Un-premultiplies a row of pixels with rounding into "dst", which has
+// four uint32_t per pixel. Colour channels become ((c << 15) + a/2) / a,
+// or 0 where alpha is 0. Alpha is copied.
+
+static inline void
+unpremultiply_row (const uint16_t *src, uint32_t *dst)
+{
+#ifdef __SSE2__
+  // The numerators are below 2^31, and a quotient that is not an integer
+  // is at least 1/a away from one, so truncating the double precision
+  // quotient gives the integer result.
+  const __m128i zero = _mm_setzero_si128();
+  for (int x=0; x<MYPAINT_TILE_SIZE; x+=2) {
+    const __m128i px = _mm_loadu_si128((const __m128i *)(src + 4*x));
+    for (int i=0; i<2; i++) {
+      const __m128i c = i ? _mm_unpackhi_epi16(px, zero)
+                          : _mm_unpacklo_epi16(px, zero);
+      const __m128i a = _mm_shuffle_epi32(c, _MM_SHUFFLE(3, 3, 3, 3));
+      const __m128i num = _mm_add_epi32(_mm_slli_epi32(c, 15),
+                                        _mm_srli_epi32(a, 1));
+      const __m128d div = _mm_cvtepi32_pd(a);
+      const __m128i q_lo = _mm_cvttpd_epi32(
+          _mm_div_pd(_mm_cvtepi32_pd(num), div));
+      const __m128i q_hi = _mm_cvttpd_epi32(
+          _mm_div_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(num, num)), div));
+      const __m128i q = _mm_andnot_si128(_mm_cmpeq_epi32(a, zero),
+                                         _mm_unpacklo_epi64(q_lo, q_hi));
+      uint32_t *dst_p = dst + 4*(x+i);
+      _mm_storeu_si128((__m128i *)dst_p, q);
+      dst_p[3] = src[4*(x+i)+3];
+    }
+  }
+#else
+  for (int x=0; x<MYPAINT_TILE_SIZE; x++) {
+    const uint32_t a = src[3];
+    if (a != 0) {
+      const uint32_t rnd_a = a/2;
+      dst[0] = (((uint32_t)src[0] << 15) + rnd_a) / a;
+      dst[1] = (((uint32_t)src[1] << 15) + rnd_a) / a;
+      dst[2] = (((uint32_t)src[2] << 15) + rnd_a) / a;
+    } else {
+      dst[0] = dst[1] = dst[2] = 0;
+    }
+    dst[3] = a;
+    src += 4;
+    dst += 4;
+  }
+#endif
+}
+
 // Used for saving layers (transparent PNG), and for display when there
 // can be transparent areas in the output.
 
@@ -185,26 +355,20 @@ tile_convert_rgba16_to_rgba8_const_c (const uint16_t* const src,
 				      const int dst_strides)
 {
   precalculate_dithering_noise_if_required();
+  uint32_t row[MYPAINT_TILE_SIZE*4];
 
   for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
     int noise_idx = y*MYPAINT_TILE_SIZE*4;
     const uint16_t *src_p = (uint16_t*)((char *)src + y*src_strides);
     uint8_t *dst_p = (uint8_t*)((char *)dst + y*dst_strides);
+    // un-premultiply alpha (with rounding)
+    unpremultiply_row(src_p, row);
+    const uint32_t *row_p = row;
     for (int x=0; x<MYPAINT_TILE_SIZE; x++) {
-      uint32_t r, g, b, a;
-      r = *src_p++;
-      g = *src_p++;
-      b = *src_p++;
-      a = *src_p++;
-      // un-premultiply alpha (with rounding)
-      if (a != 0) {
-        const uint32_t rnd_a = a/2;
-        r = ((r << 15) + rnd_a) / a;
-        g = ((g << 15) + rnd_a) / a;
-        b = ((b << 15) + rnd_a) / a;
-      } else {
-        r = g = b = 0;
-      }
+      const uint32_t r = *row_p++;
+      const uint32_t g = *row_p++;
+      const uint32_t b = *row_p++;
+      const uint32_t a = *row_p++;
       const uint32_t add_r = dithering_noise[noise_idx+0];
       const uint32_t add_g = add_r; // hm... do not produce too much color noise
       const uint32_t add_b = add_r;
@@ -217,16 +381,14 @@ tile_convert_rgba16_to_rgba8_const_c (const uint16_t* const src,
       *dst_p++ = (b * 255 + add_b) / (1<<15);
       *dst_p++ = (a * 255 + add_a) / (1<<15);
     }
-    src_p += src_strides;
-    dst_p += dst_strides;
   }
 }
 
 
-static inline void
+void
 tile_convert_rgba16_to_rgba8_c (const uint16_t* const src,
                                 const int src_strides,
-                                const uint8_t* dst,
+                                uint8_t* const dst,
                                 const int dst_strides,
                                 const float EOTF)
 {
@@ -236,6 +398,27 @@ tile_convert_rgba16_to_rgba8_c (const uint16_t* const src,
   }
   precalculate_dithering_noise_if_required();
 
+  const uint8_t *lut = eotf_lookup_table(EOTF, false);
+  if (lut) {
+    uint32_t row[MYPAINT_TILE_SIZE*4];
+    for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
+      int noise_idx = y*MYPAINT_TILE_SIZE*4;
+      const uint16_t *src_p = (uint16_t*)((char *)src + y*src_strides);
+      uint8_t *dst_p = (uint8_t*)((char *)dst + y*dst_strides);
+      unpremultiply_row(src_p, row);
+      const uint32_t *row_p = row;
+      for (int x=0; x<MYPAINT_TILE_SIZE; x++) {
+        const uint32_t add_a = dithering_noise[noise_idx+1];
+        noise_idx += 4;
+        *dst_p++ = lut[eotf_lut_index(*row_p++)];
+        *dst_p++ = lut[eotf_lut_index(*row_p++)];
+        *dst_p++ = lut[eotf_lut_index(*row_p++)];
+        *dst_p++ = ((*row_p++ * 255 + add_a) / (1<<15));
+      }
+    }
+    return;
+  }
+
   for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
     int noise_idx = y*MYPAINT_TILE_SIZE*4;
     const uint16_t *src_p = (uint16_t*)((char *)src + y*src_strides);
@@ -387,10 +570,10 @@ tile_convert_rgbu16_to_rgbu8_const_c(const uint16_t *const src,
   }
 }
 
-static inline void
+void
 tile_convert_rgbu16_to_rgbu8_c(const uint16_t* const src,
                                const int src_strides,
-                               const uint8_t* dst,
+                               uint8_t* const dst,
                                const int dst_strides,
                                const float EOTF)
 {
@@ -400,6 +583,22 @@ tile_convert_rgbu16_to_rgbu8_c(const uint16_t* const src,
   }
   precalculate_dithering_noise_if_required();
 
+  const uint8_t *lut = eotf_lookup_table(EOTF, true);
+  if (lut) {
+    for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
+      const uint16_t *src_p = (uint16_t*)((char *)src + y*src_strides);
+      uint8_t *dst_p = (uint8_t*)((char *)dst + y*dst_strides);
+      for (int x=0; x<MYPAINT_TILE_SIZE; x++) {
+        *dst_p++ = lut[eotf_lut_index(*src_p++)];
+        *dst_p++ = lut[eotf_lut_index(*src_p++)];
+        *dst_p++ = lut[eotf_lut_index(*src_p++)];
+        *dst_p++ = 255;
+        src_p++; // alpha unused
+      }
+    }
+    return;
+  }
+
   for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
     int noise_idx = y*MYPAINT_TILE_SIZE*4;
     const uint16_t *src_p = (uint16_t*)((char *)src + y*src_strides);
@@ -525,6 +724,17 @@ void tile_convert_rgba8_to_rgba16(PyObject * src, PyObject * dst, const float EO
   assert(PyArray_STRIDES(src_arr)[2] ==   sizeof(uint8_t));
 #endif
 
+  // There are only 256 possible inputs, so convert all of them at once
+  float linear[256];
+  for (int i=0; i<256; i++) {
+    linear[i] = (float)i/255.0;
+  }
+  fastpow_n(linear, EOTF, linear, 256);
+  uint32_t to_fix15[256];
+  for (int i=0; i<256; i++) {
+    to_fix15[i] = uint32_t(linear[i] * (1<<15) + 0.5);
+  }
+
   for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
     uint8_t  * src_p = (uint8_t*)((char *)PyArray_DATA(src_arr) + y*PyArray_STRIDES(src_arr)[0]);
     uint16_t * dst_p = (uint16_t*)((char *)PyArray_DATA(dst_arr) + y*PyArray_STRIDES(dst_arr)[0]);
@@ -536,9 +746,9 @@ void tile_convert_rgba8_to_rgba16(PyObject * src, PyObject * dst, const float EO
       a = *src_p++;
 
       // convert to fixed point (with rounding)
-      r = uint32_t(fastpow((float)r/255.0, EOTF) * (1<<15) + 0.5);
-      g = uint32_t(fastpow((float)g/255.0, EOTF) * (1<<15) + 0.5);
-      b = uint32_t(fastpow((float)b/255.0, EOTF) * (1<<15) + 0.5);
+      r = to_fix15[r];
+      g = to_fix15[g];
+      b = to_fix15[b];
       a = (a * (1<<15) + 255/2) / 255;
 
       // premultiply alpha (with rounding), save back
@@ -551,29 +761,85 @@ void tile_convert_rgba8_to_rgba16(PyObject * src, PyObject * dst, const float EO
 }
 
 
-void tile_rgba2flat(PyObject * dst_obj, PyObject * bg_obj) {
-  PyArrayObject* bg = ((PyArrayObject*)bg_obj);
-  PyArrayObject* dst = ((PyArrayObject*)dst_obj);
+// Both row functions below work on "n" pixels of a tile. Their vector code
+// gives the same results as the scalar code.
 
-#ifdef HEAVY_DEBUG
-  assert(PyArray_Check(dst_obj));
-  assert(PyArray_DIM(dst, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst, 1) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst, 2) == 4);
-  assert(PyArray_TYPE(dst) == NPY_UINT16);
-  assert(PyArray_ISCARRAY(dst));
+#ifdef __SSE2__
 
-  assert(PyArray_Check(bg_obj));
-  assert(PyArray_DIM(bg, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(bg, 1) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(bg, 2) == 4);
-  assert(PyArray_TYPE(bg) == NPY_UINT16);
-  assert(PyArray_ISCARRAY(bg));
-#endif
+// (a * b) >> 15 for each uint16 pair, exact for a, b <= 1<<15
+static inline __m128i
+mul_fix15_epu16 (const __m128i a, const __m128i b)
+{
+  return _mm_or_si128(_mm_slli_epi16(_mm_mulhi_epu16(a, b), 1),
+                      _mm_srli_epi16(_mm_mullo_epi16(a, b), 15));
+}
+
+// Packs two vectors of int32 values in [0, 1<<15] into one of uint16
+static inline __m128i
+pack_fix15_epi32 (const __m128i lo, const __m128i hi)
+{
+  const __m128i bias = _mm_set1_epi32(1<<15);
+  const __m128i packed = _mm_packs_epi32(_mm_sub_epi32(lo, bias),
+                                         _mm_sub_epi32(hi, bias));
+  return _mm_add_epi16(packed, _mm_set1_epi16((short)(1<<15)));
+}
+
+// Larger of two int32 vectors, for SSE2 which has no pmaxsd
+static inline __m128i
+max_epi32_sse2 (const __m128i a, const __m128i b)
+{
+  const __m128i gt = _mm_cmpgt_epi32(a, b);
+  return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
+
+// Splits four RGBA pixels into their channels: "rg" gets the four reds,
+// then the four greens, and "ba" gets the blues and then the alphas.
+static inline void
+deinterleave_rgba16 (const uint16_t *p, __m128i &rg, __m128i &ba)
+{
+  const __m128i p01 = _mm_loadu_si128((const __m128i *)p);
+  const __m128i p23 = _mm_loadu_si128((const __m128i *)(p + 8));
+  const __m128i t0 = _mm_unpacklo_epi16(p01, p23);
+  const __m128i t1 = _mm_unpackhi_epi16(p01, p23);
+  rg = _mm_unpacklo_epi16(t0, t1);
+  ba = _mm_unpackhi_epi16(t0, t1);
+}
 
-  uint16_t * dst_p  = (uint16_t*)PyArray_DATA(dst);
-  uint16_t * bg_p  = (uint16_t*)PyArray_DATA(bg);
-  for (int i=0; i<MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE; i++) {
+// The inverse of deinterleave_rgba16()
+static inline void
+interleave_rgba16 (uint16_t *p, const __m128i rg, const __m128i ba)
+{
+  const __m128i t0 = _mm_unpacklo_epi16(rg, ba);
+  const __m128i t1 = _mm_unpackhi_epi16(rg, ba);
+  _mm_storeu_si128((__m128i *)p, _mm_unpacklo_epi16(t0, t1));
+  _mm_storeu_si128((__m128i *)(p + 8), _mm_unpackhi_epi16(t0, t1));
+}
+
+#endif /* #ifdef __SSE2__ */
+
+
+static void
+tile_rgba2flat_row (uint16_t *dst_p, const uint16_t *bg_p, const int n)
+{
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i one = _mm_set1_epi16((short)(1<<15));
+  const __m128i rgb_mask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+  for (; i+2 <= n; i += 2) {
+    const __m128i dst = _mm_loadu_si128((const __m128i *)dst_p);
+    const __m128i bg = _mm_loadu_si128((const __m128i *)bg_p);
+    __m128i alpha = _mm_shufflelo_epi16(dst, _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+    const __m128i one_minus_top_alpha =
+      _mm_and_si128(_mm_sub_epi16(one, alpha), rgb_mask);
+    const __m128i res = _mm_add_epi16(dst,
+                                      mul_fix15_epu16(one_minus_top_alpha, bg));
+    _mm_storeu_si128((__m128i *)dst_p, res);
+    dst_p += 8;
+    bg_p += 8;
+  }
+#endif /* #ifdef __SSE2__ */
+  for (; i<n; i++) {
     // resultAlpha = 1.0 (thus it does not matter if resultColor is premultiplied alpha or not)
     // resultColor = topColor + (1.0 - topAlpha) * bottomColor
     const uint32_t one_minus_top_alpha = (1<<15) - dst_p[3];
@@ -586,29 +852,80 @@ void tile_rgba2flat(PyObject * dst_obj, PyObject * bg_obj) {
 }
 
 
-void tile_flat2rgba(PyObject * dst_obj, PyObject * bg_obj) {
-
-  PyArrayObject *dst = (PyArrayObject *)dst_obj;
-  PyArrayObject *bg = (PyArrayObject *)bg_obj;
-#ifdef HEAVY_DEBUG
-  assert(PyArray_Check(dst_obj));
-  assert(PyArray_DIM(dst, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst, 1) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(dst, 2) == 4);
-  assert(PyArray_TYPE(dst) == NPY_UINT16);
-  assert(PyArray_ISCARRAY(dst));
+static void
+tile_flat2rgba_row (uint16_t *dst_p, const uint16_t *bg_p, const int n)
+{
+  int i = 0;
+#ifdef __SSE2__
+  // Four pixels at a time, with one channel of all of them in each vector.
+  // As in the unpremultiplying code above, truncating the double precision
+  // quotients gives the integer results: the numerators are below 2^31.
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi32(1<<15);
+  for (; i+4 <= n; i += 4) {
+    __m128i dst_rg, dst_ba, bg_rg, bg_ba;
+    deinterleave_rgba16(dst_p, dst_rg, dst_ba);
+    deinterleave_rgba16(bg_p, bg_rg, bg_ba);
+    const __m128i d[3] = {
+      _mm_unpacklo_epi16(dst_rg, zero),
+      _mm_unpackhi_epi16(dst_rg, zero),
+      _mm_unpacklo_epi16(dst_ba, zero),
+    };
+    const __m128i b[3] = {
+      _mm_unpacklo_epi16(bg_rg, zero),
+      _mm_unpackhi_epi16(bg_rg, zero),
+      _mm_unpacklo_epi16(bg_ba, zero),
+    };
 
-  assert(PyArray_Check(bg_obj));
-  assert(PyArray_DIM(bg, 0) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(bg, 1) == MYPAINT_TILE_SIZE);
-  assert(PyArray_DIM(bg, 2) == 4);
-  assert(PyArray_TYPE(bg) == NPY_UINT16);
-  assert(PyArray_ISCARRAY(bg));
-#endif
+    // 1. calculate final dst.alpha
+    __m128i final_alpha = _mm_unpackhi_epi16(dst_ba, zero);
+    __m128i color_change[3];
+    for (int c=0; c<3; c++) {
+      const __m128i cc = _mm_sub_epi32(d[c], b[c]);
+      const __m128i pos = _mm_cmpgt_epi32(cc, zero);
+      const __m128i neg = _mm_cmpgt_epi32(zero, cc);
+      const __m128i num = _mm_slli_epi32(
+        _mm_sub_epi32(_mm_xor_si128(cc, neg), neg), 15);
+      // unchanged channels divide 0 by 1
+      __m128i den = _mm_or_si128(_mm_and_si128(pos, _mm_sub_epi32(one, b[c])),
+                                 _mm_and_si128(neg, b[c]));
+      den = _mm_or_si128(den, _mm_andnot_si128(_mm_or_si128(pos, neg),
+                                               _mm_set1_epi32(1)));
+      const __m128i q_lo = _mm_cvttpd_epi32(
+        _mm_div_pd(_mm_cvtepi32_pd(num), _mm_cvtepi32_pd(den)));
+      const __m128i q_hi = _mm_cvttpd_epi32(
+        _mm_div_pd(_mm_cvtepi32_pd(_mm_srli_si128(num, 8)),
+                   _mm_cvtepi32_pd(_mm_srli_si128(den, 8))));
+      const __m128i minimal_alpha = _mm_unpacklo_epi64(q_lo, q_hi);
+      final_alpha = max_epi32_sse2(final_alpha, minimal_alpha);
+      color_change[c] = cc;
+    }
 
-  uint16_t * dst_p  = (uint16_t*)PyArray_DATA(dst);
-  uint16_t * bg_p  = (uint16_t*)PyArray_DATA(bg);
-  for (int i=0; i<MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE; i++) {
+    // 2. calculate dst.color and update dst
+    const __m128i alpha16 = pack_fix15_epi32(final_alpha, final_alpha);
+    const __m128i scaled_rg = mul_fix15_epu16(bg_rg, alpha16);
+    const __m128i scaled_ba = mul_fix15_epu16(bg_ba, alpha16);
+    const __m128i scaled[3] = {
+      _mm_unpacklo_epi16(scaled_rg, zero),
+      _mm_unpackhi_epi16(scaled_rg, zero),
+      _mm_unpacklo_epi16(scaled_ba, zero),
+    };
+    __m128i res[3];
+    for (int c=0; c<3; c++) {
+      __m128i r = _mm_add_epi32(scaled[c], color_change[c]);
+      // fix rounding errors
+      r = _mm_andnot_si128(_mm_cmpgt_epi32(zero, r), r);
+      const __m128i over = _mm_cmpgt_epi32(r, final_alpha);
+      res[c] = _mm_or_si128(_mm_and_si128(over, final_alpha),
+                            _mm_andnot_si128(over, r));
+    }
+    interleave_rgba16(dst_p, pack_fix15_epi32(res[0], res[1]),
+                      pack_fix15_epi32(res[2], final_alpha));
+    dst_p += 16;
+    bg_p += 16;
+  }
+#endif /* #ifdef __SSE2__ */
+  for (; i<n; i++) {
 
     // 1. calculate final dst.alpha
     uint16_t final_alpha = dst_p[3];
@@ -654,6 +971,175 @@ void tile_flat2rgba(PyObject * dst_obj, PyObject * bg_obj) {
 }
 
 
+void tile_rgba2flat(PyObject * dst_obj, PyObject * bg_obj) {
+  PyArrayObject* bg = ((PyArrayObject*)bg_obj);
+  PyArrayObject* dst = ((PyArrayObject*)dst_obj);
+
+#ifdef HEAVY_DEBUG
+  assert(PyArray_Check(dst_obj));
+  assert(PyArray_DIM(dst, 0) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst, 2) == 4);
+  assert(PyArray_TYPE(dst) == NPY_UINT16);
+  assert(PyArray_ISCARRAY(dst));
+
+  assert(PyArray_Check(bg_obj));
+  assert(PyArray_DIM(bg, 0) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(bg, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(bg, 2) == 4);
+  assert(PyArray_TYPE(bg) == NPY_UINT16);
+  assert(PyArray_ISCARRAY(bg));
+#endif
+
+  tile_rgba2flat_row((uint16_t *)PyArray_DATA(dst),
+                     (const uint16_t *)PyArray_DATA(bg),
+                     MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE);
+}
+
+
+void tile_flat2rgba(PyObject * dst_obj, PyObject * bg_obj) {
+
+  PyArrayObject *dst = (PyArrayObject *)dst_obj;
+  PyArrayObject *bg = (PyArrayObject *)bg_obj;
+#ifdef HEAVY_DEBUG
+  assert(PyArray_Check(dst_obj));
+  assert(PyArray_DIM(dst, 0) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(dst, 2) == 4);
+  assert(PyArray_TYPE(dst) == NPY_UINT16);
+  assert(PyArray_ISCARRAY(dst));
+
+  assert(PyArray_Check(bg_obj));
+  assert(PyArray_DIM(bg, 0) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(bg, 1) == MYPAINT_TILE_SIZE);
+  assert(PyArray_DIM(bg, 2) == 4);
+  assert(PyArray_TYPE(bg) == NPY_UINT16);
+  assert(PyArray_ISCARRAY(bg));
+#endif
+
+  tile_flat2rgba_row((uint16_t *)PyArray_DATA(dst),
+                     (const uint16_t *)PyArray_DATA(bg),
+                     MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE);
+}
+
+
+static bool is_fix15_tile (PyObject *obj, const bool writeable);
+
+typedef void (*FlattenRowFunc) (uint16_t *dst_p, const uint16_t *bg_p,
+                                const int n);
+
+// Runs a row function over a tile, with the background taken from a
+// repeating pattern. Pattern rows that do not line up with the tile are
+// unrolled into a row buffer first; the others are used in place.
+
+static PyObject *
+tile_flatten_repeat (PyObject *dst_obj, PyObject *pattern_obj,
+                     int x, int y, FlattenRowFunc row_func)
+{
+  if (! is_fix15_tile(dst_obj, true)) {
+    PyErr_SetString(PyExc_ValueError,
+                    "dst must be a writeable C-contiguous uint16 tile array");
+    return NULL;
+  }
+  PyArrayObject *pattern = (PyArrayObject *)pattern_obj;
+  if (! PyArray_Check(pattern_obj)
+      || PyArray_NDIM(pattern) != 3
+      || PyArray_DIM(pattern, 0) < 1
+      || PyArray_DIM(pattern, 1) < 1
+      || PyArray_DIM(pattern, 2) != 4
+      || PyArray_TYPE(pattern) != NPY_UINT16
+      || ! PyArray_ISCARRAY_RO(pattern))
+  {
+    PyErr_SetString(PyExc_ValueError,
+                    "pattern must be a C-contiguous HxWx4 uint16 array");
+    return NULL;
+  }
+  const int h = PyArray_DIM(pattern, 0);
+  const int w = PyArray_DIM(pattern, 1);
+  const uint16_t *pattern_p = (const uint16_t *)PyArray_DATA(pattern);
+  uint16_t *dst_p = (uint16_t *)PyArray_DATA((PyArrayObject *)dst_obj);
+
+  const int px = ((x % w) + w) % w;
+  const bool in_place = (px + MYPAINT_TILE_SIZE <= w);
+  uint16_t row_buf[4*MYPAINT_TILE_SIZE];
+  int buf_row = -1;
+
+  for (int ty=0; ty<MYPAINT_TILE_SIZE; ty++) {
+    const int py = (((y + ty) % h) + h) % h;
+    const uint16_t *src_row = pattern_p + 4*py*w;
+    const uint16_t *bg_row = src_row + 4*px;
+    if (! in_place) {
+      if (py != buf_row) {
+        for (int tx=0, sx=px; tx<MYPAINT_TILE_SIZE; tx++) {
+          memcpy(row_buf + 4*tx, src_row + 4*sx, 4*sizeof(uint16_t));
+          if (++sx == w) {
+            sx = 0;
+          }
+        }
+        buf_row = py;
+      }
+      bg_row = row_buf;
+    }
+    row_func(dst_p + 4*MYPAINT_TILE_SIZE*ty, bg_row, MYPAINT_TILE_SIZE);
+  }
+  Py_RETURN_NONE;
+}
+
+
+PyObject *
+tile_rgba2flat_repeat (PyObject *dst_obj, PyObject *pattern_obj, int x, int y)
+{
+  return tile_flatten_repeat(dst_obj, pattern_obj, x, y, tile_rgba2flat_row);
+}
+
+
+PyObject *
+tile_flat2rgba_repeat (PyObject *dst_obj, PyObject *pattern_obj, int x, int y)
+{
+  return tile_flatten_repeat(dst_obj, pattern_obj, x, y, tile_flat2rgba_row);
+}
+
+
+// The per-pixel test of tile_perceptual_change_strokemap()
+
+static inline bool
+tile_perceptual_change_pixel (const uint16_t *a_p, const uint16_t *b_p)
+{
+  int32_t color_change = 0;
+  // We want to compare a.color with b.color, but we only know
+  // (a.color * a.alpha) and (b.color * b.alpha).  We multiply
+  // each component with the alpha of the other image, so they are
+  // scaled the same and can be compared.
+
+  for (int i=0; i<3; i++) {
+    int32_t a_col = (uint32_t)a_p[i] * b_p[3] / (1<<15); // a.color * a.alpha*b.alpha
+    int32_t b_col = (uint32_t)b_p[i] * a_p[3] / (1<<15); // b.color * a.alpha*b.alpha
+    color_change += abs(b_col - a_col);
+  }
+  // "color_change" is in the range [0, 3*a_a]
+  // if either old or new alpha is (near) zero, "color_change" is (near) zero
+
+  int32_t alpha_old = a_p[3];
+  int32_t alpha_new = b_p[3];
+
+  // Note: the thresholds below are arbitrary choices found to work okay
+
+  // We report a color change only if both old and new color are
+  // well-defined (big enough alpha).
+  bool is_perceptual_color_change = color_change > MAX(alpha_old, alpha_new)/16;
+
+  int32_t alpha_diff = alpha_new - alpha_old; // no abs() here (ignore erasers)
+  // We check the alpha increase relative to the previous alpha.
+  bool is_perceptual_alpha_increase = alpha_diff > (1<<15)/4;
+
+  // this one is responsible for making fat big ugly easy-to-hit pointer targets
+  bool is_big_relative_alpha_increase  = alpha_diff > (1<<15)/64 && alpha_diff > alpha_old/2;
+
+  return (is_perceptual_alpha_increase || is_big_relative_alpha_increase
+          || is_perceptual_color_change);
+}
+
+
 void tile_perceptual_change_strokemap(PyObject * a_obj, PyObject * b_obj, PyObject * res_obj) {
 
   PyArrayObject *a = (PyArrayObject *)a_obj;
@@ -675,48 +1161,116 @@ void tile_perceptual_change_strokemap(PyObject * a_obj, PyObject * b_obj, PyObje
 
   for (int y=0; y<MYPAINT_TILE_SIZE; y++) {
     for (int x=0; x<MYPAINT_TILE_SIZE; x++) {
+      res_p[0] = tile_perceptual_change_pixel(a_p, b_p) ? 1 : 0;
+      a_p += 4;
+      b_p += 4;
+      res_p += 1;
+    }
+  }
+}
 
-      int32_t color_change = 0;
-      // We want to compare a.color with b.color, but we only know
-      // (a.color * a.alpha) and (b.color * b.alpha).  We multiply
-      // each component with the alpha of the other image, so they are
-      // scaled the same and can be compared.
 
-      for (int i=0; i<3; i++) {
-        int32_t a_col = (uint32_t)a_p[i] * b_p[3] / (1<<15); // a.color * a.alpha*b.alpha
-        int32_t b_col = (uint32_t)b_p[i] * a_p[3] / (1<<15); // b.color * a.alpha*b.alpha
-        color_change += abs(b_col - a_col);
-      }
-      // "color_change" is in the range [0, 3*a_a]
-      // if either old or new alpha is (near) zero, "color_change" is (near) zero
+// Four pixels' worth of the test above, as a 4-bit mask (bit i for pixel i)
 
-      int32_t alpha_old = a_p[3];
-      int32_t alpha_new = b_p[3];
+#ifdef __SSE2__
 
-      // Note: the thresholds below are arbitrary choices found to work okay
+static inline int
+perceptual_change_mask4 (const uint16_t *a_p, const uint16_t *b_p)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a_rg, a_ba, b_rg, b_ba;
+  deinterleave_rgba16(a_p, a_rg, a_ba);
+  deinterleave_rgba16(b_p, b_rg, b_ba);
+  const __m128i a_alpha = _mm_unpackhi_epi64(a_ba, a_ba);
+  const __m128i b_alpha = _mm_unpackhi_epi64(b_ba, b_ba);
+
+  // Colours scaled by the other tile's alpha, and their absolute differences
+  const __m128i a_col_rg = mul_fix15_epu16(a_rg, b_alpha);
+  const __m128i a_col_b = mul_fix15_epu16(a_ba, b_alpha);
+  const __m128i b_col_rg = mul_fix15_epu16(b_rg, a_alpha);
+  const __m128i b_col_b = mul_fix15_epu16(b_ba, a_alpha);
+  const __m128i diff_rg = _mm_or_si128(_mm_subs_epu16(a_col_rg, b_col_rg),
+                                       _mm_subs_epu16(b_col_rg, a_col_rg));
+  const __m128i diff_b = _mm_or_si128(_mm_subs_epu16(a_col_b, b_col_b),
+                                      _mm_subs_epu16(b_col_b, a_col_b));
+  const __m128i color_change = _mm_add_epi32(
+    _mm_add_epi32(_mm_unpacklo_epi16(diff_rg, zero),
+                  _mm_unpackhi_epi16(diff_rg, zero)),
+    _mm_unpacklo_epi16(diff_b, zero));
+
+  // MAX(alpha_old, alpha_new)/16, with both shifted first to fit int16
+  const __m128i threshold = _mm_unpacklo_epi16(
+    _mm_max_epi16(_mm_srli_epi16(a_alpha, 4), _mm_srli_epi16(b_alpha, 4)),
+    zero);
+  const __m128i alpha_old = _mm_unpacklo_epi16(a_alpha, zero);
+  const __m128i alpha_new = _mm_unpacklo_epi16(b_alpha, zero);
+  const __m128i alpha_diff = _mm_sub_epi32(alpha_new, alpha_old);
+
+  const __m128i is_perceptual_color_change =
+    _mm_cmpgt_epi32(color_change, threshold);
+  const __m128i is_perceptual_alpha_increase =
+    _mm_cmpgt_epi32(alpha_diff, _mm_set1_epi32((1<<15)/4));
+  const __m128i is_big_relative_alpha_increase = _mm_and_si128(
+    _mm_cmpgt_epi32(alpha_diff, _mm_set1_epi32((1<<15)/64)),
+    _mm_cmpgt_epi32(alpha_diff, _mm_srli_epi32(alpha_old, 1)));
+  const __m128i changed = _mm_or_si128(
+    _mm_or_si128(is_perceptual_alpha_increase, is_big_relative_alpha_increase),
+    is_perceptual_color_change);
+  return _mm_movemask_ps(_mm_castsi128_ps(changed));
+}
 
-      // We report a color change only if both old and new color are
-      // well-defined (big enough alpha).
-      bool is_perceptual_color_change = color_change > MAX(alpha_old, alpha_new)/16;
+#endif /* #ifdef __SSE2__ */
 
-      int32_t alpha_diff = alpha_new - alpha_old; // no abs() here (ignore erasers)
-      // We check the alpha increase relative to the previous alpha.
-      bool is_perceptual_alpha_increase = alpha_diff > (1<<15)/4;
 
-      // this one is responsible for making fat big ugly easy-to-hit pointer targets
-      bool is_big_relative_alpha_increase  = alpha_diff > (1<<15)/64 && alpha_diff > alpha_old/2;
+// The leftmost pixel goes in the most significant bit, as for numpy's
+// packbits() and unpackbits().
 
-      if (is_perceptual_alpha_increase || is_big_relative_alpha_increase || is_perceptual_color_change) {
-        res_p[0] = 1;
-      } else {
-        res_p[0] = 0;
-      }
+static inline uint8_t
+reverse_bits8 (uint8_t b)
+{
+  b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+  b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+  b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+  return b;
+}
 
-      a_p += 4;
-      b_p += 4;
-      res_p += 1;
+
+PyObject *
+tile_perceptual_change_strokemap_bits (PyObject *a_obj, PyObject *b_obj)
+{
+  if (! is_fix15_tile(a_obj, false) || ! is_fix15_tile(b_obj, false)) {
+    PyErr_SetString(PyExc_ValueError,
+                    "expected two C-contiguous uint16 tile arrays");
+    return NULL;
+  }
+  const uint16_t *a_p = (const uint16_t *)PyArray_DATA((PyArrayObject *)a_obj);
+  const uint16_t *b_p = (const uint16_t *)PyArray_DATA((PyArrayObject *)b_obj);
+  static const size_t tile_bytes = MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE*4*sizeof(uint16_t);
+  if (a_p == b_p || memcmp(a_p, b_p, tile_bytes) == 0) {
+    Py_RETURN_NONE;
+  }
+
+  uint8_t bits[MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE/8];
+  uint8_t any = 0;
+  for (size_t i=0; i<sizeof(bits); i++) {
+    int mask = 0;
+#ifdef __SSE2__
+    mask = perceptual_change_mask4(a_p, b_p)
+         | perceptual_change_mask4(a_p + 16, b_p + 16) << 4;
+#else
+    for (int j=0; j<8; j++) {
+      mask |= tile_perceptual_change_pixel(a_p + 4*j, b_p + 4*j) << j;
     }
+#endif
+    bits[i] = reverse_bits8(mask);
+    any |= mask;
+    a_p += 32;
+    b_p += 32;
   }
+  if (! any) {
+    Py_RETURN_NONE;
+  }
+  return PyBytes_FromStringAndSize((const char *)bits, sizeof(bits));
 }
 
 
@@ -832,6 +1386,135 @@ combine_mode_get_info(enum CombineMode mode)
 
 
 
+/* tile_summarize(): classifies tiles as empty, uniform, or mixed */
+
+
+static const unsigned int TILE_NUM_PIXELS = MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE;
+
+
+static enum TileSummary
+tile_summarize_data (const fix15_short_t *src_p)
+{
+    // One pixel is exactly 64 bits, so compare them as such
+    uint64_t first;
+    memcpy(&first, src_p, sizeof(first));
+    for (unsigned int i = 1; i < TILE_NUM_PIXELS; ++i) {
+        uint64_t pixel;
+        memcpy(&pixel, src_p + 4*i, sizeof(pixel));
+        if (pixel != first) {
+            return TileSummaryMixed;
+        }
+    }
+    return (first == 0) ? TileSummaryEmpty : TileSummaryUniform;
+}
+
+
+PyObject *
+tile_summarize (PyObject *src_obj)
+{
+    PyArrayObject* src = ((PyArrayObject*)src_obj);
+#ifdef HEAVY_DEBUG
+    assert(PyArray_Check(src_obj));
+    assert(PyArray_DIM(src, 0) == MYPAINT_TILE_SIZE);
+    assert(PyArray_DIM(src, 1) == MYPAINT_TILE_SIZE);
+    assert(PyArray_DIM(src, 2) == 4);
+    assert(PyArray_TYPE(src) == NPY_UINT16);
+    assert(PyArray_ISCARRAY_RO(src));
+#endif
+    const fix15_short_t* const src_p = (fix15_short_t *)PyArray_DATA(src);
+    const enum TileSummary summary = tile_summarize_data(src_p);
+    return Py_BuildValue("i(iiii)", (int) summary,
+                         src_p[0], src_p[1], src_p[2], src_p[3]);
+}
+
+
+
+/* tile_combine_data(): combines raw tile buffers, without touching Python */
+
+
+// Whole-tile shortcuts for sources known to be empty or uniform. Returns
+// true if dst is already finished. The results match what the combine op
+// would have written for in-range pixel data.
+
+static bool
+tile_combine_shortcut (const enum CombineMode mode,
+                       const enum TileSummary src_summary,
+                       const fix15_short_t *src_p,
+                       fix15_short_t *dst_p,
+                       const bool dst_has_alpha,
+                       const fix15_short_t opac)
+{
+    const TileDataCombineOp *op = combine_mode_info[mode];
+    if (src_summary == TileSummaryEmpty) {
+        if (dst_has_alpha && op->zero_alpha_clears_backdrop()) {
+            memset(dst_p, 0, TILE_NUM_PIXELS*4*sizeof(fix15_short_t));
+            return true;
+        }
+        return ! op->zero_alpha_has_effect();
+    }
+    if (src_summary != TileSummaryUniform
+        || src_p[3] != fix15_one || opac != fix15_one)
+    {
+        return false;
+    }
+
+    // Uniform, opaque source at full opacity
+    switch (mode) {
+    case CombineNormal:
+    case CombineSpectralWGM:
+        // Both are plain source-over for opaque pixels
+        for (unsigned int i = 0; i < TILE_NUM_PIXELS*4; i += 4) {
+            dst_p[i+0] = src_p[0];
+            dst_p[i+1] = src_p[1];
+            dst_p[i+2] = src_p[2];
+            if (dst_has_alpha) {
+                dst_p[i+3] = fix15_one;
+            }
+        }
+        return true;
+    case CombineDestinationIn:
+        return true;
+    case CombineDestinationOut:
+        if (dst_has_alpha) {
+            memset(dst_p, 0, TILE_NUM_PIXELS*4*sizeof(fix15_short_t));
+        }
+        else {
+            for (unsigned int i = 0; i < TILE_NUM_PIXELS*4; i += 4) {
+                dst_p[i+0] = dst_p[i+1] = dst_p[i+2] = 0;
+            }
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+static void
+tile_combine_data (const enum CombineMode mode,
+                   const fix15_short_t *src_p,
+                   fix15_short_t *dst_p,
+                   const bool dst_has_alpha,
+                   const float src_opacity,
+                   const enum TileSummary src_summary)
+{
+    const fix15_short_t opac = fix15_short_clamp(src_opacity * fix15_one);
+    if (tile_combine_shortcut(mode, src_summary, src_p, dst_p,
+                              dst_has_alpha, opac))
+    {
+        return;
+    }
+    const SIMDCombineFunc simd_func = simd_combine_func(mode, dst_has_alpha);
+    if (simd_func) {
+        simd_func(src_p, dst_p, opac);
+        return;
+    }
+    const TileDataCombineOp *op = combine_mode_info[mode];
+    op->combine_data(src_p, dst_p, dst_has_alpha, src_opacity);
+}
+
+
+
 /* tile_combine(): primary Python interface for blending+compositing tiles */
 
 
@@ -840,8 +1523,10 @@ tile_combine (enum CombineMode mode,
               PyObject *src_obj,
               PyObject *dst_obj,
               const bool dst_has_alpha,
-              const float src_opacity)
+              const float src_opacity,
+              const enum TileSummary src_summary)
 {
+    TRACE_SCOPE("tile_combine");
     PyArrayObject* src = ((PyArrayObject*)src_obj);
     PyArrayObject* dst = ((PyArrayObject*)dst_obj);
 #ifdef HEAVY_DEBUG
@@ -870,7 +1555,782 @@ tile_combine (enum CombineMode mode,
     if (mode >= NumCombineModes || mode < 0) {
         return;
     }
-    const TileDataCombineOp *op = combine_mode_info[mode];
-    op->combine_data(src_p, dst_p, dst_has_alpha, src_opacity);
+    tile_combine_data(mode, src_p, dst_p, dst_has_alpha, src_opacity,
+                      src_summary);
+}
+
+
+
+/* tile_combine_many(): batched tile_combine(), run without the GIL */
+
+
+// One validated entry of a tile_combine_many() job list
+
+struct TileCombineJob
+{
+    enum CombineMode mode;
+    const fix15_short_t *src;
+    fix15_short_t *dst;
+    bool dst_has_alpha;
+    float src_opacity;
+    enum TileSummary src_summary;
+};
+
+
+// True if obj is a C-contiguous fix15 RGBA tile array (writeable ones only
+// if the flag is set)
+
+static bool
+is_fix15_tile (PyObject *obj, const bool writeable)
+{
+    if (! PyArray_Check(obj)) {
+        return false;
+    }
+    PyArrayObject *arr = (PyArrayObject *)obj;
+    return (PyArray_NDIM(arr) == 3
+            && PyArray_DIM(arr, 0) == MYPAINT_TILE_SIZE
+            && PyArray_DIM(arr, 1) == MYPAINT_TILE_SIZE
+            && PyArray_DIM(arr, 2) == 4
+            && PyArray_TYPE(arr) == NPY_UINT16
+            && (writeable ? PyArray_ISCARRAY(arr) : PyArray_ISCARRAY_RO(arr)));
+}
+
+
+// Union-find root of a job, with path halving
+
+static int
+job_chain_root (std::vector<int> &parent, int i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+
+PyObject *
+tile_combine_many (PyObject *jobs)
+{
+    TRACE_SCOPE("tile_combine_many");
+    PyObject *seq = PySequence_Fast(jobs, "jobs must be a sequence");
+    if (! seq) {
+        return NULL;
+    }
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+
+    // Validate everything while the GIL is held. The arrays are kept
+    // referenced by us so nothing can free them once it is released.
+    std::vector<TileCombineJob> parsed;
+    std::vector<PyObject *> arrays;
+    parsed.reserve(n);
+    arrays.reserve(2*n);
+    bool ok = true;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        int mode = 0;
+        int dst_has_alpha = 0;
+        float src_opacity = 1.0;
+        int src_summary = TileSummaryUnknown;
+        PyObject *src_obj = NULL;
+        PyObject *dst_obj = NULL;
+        if (! PyTuple_Check(item)
+            || ! PyArg_ParseTuple(item, "iOOif|i", &mode, &src_obj, &dst_obj,
+                                  &dst_has_alpha, &src_opacity, &src_summary))
+        {
+            PyErr_Clear();
+            PyErr_Format(PyExc_TypeError,
+                         "job %zd must be a tuple "
+                         "(mode, src, dst, dst_has_alpha, opacity"
+                         "[, src_summary])", i);
+            ok = false;
+            break;
+        }
+        if (mode >= NumCombineModes || mode < 0) {
+            PyErr_Format(PyExc_ValueError,
+                         "job %zd: unknown combine mode %d", i, mode);
+            ok = false;
+            break;
+        }
+        if (src_summary >= NumTileSummaries || src_summary < 0) {
+            PyErr_Format(PyExc_ValueError,
+                         "job %zd: unknown tile summary %d", i, src_summary);
+            ok = false;
+            break;
+        }
+        if (! is_fix15_tile(src_obj, false)
+            || ! is_fix15_tile(dst_obj, true))
+        {
+            PyErr_Format(PyExc_ValueError,
+                         "job %zd: src and dst must be C-contiguous "
+                         "uint16 tile arrays, and dst must be writeable", i);
+            ok = false;
+            break;
+        }
+        Py_INCREF(src_obj);
+        Py_INCREF(dst_obj);
+        arrays.push_back(src_obj);
+        arrays.push_back(dst_obj);
+        TileCombineJob job;
+        job.mode = (enum CombineMode) mode;
+        job.src = (fix15_short_t *)PyArray_DATA((PyArrayObject *)src_obj);
+        job.dst = (fix15_short_t *)PyArray_DATA((PyArrayObject *)dst_obj);
+        job.dst_has_alpha = dst_has_alpha;
+        job.src_opacity = src_opacity;
+        job.src_summary = (enum TileSummary) src_summary;
+        parsed.push_back(job);
+    }
+    Py_DECREF(seq);
+
+    if (ok) {
+        // Jobs which write to a tile array, or read from one which some
+        // job writes to, form a chain which must run in list order.
+        // Separate chains are independent of each other. Sources that are
+        // only ever read, like a shared solid colour tile, link nothing.
+        const int num_jobs = parsed.size();
+        std::vector<int> parent(num_jobs);
+        std::map<const void *, int> first_writer;
+        for (int i = 0; i < num_jobs; ++i) {
+            parent[i] = i;
+            first_writer.insert(std::make_pair((const void *)parsed[i].dst, i));
+        }
+        for (int i = 0; i < num_jobs; ++i) {
+            const void *bufs[2] = {parsed[i].src, parsed[i].dst};
+            for (int b = 0; b < 2; ++b) {
+                std::map<const void *, int>::iterator it
+                    = first_writer.find(bufs[b]);
+                if (it != first_writer.end()) {
+                    parent[job_chain_root(parent, i)]
+                        = job_chain_root(parent, it->second);
+                }
+            }
+        }
+        std::map<int, int> chain_index;
+        std::vector<std::vector<int> > chains;
+        for (int i = 0; i < num_jobs; ++i) {
+            const int root = job_chain_root(parent, i);
+            std::map<int, int>::iterator it = chain_index.find(root);
+            if (it == chain_index.end()) {
+                chain_index[root] = chains.size();
+                chains.push_back(std::vector<int>(1, i));
+            }
+            else {
+                chains[it->second].push_back(i);
+            }
+        }
+
+        const int num_chains = chains.size();
+        Py_BEGIN_ALLOW_THREADS
+#pragma omp parallel for schedule(dynamic)
+        for (int c = 0; c < num_chains; ++c) {
+            const std::vector<int> &chain = chains[c];
+            for (size_t j = 0; j < chain.size(); ++j) {
+                const TileCombineJob &job = parsed[chain[j]];
+                tile_combine_data(job.mode, job.src, job.dst,
+                                  job.dst_has_alpha, job.src_opacity,
+                                  job.src_summary);
+            }
+        }
+        Py_END_ALLOW_THREADS
+    }
+
+    for (size_t i = 0; i < arrays.size(); ++i) {
+        Py_DECREF(arrays[i]);
+    }
+    if (! ok) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* tile_downscale_many(): batched mipmap building, run without the GIL */
+
+
+// One validated entry of a tile_downscale_many() job list. Sources are in
+// the order nw, ne, sw, se, and NULL where transparent.
+
+struct TileDownscaleJob
+{
+    uint16_t *dst;
+    const uint16_t *src[4];
+};
+
+
+PyObject *
+tile_downscale_many (PyObject *jobs)
+{
+    PyObject *seq = PySequence_Fast(jobs, "jobs must be a sequence");
+    if (! seq) {
+        return NULL;
+    }
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+
+    // As in tile_combine_many(), validate and hold references first
+    std::vector<TileDownscaleJob> parsed;
+    std::vector<PyObject *> arrays;
+    parsed.reserve(n);
+    arrays.reserve(5*n);
+    bool ok = true;
+    for (Py_ssize_t i = 0; ok && i < n; ++i) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        PyObject *dst_obj = NULL;
+        PyObject *srcs_obj = NULL;
+        if (! PyTuple_Check(item)
+            || ! PyArg_ParseTuple(item, "OO", &dst_obj, &srcs_obj)
+            || ! PyTuple_Check(srcs_obj)
+            || PyTuple_GET_SIZE(srcs_obj) != 4)
+        {
+            PyErr_Clear();
+            PyErr_Format(PyExc_TypeError,
+                         "job %zd must be a tuple "
+                         "(dst, (src_nw, src_ne, src_sw, src_se))", i);
+            ok = false;
+            break;
+        }
+        if (! is_fix15_tile(dst_obj, true)) {
+            PyErr_Format(PyExc_ValueError,
+                         "job %zd: dst must be a writeable C-contiguous "
+                         "uint16 tile array", i);
+            ok = false;
+            break;
+        }
+        TileDownscaleJob job;
+        job.dst = (uint16_t *)PyArray_DATA((PyArrayObject *)dst_obj);
+        Py_INCREF(dst_obj);
+        arrays.push_back(dst_obj);
+        for (int q = 0; q < 4; ++q) {
+            PyObject *src_obj = PyTuple_GET_ITEM(srcs_obj, q);
+            if (src_obj == Py_None) {
+                job.src[q] = NULL;
+                continue;
+            }
+            if (! is_fix15_tile(src_obj, false)) {
+                PyErr_Format(PyExc_ValueError,
+                             "job %zd: sources must be None or C-contiguous "
+                             "uint16 tile arrays", i);
+                ok = false;
+                break;
+            }
+            job.src[q] = (const uint16_t *)PyArray_DATA((PyArrayObject *)src_obj);
+            Py_INCREF(src_obj);
+            arrays.push_back(src_obj);
+        }
+        parsed.push_back(job);
+    }
+    Py_DECREF(seq);
+
+    if (ok) {
+        // Quadrants are independent, so there are four work items per tile
+        const int num_quadrants = 4 * parsed.size();
+        const int row_bytes = MYPAINT_TILE_SIZE * 4 * sizeof(uint16_t);
+        Py_BEGIN_ALLOW_THREADS
+#pragma omp parallel for schedule(dynamic, 4)
+        for (int i = 0; i < num_quadrants; ++i) {
+            const TileDownscaleJob &job = parsed[i / 4];
+            const int q = i % 4;
+            const int dst_x = (q % 2) * MYPAINT_TILE_SIZE / 2;
+            const int dst_y = (q / 2) * MYPAINT_TILE_SIZE / 2;
+            if (job.src[q]) {
+                tile_downscale_rgba16_c(job.src[q], row_bytes, job.dst,
+                                        row_bytes, dst_x, dst_y);
+            }
+            else {
+                for (int y = 0; y < MYPAINT_TILE_SIZE / 2; ++y) {
+                    uint16_t *dst_p = job.dst
+                        + ((dst_y + y) * MYPAINT_TILE_SIZE + dst_x) * 4;
+                    memset(dst_p, 0, row_bytes / 2);
+                }
+            }
+        }
+        Py_END_ALLOW_THREADS
+    }
+
+    for (size_t i = 0; i < arrays.size(); ++i) {
+        Py_DECREF(arrays[i]);
+    }
+    if (! ok) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* tile_render_ops_many(): layer stack rendering, run without the GIL */
+
+
+// One validated tile of a tile_render_ops_many() job list. Its sources
+// are those at [first_source, first_source + the program's source count).
+
+struct RenderOpsJob
+{
+    fix15_short_t *dst;
+    bool dst_has_alpha;
+    size_t first_source;
+};
+
+
+// Stands in for transparent sources of modes with an effect at zero alpha
+
+static const fix15_short_t render_zero_tile[TILE_NUM_PIXELS*4] = {0};
+
+
+RenderScratch::RenderScratch (int depth)
+    : tiles(depth, std::vector<uint16_t>(TILE_NUM_PIXELS*4)),
+      parents(depth, std::make_pair((uint16_t *)NULL, false))
+{
+}
+
+
+// This does for raw buffers what the ops of
+// lib.layer.tree.RootLayerStack._process_ops_list() do via the surfaces.
+
+void
+render_ops_tile (const std::vector<RenderOp> &program,
+                 const RenderOpSource *sources,
+                 fix15_short_t *dst,
+                 bool dst_has_alpha,
+                 RenderScratch &scratch)
+{
+    const size_t tile_bytes = TILE_NUM_PIXELS*4*sizeof(fix15_short_t);
+    int depth = 0;
+    for (size_t i = 0; i < program.size(); ++i) {
+        const RenderOp &op = program[i];
+        switch (op.opcode) {
+        case RenderOpComposite: {
+            const RenderOpSource &src = *sources++;
+            const TileDataCombineOp *info = combine_mode_info[op.mode];
+            if (op.opacity == 0) {
+                // As in lib.tiledsurface.MyPaintSurface.composite_tile()
+                if (dst_has_alpha && info->zero_alpha_clears_backdrop()) {
+                    memset(dst, 0, tile_bytes);
+                    break;
+                }
+                if (! info->zero_alpha_has_effect()) {
+                    break;
+                }
+            }
+            if (src.data) {
+                tile_combine_data(op.mode, src.data, dst, dst_has_alpha,
+                                  op.opacity, src.summary);
+            }
+            else {
+                tile_combine_data(op.mode, render_zero_tile, dst,
+                                  dst_has_alpha, op.opacity,
+                                  TileSummaryEmpty);
+            }
+            break;
+        }
+        case RenderOpBlit: {
+            const RenderOpSource &src = *sources++;
+            if (src.data) {
+                memcpy(dst, src.data, tile_bytes);
+            }
+            else {
+                memset(dst, 0, tile_bytes);
+            }
+            break;
+        }
+        case RenderOpPush:
+            scratch.parents[depth] = std::make_pair(dst, dst_has_alpha);
+            dst = &scratch.tiles[depth][0];
+            dst_has_alpha = true;
+            memset(dst, 0, tile_bytes);
+            ++depth;
+            break;
+        case RenderOpPop: {
+            --depth;
+            const fix15_short_t *src = dst;
+            dst = scratch.parents[depth].first;
+            dst_has_alpha = scratch.parents[depth].second;
+            tile_combine_data(op.mode, src, dst, dst_has_alpha, op.opacity,
+                              TileSummaryUnknown);
+            break;
+        }
+        }
+    }
+}
+
+
+bool
+render_ops_parse_program (PyObject *program_obj,
+                          std::vector<RenderOp> &program,
+                          size_t &num_sources,
+                          int &max_depth)
+{
+    PyObject *seq = PySequence_Fast(program_obj, "program must be a sequence");
+    if (! seq) {
+        return false;
+    }
+    program.clear();
+    num_sources = 0;
+    max_depth = 0;
+    int depth = 0;
+    bool ok = true;
+    for (Py_ssize_t i = 0; ok && i < PySequence_Fast_GET_SIZE(seq); ++i) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        int opcode = 0;
+        int mode = 0;
+        float opacity = 1.0;
+        if (! PyTuple_Check(item)
+            || ! PyArg_ParseTuple(item, "iif", &opcode, &mode, &opacity))
+        {
+            PyErr_Clear();
+            PyErr_Format(PyExc_TypeError,
+                         "op %zd must be a tuple (opcode, mode, opacity)", i);
+            ok = false;
+            break;
+        }
+        if (opcode < RenderOpComposite || opcode > RenderOpPop) {
+            PyErr_Format(PyExc_ValueError,
+                         "op %zd: unknown opcode %d", i, opcode);
+            ok = false;
+            break;
+        }
+        if ((opcode == RenderOpComposite || opcode == RenderOpPop)
+            && (mode >= NumCombineModes || mode < 0))
+        {
+            PyErr_Format(PyExc_ValueError,
+                         "op %zd: unknown combine mode %d", i, mode);
+            ok = false;
+            break;
+        }
+        if (opcode == RenderOpComposite || opcode == RenderOpBlit) {
+            ++num_sources;
+        }
+        else if (opcode == RenderOpPush) {
+            max_depth = std::max(max_depth, ++depth);
+        }
+        else if (--depth < 0) {
+            PyErr_Format(PyExc_ValueError,
+                         "op %zd: POP without a matching PUSH", i);
+            ok = false;
+            break;
+        }
+        RenderOp op;
+        op.opcode = (enum RenderOpcode) opcode;
+        op.mode = (enum CombineMode) mode;
+        op.opacity = opacity;
+        program.push_back(op);
+    }
+    Py_DECREF(seq);
+    if (ok && depth != 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "program contains more PUSH ops than POPs");
+        ok = false;
+    }
+    return ok;
+}
+
+
+bool
+render_ops_parse_sources (PyObject *srcs_obj, const size_t num_sources,
+                          const Py_ssize_t index,
+                          std::vector<RenderOpSource> &sources,
+                          std::vector<PyObject *> &refs)
+{
+    if (! PyTuple_Check(srcs_obj)
+        || (size_t) PyTuple_GET_SIZE(srcs_obj) != num_sources)
+    {
+        PyErr_Format(PyExc_TypeError,
+                     "job %zd must have one source per COMPOSITE or "
+                     "BLIT op", index);
+        return false;
+    }
+    for (size_t q = 0; q < num_sources; ++q) {
+        PyObject *src_item = PyTuple_GET_ITEM(srcs_obj, q);
+        RenderOpSource src;
+        src.data = NULL;
+        src.summary = TileSummaryEmpty;
+        if (src_item != Py_None) {
+            PyObject *src_obj = NULL;
+            int summary = TileSummaryUnknown;
+            if (! PyTuple_Check(src_item)
+                || ! PyArg_ParseTuple(src_item, "Oi", &src_obj, &summary)
+                || summary >= NumTileSummaries || summary < 0
+                || ! is_fix15_tile(src_obj, false))
+            {
+                PyErr_Clear();
+                PyErr_Format(PyExc_ValueError,
+                             "job %zd: sources must be None or "
+                             "(tile, summary) tuples, with C-contiguous "
+                             "uint16 tile arrays", index);
+                return false;
+            }
+            src.data = (const fix15_short_t *)
+                PyArray_DATA((PyArrayObject *)src_obj);
+            src.summary = (enum TileSummary) summary;
+            Py_INCREF(src_obj);
+            refs.push_back(src_obj);
+        }
+        sources.push_back(src);
+    }
+    return true;
+}
+
+
+PyObject *
+tile_render_ops_many (PyObject *program_obj, PyObject *jobs)
+{
+    TRACE_SCOPE("tile_render_ops_many");
+    // Check the program, finding how deeply groups nest
+    std::vector<RenderOp> program;
+    size_t num_sources = 0;
+    int max_depth = 0;
+    if (! render_ops_parse_program(program_obj, program, num_sources,
+                                   max_depth))
+    {
+        return NULL;
+    }
+
+    PyObject *seq = PySequence_Fast(jobs, "jobs must be a sequence");
+    if (! seq) {
+        return NULL;
+    }
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+
+    // As in tile_combine_many(), validate and hold references first
+    bool ok = true;
+    std::vector<RenderOpsJob> parsed;
+    std::vector<RenderOpSource> sources;
+    std::vector<PyObject *> arrays;
+    parsed.reserve(n);
+    sources.reserve(n * num_sources);
+    for (Py_ssize_t i = 0; ok && i < n; ++i) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        PyObject *dst_obj = NULL;
+        int dst_has_alpha = 0;
+        PyObject *srcs_obj = NULL;
+        if (! PyTuple_Check(item)
+            || ! PyArg_ParseTuple(item, "OiO", &dst_obj, &dst_has_alpha,
+                                  &srcs_obj))
+        {
+            PyErr_Clear();
+            PyErr_Format(PyExc_TypeError,
+                         "job %zd must be a tuple (dst, dst_has_alpha, "
+                         "sources), with one source per COMPOSITE or "
+                         "BLIT op", i);
+            ok = false;
+            break;
+        }
+        if (! is_fix15_tile(dst_obj, true)) {
+            PyErr_Format(PyExc_ValueError,
+                         "job %zd: dst must be a writeable C-contiguous "
+                         "uint16 tile array", i);
+            ok = false;
+            break;
+        }
+        RenderOpsJob job;
+        job.dst = (fix15_short_t *)PyArray_DATA((PyArrayObject *)dst_obj);
+        job.dst_has_alpha = dst_has_alpha;
+        job.first_source = sources.size();
+        Py_INCREF(dst_obj);
+        arrays.push_back(dst_obj);
+        if (! render_ops_parse_sources(srcs_obj, num_sources, i,
+                                       sources, arrays))
+        {
+            ok = false;
+            break;
+        }
+        parsed.push_back(job);
+    }
+    Py_DECREF(seq);
+
+    if (ok) {
+        const int num_jobs = parsed.size();
+        Py_BEGIN_ALLOW_THREADS
+#pragma omp parallel
+        {
+            RenderScratch scratch(max_depth);
+#pragma omp for schedule(dynamic)
+            for (int i = 0; i < num_jobs; ++i) {
+                const RenderOpsJob &job = parsed[i];
+                render_ops_tile(program, &sources[job.first_source],
+                                job.dst, job.dst_has_alpha, scratch);
+            }
+        }
+        Py_END_ALLOW_THREADS
+    }
+
+    for (size_t i = 0; i < arrays.size(); ++i) {
+        Py_DECREF(arrays[i]);
+    }
+    if (! ok) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+/* tile_rgba8_to_cairo_many(): display tiles into a cairo image surface */
+
+
+// One validated entry of a tile_rgba8_to_cairo_many() job list, clipped to
+// the surface: the tile's columns [x0, x1) and rows [y0, y1) are written.
+
+struct CairoTileJob {
+    const uint8_t *src;
+    int src_stride;
+    int x, y;
+    int x0, y0, x1, y1;
+};
+
+
+// Premultiplies straight RGBA pixels into native-endian ARGB32, rounding
+// as cairo and gdk_cairo_set_source_pixbuf() do.
+
+static inline void
+rgba8_row_to_cairo_argb32 (const uint8_t *src, uint32_t *dst, const int n)
+{
+    for (int i = 0; i < n; ++i, src += 4) {
+        const uint32_t a = src[3];
+        uint32_t r = src[0];
+        uint32_t g = src[1];
+        uint32_t b = src[2];
+        if (a == 0) {
+            dst[i] = 0;
+            continue;
+        }
+        if (a != 255) {
+            r = r*a + 0x80;
+            g = g*a + 0x80;
+            b = b*a + 0x80;
+            r = (r + (r >> 8)) >> 8;
+            g = (g + (g >> 8)) >> 8;
+            b = (b + (b >> 8)) >> 8;
+        }
+        dst[i] = (a << 24) | (r << 16) | (g << 8) | b;
+    }
+}
+
+
+static bool
+is_rgba8_tile (PyObject *obj)
+{
+    if (! PyArray_Check(obj)) {
+        return false;
+    }
+    PyArrayObject *arr = (PyArrayObject *)obj;
+    return (PyArray_NDIM(arr) == 3
+            && PyArray_DIM(arr, 0) == MYPAINT_TILE_SIZE
+            && PyArray_DIM(arr, 1) == MYPAINT_TILE_SIZE
+            && PyArray_DIM(arr, 2) == 4
+            && PyArray_TYPE(arr) == NPY_UINT8
+            && PyArray_ISALIGNED(arr)
+            && PyArray_STRIDE(arr, 1) == 4
+            && PyArray_STRIDE(arr, 2) == 1);
+}
+
+
+PyObject *
+tile_rgba8_to_cairo_many (PyObject *jobs, PyObject *buffer,
+                          int width, int height, int stride)
+{
+    if (width < 0 || height < 0 || stride < 4*width || stride % 4 != 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "bad surface dimensions %dx%d with stride %d",
+                     width, height, stride);
+        return NULL;
+    }
+    Py_buffer view;
+    if (PyObject_GetBuffer(buffer, &view, PyBUF_WRITABLE) != 0) {
+        return NULL;
+    }
+    if (view.len < (Py_ssize_t)stride * height) {
+        PyBuffer_Release(&view);
+        PyErr_Format(PyExc_ValueError,
+                     "buffer too small for %d rows of stride %d",
+                     height, stride);
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(jobs, "jobs must be a sequence");
+    if (! seq) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+
+    // As in tile_combine_many(), validate and hold references first
+    std::vector<CairoTileJob> parsed;
+    std::vector<PyObject *> arrays;
+    parsed.reserve(n);
+    arrays.reserve(n);
+    bool ok = true;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        PyObject *src_obj = NULL;
+        CairoTileJob job;
+        if (! PyTuple_Check(item)
+            || ! PyArg_ParseTuple(item, "Oii", &src_obj, &job.x, &job.y))
+        {
+            PyErr_Clear();
+            PyErr_Format(PyExc_TypeError,
+                         "job %zd must be a tuple (src, x, y)", i);
+            ok = false;
+            break;
+        }
+        if (! is_rgba8_tile(src_obj)) {
+            PyErr_Format(PyExc_ValueError,
+                         "job %zd: src must be a uint8 RGBA tile array "
+                         "with contiguous rows", i);
+            ok = false;
+            break;
+        }
+        job.x0 = std::max(0, -job.x);
+        job.y0 = std::max(0, -job.y);
+        job.x1 = std::min(MYPAINT_TILE_SIZE, width - job.x);
+        job.y1 = std::min(MYPAINT_TILE_SIZE, height - job.y);
+        if (job.x0 >= job.x1 || job.y0 >= job.y1) {
+            continue;
+        }
+        PyArrayObject *src_arr = (PyArrayObject *)src_obj;
+        job.src = (const uint8_t *)PyArray_DATA(src_arr);
+        job.src_stride = PyArray_STRIDE(src_arr, 0);
+        Py_INCREF(src_obj);
+        arrays.push_back(src_obj);
+        parsed.push_back(job);
+    }
+    Py_DECREF(seq);
+
+    if (ok) {
+        const int num_jobs = parsed.size();
+        uint8_t *dst = (uint8_t *)view.buf;
+        Py_BEGIN_ALLOW_THREADS
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < num_jobs; ++i) {
+            const CairoTileJob &job = parsed[i];
+            for (int y = job.y0; y < job.y1; ++y) {
+                const uint8_t *src_p = job.src + y*job.src_stride + 4*job.x0;
+                uint32_t *dst_p = (uint32_t *)(
+                    dst + (Py_ssize_t)(job.y + y)*stride
+                ) + job.x + job.x0;
+                rgba8_row_to_cairo_argb32(src_p, dst_p, job.x1 - job.x0);
+            }
+        }
+        Py_END_ALLOW_THREADS
+    }
+
+    for (size_t i = 0; i < arrays.size(); ++i) {
+        Py_DECREF(arrays[i]);
+    }
+    PyBuffer_Release(&view);
+    if (! ok) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+const char *
+tile_combine_simd_variant ()
+{
+    return simd_combine_variant();
+}
+
+
+void
+tile_combine_set_simd_enabled (const bool enabled)
+{
+    simd_combine_set_enabled(enabled);
 }
 
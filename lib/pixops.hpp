@@ -19,6 +19,29 @@
 
 void tile_downscale_rgba16(PyObject *src, PyObject *dst, int dst_x, int dst_y);
 
+#ifndef SWIG
+#include <stdint.h>
+
+// The same on raw pixels, for other C++ code. Rows are src_strides and
+// dst_strides bytes apart.
+
+void
+tile_downscale_rgba16_c(const uint16_t *src, int src_strides, uint16_t *dst,
+                        int dst_strides, int dst_x, int dst_y);
+#endif
+
+
+// Builds a batch of mipmap tiles from the tiles one level below them, in
+// parallel and with the GIL released.
+//
+// "jobs" is a sequence of (dst, (src_nw, src_ne, src_sw, src_se)) tuples.
+// Each dst tile is entirely overwritten with its four sources downscaled
+// into the matching quadrants; a source of None counts as transparent.
+// Every dst must be distinct and not be used as a source in the same batch.
+
+PyObject *
+tile_downscale_many (PyObject *jobs);
+
 
 // Used to e.g. copy the background before starting to composite over it
 //
@@ -73,6 +96,20 @@ void tile_rgba2flat(PyObject *dst_obj, PyObject *bg_obj);
 void tile_flat2rgba(PyObject * dst_obj, PyObject * bg_obj);
 
 
+// Variants of the two functions above for repeating backgrounds. The
+// background is an HxWx4 uint16 "pattern" of any size, and (x, y) is the
+// position within it of the tile's top left pixel; it wraps around in both
+// directions. A solid colour can be given as just a 1x1 pattern, so no full
+// background tile needs to be made. Returns None, or raises ValueError if
+// an array has the wrong layout.
+
+PyObject *tile_rgba2flat_repeat(PyObject *dst_obj, PyObject *pattern_obj,
+                                int x, int y);
+
+PyObject *tile_flat2rgba_repeat(PyObject *dst_obj, PyObject *pattern_obj,
+                                int x, int y);
+
+
 // Calculates a 1-bit bitmap of the stroke shape using two snapshots of the
 // layer (the layer before and after the stroke). Used in strokemap.py
 //
@@ -88,6 +125,14 @@ void tile_flat2rgba(PyObject * dst_obj, PyObject * bg_obj);
 void tile_perceptual_change_strokemap(PyObject *a_obj, PyObject *b_obj, PyObject *res_obj);
 
 
+// The same test, returning the bitmap packed 8 pixels to a byte, row by row
+// and leftmost pixel in the most significant bit (the layout of numpy's
+// packbits()): 512 bytes for a 64x64 tile. Returns None instead if no
+// pixel changed, which is found cheaply when the two tiles are identical.
+
+PyObject *tile_perceptual_change_strokemap_bits(PyObject *a_obj, PyObject *b_obj);
+
+
 // Tile blending & compositing modes
 
 enum CombineMode {
@@ -123,14 +168,200 @@ PyObject *
 combine_mode_get_info(enum CombineMode mode);
 
 
+// What is known about the pixels of a whole source tile
+
+enum TileSummary {
+    TileSummaryUnknown,   // not examined yet: treated like Mixed
+    TileSummaryEmpty,     // every channel of every pixel is zero
+    TileSummaryUniform,   // every pixel has the same, non-zero value
+    TileSummaryMixed,
+    NumTileSummaries
+};
+
+
+// Classifies a 15ish-bit RGBA tile, returning (summary, (r, g, b, a)) where
+// the colour is that of the first pixel. Stops at the first pixel that
+// differs from it, so mixed tiles are cheap to classify.
+
+PyObject *
+tile_summarize (PyObject *src_obj);
+
+
 // Blend and composite one tile, writing into the destination.
+//
+// If the caller knows the source tile to be empty or uniform, passing its
+// summary lets whole tiles be skipped, cleared, or filled with a constant
+// when the mode allows it. The results are the same either way.
 
 void
 tile_combine (enum CombineMode mode,
               PyObject *src_obj,
               PyObject *dst_obj,
               const bool dst_has_alpha,
-              const float src_opacity);
+              const float src_opacity,
+              const enum TileSummary src_summary = TileSummaryUnknown);
+
+
+// Runs a batch of tile_combine() operations with the GIL released.
+//
+// "jobs" is a sequence of (mode, src, dst, dst_has_alpha, opacity) tuples,
+// which may have the source tile's summary as an optional sixth item.
+// Jobs which write to the same tile array, or read one that another job
+// writes, run in the order given; independent chains of jobs are shared out
+// over a pool of threads. Raises TypeError or
+// ValueError, without combining anything, if any job is malformed.
+
+PyObject *
+tile_combine_many (PyObject *jobs);
+
+
+// Renders a batch of tiles of a layer stack with the GIL released, in
+// parallel.
+//
+// "program" is the stack's list of render ops (see lib.layer.rendering),
+// with each op as an (opcode, mode, opacity) tuple. "jobs" is a sequence
+// of (dst, dst_has_alpha, sources) tuples, where "sources" has one item
+// for each COMPOSITE or BLIT op, in program order: None for a transparent
+// tile, or a (tile, summary) tuple. Every dst must be distinct, and not be
+// a source. Group isolation uses scratch tiles kept by each thread.
+// Raises TypeError or ValueError, rendering nothing, if anything is
+// malformed.
+
+PyObject *
+tile_render_ops_many (PyObject *program, PyObject *jobs);
+
+
+// Writes a batch of 8bpc display tiles straight into the pixel buffer of a
+// cairo image surface, as premultiplied native-endian ARGB32, in parallel
+// and with the GIL released.
+//
+// "jobs" is a sequence of (src, x, y) tuples: a straight-alpha RGBA uint8
+// tile, as rendered for the display, and the position of its top left
+// pixel in the surface. Tiles are clipped to the width x height surface,
+// whose rows are "stride" bytes apart in the writable "buffer". Tiles
+// should not overlap. Raises TypeError or ValueError, writing nothing,
+// if anything is malformed.
+
+PyObject *
+tile_rgba8_to_cairo_many (PyObject *jobs, PyObject *buffer,
+                          int width, int height, int stride);
+
+
+// Name of the instruction set used by tile_combine() for its vectorized
+// modes on this CPU, or "none". The vectorized kernels can be turned off for
+// testing; their output is identical to that of the generic code.
+
+const char *
+tile_combine_simd_variant ();
+
+void
+tile_combine_set_simd_enabled (const bool enabled);
+
+
+#ifndef SWIG
+#include <utility>
+#include <vector>
+
+// Layer stack rendering for other C++ code, as done by
+// tile_render_ops_many(). Programs and sources are parsed with the GIL
+// held. render_ops_tile() needs no Python, and can run in any thread
+// with a RenderScratch of its own.
+
+// Opcodes of a render program, as in lib.layer.rendering.Opcode
+
+enum RenderOpcode
+{
+    RenderOpComposite = 1,
+    RenderOpBlit = 2,
+    RenderOpPush = 3,
+    RenderOpPop = 4
+};
+
+struct RenderOp
+{
+    enum RenderOpcode opcode;
+    enum CombineMode mode;
+    float opacity;
+};
+
+
+// The source tile of a COMPOSITE or BLIT op, data is NULL if transparent
+
+struct RenderOpSource
+{
+    const uint16_t *data;
+    enum TileSummary summary;
+};
+
+
+// The isolated backdrops of the groups being rendered, one per PUSH level.
+// Each worker thread has its own, reused for all of its tiles.
+
+class RenderScratch
+{
+  public:
+    explicit RenderScratch(int depth);
+
+    std::vector<std::vector<uint16_t> > tiles;
+    std::vector<std::pair<uint16_t *, bool> > parents;
+};
+
+
+// Checks and parses a program. "num_sources" is set to its number of
+// COMPOSITE and BLIT ops, and "max_depth" to the RenderScratch depth it
+// needs. Returns false with an exception set if it is malformed.
+
+bool
+render_ops_parse_program (PyObject *program_obj,
+                          std::vector<RenderOp> &program,
+                          size_t &num_sources,
+                          int &max_depth);
+
+
+// Parses the sources tuple of one tile, the job numbered "index" in any
+// error message. Its sources are appended to "sources", and new
+// references to their arrays to "refs", which the caller must release.
+
+bool
+render_ops_parse_sources (PyObject *srcs_obj, const size_t num_sources,
+                          const Py_ssize_t index,
+                          std::vector<RenderOpSource> &sources,
+                          std::vector<PyObject *> &refs);
+
+
+// Renders a tile from its sources over dst.
+
+void
+render_ops_tile (const std::vector<RenderOp> &program,
+                 const RenderOpSource *sources,
+                 uint16_t *dst,
+                 bool dst_has_alpha,
+                 RenderScratch &scratch);
+
+
+// tile_convert_rgba16_to_rgba8() and tile_convert_rgbu16_to_rgbu8() on
+// raw tiles, with rows src_strides and dst_strides bytes apart. They can
+// run in any thread once tile_convert_prepare() has been called with
+// the GIL held for the EOTF they will be used with.
+
+void
+tile_convert_prepare (const float EOTF);
+
+void
+tile_convert_rgba16_to_rgba8_c (const uint16_t* const src,
+                                const int src_strides,
+                                uint8_t* const dst,
+                                const int dst_strides,
+                                const float EOTF);
+
+void
+tile_convert_rgbu16_to_rgbu8_c (const uint16_t* const src,
+                                const int src_strides,
+                                uint8_t* const dst,
+                                const int dst_strides,
+                                const float EOTF);
+
+#endif /* #ifndef SWIG */
 
 
 #endif // PIXOPS_HPP
@@ -51,9 +51,45 @@ public:
   {
     bool res = Brush::stroke_to (surface, x, y, pressure, xtilt, ytilt, dtime, viewzoom, viewrotation, barrel_rotation);
     if (PyErr_Occurred()) {
-      res = false;
+      return NULL;
     }
     return res;
   }
 
+  // Runs stroke_to() for every row of an Nx9 float64 array of
+  // (x, y, pressure, xtilt, ytilt, dtime, viewzoom, viewrotation,
+  // barrel_rotation) events, with the GIL released throughout.
+  // Returns whether any of the events made a split pending, or NULL with
+  // an exception set if the events array is unusable.
+  PyObject * stroke_to_many (Surface * surface, PyObject * events_obj)
+  {
+    PyArrayObject *events = (PyArrayObject *)PyArray_FROM_OTF(
+      events_obj, NPY_FLOAT64, NPY_ARRAY_IN_ARRAY
+    );
+    if (! events) {
+      return NULL;
+    }
+    if (PyArray_NDIM(events) != 2 || PyArray_DIM(events, 1) != 9) {
+      Py_DECREF(events);
+      PyErr_SetString(PyExc_ValueError, "events must be an Nx9 array");
+      return NULL;
+    }
+    const npy_intp num_events = PyArray_DIM(events, 0);
+    const double *e = (const double *)PyArray_DATA(events);
+    bool res = false;
+    Py_BEGIN_ALLOW_THREADS
+    surface->set_gil_released(true);
+    for (npy_intp i = 0; i < num_events; i++, e += 9) {
+      res |= Brush::stroke_to (surface, e[0], e[1], e[2], e[3], e[4],
+                               e[5], e[6], e[7], e[8]);
+    }
+    surface->set_gil_released(false);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(events);
+    if (PyErr_Occurred()) {
+      return NULL;
+    }
+    return PyBool_FromLong(res);
+  }
+
 };
@@ -9,6 +9,9 @@
 
 #include "pythontiledsurface.h"
 #include "surface.hpp"
+#include "tilerequestcache.hpp"
+#include "symmetryprefetch.hpp"
+#include "tracing.hpp"
 
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #define NO_IMPORT_ARRAY
@@ -17,10 +20,23 @@
 
 #include <mypaint-tiled-surface.h>
 
+#include <atomic>
+#include <new>
+
 
 struct MyPaintPythonTiledSurface {
     MyPaintTiledSurface2 parent;
     PyObject * py_obj;
+    TileRequestCache * tile_cache;
+    SymmetryPrefetch * prefetch;
+    MyPaintSurfaceDrawDabFunction2 draw_dab_unwrapped;
+    MyPaintSurfaceGetColorFunction2 get_color_unwrapped;
+    MyPaintSurfaceGetColorFunction get_color_legacy_unwrapped;
+    MyPaintPythonTiledSurface * mipmap; // next mipmap level, or NULL
+    bool mipmap_sampling;
+    // Set while a brush paints with the GIL released, see surface.hpp.
+    // Read by every thread libmypaint makes tile requests from.
+    std::atomic<bool> gil_released;
 };
 
 // Forward declare
@@ -29,6 +45,7 @@ void free_tiledsurf(MyPaintSurface *surface);
 static void
 tile_request_start(MyPaintTiledSurface2 *tiled_surface, MyPaintTileRequest *request)
 {
+    TRACE_SCOPE("tile_request_start");
     MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)tiled_surface;
 
     const gboolean readonly = request->readonly;
@@ -36,8 +53,26 @@ tile_request_start(MyPaintTiledSurface2 *tiled_surface, MyPaintTileRequest *requ
     const int ty = request->ty;
     PyArrayObject* rgba = NULL;
 
+    // Repeat requests are answered without going through Python
+    uint16_t *cached = self->tile_cache->lookup(tx, ty, readonly);
+    if (cached) {
+        request->buffer = cached;
+        return;
+    }
+
+    // The painting thread may have released the GIL. Requests can then
+    // come from libmypaint's worker threads as well, e.g. for get_color().
+    const bool need_gil = self->gil_released.load();
+
 #pragma omp critical
 {
+    // Taken inside the critical section, so that no thread ever waits
+    // for the section while holding the GIL
+    PyGILState_STATE gil_state = PyGILState_UNLOCKED;
+    if (need_gil) {
+        gil_state = PyGILState_Ensure();
+    }
+
     rgba = (PyArrayObject*)PyObject_CallMethod(self->py_obj, "_get_tile_numpy", "(iii)", tx, ty, readonly);
     if (rgba == NULL) {
         request->buffer = NULL;
@@ -56,12 +91,16 @@ tile_request_start(MyPaintTiledSurface2 *tiled_surface, MyPaintTileRequest *requ
         assert(PyArray_TYPE(rgba) == NPY_UINT16);
 #endif
         // tiledsurface.py will keep a reference in its tiledict, at least until the final end_atomic()
-        Py_DECREF((PyObject *)rgba);
         request->buffer = (uint16_t*)PyArray_DATA(rgba);
+        self->tile_cache->insert(tx, ty, (PyObject *)rgba, request->buffer,
+                                 ! readonly);
+        Py_DECREF((PyObject *)rgba);
     }
-} // #end pragma opt critical
-
 
+    if (need_gil) {
+        PyGILState_Release(gil_state);
+    }
+} // #end pragma opt critical
 }
 
 static void
@@ -70,6 +109,80 @@ tile_request_end(MyPaintTiledSurface2 *tiled_surface, MyPaintTileRequest *reques
     // We modify tiles directly, so don't need to do anything here
 }
 
+// Notes where a dab's mirrored copies will go, then draws it as usual
+static int
+draw_dab_prefetching(MyPaintSurface2 *surface, float x, float y,
+                     float radius,
+                     float color_r, float color_g, float color_b,
+                     float opaque, float hardness, float alpha_eraser,
+                     float aspect_ratio, float angle, float lock_alpha,
+                     float colorize, float posterize, float posterize_num,
+                     float paint)
+{
+    MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)surface;
+    self->prefetch->add_dab(x, y, radius);
+    return self->draw_dab_unwrapped(surface, x, y, radius,
+                                    color_r, color_g, color_b,
+                                    opaque, hardness, alpha_eraser,
+                                    aspect_ratio, angle, lock_alpha,
+                                    colorize, posterize, posterize_num,
+                                    paint);
+}
+
+// Large areas are sampled at the coarsest mipmap level on which their
+// radius is still at least this many pixels, so that the cost of a
+// sample stops growing with its radius.
+static const float MIPMAP_SAMPLE_MIN_RADIUS = 16.0f;
+
+// The level to sample an area at, and the factor scaling coordinates on
+// the surface to its pixels. Pixel i of a mipmap level is the average of
+// pixels 2i and 2i+1 of the one below, so positions scale by exactly half.
+static MyPaintPythonTiledSurface *
+mipmap_sample_level(MyPaintPythonTiledSurface *self, const float radius,
+                    float *scale)
+{
+    MyPaintPythonTiledSurface *level = self;
+    *scale = 1.0f;
+    if (! self->mipmap_sampling) {
+        return level;
+    }
+    while (level->mipmap
+           && radius * *scale * 0.5f >= MIPMAP_SAMPLE_MIN_RADIUS) {
+        level = level->mipmap;
+        *scale *= 0.5f;
+    }
+    return level;
+}
+
+static void
+get_color_mipmapped(MyPaintSurface2 *surface, float x, float y, float radius,
+                    float *color_r, float *color_g, float *color_b,
+                    float *color_a, float paint)
+{
+    MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)surface;
+    float scale;
+    MyPaintPythonTiledSurface *level = mipmap_sample_level(self, radius,
+                                                           &scale);
+    level->get_color_unwrapped((MyPaintSurface2 *)level,
+                               x * scale, y * scale, radius * scale,
+                               color_r, color_g, color_b, color_a, paint);
+}
+
+static void
+get_color_legacy_mipmapped(MyPaintSurface *surface,
+                           float x, float y, float radius,
+                           float *color_r, float *color_g, float *color_b,
+                           float *color_a)
+{
+    MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)surface;
+    float scale;
+    MyPaintPythonTiledSurface *level = mipmap_sample_level(self, radius,
+                                                           &scale);
+    level->get_color_legacy_unwrapped((MyPaintSurface *)level,
+                                      x * scale, y * scale, radius * scale,
+                                      color_r, color_g, color_b, color_a);
+}
+
 MyPaintPythonTiledSurface *
 mypaint_python_tiled_surface_new(PyObject *py_object)
 {
@@ -81,6 +194,17 @@ mypaint_python_tiled_surface_new(PyObject *py_object)
     // MyPaintSurface vfuncs
     self->parent.parent.parent.destroy = free_tiledsurf;
     self->py_obj = py_object; // no need to incref
+    self->tile_cache = new TileRequestCache();
+    self->prefetch = new SymmetryPrefetch();
+    self->draw_dab_unwrapped = self->parent.parent.draw_dab;
+    self->parent.parent.draw_dab = draw_dab_prefetching;
+    self->get_color_unwrapped = self->parent.parent.get_color;
+    self->parent.parent.get_color = get_color_mipmapped;
+    self->get_color_legacy_unwrapped = self->parent.parent.parent.get_color;
+    self->parent.parent.parent.get_color = get_color_legacy_mipmapped;
+    self->mipmap = NULL;
+    self->mipmap_sampling = false;
+    new (&self->gil_released) std::atomic<bool>(false);
 
     return self;
 }
@@ -89,5 +213,7 @@ void free_tiledsurf(MyPaintSurface *surface)
 {
     MyPaintPythonTiledSurface *self = (MyPaintPythonTiledSurface *)surface;
     mypaint_tiled_surface2_destroy(&self->parent);
+    delete self->tile_cache;
+    delete self->prefetch;
     free(self);
 }
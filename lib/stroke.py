@@ -90,11 +90,10 @@ class Stroke (object):
         data = np.fromstring(data, dtype='float64')
         data.shape = (len(data) // 9, 9)
 
+        # Reorder to stroke_to()'s argument order, for stroke_to_many()
+        events = data[:, [1, 2, 3, 4, 5, 0, 6, 7, 8]]
         surface.begin_atomic()
-        for (dtime, x, y, pressure, xtilt, ytilt, viewzoom,
-             viewrotation, barrel_rotation) in data:
-            b.stroke_to(surface.backend, x, y, pressure, xtilt, ytilt, dtime,
-                        viewzoom, viewrotation, barrel_rotation)
+        b.stroke_to_many(surface.backend, events)
         surface.end_atomic()
 
     def copy_using_different_brush(self, brushinfo):
@@ -0,0 +1,82 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "strokeindex.hpp"
+
+
+uint64_t
+StrokeIndex::tile_key (int tx, int ty)
+{
+    return ((uint64_t)(uint32_t)tx << 32) | (uint32_t)ty;
+}
+
+
+PyObject *
+StrokeIndex::add_tile (int key, int tx, int ty, PyObject *bits)
+{
+    Entry entry;
+    entry.key = key;
+    entry.mask = -1;
+    if (bits != Py_None) {
+        if (! PyBytes_Check(bits) || PyBytes_GET_SIZE(bits) != MASK_BYTES) {
+            PyErr_Format(PyExc_ValueError,
+                         "bits must be None or %d bytes", MASK_BYTES);
+            return NULL;
+        }
+        entry.mask = masks.size() / MASK_BYTES;
+        const uint8_t *data = (const uint8_t *)PyBytes_AS_STRING(bits);
+        masks.insert(masks.end(), data, data + MASK_BYTES);
+    }
+
+    // Strokes are normally added oldest first, so this appends
+    std::vector<Entry> &entries = tiles[tile_key(tx, ty)];
+    std::vector<Entry>::iterator pos = entries.end();
+    while (pos != entries.begin() && (pos - 1)->key > key) {
+        --pos;
+    }
+    entries.insert(pos, entry);
+    ++size;
+    Py_RETURN_NONE;
+}
+
+
+int
+StrokeIndex::pick (int x, int y) const
+{
+    const int N = MYPAINT_TILE_SIZE;
+    const int tx = (x >= 0) ? x / N : -((-x - 1) / N) - 1;
+    const int ty = (y >= 0) ? y / N : -((-y - 1) / N) - 1;
+    std::unordered_map<uint64_t, std::vector<Entry> >::const_iterator found
+        = tiles.find(tile_key(tx, ty));
+    if (found == tiles.end()) {
+        return -1;
+    }
+    const int i = (y - ty*N) * N + (x - tx*N);
+    const std::vector<Entry> &entries = found->second;
+    for (size_t n = entries.size(); n > 0; --n) {
+        const Entry &entry = entries[n - 1];
+        if (entry.mask < 0) {
+            return entry.key;
+        }
+        const uint8_t byte = masks[(size_t)entry.mask * MASK_BYTES + (i >> 3)];
+        if (byte & (0x80 >> (i & 7))) {
+            return entry.key;
+        }
+    }
+    return -1;
+}
+
+
+void
+StrokeIndex::clear ()
+{
+    tiles.clear();
+    masks.clear();
+    size = 0;
+}
@@ -0,0 +1,67 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef STROKEINDEX_HPP
+#define STROKEINDEX_HPP
+
+#include <Python.h>
+
+#ifndef SWIG
+#include <mypaint-tiled-surface.h>
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+#endif
+
+
+// Spatial index of the stroke shapes of a layer, for picking strokes.
+//
+// Strokes are identified by integer keys, higher keys for newer strokes.
+// For each tile the index holds the strokes touching it in key order, with
+// a copy of their packed bitmaps (see strokemap.py), so finding the newest
+// stroke at a pixel only tests one bit for each stroke on its tile.
+
+class StrokeIndex
+{
+  public:
+    StrokeIndex() : size(0) {}
+
+    // Adds a stroke's tile. "bits" is the tile's packbits()-layout bitmap
+    // as bytes, or None if the stroke covers all of it.
+    PyObject *add_tile (int key, int tx, int ty, PyObject *bits);
+
+    // The key of the newest stroke covering pixel (x, y), or -1.
+    int pick (int x, int y) const;
+
+    // Number of (stroke, tile) entries.
+    int get_size () const { return size; }
+
+    void clear ();
+
+#ifndef SWIG
+  private:
+    static const int MASK_BYTES = MYPAINT_TILE_SIZE*MYPAINT_TILE_SIZE/8;
+
+    struct Entry {
+        int key;
+        int mask;   // index into masks, or -1 if the tile is all set
+    };
+
+    static uint64_t tile_key (int tx, int ty);
+
+    std::unordered_map<uint64_t, std::vector<Entry> > tiles;
+    std::vector<uint8_t> masks;
+    int size;
+#endif /* #ifndef SWIG */
+};
+
+
+#endif // STROKEINDEX_HPP
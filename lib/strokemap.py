@@ -37,6 +37,11 @@ class StrokeShape (object):
     tile (for fast lookup).
 
     """
+
+    #: Counts the times any shape's existing tiles were moved or trimmed,
+    #: which a `StrokeMapIndex` has to start over after.
+    generation = 0
+
     def __init__(self):
         """Construct a new, blank StrokeShape."""
         object.__init__(self)
@@ -175,10 +180,22 @@ class StrokeShape (object):
         self._complete_tile_tasks(lambda ti: (ti == pixel_ti))
         tile = self.strokemap.get(pixel_ti)
         if tile:
-            array = tile.to_array()
-            return bool(array[y % N, x % N])
+            return tile.touches(x % N, y % N)
         return False
 
+    def add_to_index(self, index, key):
+        """Add the shape's tiles to a native StrokeIndex
+
+        :param lib.mypaintlib.StrokeIndex index: index to update
+        :param int key: stroke key, ordering the strokes in the index
+
+        Queued work must have been finished beforehand.
+
+        """
+        assert not self.tasks.has_work()
+        for (tx, ty), tile in iteritems(self.strokemap):
+            index.add_tile(key, tx, ty, tile.get_bits())
+
     def render_to_surface(self, surf, bbox=None, center=None):
         """Draw all or part of the shape to a tile-accessible surface.
 
@@ -210,6 +227,7 @@ class StrokeShape (object):
 
     def translate(self, dx, dy):
         """Translate the shape by (dx, dy)"""
+        StrokeShape.generation += 1
         self.tasks.finish_all()
         tmp = {}
         self.tasks.add_work(_TileTranslateTask(self.strokemap, tmp, dx, dy))
@@ -225,6 +243,7 @@ class StrokeShape (object):
 
         Only complete tiles are discarded by this method.
         """
+        StrokeShape.generation += 1
         self.tasks.finish_all()
         x, y, w, h = rect
         logger.debug("Trimming stroke to %dx%d%+d%+d", w, h, x, y)
@@ -234,6 +253,69 @@ class StrokeShape (object):
         return bool(self.strokemap)
 
 
+class StrokeMapIndex (object):
+    """Picks strokes from a list of StrokeShapes via a native index
+
+    The list is expected to grow at the end only, as it does when a
+    layer is painted on or loaded. Anything else, or any shape being
+    translated or trimmed, makes the index start over. Strokes with
+    queued work (diffs or moves) are tested one by one until they're
+    done, so that picking never forces all of it.
+
+    """
+
+    def __init__(self):
+        super(StrokeMapIndex, self).__init__()
+        self._index = None
+        self._generation = None
+        self._strokes = []
+        self._pending = []
+
+    def _update(self, strokes):
+        """Catch up with a list of strokes"""
+        n = len(self._strokes)
+        if (self._generation != StrokeShape.generation
+                or len(strokes) < n or strokes[:n] != self._strokes):
+            self._index = mypaintlib.StrokeIndex()
+            self._generation = StrokeShape.generation
+            self._strokes = []
+            self._pending = []
+            n = 0
+        for key in range(n, len(strokes)):
+            self._strokes.append(strokes[key])
+            self._pending.append(key)
+        still_pending = []
+        for key in self._pending:
+            stroke = self._strokes[key]
+            if stroke.tasks.has_work():
+                still_pending.append(key)
+            else:
+                stroke.add_to_index(self._index, key)
+        self._pending = still_pending
+
+    def pick(self, strokes, x, y):
+        """Returns the newest stroke touching a pixel
+
+        :param list strokes: StrokeShapes in painting order
+        :param int x: Pixel X position.
+        :param int y: Pixel Y position.
+        :returns: the stroke touching the pixel, or None
+        :rtype: StrokeShape
+
+        """
+        self._update(strokes)
+        key = self._index.pick(x, y)
+        for pending_key in reversed(self._pending):
+            if pending_key < key:
+                break
+            stroke = self._strokes[pending_key]
+            if stroke.touches_pixel(x, y):
+                return stroke
+        if key < 0:
+            return None
+        return self._strokes[key]
+
+
 class _TileDiffUpdateTask:
     """Idle task: update strokemap with tile & pixel diffs of snapshots.
 
@@ -282,10 +364,15 @@ class _TileDiffUpdateTask:
 
     def _update_tile(self, ti):
         """Diff and update the tile at a specified position."""
+        # Erased tiles have no strokes on them, nor do unchanged ones
+        after = self._after_dict.get(ti)
+        if after is None:
+            return
         transparent = tiledsurface.transparent_tile
         data_before = self._before_dict.get(ti, transparent).rgba
-        data_after = self._after_dict.get(ti, transparent).rgba
-        self._targ_dict[ti] = _Tile.new_from_diff(data_before, data_after)
+        tile = _Tile.new_from_diff(data_before, after.rgba)
+        if tile is not None:
+            self._targ_dict[ti] = tile
 
 
 class _TileTranslateTask:
@@ -406,14 +493,18 @@ class _TileRecompressTask:
 class _Tile:
     """One strokemap tile containing perceptual stroke differences.
 
-    Stored in memory in a compressed and efficient form.
+    Stored in memory as a 1-bit bitmap, packed 8 pixels to a byte in the
+    layout of numpy's packbits(). Tiles loaded from a file keep their
+    compressed "v2" format data until it's first needed.
 
     """
 
     _ZDATA_ONES = zlib.compress(np.ones((N, N), 'uint8').tostring())
+    _BITS_ONES = b'\xff' * (N * N // 8)
 
     def __init__(self):
         """Initialize, as a tile filled with all ones."""
+        self._bits = None
         self._zdata = None
         self._all = True
 
@@ -432,27 +523,33 @@ class _Tile:
 
     @classmethod
     def new_from_diff(cls, before, after):
-        """Initialize from a diff or two RGBA arrays."""
-        differences = np.empty((N, N), 'uint8')
-        mypaintlib.tile_perceptual_change_strokemap(
+        """Initialize from a diff or two RGBA arrays.
+
+        :returns: A new tile, or None if no pixel changed perceptibly.
+
+        """
+        bits = mypaintlib.tile_perceptual_change_strokemap_bits(
             before,
             after,
-            differences,
         )
-        return cls.new_from_array(differences)
+        if bits is None:
+            return None
+        return cls.new_from_bits(bits)
 
     @classmethod
-    def new_from_array(cls, array):
-        """Initialize from a single uncompressed diff array."""
+    def new_from_bits(cls, bits):
+        """Initialize from a packed bitmap (bytes)."""
         tile = cls()
-        if array.all():
-            tile._all = True
-            tile._zdata = None
-        else:
+        if bits != cls._BITS_ONES:
             tile._all = False
-            tile._zdata = zlib.compress(array.tostring())
+            tile._bits = bits
         return tile
 
+    @classmethod
+    def new_from_array(cls, array):
+        """Initialize from a single uncompressed diff array."""
+        return cls.new_from_bits(np.packbits(array).tobytes())
+
     @classmethod
     def new_from_compressed_bitmap(cls, zdata):
         """Initialize from raw compressed zlib bitmap data.
@@ -466,24 +563,48 @@ class _Tile:
         if zdata == cls._ZDATA_ONES:
             # ASSUMPTION: this representation of these bytes never changes.
             tile._all = True
-            tile._zdata = None
         else:
             tile._all = False
             tile._zdata = zdata
         return tile
 
+    def _get_bits(self):
+        """The packed bitmap, unpacking loaded data if needed"""
+        if self._bits is None:
+            array = np.frombuffer(zlib.decompress(self._zdata), 'uint8')
+            self._bits = np.packbits(array).tobytes()
+            self._zdata = None
+        return self._bits
+
+    def get_bits(self):
+        """The packed bitmap as bytes, or None if all pixels are set"""
+        if self._all:
+            return None
+        return self._get_bits()
+
+    def touches(self, x, y):
+        """Whether a pixel of the tile is set
+
+        :param int x: Pixel X position within the tile.
+        :param int y: Pixel Y position within the tile.
+
+        >>> ones, checks, zeros = _Tile._mocks()
+        >>> ones.touches(3, 5), checks.touches(3, 5), checks.touches(N-1, 0)
+        (True, False, True)
+
+        """
+        if self._all:
+            return True
+        i = y * N + x
+        byte, = struct.unpack_from('B', self._get_bits(), i >> 3)
+        return bool(byte & (0x80 >> (i & 7)))
+
     def to_array(self):
         """Convert to an uncompressed array of ones and zeros."""
         if self._all:
-            array = np.ones((N, N), 'uint8')
-        else:
-            array = np.frombuffer(
-                zlib.decompress(self._zdata),
-                dtype='uint8',
-            )
-            array.shape = (N, N)
-        # Can this result always be treated as read-only?
-        return array
+            return np.ones((N, N), 'uint8')
+        bits = np.frombuffer(self._get_bits(), dtype='uint8')
+        return np.unpackbits(bits).reshape((N, N))
 
     def to_bytes(self):
         """Convert to a bytestring which is storable in "v2" strokemaps.
@@ -496,8 +617,10 @@ class _Tile:
         """
         if self._all:
             return self._ZDATA_ONES
-        else:
+        elif self._zdata is not None:
             return self._zdata
+        else:
+            return zlib.compress(self.to_array().tobytes())
 
     def to_string(self):
         """Deprecated alias for to_bytes()."""
@@ -534,16 +657,18 @@ class _Tile:
 
         >>> t = _Tile()
         >>> repr(t)
-        '<_Tile all=True zbytes=0>'
+        '<_Tile all=True nbytes=0>'
 
         """
-        zb = 0
-        if not self._all:
-            zb = len(self._zdata)
-        return "<{name} all={all} zbytes={zbytes}>".format(
+        nbytes = 0
+        if self._bits is not None:
+            nbytes = len(self._bits)
+        elif self._zdata is not None:
+            nbytes = len(self._zdata)
+        return "<{name} all={all} nbytes={nbytes}>".format(
             all = self._all,
             name = self.__class__.__name__,
-            zbytes = zb,
+            nbytes = nbytes,
         )
 
 
@@ -27,6 +27,17 @@ public:
   virtual ~Surface() {}
   virtual MyPaintSurface *get_surface_interface() = 0;
   virtual MyPaintSurface2 *get_surface2_interface() = 0;
+
+#ifndef SWIG
+  // Told before and after painting with the GIL released, as
+  // PythonBrush::stroke_to_many() does. In between, surfaces which call
+  // back into Python from their libmypaint callbacks must take the GIL
+  // for it, from whichever thread libmypaint runs the callback on.
+  // Otherwise, native threads like the ones processing tiles in
+  // end_atomic() run while the caller holds the GIL, and must leave it
+  // alone.
+  virtual void set_gil_released(bool released) {}
+#endif /* #ifndef SWIG */
 };
 
 #endif //SURFACE_HPP
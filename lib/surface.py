@@ -22,6 +22,7 @@ from . import mypaintlib
 import lib.helpers
 from lib.errors import FileHandlingError
 from lib.gettext import C_
+from lib.eotf import eotf
 import lib.feedback
 from lib.pycompat import xrange
 
@@ -131,6 +132,26 @@ class TileCompositable (Bounded):
         """
 
 
+class TileRenderable (Bounded):
+    """Interface for layer stack renderings which can be run natively"""
+
+    __metaclass__ = abc.ABCMeta
+
+    @abc.abstractmethod
+    def get_render_program(self):
+        """Returns the rendering's compiled ops, or None
+
+        :returns: (program, surfaces), as made by
+            lib.layer.tree.RootLayerStack._compile_ops_list(),
+            or None if not every op can be run natively.
+
+        The program is for lib.mypaintlib.tile_render_ops_many(), and
+        the surfaces give the sources of its COMPOSITE and BLIT ops
+        through their get_render_source() methods.
+
+        """
+
+
 def get_tiles_bbox(tile_coords):
     """Convert tile coords to a data bounding box
 
@@ -157,12 +178,13 @@ def get_tiles_bbox(tile_coords):
 
 
 def scanline_strips_iter(surface, rect, alpha=False,
-                         single_tile_pattern=False, **kwargs):
+                         single_tile_pattern=False, bit_depth=8, **kwargs):
     """Generate (render) scanline strips from a tile-blittable object
 
     :param lib.surface.TileBlittable surface: Surface to iterate over
     :param bool alpha: If true, write a PNG with alpha
     :param bool single_tile_pattern: True if surface is a one tile only.
+    :param int bit_depth: 8 for uint8 strips, 16 for fix15 uint16 ones.
     :param tuple \*\*kwargs: Passed to blit_tile_into.
 
     The `alpha` parameter is passed to the surface's `blit_tile_into()`.
@@ -184,7 +206,12 @@ def scanline_strips_iter(surface, rect, alpha=False,
     render_th = (y + h - 1) // N - render_ty + 1
 
     # buffer for rendering one tile row at a time
-    arr = np.empty((N, render_tw * N, 4), 'uint8')  # rgba or rgbu
+    if bit_depth == 16:
+        arr = np.empty((N, render_tw * N, 4), 'uint16')  # fix15 rgba/rgbu
+        clear_tile = mypaintlib.tile_clear_rgba16
+    else:
+        arr = np.empty((N, render_tw * N, 4), 'uint8')  # rgba or rgbu
+        clear_tile = mypaintlib.tile_clear_rgba8
     # view into arr without the horizontal padding
     arr_xcrop = arr[:, x-render_tx*N:x-render_tx*N+w, :]
 
@@ -209,7 +236,7 @@ def scanline_strips_iter(surface, rect, alpha=False,
                 except Exception:
                     logger.exception("Failed to blit tile %r of %r",
                                      (tx, ty), surface)
-                    mypaintlib.tile_clear_rgba8(dst)
+                    clear_tile(dst)
 
         # yield a numpy array of the scanline without padding
         res = arr_xcrop
@@ -220,6 +247,45 @@ def scanline_strips_iter(surface, rect, alpha=False,
         yield res
 
 
+def render_source_rows_iter(surfaces, rect, progress=None):
+    """Generate the sources of each tile row, for natively rendered saves
+
+    :param list surfaces: Sources of a TileRenderable's render program
+    :param tuple rect: Rectangle (x, y, w, h) being rendered
+    :param progress: Updated for each row, if given
+    :type progress: lib.feedback.Progress or None
+
+    Each row is a tuple with a tuple of get_render_source() results for
+    each tile column the rectangle spans, as taken by
+    mypaintlib.ProgressivePNGWriter.write_rendered().
+
+    """
+    x, y, w, h = rect
+    tx0, ty0 = x // N, y // N
+    tx1, ty1 = (x + w - 1) // N, (y + h - 1) // N
+    for ty in xrange(ty0, ty1 + 1):
+        yield tuple(
+            tuple(s.get_render_source(tx, ty) for s in surfaces)
+            for tx in xrange(tx0, tx1 + 1)
+        )
+        progress = _progress_step(progress)
+
+
+def _progress_step(progress):
+    """Advances a progress object, returning None once it fails"""
+    if not progress:
+        return progress
+    try:
+        progress += 1
+    except Exception:
+        logger.exception(
+            "Failed to update lib.feedback.Progress: "
+            "dropping it"
+        )
+        return None
+    return progress
+
+
 def save_as_png(surface, filename, *rect, **kwargs):
     """Saves a tile-blittable surface to a file in PNG format
 
@@ -231,6 +297,10 @@ def save_as_png(surface, filename, *rect, **kwargs):
     :type progress: lib.feedback.Progress or None
     :param bool single_tile_pattern: True if surface is one tile only.
     :param bool save_srgb_chunks: Set to False to not save sRGB flags.
+    :param int compression_level: zlib level 0 to 9, or -1 for its default.
+    :param int png_filter: A mypaintlib.ProgressivePNGWriter.FILTER_*.
+    :param int threads: Compression threads; 0 for one per CPU.
+    :param int bit_depth: Bits per sample in the file, 8 or 16.
     :param tuple \*\*kwargs: Passed to blit_tile_into (minus the above)
 
     The `alpha` parameter is passed to the surface's `blit_tile_into()`
@@ -241,6 +311,14 @@ def save_as_png(surface, filename, *rect, **kwargs):
     If `save_srgb_chunks` is set to False, sRGB (and associated fallback
     cHRM and gAMA) will not be saved. MyPaint's default behaviour is
     currently to save these chunks.
+    TileRenderable surfaces whose ops can all run natively are rendered
+    by the writer, in worker threads which composite the rows below while
+    the ones above are compressed.
+    With more than one thread, the image is compressed in bands
+    concurrently. The output differs from the single-threaded writer's,
+    but is the same for any number of threads above one.
+    For 16-bit files the surface is blitted as fix15, and the writer
+    converts it natively, applying the current EOTF.
 
     Raises `lib.errors.FileHandlingError` with a descriptive string if
     something went wrong.
@@ -251,6 +329,13 @@ def save_as_png(surface, filename, *rect, **kwargs):
     progress = kwargs.pop('progress', None)
     single_tile_pattern = kwargs.pop("single_tile_pattern", False)
     save_srgb_chunks = kwargs.pop("save_srgb_chunks", True)
+    compression_level = kwargs.pop("compression_level", 2)
+    png_filter = kwargs.pop(
+        "png_filter",
+        mypaintlib.ProgressivePNGWriter.FILTER_SUB,
+    )
+    threads = kwargs.pop("threads", 0)
+    bit_depth = kwargs.pop("bit_depth", 8)
 
     # Sizes. Save at least one tile to allow empty docs to be written
     if not rect:
@@ -267,37 +352,44 @@ def save_as_png(surface, filename, *rect, **kwargs):
 
     try:
         logger.debug(
-            "Writing %r (%dx%d) alpha=%r srgb=%r",
+            "Writing %r (%dx%d) alpha=%r srgb=%r bit_depth=%r",
             filename,
             w, h,
             alpha,
             save_srgb_chunks,
+            bit_depth,
         )
+        compiled = None
+        if isinstance(surface, TileRenderable) and not single_tile_pattern:
+            compiled = surface.get_render_program()
         with open(filename, "wb") as writer_fp:
             pngsave = mypaintlib.ProgressivePNGWriter(
                 writer_fp,
                 w, h,
                 alpha,
                 save_srgb_chunks,
+                compression_level,
+                png_filter,
+                threads,
+                bit_depth,
+                eotf(),
             )
-            scanline_strips = scanline_strips_iter(
-                surface, rect,
-                alpha=alpha,
-                single_tile_pattern=single_tile_pattern,
-                **kwargs
-            )
-            for scanline_strip in scanline_strips:
-                pngsave.write(scanline_strip)
-                if not progress:
-                    continue
-                try:
-                    progress += 1
-                except Exception:
-                    logger.exception(
-                        "Failed to update lib.feedback.Progress: "
-                        "dropping it"
-                    )
-                    progress = None
+            if compiled is not None:
+                # Rendered by the writer, overlapping with compression
+                program, surfaces = compiled
+                rows = render_source_rows_iter(surfaces, rect, progress)
+                pngsave.write_rendered(program, rows, x % N, y % N)
+            else:
+                scanline_strips = scanline_strips_iter(
+                    surface, rect,
+                    alpha=alpha,
+                    single_tile_pattern=single_tile_pattern,
+                    bit_depth=bit_depth,
+                    **kwargs
+                )
+                for scanline_strip in scanline_strips:
+                    pngsave.write(scanline_strip)
+                    progress = _progress_step(progress)
             pngsave.close()
         logger.debug("Finished writing %r", filename)
         if progress:
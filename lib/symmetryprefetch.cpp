@@ -0,0 +1,138 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "symmetryprefetch.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+
+// Extra room around each dab, on top of the antialiasing fringe
+// libmypaint adds, so that rounding never leaves a tile out.
+static const float FOOTPRINT_MARGIN = 2.0f;
+
+
+SymmetryPrefetch::SymmetryPrefetch()
+    : enabled(true), active(false), center_x(0), center_y(0),
+      type(MYPAINT_SYMMETRY_TYPE_VERTICAL)
+{
+}
+
+
+void
+SymmetryPrefetch::set_state (bool active, float center_x, float center_y,
+                             float angle, MyPaintSymmetryType type,
+                             int rot_symmetry_lines)
+{
+    this->active = active && angle == 0.0f;
+    this->center_x = center_x;
+    this->center_y = center_y;
+    this->type = type;
+    rot_cos.clear();
+    rot_sin.clear();
+    if (type == MYPAINT_SYMMETRY_TYPE_ROTATIONAL
+        || type == MYPAINT_SYMMETRY_TYPE_SNOWFLAKE) {
+        const int lines = std::max(1, rot_symmetry_lines);
+        for (int i = 0; i < lines; ++i) {
+            const double a = 2.0 * M_PI * i / lines;
+            rot_cos.push_back(cos(a));
+            rot_sin.push_back(sin(a));
+        }
+    }
+    tiles.clear();
+}
+
+
+void
+SymmetryPrefetch::set_enabled (bool enabled)
+{
+    this->enabled = enabled;
+    if (! enabled) {
+        tiles.clear();
+    }
+}
+
+
+void
+SymmetryPrefetch::add_span (float x, float y, float r)
+{
+    const int tx1 = (int)floorf((x - r) / MYPAINT_TILE_SIZE);
+    const int tx2 = (int)floorf((x + r) / MYPAINT_TILE_SIZE);
+    const int ty1 = (int)floorf((y - r) / MYPAINT_TILE_SIZE);
+    const int ty2 = (int)floorf((y + r) / MYPAINT_TILE_SIZE);
+    for (int ty = ty1; ty <= ty2; ++ty) {
+        for (int tx = tx1; tx <= tx2; ++tx) {
+            tiles.push_back(((uint64_t)(uint32_t)tx << 32) | (uint32_t)ty);
+        }
+    }
+}
+
+
+void
+SymmetryPrefetch::add_dab (float x, float y, float radius)
+{
+    if (! collecting()) {
+        return;
+    }
+    const float r = radius + 1.0f + FOOTPRINT_MARGIN;
+    const float dx = x - center_x;
+    const float dy = y - center_y;
+
+    // The unmirrored dab is always drawn
+    add_span(x, y, r);
+
+    switch (type) {
+    case MYPAINT_SYMMETRY_TYPE_VERTICAL:
+        add_span(center_x - dx, y, r);
+        break;
+    case MYPAINT_SYMMETRY_TYPE_HORIZONTAL:
+        add_span(x, center_y - dy, r);
+        break;
+    case MYPAINT_SYMMETRY_TYPE_VERTHORZ:
+        add_span(center_x - dx, y, r);
+        add_span(x, center_y - dy, r);
+        add_span(center_x - dx, center_y - dy, r);
+        break;
+    case MYPAINT_SYMMETRY_TYPE_ROTATIONAL:
+    case MYPAINT_SYMMETRY_TYPE_SNOWFLAKE: {
+        const bool mirror = (type == MYPAINT_SYMMETRY_TYPE_SNOWFLAKE);
+        for (size_t i = 0; i < rot_cos.size(); ++i) {
+            const float c = rot_cos[i];
+            const float s = rot_sin[i];
+            if (i > 0) {
+                add_span(center_x + c * dx - s * dy,
+                         center_y + s * dx + c * dy, r);
+            }
+            if (mirror) {
+                add_span(center_x - c * dx - s * dy,
+                         center_y - s * dx + c * dy, r);
+            }
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+
+std::vector<std::pair<int, int> >
+SymmetryPrefetch::take_tiles ()
+{
+    std::sort(tiles.begin(), tiles.end());
+    tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+    std::vector<std::pair<int, int> > out;
+    out.reserve(tiles.size());
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        out.push_back(std::make_pair((int)(uint32_t)(tiles[i] >> 32),
+                                     (int)(uint32_t)tiles[i]));
+    }
+    tiles.clear();
+    return out;
+}
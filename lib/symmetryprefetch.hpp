@@ -0,0 +1,70 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SYMMETRYPREFETCH_HPP
+#define SYMMETRYPREFETCH_HPP
+
+#include <mypaint-tiled-surface.h>
+
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+
+// Collects the tiles that the mirrored copies of the dabs drawn since the
+// last end_atomic() will render to.
+//
+// libmypaint renders the queued dabs tile by tile, on several threads.
+// Every tile it has not seen before is requested from tiledsurface.py one
+// at a time, inside a critical section, which serializes the workers
+// whenever a symmetric stroke spreads out over fresh tiles. Knowing the
+// tiles in advance lets the surface fetch them into its TileRequestCache
+// in one batch, so that the workers find all of them there.
+//
+// The footprints are conservative: tiles in them may turn out to be left
+// untouched, and the surface is expected to clean up after that.
+
+class SymmetryPrefetch
+{
+  public:
+    SymmetryPrefetch();
+
+    // The footprints only model unrotated symmetry axes, so collecting
+    // stays off for any non-zero symmetry angle.
+    void set_state (bool active, float center_x, float center_y,
+                    float angle, MyPaintSymmetryType type,
+                    int rot_symmetry_lines);
+
+    // Only collect footprints when enabled and symmetry is active.
+    void set_enabled (bool enabled);
+    bool collecting () const { return enabled && active; }
+
+    // Logs the tiles a dab and all of its mirrored copies may cover.
+    void add_dab (float x, float y, float radius);
+
+    // Returns the logged tiles without duplicates, and resets the log.
+    std::vector<std::pair<int, int> > take_tiles ();
+
+  private:
+    void add_span (float x, float y, float r);
+
+    bool enabled;
+    bool active;
+    float center_x;
+    float center_y;
+    MyPaintSymmetryType type;
+    // Rotation matrices for the rotational symmetry types
+    std::vector<float> rot_cos;
+    std::vector<float> rot_sin;
+    std::vector<uint64_t> tiles;
+};
+
+
+#endif // SYMMETRYPREFETCH_HPP
@@ -13,6 +13,7 @@
 #include <mypaint-tiled-surface.h>
 #include <Python.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <vector>
 
@@ -43,6 +44,7 @@ public:
   TiledSurface(PyObject * self_) {
       c_surface = mypaint_python_tiled_surface_new(self_);
       tile_request_in_progress = false;
+      bbox_rectangles.resize(BBOXES);
   }
 
   ~TiledSurface() {
@@ -57,26 +59,84 @@ public:
         center_x, center_y,
         symmetry_angle,
         (MyPaintSymmetryType)symmetry_type, rot_symmetry_lines);
+    // Each mirrored copy of a dab gets a bounding box of its own. Make room
+    // for all of them, so that libmypaint doesn't have to merge the surplus.
+    if (active) {
+        reserve_bboxes(2 * rot_symmetry_lines);
+    }
+    c_surface->prefetch->set_state(active, center_x, center_y,
+        symmetry_angle, (MyPaintSymmetryType)symmetry_type,
+        rot_symmetry_lines);
+  }
+
+  // While symmetry is active, fetch the tiles all mirrored dabs will be
+  // drawn to in one batch before they are rendered in parallel.
+  // See symmetryprefetch.hpp. On by default.
+  void set_symmetry_prefetch(bool enabled) {
+    c_surface->prefetch->set_enabled(enabled);
+  }
+
+  // The surface holding the next mipmap level of this one, or NULL.
+  // It must outlive this surface.
+  void set_mipmap(TiledSurface *mipmap) {
+    c_surface->mipmap = mipmap ? mipmap->c_surface : NULL;
+  }
+
+  // Sample get_color() and get_alpha() areas with large radii from
+  // coarser mipmap levels, when set_mipmap() has been given them.
+  // Those are brought up to date from this level's tiles as they are
+  // requested, but do not see what was painted since the last
+  // end_atomic(), so this is only suitable outside strokes.
+  // Off by default, and deliberately left off by the app: brushes sample
+  // inside strokes, and its own picks (gui/document.py) use radii far
+  // below MIPMAP_SAMPLE_MIN_RADIUS. For future large-area pickers.
+  void set_mipmap_sampling(bool enabled) {
+    c_surface->mipmap_sampling = enabled;
   }
 
   void begin_atomic() {
       mypaint_surface_begin_atomic((MyPaintSurface *)c_surface);
   }
-  std::vector<std::vector<int>> end_atomic() {
-      MyPaintRectangle* rects = this->bbox_rectangles;
-      MyPaintRectangles bboxes = {BBOXES, rects};
 
+  // Returns the areas modified since begin_atomic() as a flat int32 array
+  // of x, y, width, height quadruples.
+  PyObject* end_atomic() {
+      MyPaintRectangles bboxes = {
+          (int)bbox_rectangles.size(), &bbox_rectangles[0]
+      };
+
+      prefetch_tiles();
       mypaint_surface2_end_atomic((MyPaintSurface2 *)c_surface, &bboxes);
+      std::vector<std::pair<int, int>> written
+          = c_surface->tile_cache->take_written();
+      sync_cached_writes(written);
+      discard_unused_prefetches(written);
 
       // The capacity of the bounding box array will most often exceed the number
       // of rectangles that are actually used. The call to mypaint_surface_end_atomic
       // sets the num_rectangles field to N to indicate that the first N rectangles
       // were modified during the call.
-      std::vector<std::vector<int>> out_bboxes = std::vector<std::vector<int>>(bboxes.num_rectangles);
-      for(int i = 0; i < bboxes.num_rectangles; ++i) {
-        out_bboxes[i] = {rects[i].x, rects[i].y, rects[i].width, rects[i].height};
+      const int n = bboxes.num_rectangles;
+      npy_intp dims = 4 * n;
+      PyObject *out = PyArray_SimpleNew(1, &dims, NPY_INT32);
+      if (out == NULL) {
+          return NULL;
+      }
+      npy_int32 *out_p = (npy_int32 *)PyArray_DATA((PyArrayObject *)out);
+      for (int i = 0; i < n; ++i) {
+          const MyPaintRectangle &r = bbox_rectangles[i];
+          out_p[4*i+0] = r.x;
+          out_p[4*i+1] = r.y;
+          out_p[4*i+2] = r.width;
+          out_p[4*i+3] = r.height;
+      }
+
+      // A full array may have had more boxes merged into its last one.
+      // Grow it for the next time; it is kept across calls.
+      if (n == (int)bbox_rectangles.size()) {
+          reserve_bboxes(2 * n);
       }
-      return out_bboxes;
+      return out;
   }
 
   // returns true if the surface was modified
@@ -113,6 +173,22 @@ public:
       return mypaint_surface_get_alpha((MyPaintSurface *)c_surface, x, y, radius);
   }
 
+  // The tiledict has changed for one tile (or for all of them, or its
+  // tiles were made read-only). See tilerequestcache.hpp.
+  void forget_cached_tile(int tx, int ty) {
+      c_surface->tile_cache->forget(tx, ty);
+  }
+
+  void clear_tile_cache() {
+      c_surface->tile_cache->clear();
+  }
+
+  // Whether libmypaint was handed the tile from the cache since the last
+  // call, without asking Python for it.
+  bool take_cached_tile_hit(int tx, int ty) {
+      return c_surface->tile_cache->take_hit(tx, ty);
+  }
+
   MyPaintSurface *get_surface_interface() {
     return (MyPaintSurface*)c_surface;
   }
@@ -121,8 +197,135 @@ public:
     return (MyPaintSurface2*)c_surface;
   }
 
+#ifndef SWIG
+  // The mipmap levels get_color() may sample are told as well
+  void set_gil_released(bool released) {
+    for (MyPaintPythonTiledSurface *s = c_surface; s; s = s->mipmap) {
+      s->gil_released.store(released);
+    }
+  }
+#endif /* #ifndef SWIG */
+
 private:
-    MyPaintRectangle bbox_rectangles[BBOXES];
+    void reserve_bboxes(int count) {
+        if (count > (int)bbox_rectangles.size()) {
+            bbox_rectangles.resize(count);
+        }
+    }
+
+    // Tiles written through the tile request cache skipped the Python side
+    // of a writeable tile request. Catch up on it now that the workers
+    // are done.
+    void sync_cached_writes(const std::vector<std::pair<int, int>> &written) {
+        for (size_t i = 0; i < written.size(); ++i) {
+            PyObject *rgba = PyObject_CallMethod(
+                c_surface->py_obj, "_get_tile_numpy", "(iii)",
+                written[i].first, written[i].second, 0);
+            if (rgba == NULL) {
+                printf("Python exception during get_tile_numpy()!\n");
+                PyErr_Print();
+                continue;
+            }
+            Py_DECREF(rgba);
+        }
+    }
+
+    // Puts writeable arrays for the tiles the pending symmetric dabs will
+    // need into the tile request cache, so that the rendering threads
+    // don't have to call back into Python one tile at a time.
+    void prefetch_tiles() {
+        if (! c_surface->prefetch->collecting()) {
+            return;
+        }
+        std::vector<std::pair<int, int>> wanted
+            = c_surface->prefetch->take_tiles();
+        PyObject *coords = PyList_New(0);
+        if (coords == NULL) {
+            PyErr_Print();
+            return;
+        }
+        for (size_t i = 0; i < wanted.size(); ++i) {
+            const int tx = wanted[i].first;
+            const int ty = wanted[i].second;
+            if (c_surface->tile_cache->has_writeable(tx, ty)) {
+                continue;
+            }
+            PyObject *coord = Py_BuildValue("(ii)", tx, ty);
+            PyList_Append(coords, coord);
+            Py_DECREF(coord);
+        }
+        if (PyList_GET_SIZE(coords) == 0) {
+            Py_DECREF(coords);
+            return;
+        }
+        // Any tiles this fails to fetch are just requested as usual
+        PyObject *fetched = PyObject_CallMethod(
+            c_surface->py_obj, "_prefetch_tiles_numpy", "(O)", coords);
+        Py_DECREF(coords);
+        PyObject *seq = NULL;
+        if (fetched != NULL) {
+            seq = PySequence_Fast(fetched, "expected a sequence");
+            Py_DECREF(fetched);
+        }
+        if (seq == NULL) {
+            printf("Python exception during _prefetch_tiles_numpy()!\n");
+            PyErr_Print();
+            return;
+        }
+        const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+            int tx, ty, created;
+            PyObject *rgba;
+            if (! PyArg_ParseTuple(item, "iiOi", &tx, &ty, &rgba, &created)) {
+                PyErr_Print();
+                continue;
+            }
+            uint16_t *buffer
+                = (uint16_t *)PyArray_DATA((PyArrayObject *)rgba);
+            c_surface->tile_cache->insert(tx, ty, rgba, buffer, true);
+            if (created) {
+                prefetched_new.push_back(std::make_pair(tx, ty));
+            }
+        }
+        Py_DECREF(seq);
+    }
+
+    // Tiles created by prefetch_tiles() which no dab ended up touching
+    // are removed again, leaving the tiledict as it would have been.
+    void discard_unused_prefetches(
+        std::vector<std::pair<int, int>> written)
+    {
+        if (prefetched_new.empty()) {
+            return;
+        }
+        std::sort(written.begin(), written.end());
+        PyObject *unused = PyList_New(0);
+        for (size_t i = 0; unused && i < prefetched_new.size(); ++i) {
+            const std::pair<int, int> &t = prefetched_new[i];
+            if (std::binary_search(written.begin(), written.end(), t)) {
+                continue;
+            }
+            PyObject *coord = Py_BuildValue("(ii)", t.first, t.second);
+            PyList_Append(unused, coord);
+            Py_DECREF(coord);
+        }
+        prefetched_new.clear();
+        PyObject *res = NULL;
+        if (unused && PyList_GET_SIZE(unused) > 0) {
+            res = PyObject_CallMethod(
+                c_surface->py_obj, "_discard_prefetched_tiles", "(O)", unused);
+            if (res == NULL) {
+                printf("Python exception during _discard_prefetched_tiles()!\n");
+                PyErr_Print();
+            }
+        }
+        Py_XDECREF(res);
+        Py_XDECREF(unused);
+    }
+
+    std::vector<MyPaintRectangle> bbox_rectangles;
+    std::vector<std::pair<int, int>> prefetched_new;
     MyPaintPythonTiledSurface *c_surface;
     MyPaintTileRequest tile_request;
     bool tile_request_in_progress;
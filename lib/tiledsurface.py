@@ -15,8 +15,13 @@ from __future__ import division, print_function
 import time
 import sys
 import os
+import threading
 import contextlib
+import itertools
 import logging
+import weakref
+import zlib
+from collections import OrderedDict
 
 from gettext import gettext as _
 import numpy as np
@@ -33,6 +38,7 @@ import lib.fileutils
 import lib.modes
 import lib.feedback
 import lib.floodfill
+import lib.tilelog
 from lib.pycompat import xrange
 from lib.pycompat import PY3, itervalues
 
@@ -43,6 +49,9 @@ logger = logging.getLogger(__name__)
 TILE_SIZE = N = mypaintlib.TILE_SIZE
 MAX_MIPMAP_LEVEL = mypaintlib.MAX_MIPMAP_LEVEL
 
+#: Width and height of the blocks of mipmap tiles rebuilt together
+MIPMAP_BUILD_BLOCK = 4
+
 SYMMETRY_TYPES = tuple(range(mypaintlib.NumSymmetryTypes))
 SYMMETRY_STRINGS = {
     mypaintlib.SymmetryVertical: _("Vertical"),
@@ -54,42 +63,266 @@ SYMMETRY_STRINGS = {
 for sym_type in SYMMETRY_TYPES:
     assert sym_type in SYMMETRY_STRINGS
 
+# Source of MyPaintSurface.revision tokens, unique within the process
+_revision_tokens = itertools.count(1)
+
 
 ## Tile class and marker tile constants
 
+
+def new_tile_array(zeroed=True):
+    """Returns a new NxNx4 uint16 tile array from the tile pool
+
+    :param bool zeroed: fill the array with zeros (transparent)
+    :rtype: numpy.ndarray
+
+    The array's memory goes back to the pool for reuse when it is
+    deallocated, so use this for any tile-sized scratch or pixel data.
+
+    >>> a = new_tile_array()
+    >>> a.shape == (N, N, 4), a.dtype.name, int(a.max())
+    (True, 'uint16', 0)
+
+    """
+    return mypaintlib.tile_pool_new(mypaintlib.TilePoolRGBA16, zeroed)
+
+
 class _Tile (object):
-    """Internal tile storage, with readonly flag
+    """Internal tile storage, with readonly flag and pixel summary
 
     Note: pixels are stored with premultiplied alpha.
     15 bits are used, but fully opaque or white is stored as 2**15
     (requiring 16 bits). This is to allow many calculations to divide by
     2**15 instead of (2**16-1).
 
+    The summary is a cached mypaintlib.TileSummary* value saying whether
+    the tile is empty, a uniform colour, or mixed. Code writing to the
+    pixels must reset it to TileSummaryUnknown.
+
+    Constant tiles are shared tiles of a single colour, see
+    constant_tile(). They are always read-only.
+
+    Tiles which have not been used for a while can be compressed in
+    memory. The pixels are unpacked again the next time the rgba
+    array is accessed.
+
     """
 
-    def __init__(self, copy_from=None):
+    def __init__(self, copy_from=None, rgba=None, zdata=None):
         super(_Tile, self).__init__()
-        if copy_from is None:
-            self.rgba = np.zeros((N, N, 4), 'uint16')
+        if rgba is not None or zdata is not None:
+            self._rgba = rgba
+            self.summary = mypaintlib.TileSummaryUnknown
+        elif copy_from is None:
+            self._rgba = new_tile_array()
+            self.summary = mypaintlib.TileSummaryEmpty
         else:
-            self.rgba = copy_from.rgba.copy()
+            self._rgba = new_tile_array(zeroed=False)
+            self._rgba[...] = copy_from.rgba
+            self.summary = copy_from.summary
+        self._zdata = zdata
+        # Counts the times the array was handed out, see compress()
+        self._handouts = 0
         self.readonly = False
+        self.accessed = zdata is None
+        self.constant = False
 
     def copy(self):
         return _Tile(copy_from=self)
 
+    @property
+    def rgba(self):
+        """The tile's pixels, as an NxNx4 uint16 array"""
+        rgba = self._rgba
+        if rgba is None:
+            if self._zdata is None:
+                raise AttributeError("tile has no pixel data")
+            rgba = new_tile_array(zeroed=False)
+            rgba.reshape(-1).view('uint8')[:] = np.frombuffer(
+                zlib.decompress(self._zdata), 'uint8',
+            )
+            self._rgba = rgba
+            self._zdata = None
+        self._handouts += 1
+        return rgba
+
+    @rgba.setter
+    def rgba(self, rgba):
+        self._rgba = rgba
+        self._zdata = None
+
+    @rgba.deleter
+    def rgba(self):
+        self._rgba = None
+        self._zdata = None
+
+    def compress(self):
+        """Compresses the pixels, if nothing else is looking at them
+
+        :returns: True if the tile was compressed by this call
+        :rtype: bool
+
+        Arrays which have been handed out may be written to later, so
+        tiles whose array is referenced from anywhere else are left
+        alone. The GIL is released while compressing, so the tile is
+        also left alone if its array was handed out in the meantime.
+
+        """
+        rgba = self._rgba
+        if rgba is None:
+            return False
+        # self._rgba, the local, and getrefcount()'s own argument
+        if sys.getrefcount(rgba) > 3:
+            return False
+        handouts = self._handouts
+        zdata = zlib.compress(rgba.tobytes(), 1)
+        if (self._rgba is not rgba or self._handouts != handouts
+                or sys.getrefcount(rgba) > 3):
+            return False
+        self._zdata = zdata
+        self._rgba = None
+        return True
+
+    def compressed_bytes(self):
+        """Returns the pixels in compressed form, as compress() keeps them
+
+        Compressed tiles return what they hold, without unpacking it.
+
+        """
+        if self._zdata is not None:
+            return self._zdata
+        return zlib.compress(self.rgba.tobytes(), 1)
+
+    @classmethod
+    def new_from_compressed(cls, zdata):
+        """New tile from bytes returned by compressed_bytes()"""
+        return cls(zdata=zdata)
+
+    def get_summary(self):
+        """Returns the tile's summary, classifying its pixels if needed"""
+        if self.summary == mypaintlib.TileSummaryUnknown:
+            self.summary = mypaintlib.tile_summarize(self.rgba)[0]
+        return self.summary
+
+
+# Recently used shared tiles of a single colour, by colour, oldest first.
+# Fill colours and the colours of loaded tiles are arbitrary, so only the
+# transparent tile is kept for good.
+_constant_tiles = OrderedDict()
+_CONSTANT_TILES_MAX = 64
+
+
+def constant_tile(rgba):
+    """Returns the shared read-only tile of a single colour
+
+    :param tuple rgba: premultiplied 15-bit colour of all the pixels
+    :rtype: _Tile
+
+    The pixels are an interned array (see mypaintlib.ConstTiles), so
+    an area of one colour costs no pixel memory however many tiles of
+    a tiledict it covers. Such tiles are always copied on the first
+    write to them. Only recently used colours are remembered, so a
+    colour may be given a new tile after a while; tiles handed out
+    earlier stay valid.
+
+    >>> constant_tile((0, 0, 0, 0)) is transparent_tile
+    True
+    >>> white = constant_tile((1 << 15,) * 4)
+    >>> white is constant_tile((1 << 15,) * 4)
+    True
+    >>> int(white.rgba[7, 5, 3]), white.rgba.flags.writeable
+    (32768, False)
+
+    """
+    rgba = tuple(int(c) for c in rgba)
+    tile = _constant_tiles.pop(rgba, None)
+    if tile is None:
+        tile = _Tile(rgba=mypaintlib.ConstTiles.rgba16(*rgba))
+        tile.summary = (mypaintlib.TileSummaryUniform if any(rgba)
+                        else mypaintlib.TileSummaryEmpty)
+        tile.readonly = True
+        tile.constant = True
+        if len(_constant_tiles) >= _CONSTANT_TILES_MAX:
+            oldest = next(c for c in _constant_tiles if any(c))
+            del _constant_tiles[oldest]
+    _constant_tiles[rgba] = tile
+    return tile
+
 
 # tile for read-only operations on empty spots
-transparent_tile = _Tile()
-transparent_tile.readonly = True
+transparent_tile = constant_tile((0, 0, 0, 0))
 
 # tile with invalid pixel memory (needs refresh)
 mipmap_dirty_tile = _Tile()
 del mipmap_dirty_tile.rgba
 
 
+def _mipmap_children(tx, ty):
+    """The positions a mipmap tile is built from, in nw, ne, sw, se order"""
+    return (
+        (tx*2, ty*2), (tx*2 + 1, ty*2),
+        (tx*2, ty*2 + 1), (tx*2 + 1, ty*2 + 1),
+    )
+
+
 ## Class defs: surfaces
 
+class _TileDict (dict):
+    """Tile dict which passes changes on to the backend's tile cache
+
+    The C++ backend caches the tile arrays it has been given by
+    _get_tile_numpy(), so it must be told when an entry is replaced or
+    removed. Looped surfaces alias many tile indices to one entry, and
+    drop the whole cache instead.
+
+    """
+
+    def __init__(self, backend, looped, *args):
+        super(_TileDict, self).__init__(*args)
+        self._backend = backend
+        self._looped = looped
+
+    def _forget(self, pos):
+        if self._looped:
+            self._backend.clear_tile_cache()
+        else:
+            self._backend.forget_cached_tile(*pos)
+
+    def __setitem__(self, pos, tile):
+        super(_TileDict, self).__setitem__(pos, tile)
+        self._forget(pos)
+
+    def __delitem__(self, pos):
+        super(_TileDict, self).__delitem__(pos)
+        self._forget(pos)
+
+    def pop(self, pos, *default):
+        tile = super(_TileDict, self).pop(pos, *default)
+        self._forget(pos)
+        return tile
+
+    def popitem(self):
+        pos, tile = super(_TileDict, self).popitem()
+        self._forget(pos)
+        return pos, tile
+
+    def setdefault(self, pos, tile=None):
+        if pos not in self:
+            self[pos] = tile
+        return self[pos]
+
+    def update(self, *args, **kwargs):
+        super(_TileDict, self).update(*args, **kwargs)
+        self._backend.clear_tile_cache()
+
+    def clear(self):
+        super(_TileDict, self).clear()
+        self._backend.clear_tile_cache()
+
+    def copy(self):
+        return dict(self)
+
+
 class _SurfaceSnapshot (object):
     pass
 
@@ -108,7 +341,6 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
 
         # TODO: pass just what it needs access to, not all of self
         self._backend = mypaintlib.TiledSurface(self)
-        self.tiledict = {}
         self.observers = []
 
         # Used to implement repeating surfaces, like Background
@@ -117,6 +349,22 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         self.looped = looped
         self.looped_size = looped_size
 
+        # Deferred loader of the initial tiles, see set_pending_load().
+        # Only the base level's bbox and lock are used.
+        self._pending_load = None
+        self._pending_bbox = None
+        self._load_lock = threading.RLock()
+        self.load_error = None
+        self.tiledict = {}
+
+        # Tiles only snapshots refer to, waiting to be compressed
+        self._retired_tiles = weakref.WeakSet()
+
+        # Number of tile requests and other writers in progress, during
+        # which cold tiles are left uncompressed. See in_use().
+        self._users = 0
+        self._users_lock = threading.Lock()
+
         self.mipmap_level = mipmap_level
         if mipmap_level == 0:
             assert mipmap_surfaces is None
@@ -172,19 +420,166 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
                 s.mipmap = mipmaps[level+1]
             except IndexError:
                 s.mipmap = None
+            else:
+                # Lets large get_color() areas be sampled from the pyramid
+                # once the backend's set_mipmap_sampling() turns that on
+                s._backend.set_mipmap(s.mipmap._backend)
         return mipmaps
 
     def end_atomic(self):
         bboxes = self._backend.end_atomic()
-        for bbox in bboxes:
-            if (bbox[2] > 0 and bbox[3] > 0):
-                self.notify_observers(*bbox)
+        for x, y, w, h in bboxes.reshape(-1, 4).tolist():
+            if (w > 0 and h > 0):
+                self.notify_observers(x, y, w, h)
 
     @property
     def backend(self):
         return self._backend
 
+    @property
+    def revision(self):
+        """Token identifying the current content of the surface
+
+        A new token is taken whenever the content may change, and the
+        token is saved and restored along with snapshots. The content is
+        the same whenever the token is: results computed from the
+        surface can be reused as long as it stays the same.
+
+        >>> s = MyPaintSurface()
+        >>> r0 = s.revision
+        >>> sshot = s.save_snapshot()
+        >>> with s.tile_request(0, 0, readonly=False) as t:
+        ...     t[...] = 1 << 15
+        >>> r0 == s.revision
+        False
+        >>> s.load_snapshot(sshot)
+        >>> r0 == s.revision
+        True
+
+        """
+        return self._revision
+
+    def _touch(self):
+        """Takes a new revision token, the content may have changed"""
+        self._revision = next(_revision_tokens)
+
+    @property
+    def tiledict(self):
+        """The surface's tiles, as a dict of {(tx, ty): _Tile}"""
+        if self._pending_load is not None:
+            self._run_pending_load()
+        return self._tiledict
+
+    @tiledict.setter
+    def tiledict(self, tiles):
+        if self._pending_load is not None:
+            if self.mipmap_level == 0:
+                with self._load_lock:
+                    self._cancel_pending_load()
+            else:
+                self._run_pending_load()
+        self._tiledict = _TileDict(self._backend, self.looped, tiles)
+        self._backend.clear_tile_cache()
+        self._touch()
+
+    ## Deferred loading
+
+    def set_pending_load(self, load, bbox=None):
+        """Empties the surface, and defers loading its tiles until needed
+
+        :param callable load: returns the new tiles, as a dict
+        :param tuple bbox: the area they cover, as (x, y, w, h)
+
+        The load() callable is run the first time anything asks the
+        surface or one of its mipmap levels for its tiles, so surfaces
+        nothing reads, like those of hidden layers, are never loaded.
+        Its tiles are installed without a change of revision or any
+        notification, since they are what the surface held all along.
+        The observers are notified of the bbox now instead, if given,
+        and get_bbox() and is_empty() answer from it, rounded out to
+        whole tiles, until the tiles are loaded.
+
+        Threads asking for the tiles while they are being loaded wait
+        for the load to finish. If load() fails, the error is logged
+        and kept in load_error, the surface is left empty, and
+        save_as_png() refuses to save it, so that the layer's data in
+        the file it came from is not overwritten with nothing.
+
+        >>> s = MyPaintSurface()
+        >>> t = _Tile()
+        >>> t.rgba[...] = 1 << 15
+        >>> s.set_pending_load(lambda: {(1, 2): t}, bbox=(70, 130, 50, 60))
+        >>> s.get_bbox()
+        Rect(64, 128, 64, 64)
+        >>> s.is_pending_load()
+        True
+        >>> s.get_tiles() == {(1, 2): t}
+        True
+        >>> s.is_pending_load()
+        False
+
+        Replacing the tiles first drops the loader:
+
+        >>> s.set_pending_load(lambda: {(1, 2): t})
+        >>> s.clear()
+        >>> s.get_tiles()
+        {}
+
+        """
+        assert self.mipmap_level == 0
+        assert not self.looped
+        for surf in self._mipmaps:
+            surf.tiledict = {}
+            surf._pending_load = load
+        self.load_error = None
+        if bbox is not None:
+            x, y, w, h = bbox
+            corners = []
+            if w > 0 and h > 0:
+                corners = [(x // N, y // N),
+                           ((x + w - 1) // N, (y + h - 1) // N)]
+            self._pending_bbox = lib.surface.get_tiles_bbox(corners)
+            self.notify_observers(*bbox)
+
+    def is_pending_load(self):
+        """True if the surface's tiles have not been loaded yet"""
+        return self._pending_load is not None
+
+    def _cancel_pending_load(self):
+        self._mipmaps[0]._pending_bbox = None
+        for surf in self._mipmaps:
+            surf._pending_load = None
+
+    def _run_pending_load(self):
+        base = self._mipmaps[0]
+        with base._load_lock:
+            load = self._pending_load
+            if load is None:
+                # Another thread got here first
+                return
+            # The loader stays installed while it runs, so that other
+            # threads wait for it rather than using the empty tiledict.
+            try:
+                tiles = load()
+            except Exception as ex:
+                logger.exception("Loading the surface's tiles failed")
+                base.load_error = ex
+                tiles = {}
+            # Nothing can be in the backend's tile cache yet: every
+            # request which could have put it there would have ended up
+            # here first. The mipmaps are marked dirty directly, since
+            # going through their tiledict would come back here.
+            base._tiledict = _TileDict(base._backend, base.looped, tiles)
+            for level, surf in enumerate(base._mipmaps):
+                if level == 0:
+                    continue
+                for tx, ty in set((tx >> level, ty >> level)
+                                  for (tx, ty) in tiles):
+                    surf._tiledict[(tx, ty)] = mipmap_dirty_tile
+            base._cancel_pending_load()
+
     def notify_observers(self, *args):
+        self._touch()
         for f in self.observers:
             f(*args)
 
@@ -278,41 +673,178 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
             ...     assert (t4 == t1).all()
 
         """
-        numpy_tile = self._get_tile_numpy(tx, ty, readonly)
-        yield numpy_tile
-        self._set_tile_numpy(tx, ty, numpy_tile, readonly)
-
-    def _regenerate_mipmap(self, t, tx, ty):
-        t = _Tile()
-        self.tiledict[(tx, ty)] = t
-        empty = True
-
-        for x in xrange(2):
-            for y in xrange(2):
-                src = self.parent.tiledict.get((tx*2 + x, ty*2 + y),
-                                               transparent_tile)
-                if src is mipmap_dirty_tile:
-                    src = self.parent._regenerate_mipmap(
-                        src,
-                        tx*2 + x, ty*2 + y,
-                    )
-                mypaintlib.tile_downscale_rgba16(src.rgba, t.rgba,
-                                                 x * N // 2,
-                                                 y * N // 2)
-                if src.rgba is not transparent_tile.rgba:
-                    empty = False
-        if empty:
-            # rare case, no need to speed it up
-            del self.tiledict[(tx, ty)]
-            t = transparent_tile
-        return t
+        with self.in_use():
+            tile = self._get_tile(tx, ty, readonly)
+            yield tile.rgba
+            if not readonly:
+                # The tile may have been summarized while being written
+                tile.summary = mypaintlib.TileSummaryUnknown
+                self._touch()
+            self._set_tile_numpy(tx, ty, tile.rgba, readonly)
+
+    @contextlib.contextmanager
+    def in_use(self):
+        """Keeps cold tile compression away while tiles are being written
+
+        Tile requests are covered already. Code which goes on writing to
+        tile arrays after their requests have ended, like the fill
+        compositing them in a thread, should hold this for as long.
+
+        """
+        with self._users_lock:
+            self._users += 1
+        try:
+            yield
+        finally:
+            with self._users_lock:
+                self._users -= 1
+
+    def _regenerate_mipmap(self, tx, ty):
+        """Rebuilds a dirty mipmap tile, and returns it
+
+        Dirty neighbours within the same aligned block are rebuilt along
+        with it, since redraws tend to want them next, and this lets the
+        native builder work on more than one tile at once.
+
+        """
+        bx = tx - tx % MIPMAP_BUILD_BLOCK
+        by = ty - ty % MIPMAP_BUILD_BLOCK
+        block = []
+        for y in xrange(by, by + MIPMAP_BUILD_BLOCK):
+            for x in xrange(bx, bx + MIPMAP_BUILD_BLOCK):
+                if self.tiledict.get((x, y)) is mipmap_dirty_tile:
+                    block.append((x, y))
+        self._regenerate_mipmaps(block)
+        return self.tiledict.get((tx, ty), transparent_tile)
+
+    def _regenerate_mipmaps(self, tiles):
+        """Rebuilds dirty mipmap tiles here, and the dirty tiles below them
+
+        :param iterable tiles: positions of dirty tiles at this level
+
+        The dirty subtrees are found first, then built level by level
+        from the bottom up, with one call to the native builder per level.
+
+        """
+        levels = []
+        surf = self
+        tiles = set(tiles)
+        while tiles and surf.mipmap_level > 0:
+            levels.append((surf, tiles))
+            below = set()
+            for tx, ty in tiles:
+                for pos in _mipmap_children(tx, ty):
+                    if surf.parent.tiledict.get(pos) is mipmap_dirty_tile:
+                        below.add(pos)
+            surf = surf.parent
+            tiles = below
+        for surf, tiles in reversed(levels):
+            jobs = []
+            built = []
+            for tx, ty in tiles:
+                children = [surf.parent.tiledict.get(pos, transparent_tile)
+                            for pos in _mipmap_children(tx, ty)]
+                assert mipmap_dirty_tile not in children
+                if children.count(transparent_tile) == 4:
+                    surf.tiledict.pop((tx, ty), None)
+                    continue
+                # A single colour downscales to itself
+                if children[0].constant and children.count(children[0]) == 4:
+                    surf.tiledict[(tx, ty)] = children[0]
+                    continue
+                srcs = tuple(None if c is transparent_tile else c.rgba
+                             for c in children)
+                t = _Tile()
+                t.summary = mypaintlib.TileSummaryUnknown
+                jobs.append((t.rgba, srcs))
+                built.append(((tx, ty), t))
+            mypaintlib.tile_downscale_many(jobs)
+            for pos, t in built:
+                surf.tiledict[pos] = t
+
+    def build_mipmaps(self):
+        """Brings all mipmap levels up to date now
+
+        Mipmap tiles are otherwise rebuilt on demand when they are first
+        drawn. Only tiles marked dirty since they were last built are
+        touched.
+
+        """
+        top = self._mipmaps[-1]
+        if top is self:
+            return
+        top._regenerate_mipmaps(
+            pos for (pos, t) in top.tiledict.items()
+            if t is mipmap_dirty_tile
+        )
+
+    def constant_mipmap_tile(self, level, tx, ty):
+        """The colour of a block of tiles, if they all have the same one
+
+        :param int level: mipmap level to look at, 1 or more
+        :param int tx: mipmap tile X coord at that level
+        :param int ty: mipmap tile Y coord at that level
+        :returns: the shared rgba array of the constant tile which every
+          tile of the 2**level square block below it is, or None
+
+        Mipmap tiles are only the shared constant tile of a colour when
+        all four tiles they are built from are that same tile, and are
+        left out only when all four are left out, so the pyramid tells
+        which blocks are of one colour without looking at their tiles.
+        Blocks of uniform but unshared tiles are not found this way.
+
+        """
+        if self.looped or not self._mipmaps:
+            return None
+        if not (0 < level < len(self._mipmaps)):
+            return None
+        t = self._mipmaps[level]._get_tile(tx, ty, readonly=True)
+        return t.rgba if t.constant else None
 
     def _get_tile_numpy(self, tx, ty, readonly):
         # OPTIMIZE: do some profiling to check if this function is a bottleneck
         #           yes it is
         # Note: we must return memory that stays valid for writing until the
         # last end_atomic(), because of the caching in tiledsurface.hpp.
+        return self._get_tile(tx, ty, readonly).rgba
+
+    def _prefetch_tiles_numpy(self, coords):
+        """Writeable tile arrays for a batch of tiles, ahead of painting
+
+        :param list coords: (tx, ty) tile indices
+        :returns: list of (tx, ty, rgba, created) tuples
+        :rtype: list
+
+        Called by the backend's end_atomic() before rendering symmetric
+        dabs. Tiles needing more work than a plain lookup or a new blank
+        tile (read-only ones, dirty mipmaps) are left out; those are
+        requested the usual way. Bookkeeping for the tiles which really
+        get written is done by the backend afterwards, as for any other
+        tile written via its cache.
+
+        """
+        fetched = []
+        if self.looped:
+            return fetched
+        for tx, ty in coords:
+            t = self.tiledict.get((tx, ty))
+            created = t is None
+            if created:
+                t = _Tile()
+                self.tiledict[(tx, ty)] = t
+            elif t is mipmap_dirty_tile or t.readonly:
+                continue
+            fetched.append((tx, ty, t.rgba, created))
+        return fetched
 
+    def _discard_prefetched_tiles(self, coords):
+        """Remove blank tiles created by _prefetch_tiles_numpy()"""
+        for pos in coords:
+            t = self.tiledict.get(pos)
+            if t is not None and not t.rgba.any():
+                del self.tiledict[pos]
+
+    def _get_tile(self, tx, ty, readonly):
         if self.looped:
             tx = tx % (self.looped_size[0] // N)
             ty = ty % (self.looped_size[1] // N)
@@ -325,15 +857,56 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
                 t = _Tile()
                 self.tiledict[(tx, ty)] = t
         if t is mipmap_dirty_tile:
-            t = self._regenerate_mipmap(t, tx, ty)
+            t = self._regenerate_mipmap(tx, ty)
         if t.readonly and not readonly:
-            # shared memory, get a private copy for writing
-            t = t.copy()
-            self.tiledict[(tx, ty)] = t
+            # Snapshots leave their tiles read-only even after they have
+            # been discarded. If nothing but the tiledict and this frame
+            # refer to the tile (once the backend's cache has let go of
+            # it), it can be written in place. Constant tiles may be
+            # referenced only from a native table, and are always copied.
+            unshared = False
+            if not (self.looped or t.constant
+                    or not t.rgba.flags.writeable):
+                self._backend.forget_cached_tile(tx, ty)
+                unshared = (sys.getrefcount(t) <= 3
+                            and sys.getrefcount(t.rgba) <= 2)
+            if unshared:
+                t.readonly = False
+            else:
+                # shared memory, get a private copy for writing
+                self._retired_tiles.add(t)
+                t = t.copy()
+                self.tiledict[(tx, ty)] = t
         if not readonly:
             # assert self.mipmap_level == 0
             self._mark_mipmap_dirty(tx, ty)
-        return t.rgba
+            t.summary = mypaintlib.TileSummaryUnknown
+        t.accessed = True
+        return t
+
+    def set_constant_tile(self, tx, ty, rgba):
+        """Fills a whole tile with a single colour
+
+        :param tuple rgba: premultiplied 15-bit colour
+
+        The tile becomes the shared constant_tile() of the colour, and
+        takes up no pixel memory until it is next written to. Observers
+        are not notified.
+
+        """
+        if self.looped:
+            tx = tx % (self.looped_size[0] // N)
+            ty = ty % (self.looped_size[1] // N)
+        tile = constant_tile(rgba)
+        if tile is transparent_tile:
+            old = self.tiledict.pop((tx, ty), None)
+        else:
+            old = self.tiledict.get((tx, ty))
+            self.tiledict[(tx, ty)] = tile
+        if old is not None and old.readonly and not old.constant:
+            self._retired_tiles.add(old)
+        self._mark_mipmap_dirty(tx, ty)
+        self._touch()
 
     def _set_tile_numpy(self, tx, ty, obj, readonly):
         pass  # Data can be modified directly, no action needed
@@ -426,17 +999,28 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
                                        mipmap_level, opacity, mode)
             return
 
-        # Tile request at the required level.
-        # Try optimizations again if we got the special marker tile
-        with self.tile_request(tx, ty, readonly=True) as src:
-            if src is transparent_tile.rgba:
-                if dst_has_alpha:
-                    if mode in lib.modes.MODES_CLEARING_BACKDROP_AT_ZERO_ALPHA:
-                        mypaintlib.tile_clear_rgba16(dst)
-                        return
-                if mode not in lib.modes.MODES_EFFECTIVE_AT_ZERO_ALPHA:
-                    return
-            mypaintlib.tile_combine(mode, src, dst, dst_has_alpha, opacity)
+        # Tile request at the required level. The tile's summary lets
+        # empty and uniform tiles be handled without a full combine.
+        src = self._get_tile(tx, ty, readonly=True)
+        mypaintlib.tile_combine(mode, src.rgba, dst, dst_has_alpha, opacity,
+                                src.get_summary())
+
+    def get_render_source(self, tx, ty, mipmap_level=0):
+        """The tile composite_tile() or blit_tile_into() would use
+
+        :returns: None for a transparent tile, or (rgba, summary)
+
+        This is the form of the sources passed to
+        lib.mypaintlib.tile_render_ops_many().
+
+        """
+        surf = self
+        while surf.mipmap_level < mipmap_level:
+            surf = surf.mipmap
+        src = surf._get_tile(tx, ty, readonly=True)
+        if src is transparent_tile:
+            return None
+        return (src.rgba, src.get_summary())
 
     ## Snapshotting
 
@@ -452,11 +1036,14 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         for t in itervalues(self.tiledict):
             t.readonly = True
         sshot.tiledict = self.tiledict.copy()
+        sshot.revision = self._revision
+        self._backend.clear_tile_cache()
         return sshot
 
     def load_snapshot(self, sshot):
         """Loads a saved snapshot, replacing the internal tiledict"""
         self._load_tiledict(sshot.tiledict)
+        self._revision = sshot.revision
 
     def _load_tiledict(self, d):
         """Efficiently loads a tiledict, and notifies the observers"""
@@ -469,18 +1056,84 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         self.tiledict = d.copy()
         new = set(self.tiledict.items())
         dirty = old.symmetric_difference(new)
+        for pos, tile in old - new:
+            self._retired_tiles.add(tile)
         for pos, tile in dirty:
             self._mark_mipmap_dirty(*pos)
         bbox = lib.surface.get_tiles_bbox(pos for (pos, tile) in dirty)
         if not bbox.empty():
             self.notify_observers(*bbox)
 
+    ## Compression of cold tiles
+
+    def iter_compress_cold_tiles(self, all_tiles=False):
+        """Compresses tiles which have not been used lately (generator)
+
+        :param bool all_tiles: compress every tile, e.g. for hidden layers
+        :returns: an iterator which yields after each tile it examines
+
+        A tile is cold if nothing has requested it since the previous
+        pass, counting requests answered by the backend's tile cache.
+        Surfaces with tile requests in progress are skipped. Tiles left behind in snapshots by copy-on-write are always
+        cold. Compressed tiles are unpacked again transparently when
+        they are next requested, so running this only costs memory
+        traffic. The pass can be run in small chunks from an idle
+        handler, and copes with tiles changing in between.
+
+        """
+        if self.is_pending_load():
+            return
+        for surf in self._mipmaps:
+            for pos in list(surf.tiledict.keys()):
+                if self._users:
+                    # Try again on the next pass
+                    return
+                t = surf.tiledict.get(pos)
+                if t is not None:
+                    if not surf.looped:
+                        if surf._backend.take_cached_tile_hit(*pos):
+                            t.accessed = True
+                    if all_tiles or not t.accessed:
+                        if surf.looped:
+                            surf._backend.clear_tile_cache()
+                        else:
+                            surf._backend.forget_cached_tile(*pos)
+                        t.compress()
+                    else:
+                        t.accessed = False
+                yield
+        for t in list(self._retired_tiles):
+            t.compress()
+            self._retired_tiles.discard(t)
+            yield
+
     ## Loading tile data
 
     def load_from_surface(self, other):
         """Loads tile data from another surface, via a snapshot"""
         self.load_snapshot(other.save_snapshot())
 
+    def load_tile_log(self, filename, x=0, y=0):
+        """Loads the tiles saved in a tile log (see lib.tilelog)
+
+        :param unicode filename: The log to read
+        :param int x: Horizontal offset, a multiple of N
+        :param int y: Vertical offset, a multiple of N
+
+        The tiles stay compressed until they are first used.
+
+        """
+        if x % N or y % N:
+            raise ValueError("Tile logs can only be moved by whole tiles")
+        dtx = x // N
+        dty = y // N
+        tiles = lib.tilelog.read_tile_log(filename)
+        self._touch()
+        self._load_tiledict(dict(
+            ((tx + dtx, ty + dty), _Tile.new_from_compressed(zdata))
+            for ((tx, ty), zdata) in tiles.items()
+        ))
+
     def _load_from_pixbufsurface(self, s):
         dirty_tiles = set(self.tiledict.keys())
         self.tiledict = {}
@@ -516,7 +1169,7 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         return (x, y, w, h)
 
     def load_from_png(self, filename, x, y, progress=None,
-                      convert_to_srgb=True,
+                      convert_to_srgb=True, mipmap_level=0,
                       **kwargs):
         """Load from a PNG, one tilerow at a time, discarding empty tiles.
 
@@ -526,11 +1179,18 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         :param bool convert_to_srgb: If True, convert to sRGB
         :param progress: Unsized UI feedback obj.
         :type progress: lib.feedback.Progress or None
+        :param int mipmap_level: Load a reduced copy, for previews
         :param dict \*\*kwargs: Ignored
 
         Raises a `lib.errors.FileHandlingError` with a descriptive
         string when conversion or PNG reading fails.
 
+        With a nonzero mipmap_level, the surface gets the tiles which
+        its mipmap of that level would hold after a normal load, with
+        the image scaled down by 2**mipmap_level. They are built while
+        the PNG is decoded, so the full-size image is never held in
+        memory. The returned frame is still that of the full-size image.
+
         """
         if not progress:
             progress = lib.feedback.Progress()
@@ -542,17 +1202,15 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         dirty_tiles = set(self.tiledict.keys())
         self.tiledict = {}
 
-        ty0 = int(y // N)
+        ty0 = int(y // N) >> mipmap_level
         state = {}
-        state['buf'] = None   # array of height N, width depends on image
-        state['ty'] = ty0  # current tile row being filled into buf
         state['frame_size'] = None
         state['progress'] = progress
 
-        def get_buffer(png_w, png_h):
+        def store_tiles(png_w, png_h, ty, tiles):
             if state["frame_size"] is None:
                 if state['progress']:
-                    ty_final = int((y + png_h) // N)
+                    ty_final = int((y + png_h) // N) >> mipmap_level
                     # We have to handle feedback exceptions ourself
                     try:
                         state["progress"].items = ty_final - ty0
@@ -561,42 +1219,17 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
                         state["progress"] = None
                 state['frame_size'] = (x, y, png_w, png_h)
 
-            buf_x0 = x // N * N
-            buf_x1 = ((x + png_w - 1) // N + 1) * N
-            buf_y0 = state['ty']*N
-            buf_y1 = buf_y0+N
-            buf_w = buf_x1-buf_x0
-            buf_h = buf_y1-buf_y0
-            assert buf_w % N == 0
-            assert buf_h == N
-            if state['buf'] is not None:
-                consume_buf()
-            else:
-                state['buf'] = np.empty((buf_h, buf_w, 4), 'uint8')
-
-            png_x0 = x
-            png_x1 = x+png_w
-            subbuf = state['buf'][:, png_x0-buf_x0:png_x1-buf_x0]
-            if 1:  # optimize: only needed for first and last
-                state['buf'].fill(0)
-                png_y0 = max(buf_y0, y)
-                png_y1 = min(buf_y0+buf_h, y+png_h)
-                assert png_y1 > png_y0
-                subbuf = subbuf[png_y0-buf_y0:png_y1-buf_y0, :]
-
-            state['ty'] += 1
-            return subbuf
-
-        def consume_buf():
-            ty = state['ty']-1
-            for i in xrange(state['buf'].shape[1] // N):
-                tx = x // N + i
-                src = state['buf'][:, i*N:(i+1)*N, :]
-                if src[:, :, 3].any():
-                    with self.tile_request(tx, ty, readonly=False) as dst:
-                        mypaintlib.tile_convert_rgba8_to_rgba16(
-                            src, dst, eotf()
-                        )
+            # The loader only passes on tiles with something in them.
+            # Those of a single colour are swapped for shared ones.
+            for tx, rgba in tiles.items():
+                summary, colour = mypaintlib.tile_summarize(rgba)
+                if summary == mypaintlib.TileSummaryUniform:
+                    tile = constant_tile(colour)
+                else:
+                    tile = _Tile(rgba=rgba)
+                    tile.summary = summary
+                self.tiledict[(tx, ty)] = tile
+                self._mark_mipmap_dirty(tx, ty)
             if state["progress"]:
                 try:
                     state["progress"].completed(ty - ty0)
@@ -617,14 +1250,17 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         try:
             if PY3:
                 filename_sys = filename_sys.decode()
-            flags = mypaintlib.load_png_fast_progressive(
+            flags = mypaintlib.load_png_fast_to_tiles(
                 filename_sys,
-                get_buffer,
+                store_tiles,
+                x, y,
                 convert_to_srgb,
+                eotf(),
+                0,
+                mipmap_level,
             )
         except (IOError, OSError, RuntimeError) as ex:
             raise FileHandlingError(_("PNG reader failed: %s") % str(ex))
-        consume_buf()  # also process the final chunk of data
         progress.close()
         logger.debug("PNG loader flags: %r", flags)
 
@@ -645,6 +1281,13 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         return res
 
     def save_as_png(self, filename, *args, **kwargs):
+        if self._pending_load is not None:
+            self._run_pending_load()
+        if self.load_error is not None:
+            raise FileHandlingError(
+                _("The layer's data could not be loaded: %s")
+                % (self.load_error,)
+            )
         if 'alpha' not in kwargs:
             kwargs['alpha'] = True
 
@@ -653,12 +1296,18 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
         lib.surface.save_as_png(self, filename, *args, **kwargs)
 
     def get_bbox(self):
+        bbox = self._pending_bbox
+        if bbox is not None and self._pending_load is not None:
+            return bbox.copy()
         return lib.surface.get_tiles_bbox(self.tiledict)
 
     def get_tiles(self):
         return self.tiledict
 
     def is_empty(self):
+        bbox = self._pending_bbox
+        if bbox is not None and self._pending_load is not None:
+            return bbox.empty()
         return not self.tiledict
 
     def remove_empty_tiles(self):
@@ -680,6 +1329,12 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
                     continue
                 if rgba.any():
                     continue
+                # Mipmap tiles of faint tiles may round down to nothing,
+                # but are only left out when nothing is below them.
+                if surf.mipmap_level > 0 and any(
+                        c in surf.parent.tiledict
+                        for c in _mipmap_children(*pos)):
+                    continue
                 surf.tiledict.pop(pos)
                 removed += 1
         return removed, total
@@ -827,7 +1482,7 @@ class MyPaintSurface (TileAccessible, TileBlittable, TileCompositable):
                 with self.tile_request(tx, ty, readonly=False) as dst:
                     s.blit_tile_into(dst, True, tx, ty)
         else:
-            tmp = np.zeros((N, N, 4), 'uint16')
+            tmp = new_tile_array()
             for tx, ty in dirty_tiles:
                 s.blit_tile_into(tmp, True, tx, ty)
                 with self.tile_request(tx, ty, readonly=False) as dst:
@@ -1058,6 +1713,7 @@ class _TiledSurfaceMove (object):
                     # Copy this source slice to the destination
                     targ_tile.rgba[targ_y0:targ_y1, targ_x0:targ_x1] \
                         = src_tile.rgba[src_y0:src_y1, src_x0:src_x1]
+                    targ_tile.summary = mypaintlib.TileSummaryUnknown
                     updated.add(targ_t)
             # The source tile has been fully processed at this point,
             # and can be removed from the output dict if it hasn't
@@ -1265,6 +1921,9 @@ class PNGFileUpdateTask (object):
     def __init__(self, surface, filename, rect, alpha,
                  single_tile_pattern=False,
                  save_srgb_chunks=False,
+                 compression_level=2,
+                 png_filter=mypaintlib.ProgressivePNGWriter.FILTER_SUB,
+                 threads=0,
                  **kwargs):
         super(PNGFileUpdateTask, self).__init__()
         self._final_filename = filename
@@ -1291,6 +1950,9 @@ class PNGFileUpdateTask (object):
             w, h,
             alpha,
             save_srgb_chunks,
+            compression_level,
+            png_filter,
+            threads,
         )
         self._tmp_filename = tmp_filename
         self._tmp_fp = tmp_fp
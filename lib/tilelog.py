@@ -0,0 +1,295 @@
+# This file is part of MyPaint.
+# Copyright (C) 2026 by the MyPaint Development Team.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+
+"""Append-only logs of compressed tiles, for incremental autosaves
+
+A tile log holds the fix15 tiles of one surface. Instead of the whole
+surface being encoded as a PNG each time, each autosave appends just
+the tiles which changed since the previous one, and reloading it after
+a crash needs no PNG decoding.
+
+The file starts with MAGIC, followed by records. Each is a header of
+the tile's x and y indices and a byte count (little-endian, see
+_RECORD), then that many bytes of zlib-compressed pixels: the tile's
+NxNx4 uint16 array, as for in-memory compressed tiles. A count of
+zero records the removal of the tile. Each update ends with a commit
+record, and only committed records are read back, so a log cut short
+in the middle of an update still holds the tiles of the one before.
+When most of the file is tiles later overwritten, it is rewritten.
+
+"""
+
+## Imports
+
+from __future__ import division, print_function
+
+import os
+import mmap
+import struct
+import logging
+
+import lib.fileutils
+
+logger = logging.getLogger(__name__)
+
+
+## Module constants
+
+#: File name suffix for tile logs
+SUFFIX = u".tiles"
+
+#: First bytes of every tile log
+MAGIC = b"MYPTLOG\x01"
+
+# Record header: tile x, tile y, and byte count of the data following
+_RECORD = struct.Struct("<iiI")
+
+# Record byte count marking the end of an update
+_COMMIT = 0xffffffff
+
+# Logs larger than this many times the size of their current tiles
+# are rewritten from scratch
+_COMPACT_RATIO = 2
+
+# Number of tiles written by each call to an update task
+_TILES_PER_CALL = 64
+
+
+## Reading
+
+def read_tile_log(filename):
+    """Reads the committed contents of a tile log
+
+    :param unicode filename: The log to read
+    :returns: the compressed pixels of each tile, by (tx, ty)
+    :rtype: dict
+    :raises ValueError: if the file is not a tile log
+
+    The file is memory-mapped, and only the data of the most recent
+    record of each tile is copied out of it.
+
+    """
+    with open(filename, "rb") as fp:
+        size = os.fstat(fp.fileno()).st_size
+        if size < len(MAGIC):
+            raise ValueError("%r is not a tile log" % (filename,))
+        m = mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ)
+        try:
+            if m[:len(MAGIC)] != MAGIC:
+                raise ValueError("%r is not a tile log" % (filename,))
+            committed = {}
+            pending = {}
+            pos = len(MAGIC)
+            while pos + _RECORD.size <= size:
+                tx, ty, count = _RECORD.unpack_from(m, pos)
+                pos += _RECORD.size
+                if count == _COMMIT:
+                    committed.update(pending)
+                    pending.clear()
+                    continue
+                if pos + count > size:
+                    break
+                pending[(tx, ty)] = (pos, count)
+                pos += count
+            if pending:
+                logger.warning(
+                    "%r: ignored %d uncommitted tiles",
+                    filename, len(pending),
+                )
+            return dict(
+                (txy, m[start:start + count])
+                for (txy, (start, count)) in committed.items()
+                if count > 0
+            )
+        finally:
+            m.close()
+
+
+## Writing
+
+class TileLogWriter (object):
+    """Keeps the tile log of a surface up to date across autosaves
+
+    The writer remembers which tile objects it wrote last time, and
+    compares them with those of a new snapshot's tiledict by identity.
+    This holds a reference to each tile written, so copy-on-write
+    replaces any tile painted on afterwards, instead of changing it in
+    place.
+
+    >>> import zlib, tempfile, shutil
+    >>> class Tile (object):
+    ...     def __init__(self, data):
+    ...         self.data = data
+    ...     def compressed_bytes(self):
+    ...         return zlib.compress(self.data)
+    >>> tmpdir = tempfile.mkdtemp()
+    >>> log = os.path.join(tmpdir, "test" + SUFFIX)
+    >>> writer = TileLogWriter(log)
+    >>> a, b, c = Tile(b"a" * 100), Tile(b"b" * 100), Tile(b"c" * 100)
+    >>> task = writer.update_task({(0, 0): a, (1, -1): b})
+    >>> while task():
+    ...     pass
+    >>> size0 = os.path.getsize(log)
+
+    Only changes are appended:
+
+    >>> task = writer.update_task({(0, 0): a, (2, 3): c})
+    >>> while task():
+    ...     pass
+    >>> tiles = read_tile_log(log)
+    >>> sorted(tiles.keys())
+    [(0, 0), (2, 3)]
+    >>> zlib.decompress(tiles[(2, 3)]) == c.data
+    True
+    >>> os.path.getsize(log) - size0 < size0
+    True
+
+    Updates cut short leave the previous state readable:
+
+    >>> with open(log, "ab") as fp:
+    ...     _ = fp.write(_RECORD.pack(5, 5, 0))
+    >>> sorted(read_tile_log(log).keys())
+    [(0, 0), (2, 3)]
+
+    and make the next update rewrite the log.
+
+    >>> task = writer.update_task({(2, 3): c})
+    >>> while task():
+    ...     pass
+    >>> sorted(read_tile_log(log).keys())
+    [(2, 3)]
+    >>> shutil.rmtree(tmpdir)
+
+    """
+
+    def __init__(self, filename):
+        super(TileLogWriter, self).__init__()
+        self.filename = filename
+        # Tiles as of the last completed update, with their record sizes
+        self._written = {}
+        # Size of the log file after that update
+        self._end = None
+
+    def _needs_rewrite(self):
+        if self._end is None:
+            return True
+        try:
+            if os.path.getsize(self.filename) != self._end:
+                return True
+        except OSError:
+            return True
+        live = len(MAGIC) + sum(
+            _RECORD.size + size for (tile, size) in self._written.values()
+        )
+        return self._end > _COMPACT_RATIO * live
+
+    def update_task(self, tiledict):
+        """Returns a task writing a snapshot's changes to the log
+
+        :param dict tiledict: the tiles of a surface snapshot
+        :rtype: TileLogUpdateTask
+
+        Tasks must be run one at a time, and to completion.
+
+        """
+        if self._needs_rewrite():
+            return TileLogUpdateTask(self, tiledict, {}, True)
+        return TileLogUpdateTask(self, tiledict, self._written, False)
+
+    def _update_finished(self, written, end):
+        self._written = written
+        self._end = end
+
+
+class TileLogUpdateTask (object):
+    """Piecemeal callable: writes the changes of one update into a log
+
+    Runs as an idle task, see lib.autosave.Autosaveable. A rewrite
+    goes to a temporary file, which replaces the log when done.
+
+    """
+
+    def __init__(self, writer, tiledict, written, rewrite):
+        super(TileLogUpdateTask, self).__init__()
+        self._writer = writer
+        self._written = dict(written)
+        self._rewrite = rewrite
+        self._changes = [
+            (pos, tile) for (pos, tile) in tiledict.items()
+            if written.get(pos, (None, 0))[0] is not tile
+        ]
+        self._changes.extend(
+            (pos, None) for pos in written if pos not in tiledict
+        )
+        self._fp = None
+        self._filename = writer.filename
+        if rewrite:
+            self._filename += ".tmp"
+
+    def _open(self):
+        if self._rewrite:
+            fp = open(self._filename, "wb")
+            fp.write(MAGIC)
+        else:
+            # Appending starts at the end of the last committed update
+            fp = open(self._filename, "r+b")
+            fp.seek(self._writer._end)
+            fp.truncate()
+        return fp
+
+    def __call__(self, *args, **kwargs):
+        if self._changes is None:
+            raise RuntimeError("Called too many times")
+        try:
+            if self._fp is None:
+                self._fp = self._open()
+            fp = self._fp
+            chunk = self._changes[-_TILES_PER_CALL:]
+            del self._changes[-_TILES_PER_CALL:]
+            for ((tx, ty), tile) in chunk:
+                if tile is None:
+                    fp.write(_RECORD.pack(tx, ty, 0))
+                    self._written.pop((tx, ty), None)
+                    continue
+                data = tile.compressed_bytes()
+                fp.write(_RECORD.pack(tx, ty, len(data)))
+                fp.write(data)
+                self._written[(tx, ty)] = (tile, len(data))
+            if self._changes:
+                return True
+            fp.write(_RECORD.pack(0, 0, _COMMIT))
+            end = fp.tell()
+            fp.close()
+            self._fp = None
+        except Exception:
+            if self._fp is not None:
+                self._fp.close()
+                self._fp = None
+            self._changes = None
+            raise
+        if self._rewrite:
+            lib.fileutils.replace(self._filename, self._writer.filename)
+        self._writer._update_finished(self._written, end)
+        self._changes = None
+        logger.debug("autosave: updated %r", self._writer.filename)
+        return False
+
+
+## Module testing
+
+
+def _test():
+    """Run doctest strings"""
+    import doctest
+    doctest.testmod(optionflags=doctest.ELLIPSIS)
+
+
+if __name__ == '__main__':
+    logging.basicConfig(level=logging.DEBUG)
+    _test()
@@ -0,0 +1,212 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "tilepool.hpp"
+#include "common.hpp"
+
+#include <mypaint-tiled-surface.h>
+
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#define NO_IMPORT_ARRAY
+#include <numpy/arrayobject.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mutex>
+#include <vector>
+
+#define N MYPAINT_TILE_SIZE
+
+
+static const size_t TILE_POOL_ALIGNMENT = 64;
+static const size_t TILE_POOL_MAX_FREE_BYTES = 32 << 20;
+static const char *TILE_POOL_CAPSULE = "mypaintlib.tile_pool_block";
+
+
+struct TilePoolClass
+{
+    int nd;
+    npy_intp dims[3];
+    int type;
+    size_t bytes;
+};
+
+static const TilePoolClass tile_pool_classes[] = {
+    {3, {N, N, 4}, NPY_UINT16, N * N * 4 * sizeof(uint16_t)},
+    {3, {N, N, 4}, NPY_UINT8, N * N * 4 * sizeof(uint8_t)},
+    {2, {N, N, 0}, NPY_UINT16, N * N * sizeof(uint16_t)},
+};
+
+static const int TILE_POOL_NUM_KINDS =
+    sizeof(tile_pool_classes) / sizeof(tile_pool_classes[0]);
+
+
+// Free blocks of each kind. Each block starts on an aligned boundary,
+// and the malloc()ed pointer it came from is kept just before it. The
+// lists are never destroyed, since arrays may still be deallocated
+// while the process exits.
+
+static std::mutex tile_pool_lock;
+static std::vector<void *> *const tile_pool_free =
+    new std::vector<void *>[TILE_POOL_NUM_KINDS];
+
+
+static inline bool
+tile_pool_valid_kind (int kind)
+{
+    return kind >= 0 && kind < TILE_POOL_NUM_KINDS;
+}
+
+
+static void *
+tile_pool_alloc (size_t bytes)
+{
+    const size_t header = sizeof(void *);
+    char *raw = (char *)malloc(bytes + header + TILE_POOL_ALIGNMENT - 1);
+    if (! raw) {
+        return NULL;
+    }
+    const uintptr_t addr = (uintptr_t)(raw + header);
+    char *block = (char *)((addr + TILE_POOL_ALIGNMENT - 1)
+                           / TILE_POOL_ALIGNMENT * TILE_POOL_ALIGNMENT);
+    ((void **)block)[-1] = raw;
+    return block;
+}
+
+
+static void
+tile_pool_release (void *block)
+{
+    free(((void **)block)[-1]);
+}
+
+
+void *
+tile_pool_take (int kind)
+{
+    {
+        std::lock_guard<std::mutex> guard(tile_pool_lock);
+        std::vector<void *> &blocks = tile_pool_free[kind];
+        if (! blocks.empty()) {
+            void *block = blocks.back();
+            blocks.pop_back();
+            return block;
+        }
+    }
+    return tile_pool_alloc(tile_pool_classes[kind].bytes);
+}
+
+
+void
+tile_pool_give (int kind, void *block)
+{
+    const size_t max_free = TILE_POOL_MAX_FREE_BYTES
+                          / tile_pool_classes[kind].bytes;
+    {
+        std::lock_guard<std::mutex> guard(tile_pool_lock);
+        std::vector<void *> &blocks = tile_pool_free[kind];
+        if (blocks.size() < max_free) {
+            blocks.push_back(block);
+            return;
+        }
+    }
+    tile_pool_release(block);
+}
+
+
+// Destructor of the capsule holding an array's block
+
+static void
+tile_pool_capsule_destructor (PyObject *capsule)
+{
+    void *block = PyCapsule_GetPointer(capsule, TILE_POOL_CAPSULE);
+    const int kind = (int)(intptr_t)PyCapsule_GetContext(capsule);
+    if (block) {
+        tile_pool_give(kind, block);
+    }
+}
+
+
+PyObject *
+tile_pool_wrap (int kind, void *block)
+{
+    const TilePoolClass &cls = tile_pool_classes[kind];
+    npy_intp dims[3] = {cls.dims[0], cls.dims[1], cls.dims[2]};
+    PyObject *arr = PyArray_SimpleNewFromData(cls.nd, dims, cls.type, block);
+    PyObject *base = NULL;
+    if (arr) {
+        base = PyCapsule_New(block, TILE_POOL_CAPSULE,
+                             tile_pool_capsule_destructor);
+    }
+    if (base && PyCapsule_SetContext(base, (void *)(intptr_t)kind) != 0) {
+        // The destructor would not know where the block belongs
+        PyCapsule_SetDestructor(base, NULL);
+        Py_CLEAR(base);
+    }
+    if (! base) {
+        Py_XDECREF(arr);
+        tile_pool_give(kind, block);
+        return NULL;
+    }
+    // The array now owns the block, through its base
+    if (PyArray_SetBaseObject((PyArrayObject *)arr, base) != 0) {
+        Py_DECREF(arr);  // PyArray_SetBaseObject() stole the base anyway
+        return NULL;
+    }
+    return arr;
+}
+
+
+PyObject *
+tile_pool_new (int kind, bool zeroed)
+{
+    if (! tile_pool_valid_kind(kind)) {
+        PyErr_Format(PyExc_ValueError, "unknown tile pool kind %d", kind);
+        return NULL;
+    }
+    void *block = tile_pool_take(kind);
+    if (! block) {
+        return PyErr_NoMemory();
+    }
+    if (zeroed) {
+        memset(block, 0, tile_pool_classes[kind].bytes);
+    }
+    return tile_pool_wrap(kind, block);
+}
+
+
+int
+tile_pool_free_count (int kind)
+{
+    if (! tile_pool_valid_kind(kind)) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> guard(tile_pool_lock);
+    return tile_pool_free[kind].size();
+}
+
+
+void
+tile_pool_trim ()
+{
+    std::vector<void *> released;
+    {
+        std::lock_guard<std::mutex> guard(tile_pool_lock);
+        for (int kind = 0; kind < TILE_POOL_NUM_KINDS; ++kind) {
+            released.insert(released.end(), tile_pool_free[kind].begin(),
+                            tile_pool_free[kind].end());
+            std::vector<void *>().swap(tile_pool_free[kind]);
+        }
+    }
+    for (size_t i = 0; i < released.size(); ++i) {
+        tile_pool_release(released[i]);
+    }
+}
@@ -0,0 +1,68 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TILEPOOL_HPP
+#define TILEPOOL_HPP
+
+#include <Python.h>
+
+
+// Recycled memory for new tile arrays.
+//
+// Every kind of tile has a free list of cache-aligned blocks. An array
+// made here owns its block through a capsule as its base object, which
+// hands the block back to the free list when the array is deallocated,
+// so tiles created and dropped in bursts, as fills and strokes do, keep
+// reusing the same few blocks. Up to 32 MiB of each kind is kept; more
+// free blocks than that are released to the system.
+
+enum TilePoolKind {
+    TilePoolRGBA16,     // NxNx4 uint16, as held by surfaces
+    TilePoolRGBA8,      // NxNx4 uint8, for display
+    TilePoolAlpha16     // NxN uint16, as used by the fill code
+};
+
+
+// A new tile array of a kind, filled with zeros unless zeroed is false.
+
+PyObject *
+tile_pool_new (int kind, bool zeroed = true);
+
+
+// Number of free blocks of a kind waiting to be reused
+
+int
+tile_pool_free_count (int kind);
+
+
+// Returns all the free blocks to the system
+
+void
+tile_pool_trim ();
+
+
+#ifndef SWIG
+
+// Raw blocks, for code which must allocate tiles without the GIL and
+// turn them into arrays later. Both are safe to call from any thread.
+// tile_pool_take() returns NULL if memory runs out.
+
+void *tile_pool_take (int kind);
+void tile_pool_give (int kind, void *block);
+
+// Makes an array owning a block taken from the pool, with the GIL held.
+// On failure, the block goes back to the pool and NULL is returned with
+// an exception set.
+
+PyObject *tile_pool_wrap (int kind, void *block);
+
+#endif /* #ifndef SWIG */
+
+
+#endif // TILEPOOL_HPP
@@ -0,0 +1,166 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "tilerequestcache.hpp"
+
+
+TileRequestCache::~TileRequestCache()
+{
+    clear();
+}
+
+
+uint64_t
+TileRequestCache::key (int tx, int ty)
+{
+    return ((uint64_t)(uint32_t)tx << 32) | (uint32_t)ty;
+}
+
+
+TileRequestCache::Stripe &
+TileRequestCache::stripe (int tx, int ty)
+{
+    // Neighbouring tiles, which are often processed at the same time,
+    // land in different stripes.
+    const uint32_t h = (uint32_t)tx * 73856093u ^ (uint32_t)ty * 19349663u;
+    return stripes[h % NUM_STRIPES];
+}
+
+
+uint16_t *
+TileRequestCache::lookup (int tx, int ty, bool readonly)
+{
+    Stripe &s = stripe(tx, ty);
+    std::lock_guard<std::mutex> guard(s.lock);
+    std::unordered_map<uint64_t, Entry>::iterator it = s.tiles.find(key(tx, ty));
+    if (it == s.tiles.end()) {
+        return NULL;
+    }
+    Entry &entry = it->second;
+    if (readonly) {
+        entry.hit = true;
+        return entry.buffer;
+    }
+    if (! entry.writeable) {
+        return NULL;
+    }
+    entry.hit = true;
+    if (! entry.written) {
+        entry.written = true;
+        s.written.push_back(std::make_pair(tx, ty));
+    }
+    return entry.buffer;
+}
+
+
+bool
+TileRequestCache::has_writeable (int tx, int ty)
+{
+    Stripe &s = stripe(tx, ty);
+    std::lock_guard<std::mutex> guard(s.lock);
+    std::unordered_map<uint64_t, Entry>::iterator it = s.tiles.find(key(tx, ty));
+    return it != s.tiles.end() && it->second.writeable;
+}
+
+
+void
+TileRequestCache::insert (int tx, int ty, PyObject *array, uint16_t *buffer,
+                          bool writeable)
+{
+    Stripe &s = stripe(tx, ty);
+    PyObject *old_array = NULL;
+    Py_INCREF(array);
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        Entry &entry = s.tiles[key(tx, ty)];
+        old_array = entry.array;
+        entry.array = array;
+        entry.buffer = buffer;
+        entry.writeable = writeable;
+        entry.written = false;
+        entry.hit = false;
+    }
+    Py_XDECREF(old_array);
+}
+
+
+bool
+TileRequestCache::take_hit (int tx, int ty)
+{
+    Stripe &s = stripe(tx, ty);
+    std::lock_guard<std::mutex> guard(s.lock);
+    std::unordered_map<uint64_t, Entry>::iterator it = s.tiles.find(key(tx, ty));
+    if (it == s.tiles.end()) {
+        return false;
+    }
+    const bool hit = it->second.hit;
+    it->second.hit = false;
+    return hit;
+}
+
+
+void
+TileRequestCache::forget (int tx, int ty)
+{
+    Stripe &s = stripe(tx, ty);
+    PyObject *old_array = NULL;
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        std::unordered_map<uint64_t, Entry>::iterator it
+            = s.tiles.find(key(tx, ty));
+        if (it == s.tiles.end()) {
+            return;
+        }
+        old_array = it->second.array;
+        s.tiles.erase(it);
+    }
+    Py_XDECREF(old_array);
+}
+
+
+void
+TileRequestCache::clear ()
+{
+    std::vector<PyObject *> old_arrays;
+    for (int i = 0; i < NUM_STRIPES; ++i) {
+        Stripe &s = stripes[i];
+        std::lock_guard<std::mutex> guard(s.lock);
+        std::unordered_map<uint64_t, Entry>::iterator it;
+        for (it = s.tiles.begin(); it != s.tiles.end(); ++it) {
+            old_arrays.push_back(it->second.array);
+        }
+        s.tiles.clear();
+        s.written.clear();
+    }
+    for (size_t i = 0; i < old_arrays.size(); ++i) {
+        Py_XDECREF(old_arrays[i]);
+    }
+}
+
+
+std::vector<std::pair<int, int> >
+TileRequestCache::take_written ()
+{
+    std::vector<std::pair<int, int> > written;
+    for (int i = 0; i < NUM_STRIPES; ++i) {
+        Stripe &s = stripes[i];
+        std::lock_guard<std::mutex> guard(s.lock);
+        for (size_t j = 0; j < s.written.size(); ++j) {
+            const std::pair<int, int> &t = s.written[j];
+            std::unordered_map<uint64_t, Entry>::iterator it
+                = s.tiles.find(key(t.first, t.second));
+            if (it != s.tiles.end()) {
+                it->second.written = false;
+            }
+            written.push_back(t);
+        }
+        s.written.clear();
+    }
+    return written;
+}
@@ -0,0 +1,94 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TILEREQUESTCACHE_HPP
+#define TILEREQUESTCACHE_HPP
+
+#include <Python.h>
+
+#include <stdint.h>
+
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+// Native lookup table of the tile arrays a Python tiled surface has handed
+// out to libmypaint.
+//
+// tiledsurface.py owns the tiles and stays the authority on them; this only
+// lets repeated tile requests from the worker threads be answered without
+// calling back into Python. Lookups take one of several striped locks.
+//
+// Python must make the cache forget a tile whenever its tiledict entry
+// changes, and clear it whenever tiles become read-only. Writes done via the
+// cache are logged so that the Python side can catch up on its bookkeeping
+// for them (mipmap invalidation, summaries) once the workers are done.
+
+class TileRequestCache
+{
+  public:
+    TileRequestCache() {}
+    ~TileRequestCache();
+
+    // Returns the cached buffer for a tile, or NULL. Read-only requests can
+    // be met by read-only or writeable entries, writeable ones only by the
+    // latter. Writeable hits are logged.
+    uint16_t *lookup (int tx, int ty, bool readonly);
+
+    // True if a writeable lookup would succeed. Doesn't log anything.
+    bool has_writeable (int tx, int ty);
+
+    // True if a lookup has been answered from the tile's entry since the
+    // last call. Those requests never reach Python, which would otherwise
+    // take a tile in use for a cold one.
+    bool take_hit (int tx, int ty);
+
+    // Remembers the array a request was answered with, taking a reference.
+    // Call with the GIL held.
+    void insert (int tx, int ty, PyObject *array, uint16_t *buffer,
+                 bool writeable);
+
+    // Drops one tile, or all of them along with the write log.
+    // Call with the GIL held.
+    void forget (int tx, int ty);
+    void clear ();
+
+    // Returns the tiles written via lookup() since the last call, and resets
+    // the log.
+    std::vector<std::pair<int, int> > take_written ();
+
+  private:
+    TileRequestCache(const TileRequestCache &);
+    TileRequestCache &operator= (const TileRequestCache &);
+
+    struct Entry {
+        PyObject *array;
+        uint16_t *buffer;
+        bool writeable;
+        bool written;
+        bool hit;
+    };
+
+    struct Stripe {
+        std::mutex lock;
+        std::unordered_map<uint64_t, Entry> tiles;
+        std::vector<std::pair<int, int> > written;
+    };
+
+    static const int NUM_STRIPES = 16;
+    Stripe stripes[NUM_STRIPES];
+
+    static uint64_t key (int tx, int ty);
+    Stripe &stripe (int tx, int ty);
+};
+
+
+#endif // TILEREQUESTCACHE_HPP
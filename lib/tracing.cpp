@@ -0,0 +1,188 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "tracing.hpp"
+
+#include <stdio.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// Events kept for each thread, of 24 bytes each on 64-bit systems
+static const size_t TRACE_RING_EVENTS = 1 << 15;
+
+
+std::atomic<bool> trace_enabled_flag(false);
+
+// Start of the current recording, in trace_now() time
+static std::atomic<int64_t> trace_epoch(0);
+
+
+struct TraceEvent
+{
+    const char *name;
+    int64_t start;
+    int64_t end;
+};
+
+
+// A thread's events. Each ring is only written by its thread, but it is
+// locked while doing so because dumps and clears may come from any other.
+
+struct TraceRing
+{
+    std::mutex lock;
+    std::vector<TraceEvent> events;
+    size_t next;    // oldest event, to be overwritten next, once full
+    int tid;
+};
+
+
+// Every ring ever made, and the ones left behind by exited threads, which
+// new threads take over so short-lived threads don't each cost a buffer.
+// Like the rings themselves, these are never destroyed, since threads may
+// still be exiting while the process exits.
+
+static std::mutex trace_rings_lock;
+static std::vector<TraceRing *> *const trace_rings =
+    new std::vector<TraceRing *>();
+static std::vector<TraceRing *> *const trace_idle_rings =
+    new std::vector<TraceRing *>();
+
+
+static TraceRing *
+trace_take_ring ()
+{
+    std::lock_guard<std::mutex> guard(trace_rings_lock);
+    if (! trace_idle_rings->empty()) {
+        TraceRing *ring = trace_idle_rings->back();
+        trace_idle_rings->pop_back();
+        return ring;
+    }
+    TraceRing *ring = new TraceRing();
+    ring->events.reserve(TRACE_RING_EVENTS);
+    ring->next = 0;
+    ring->tid = trace_rings->size() + 1;
+    trace_rings->push_back(ring);
+    return ring;
+}
+
+
+struct TraceRingOwner
+{
+    TraceRing *ring;
+
+    ~TraceRingOwner ()
+    {
+        if (ring) {
+            std::lock_guard<std::mutex> guard(trace_rings_lock);
+            trace_idle_rings->push_back(ring);
+        }
+    }
+};
+
+static thread_local TraceRingOwner trace_ring_owner = {NULL};
+
+
+int64_t
+trace_now ()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+
+void
+trace_record (const char *name, int64_t start, int64_t end)
+{
+    TraceRing *ring = trace_ring_owner.ring;
+    if (! ring) {
+        ring = trace_ring_owner.ring = trace_take_ring();
+    }
+    const TraceEvent event = {name, start, end};
+    std::lock_guard<std::mutex> guard(ring->lock);
+    if (ring->events.size() < TRACE_RING_EVENTS) {
+        ring->events.push_back(event);
+    }
+    else {
+        ring->events[ring->next] = event;
+        ring->next = (ring->next + 1) % TRACE_RING_EVENTS;
+    }
+}
+
+
+void
+trace_set_enabled (bool enabled)
+{
+    if (enabled && trace_epoch.load() == 0) {
+        trace_epoch.store(trace_now());
+    }
+    trace_enabled_flag.store(enabled);
+}
+
+
+bool
+trace_is_enabled ()
+{
+    return trace_enabled_flag.load();
+}
+
+
+void
+trace_clear ()
+{
+    std::lock_guard<std::mutex> guard(trace_rings_lock);
+    trace_epoch.store(trace_now());
+    for (size_t i = 0; i < trace_rings->size(); ++i) {
+        TraceRing *ring = (*trace_rings)[i];
+        std::lock_guard<std::mutex> ring_guard(ring->lock);
+        ring->events.clear();
+        ring->next = 0;
+    }
+}
+
+
+PyObject *
+trace_dump_json ()
+{
+    std::string json("{\"traceEvents\":[");
+    const int64_t epoch = trace_epoch.load();
+    bool first = true;
+    char buf[256];
+    {
+        std::lock_guard<std::mutex> guard(trace_rings_lock);
+        for (size_t i = 0; i < trace_rings->size(); ++i) {
+            TraceRing *ring = (*trace_rings)[i];
+            std::lock_guard<std::mutex> ring_guard(ring->lock);
+            const size_t n = ring->events.size();
+            for (size_t j = 0; j < n; ++j) {
+                const TraceEvent &e = ring->events[(ring->next + j) % n];
+                if (e.start < epoch) {
+                    continue;   // began before the last clear
+                }
+                snprintf(buf, sizeof(buf),
+                         "%s\n{\"name\":\"%s\",\"cat\":\"mypaint\","
+                         "\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f}",
+                         first ? "" : ",", e.name, ring->tid,
+                         (e.start - epoch) / 1000.0,
+                         (e.end - e.start) / 1000.0);
+                json += buf;
+                first = false;
+            }
+        }
+    }
+    json += "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return PyBytes_FromStringAndSize(json.data(), json.size());
+}
@@ -0,0 +1,85 @@
+/* This file is part of MyPaint.
+ * Copyright (C) 2026 by the MyPaint Development Team.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TRACING_HPP
+#define TRACING_HPP
+
+#include <Python.h>
+
+#ifndef SWIG
+#include <stdint.h>
+
+#include <atomic>
+#endif
+
+
+// Opt-in tracing of the native code's hot paths.
+//
+// While tracing is enabled, each TRACE_SCOPE() records when it was entered
+// and left into a ring buffer belonging to the running thread, keeping the
+// most recent events of each thread. The events can be dumped as Chrome
+// trace JSON, for chrome://tracing or the Perfetto UI. While disabled, a
+// scope costs a single relaxed atomic load.
+
+// Starts or stops recording events
+void trace_set_enabled (bool enabled);
+bool trace_is_enabled ();
+
+// Forgets all recorded events
+void trace_clear ();
+
+// The recorded events, as Chrome trace JSON in a bytes object. Timestamps
+// are in microseconds since the recording was last cleared.
+PyObject *trace_dump_json ();
+
+
+#ifndef SWIG
+
+extern std::atomic<bool> trace_enabled_flag;
+
+int64_t trace_now ();
+void trace_record (const char *name, int64_t start, int64_t end);
+
+
+// Records its lifetime as an event, if tracing was on when it was made.
+// The name must be a string literal without quotes or backslashes.
+
+class TraceScope
+{
+  public:
+    explicit TraceScope (const char *name)
+        : name(trace_enabled_flag.load(std::memory_order_relaxed)
+               ? name : NULL),
+          start(this->name ? trace_now() : 0)
+    { }
+
+    ~TraceScope ()
+    {
+        if (name) {
+            trace_record(name, start, trace_now());
+        }
+    }
+
+  private:
+    TraceScope (const TraceScope &);
+    TraceScope &operator= (const TraceScope &);
+
+    const char *const name;
+    const int64_t start;
+};
+
+#define TRACE_SCOPE_CONCAT2(a, b) a##b
+#define TRACE_SCOPE_CONCAT(a, b) TRACE_SCOPE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) \
+    TraceScope TRACE_SCOPE_CONCAT(trace_scope_, __LINE__)(name)
+
+#endif /* #ifndef SWIG */
+
+
+#endif // TRACING_HPP
@@ -829,6 +829,7 @@ def get_ext_modules():
             "pygobject-3.0",
             "glib-2.0",
             "libpng",
+            "zlib",
             "lcms2",
             "gtk+-3.0",
             "mypaint-brushes-2.0",
@@ -850,6 +851,13 @@ def get_ext_modules():
             'lib/mypaintlib.i',
             'lib/gdkpixbuf2numpy.cpp',
             'lib/pixops.cpp',
+            'lib/compositing_simd.cpp',
+            'lib/fastapprox_batch.cpp',
+            'lib/tilerequestcache.cpp',
+            'lib/symmetryprefetch.cpp',
+            'lib/strokeindex.cpp',
+            'lib/tilepool.cpp',
+            'lib/tracing.cpp',
             'lib/fastpng.cpp',
             'lib/brushsettings.cpp',
             'lib/fill/fill_common.cpp',
@@ -859,6 +867,9 @@ def get_ext_modules():
             'lib/fill/gap_detection.cpp',
             'lib/fill/blur.cpp',
             'lib/fill/morphology.cpp',
+            'lib/fill/morph_blur.cpp',
+            'lib/fill/parallel_fill.cpp',
+            'lib/fill/tile_occupancy.cpp',
         ],
         swig_opts=mypaintlib_swig_opts,
         language='c++',
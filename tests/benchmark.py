@@ -0,0 +1,433 @@
+#!/usr/bin/env python
+# This file is part of MyPaint.
+# Copyright (C) 2026 by the MyPaint Development Team.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+"""Repeatable benchmarks of the native painting and imaging code
+
+Each benchmark replays one of the bundled fixtures through a single
+subsystem of mypaintlib (the brush engine, tile compositing, flood
+fill, morphology, PNG export), and reports its throughput together
+with the median and 99th percentile latency of its unit of work.
+Random inputs are drawn from fixed seeds, so runs of the same build
+on the same machine can be compared across releases.
+
+Run from the top of the source tree after building:
+
+    python -m tests.benchmark > before.json
+    python -m tests.benchmark -b fill -b png_write -r 10
+
+The results are written as JSON, one object per benchmark.
+
+"""
+
+# Imports:
+
+from __future__ import division, print_function
+from os.path import join
+import argparse
+import json
+import os
+import shutil
+import sys
+import tempfile
+import time
+
+import numpy as np
+
+from . import paths
+from lib import mypaintlib
+from lib import tiledsurface
+from lib import brush
+from lib import document
+from lib import floodfill
+from lib import fill_common
+import lib.morphology
+
+
+N = mypaintlib.TILE_SIZE
+MPIX = 1000.0 * 1000.0
+
+try:
+    _clock = time.perf_counter
+except AttributeError:
+    _clock = time.time
+
+all_benchmarks = []
+
+
+# Helpers:
+
+def benchmark(f):
+    "decorator for benchmark functions, run in definition order"
+    all_benchmarks.append(f)
+    return f
+
+
+class Timer (object):
+    """Collects the latencies of the units of work of one benchmark"""
+
+    def __init__(self):
+        self.latencies = []
+
+    def __enter__(self):
+        self._t0 = _clock()
+        return self
+
+    def __exit__(self, *exc_info):
+        self.latencies.append(_clock() - self._t0)
+
+    @property
+    def total(self):
+        return sum(self.latencies)
+
+    def report(self, unit, **counts):
+        """Summarize as a JSON-serializable dict
+
+        :param str unit: what one latency sample measures
+        :param counts: totals of work done, keyed by the name of the
+            rate to derive from them, e.g. dabs_per_s=len(events)
+
+        """
+        total = self.total
+        lat = np.array(self.latencies) * 1000.0
+        result = {
+            "unit": unit,
+            "samples": len(self.latencies),
+            "total_s": total,
+            "p50_ms": float(np.percentile(lat, 50)) if len(lat) else None,
+            "p99_ms": float(np.percentile(lat, 99)) if len(lat) else None,
+        }
+        for name, count in counts.items():
+            result[name] = (count / total) if total > 0 else None
+        return result
+
+
+def _load_events():
+    return np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+
+
+def _load_brush(name):
+    myb_path = join(paths.TESTS_DIR, 'brushes', 'v2', name + '.myb')
+    with open(myb_path, "r") as fp:
+        bi = brush.BrushInfo(fp.read())
+    bi.set_color_rgb((0.0, 0.9, 1.0))
+    return bi
+
+
+def _random_tiles(rng, count):
+    """Premultiplied fix15 tiles with random alpha"""
+    tiles = np.zeros((count, N, N, 4), 'uint16')
+    alpha = rng.randint(0, (1 << 15) + 1, (count, N, N)).astype('uint32')
+    tiles[..., 3] = alpha
+    for i in range(3):
+        color = rng.randint(0, (1 << 15) + 1, (count, N, N))
+        tiles[..., i] = color * alpha >> 15
+    return tiles
+
+
+_fill_doc = None
+
+
+def _fill_layers():
+    """Outline layers of the fill fixture: (name, layer) pairs"""
+    global _fill_doc
+    if _fill_doc is None:
+        _fill_doc = document.Document()
+        _fill_doc.load(join(paths.TESTS_DIR, 'fill_outlines.ora'))
+    root = _fill_doc.layer_stack
+    return root, [
+        ("closed_small", root.deepget((0, 0))),
+        ("closed_large", root.deepget((0, 2))),
+        ("heavy", root.deepget((2, 0))),
+    ]
+
+
+def _fill(root, layer, handler):
+    """Run only the fill step for a layer, from the center of its bbox"""
+    bbox = fill_common.TileBoundingBox(root.get_bbox())
+    x, y, w, h = layer.get_bbox()
+    x, y = x + w // 2, y + h // 2
+    src = layer._surface
+    seed_lists = floodfill.seeds_by_tile({(x, y)})
+    init = floodfill.starting_coordinates(x, y)
+    r, g, b, a = floodfill.get_target_color(src, *init)
+    filler = mypaintlib.Filler(r, g, b, a, 0.2)
+    return floodfill.parallel_scanline_fill(
+        handler, src, seed_lists, bbox, filler,
+    )
+
+
+# Benchmarks:
+
+@benchmark
+def direct_paint(opts, rng):
+    """Dabs drawn straight onto a tiled surface, 1x scale"""
+    events = _load_events()
+    timer = Timer()
+    dabs = tiles = 0
+    for _ in range(opts.repeat):
+        s = tiledsurface.Surface()
+        s.begin_atomic()
+        for t, x, y, pressure in events:
+            with timer:
+                r = g = b = 0.5 * (1.0 + np.sin(t))
+                s.draw_dab(x, y, 12, r * 0.8, g, b, pressure, 0.6)
+        with timer:
+            s.end_atomic()
+        dabs += len(events)
+        tiles += len(s.tiledict)
+    return timer.report("dab", dabs_per_s=dabs, tiles_per_s=tiles)
+
+
+def _brush_surface(opts, brush_name, batched):
+    events = _load_events()
+    bi = _load_brush(brush_name)
+    dtimes = np.diff(events[:, 0], prepend=events[0, 0])
+    batch = np.zeros((len(events), 9))
+    batch[:, 0:2] = events[:, 1:3] * 4
+    batch[:, 2] = events[:, 3]
+    batch[:, 5] = dtimes
+    batch[:, 6] = 1.0
+    timer = Timer()
+    tiles = 0
+    for _ in range(opts.repeat):
+        s = tiledsurface.Surface()
+        b = brush.Brush(bi)
+        if batched:
+            with timer:
+                s.begin_atomic()
+                b.stroke_to_many(s.backend, batch)
+                s.end_atomic()
+        else:
+            for row in batch:
+                x, y, pressure, xtilt, ytilt, dtime = row[:6]
+                with timer:
+                    s.begin_atomic()
+                    b.stroke_to(s.backend, x, y, pressure, xtilt, ytilt,
+                                dtime, 1.0, 0.0, 0.0)
+                    s.end_atomic()
+        tiles += len(s.tiledict)
+    return timer, len(events) * opts.repeat, tiles
+
+
+@benchmark
+def brush_stroke(opts, rng):
+    """Recorded stroke at 4x through the charcoal brush, per event"""
+    timer, events, tiles = _brush_surface(opts, "charcoal", False)
+    return timer.report("event", events_per_s=events, tiles_per_s=tiles)
+
+
+@benchmark
+def brush_stroke_many(opts, rng):
+    """Recorded stroke at 4x through the charcoal brush, in one batch"""
+    timer, events, tiles = _brush_surface(opts, "charcoal", True)
+    return timer.report("stroke", events_per_s=events, tiles_per_s=tiles)
+
+
+@benchmark
+def tile_combine(opts, rng):
+    """Every combine mode, one tile_combine_many() per mode"""
+    srcs = _random_tiles(rng, 64)
+    dsts = _random_tiles(rng, 64)
+    timer = Timer()
+    tiles = 0
+    for _ in range(opts.repeat):
+        for mode in range(mypaintlib.NumCombineModes):
+            work = dsts.copy()
+            jobs = [
+                (mode, src, dst, True, 0.8)
+                for src, dst in zip(srcs, work)
+            ]
+            with timer:
+                mypaintlib.tile_combine_many(jobs)
+            tiles += len(jobs)
+    return timer.report(
+        "64 tiles",
+        tiles_per_s=tiles,
+        mpix_per_s=tiles * N * N / MPIX,
+    )
+
+
+@benchmark
+def fill(opts, rng):
+    """Scanline fills of the closed outlines of the fill fixture"""
+    root, layers = _fill_layers()
+    handler = floodfill.FillHandler()
+    timer = Timer()
+    tiles = 0
+    for _ in range(opts.repeat):
+        for name, layer in layers:
+            with timer:
+                filled = _fill(root, layer, handler)
+            tiles += len(filled)
+    return timer.report(
+        "fill",
+        tiles_per_s=tiles,
+        mpix_per_s=tiles * N * N / MPIX,
+    )
+
+
+def _morphology(opts, func, *args):
+    root, layers = _fill_layers()
+    handler = floodfill.FillHandler()
+    inputs = [_fill(root, layer, handler) for name, layer in layers]
+    timer = Timer()
+    tiles = 0
+    for _ in range(opts.repeat):
+        for filled in inputs:
+            filled = dict(filled)
+            with timer:
+                result = func(handler, args[0], filled, *args[1:])
+            tiles += len(result)
+    return timer.report(
+        "operation",
+        tiles_per_s=tiles,
+        mpix_per_s=tiles * N * N / MPIX,
+    )
+
+
+@benchmark
+def morph_dilate(opts, rng):
+    """Grow the fills of the fill fixture by 20px"""
+    return _morphology(opts, lib.morphology.morph, 20)
+
+
+@benchmark
+def morph_erode(opts, rng):
+    """Shrink the fills of the fill fixture by 20px"""
+    return _morphology(opts, lib.morphology.morph, -20)
+
+
+@benchmark
+def blur(opts, rng):
+    """Feather the fills of the fill fixture by 10px"""
+    return _morphology(opts, lib.morphology.blur, 10, False)
+
+
+@benchmark
+def blur_fast(opts, rng):
+    """Feather the fills of the fill fixture by 10px, box approximated"""
+    return _morphology(opts, lib.morphology.blur, 10, True)
+
+
+def _png_write(opts, rng, threads):
+    w, h = 4 * 1024, 2 * 1024
+    img = np.zeros((h, w, 4), 'uint8')
+    gradient = np.linspace(0, 255, w).astype('uint8')
+    img[..., 0] = gradient
+    img[..., 1] = gradient[::-1]
+    img[..., 2] = rng.randint(0, 32, (h, w))
+    img[..., 3] = 255
+    filename = join(opts.temp_dir, "benchmark.png")
+    timer = Timer()
+    for _ in range(opts.repeat):
+        with open(filename, "wb") as fp:
+            with timer:
+                writer = mypaintlib.ProgressivePNGWriter(
+                    fp, w, h, True, True, 2,
+                    mypaintlib.ProgressivePNGWriter.FILTER_SUB, threads,
+                )
+                for y in range(0, h, N):
+                    writer.write(img[y:y+N])
+                writer.close()
+    return timer.report("image", mpix_per_s=opts.repeat * w * h / MPIX)
+
+
+@benchmark
+def png_write(opts, rng):
+    """8 MPix RGBA PNG export, single-threaded"""
+    return _png_write(opts, rng, 1)
+
+
+@benchmark
+def png_write_parallel(opts, rng):
+    """8 MPix RGBA PNG export, compressed in bands on all cores"""
+    return _png_write(opts, rng, 0)
+
+
+@benchmark
+def load_ora(opts, rng):
+    """Load the big OpenRaster fixture"""
+    timer = Timer()
+    tiles = 0
+    for _ in range(opts.repeat):
+        doc = document.Document()
+        with timer:
+            doc.load(join(paths.TESTS_DIR, 'bigimage.ora'))
+        for layer in doc.layer_stack.deepiter():
+            surface = getattr(layer, "_surface", None)
+            if surface is not None:
+                tiles += len(surface.get_tiles())
+        doc.cleanup()
+    return timer.report(
+        "document",
+        tiles_per_s=tiles,
+        mpix_per_s=tiles * N * N / MPIX,
+    )
+
+
+# Main:
+
+def main(argv):
+    names = [f.__name__ for f in all_benchmarks]
+    parser = argparse.ArgumentParser(
+        description="Benchmark the native MyPaint code, reporting JSON.",
+    )
+    parser.add_argument(
+        "-b", "--benchmark", action="append", choices=names,
+        help="benchmark to run (repeatable; default: all)",
+    )
+    parser.add_argument(
+        "-r", "--repeat", type=int, default=3,
+        help="number of times each benchmark replays its fixture",
+    )
+    parser.add_argument(
+        "-s", "--seed", type=int, default=1,
+        help="seed for the random inputs",
+    )
+    parser.add_argument(
+        "-o", "--output",
+        help="write the JSON here instead of to stdout",
+    )
+    opts = parser.parse_args(argv)
+    selected = opts.benchmark or names
+
+    results = {}
+    opts.temp_dir = tempfile.mkdtemp()
+    old_cwd = os.getcwd()
+    os.chdir(opts.temp_dir)
+    try:
+        for func in all_benchmarks:
+            if func.__name__ not in selected:
+                continue
+            print("running %s..." % (func.__name__,), file=sys.stderr)
+            rng = np.random.RandomState(opts.seed)
+            result = func(opts, rng)
+            result["description"] = func.__doc__
+            results[func.__name__] = result
+    finally:
+        os.chdir(old_cwd)
+        shutil.rmtree(opts.temp_dir, ignore_errors=True)
+
+    report = {
+        "tile_size": N,
+        "repeat": opts.repeat,
+        "seed": opts.seed,
+        "simd_variant": mypaintlib.tile_combine_simd_variant(),
+        "benchmarks": results,
+    }
+    text = json.dumps(report, indent=2, sort_keys=True)
+    if opts.output:
+        with open(opts.output, "w") as fp:
+            fp.write(text + "\n")
+    else:
+        print(text)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
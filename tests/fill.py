@@ -12,12 +12,15 @@ import contextlib
 import copy
 from itertools import repeat, chain, product
 
+import numpy as np
+
 from . import paths
 from lib import mypaintlib
 from lib import document
 from lib import floodfill
 from lib import fill_common
 from lib import morphology
+from lib import tiledsurface
 
 N = mypaintlib.TILE_SIZE
 
@@ -122,7 +125,7 @@ class FillTestsBase(unittest.TestCase):
     def fill(
             self, src, dst, bbox=None, init_xy=None,
             tol=0.2, offset=0, feather=0, gc=None,
-            framed=False
+            framed=False, fast_feather=False
     ):
         """
         :param src: Outline goes here
@@ -138,6 +141,8 @@ class FillTestsBase(unittest.TestCase):
         :type gc: lib.floodfill.GapClosingOptions
         :param framed: To be or not to be (framed)
         :type framed: bool
+        :param fast_feather: Approximate the feather blur
+        :type fast_feather: bool
         """
         if bbox:
             x, y = self.center(bbox)
@@ -154,10 +159,11 @@ class FillTestsBase(unittest.TestCase):
         args = floodfill.FloodFillArguments(
             (x, y), seeds, col, tol, offset,
             feather, gc, mode, lock_alpha,
-            opacity, framed, bbox
+            opacity, framed, bbox, fast_feather
         )
         handle = src.flood_fill(args, dst)
         handle.wait()
+        return handle
 
     @classmethod
     def setUpClass(cls):
@@ -323,6 +329,273 @@ class CorrectnessTests(FillTestsBase):
                         )
                     )
 
+    def test_filler_edge_masks(self):
+        full_edge = (1 << N) - 1
+        src = np.zeros((N, N, 4), 'uint16')
+        dst = np.zeros((N, N), 'uint16')
+        # Transparent target color, every pixel is fillable
+        filler = mypaintlib.Filler(0, 0, 0, 0, 0.2)
+        seeds = (1 << 3) | (1 << 40)
+        overflows = filler.fill(
+            src, dst, seeds, mypaintlib.edges.west, 0, 0, N-1, N-1
+        )
+        self.assertTrue((dst == 1 << 15).all())
+        self.assertEqual(
+            list(overflows),
+            [full_edge, full_edge, full_edge, full_edge & ~seeds],
+            msg="Overflows should cover the edges, except for the seeds"
+        )
+
+    def test_tile_occupancy(self):
+        # Strands, dilation and bounds match the tile-by-tile definitions,
+        # across the 64-row words of the bitmap and for negative coordinates
+        full = fill_common._FULL_TILE
+        empty = fill_common._EMPTY_TILE
+        other = fill_common.new_full_tile(1 << 14)
+        rng = np.random.RandomState(7)
+        tiles = {}
+        for x, y in product(range(-5, 4), range(-70, 80)):
+            r = rng.randint(6)
+            if r < 3 or (x == 0 and r < 5):
+                tiles[(x, y)] = full if r else other
+
+        def neighbours(x, y):
+            steps = product((-1, 0, 1), repeat=2)
+            return [(x + dx, y + dy) for dx, dy in steps if dx or dy]
+
+        expected_added = set(
+            c for pos in tiles for c in neighbours(*pos) if c not in tiles
+        )
+        for dilating in (False, True):
+            occupancy = mypaintlib.TileOccupancy(tiles)
+            self.assertEqual(occupancy.size(), len(tiles))
+            xs, ys = zip(*tiles)
+            self.assertEqual(
+                occupancy.bbox(), (min(xs), min(ys), max(xs), max(ys))
+            )
+            final = {}
+            strands = occupancy.strands(dilating, final)
+            expected_final = set(
+                pos for pos, t in tiles.items() if t is full and (
+                    dilating or all(tiles.get(c) is full
+                                    for c in neighbours(*pos))
+                )
+            )
+            self.assertEqual(set(final), expected_final)
+            self.assertTrue(all(t is full for t in final.values()))
+            coords = [c for s in strands for c in s]
+            self.assertEqual(coords, sorted(set(tiles) - expected_final))
+            for s in strands:
+                for (x0, y0), (x1, y1) in zip(s, s[1:]):
+                    self.assertEqual((x1, y1), (x0, y0 + 1))
+            for a, b in zip(strands, strands[1:]):
+                self.assertNotEqual(
+                    b[0], (a[-1][0], a[-1][1] + 1),
+                    msg="Contiguous tiles should share a strand",
+                )
+
+        dilated = dict(tiles)
+        occupancy = mypaintlib.TileOccupancy(dilated)
+        occupancy.complement_adjacent(dilated)
+        self.assertEqual(set(dilated) - set(tiles), expected_added)
+        self.assertTrue(all(dilated[c] is empty for c in expected_added))
+        self.assertEqual(occupancy.size(), len(dilated))
+        self.assertIsNone(mypaintlib.TileOccupancy({}).bbox())
+
+    def test_parallel_scanline_fill(self):
+        floodfill._EMPTY_RGBA = tiledsurface.transparent_tile.rgba
+        for src in (self.minimal, self.heavy) + self.small + self.large:
+            surf = src._surface
+            bbox = self.root.get_bbox()
+            x, y = self.center(src.get_bbox())
+            tiles_bbox = fill_common.TileBoundingBox(bbox)
+            target = floodfill.get_target_color(
+                surf, *floodfill.starting_coordinates(x, y)
+            )
+            seed_lists = floodfill.seeds_by_tile({(x, y)})
+            results = []
+            for fill_func in (floodfill.scanline_fill,
+                              floodfill.parallel_scanline_fill):
+                filler = mypaintlib.Filler(*(target + (0.2,)))
+                handler = floodfill.FillHandler()
+                results.append(fill_func(
+                    handler, surf, seed_lists, tiles_bbox, filler
+                ))
+            serial, parallel = results
+            self.assertEqual(
+                set(serial), set(parallel),
+                msg="Parallel fill should fill the same tiles!"
+                " layer={layer}".format(layer=src.name)
+            )
+            for tc in serial:
+                self.assertTrue(
+                    (serial[tc] == parallel[tc]).all(),
+                    msg="Parallel fill results should be identical!"
+                    " layer={layer} tile={tile}".format(
+                        layer=src.name, tile=tc
+                    )
+                )
+
+    def test_coarse_fill_matches_tile_by_tile(self):
+        # Blocks of shared constant tiles are filled from the mipmaps
+        # without fetching their tiles, with the same result
+        floodfill._EMPTY_RGBA = tiledsurface.transparent_tile.rgba
+        white = (1 << 15,) * 4
+        surf = tiledsurface.Surface()
+        for tx, ty in product(range(24), range(24)):
+            surf.set_constant_tile(tx, ty, white)
+        self.assertIs(
+            surf.constant_mipmap_tile(3, 1, 2),
+            tiledsurface.constant_tile(white).rgba,
+        )
+        # A wall with a gap, and some noise
+        for ty in range(24):
+            with surf.tile_request(13, ty, readonly=False) as rgba:
+                if ty != 5:
+                    rgba[:, 30, :3] = 0
+        for tx, ty in ((2, 9), (19, 20)):
+            with surf.tile_request(tx, ty, readonly=False) as rgba:
+                rgba[...] = np.random.randint(0, 1 << 15, (N, N, 4))
+                rgba[..., :3] = np.minimum(rgba[..., :3], rgba[..., 3:])
+        self.assertIsNone(surf.constant_mipmap_tile(2, 3, 1))
+        self.assertIsNotNone(surf.constant_mipmap_tile(2, 2, 1))
+
+        class CountingSource(object):
+            def __init__(self, surf):
+                self.surf = surf
+                self.requests = 0
+
+            def tile_request(self, tx, ty, readonly):
+                self.requests += 1
+                return self.surf.tile_request(tx, ty, readonly)
+
+            def constant_mipmap_tile(self, level, tx, ty):
+                return self.surf.constant_mipmap_tile(level, tx, ty)
+
+        seeds = floodfill.seeds_by_tile({(N * 3 + 7, N * 17 + 2)})
+        for rect in ((0, 0, N * 24, N * 24), (5, 7, N * 24 - 20, N * 24)):
+            tiles_bbox = fill_common.TileBoundingBox(rect)
+            results = []
+            for coarse in (False, True):
+                src = CountingSource(surf)
+                filler = mypaintlib.Filler(*(white + (0.2,)))
+                filled = floodfill.parallel_scanline_fill(
+                    floodfill.FillHandler(), src, seeds, tiles_bbox, filler,
+                    coarse=coarse,
+                )
+                results.append((filled, src.requests))
+            (plain, plain_requests), (coarse, coarse_requests) = results
+            self.assertEqual(set(plain), set(coarse))
+            self.assertIn((20, 3), coarse, msg="fill should leak")
+            for tc in plain:
+                self.assertTrue(
+                    (plain[tc] == coarse[tc]).all(),
+                    msg="Coarse fill differs at tile {}".format(tc),
+                )
+            self.assertLess(coarse_requests, plain_requests // 2)
+
+    def test_morph_blur_matches_staged(self):
+        floodfill._EMPTY_RGBA = tiledsurface.transparent_tile.rgba
+        for src in self.small:
+            surf = src._surface
+            x, y = self.center(src.get_bbox())
+            tiles_bbox = fill_common.TileBoundingBox(self.root.get_bbox())
+            target = floodfill.get_target_color(
+                surf, *floodfill.starting_coordinates(x, y)
+            )
+            filler = mypaintlib.Filler(*(target + (0.2,)))
+            filled = floodfill.parallel_scanline_fill(
+                floodfill.FillHandler(), surf,
+                floodfill.seeds_by_tile({(x, y)}), tiles_bbox, filler
+            )
+            for offset, feather, fast in product((-9, 21), (3, 40), (0, 1)):
+                handler = floodfill.FillHandler()
+                staged = morphology.blur(
+                    handler, feather,
+                    morphology.morph(handler, offset, dict(filled)), fast
+                )
+                tiles = dict(filled)
+                fused = morphology.morph_blur(
+                    handler, offset, feather, tiles, fast
+                )
+                self.assertEqual(
+                    tiles, {}, msg="The input tiles should be used up"
+                )
+                self.assertEqual(
+                    set(staged), set(fused),
+                    msg="Fused morph+blur should produce the same tiles!"
+                    " layer={layer}".format(layer=src.name)
+                )
+                for tc in staged:
+                    self.assertTrue(
+                        (staged[tc] == fused[tc]).all(),
+                        msg="Fused morph+blur results should be identical!"
+                        " layer={layer} tile={tile} args={args}".format(
+                            layer=src.name, tile=tc,
+                            args=(offset, feather, fast)
+                        )
+                    )
+
+    @fill_test
+    def test_cached_flood(self):
+        # Refilling an unchanged source with other settings reuses the
+        # flooded tiles, with the same results as flooding again
+        for src in self.small:
+            with self.fill_layers() as (f1, f2):
+                floodfill._flood_cache.clear()
+                self.fill(src, f1)
+                self.assertIsNotNone(floodfill._flood_cache._key)
+                self.fill(src, f2, offset=9, feather=5)
+                f1.clear()
+                floodfill._flood_cache.clear()
+                self.fill(src, f1, offset=9, feather=5)
+                self.assertTrue(
+                    self.layers_identical(f1, f2),
+                    msg="Cached flood results should be identical!"
+                    " layer={layer}".format(layer=src.name)
+                )
+        floodfill._flood_cache.clear()
+
+    @fill_test
+    def test_stage_stats(self):
+        # Each finished stage leaves its figures with the handler
+        src = self.small[0]
+        with self.fill_layers() as (f1, _):
+            floodfill._flood_cache.clear()
+            handler = self.fill(src, f1, offset=9, feather=5)
+            stages = [s["stage"] for s in handler.stats]
+            self.assertEqual(stages, [
+                floodfill.FillHandler.FILL,
+                floodfill.FillHandler.MORPH,
+                floodfill.FillHandler.COMPOSITE,
+            ])
+            for stats in handler.stats:
+                self.assertGreaterEqual(stats["seconds"], 0)
+                self.assertGreater(stats["processed"], 0)
+                self.assertLessEqual(stats["skipped"], stats["processed"])
+                self.assertGreaterEqual(stats["imbalance"], 1.0)
+
+    @fill_test
+    def test_shared_full_tiles(self):
+        # Fully filled tiles share one read-only tile,
+        # which is copied when written to
+        with self.fill_layers() as (f1, _):
+            self.fill(self.closed_large_s, f1)
+            surf = f1._surface
+            shared = [
+                (pos, t) for pos, t in surf.get_tiles().items() if t.constant
+            ]
+            self.assertGreater(len(shared), 1)
+            (pos, tile), others = shared[0], shared[1:]
+            self.assertTrue(all(t is tile for _, t in others))
+            color = tuple(tile.rgba[0, 0])
+            with surf.tile_request(*pos, readonly=False) as rgba:
+                self.assertIsNot(rgba, tile.rgba)
+                self.assertEqual(tuple(rgba[N-1, N-1]), color)
+                rgba[...] = 0
+            self.assertEqual(tuple(tile.rgba[N-1, N-1]), color)
+            self.assertTrue(all(t is tile for _, t in others))
+
     @fill_test
     def test_erosion(self):
         # The SmallComplex outline has thin protrusions and internal
@@ -361,6 +634,31 @@ class CorrectnessTests(FillTestsBase):
                         )
                     )
 
+    @fill_test
+    def test_fast_feather(self):
+        # The box blur approximation should stay close to the gaussian
+        feather = 40
+        max_diff = 0.03 * (1 << 15)
+        for src in self.small:
+            with self.fill_layers() as (f1, f2):
+                self.fill(src, f1, feather=feather)
+                self.fill(src, f2, feather=feather, fast_feather=True)
+                s1, s2 = f1._surface, f2._surface
+                tiles = set(s1.get_tiles()).union(set(s2.get_tiles()))
+                for tx, ty in tiles:
+                    with s1.tile_request(tx, ty, readonly=True) as t1:
+                        with s2.tile_request(tx, ty, readonly=True) as t2:
+                            diff = abs(
+                                t1[..., 3].astype(int) - t2[..., 3]
+                            ).max()
+                            self.assertLessEqual(
+                                diff, max_diff,
+                                msg="Fast feather differs too much! "
+                                "src={layer} tile={tile}".format(
+                                    layer=src.name, tile=(tx, ty)
+                                )
+                            )
+
 
 # Performance tests, not run as part of the standard test suite
 
@@ -477,6 +775,23 @@ class PerformanceTests(FillTestsBase):
             avg_time = 1000 * (time() - t0) / repeats
             print(src.name, "\t", repeats, "\t\t%0.2fms" % avg_time)
 
+    @fill_test
+    def test_gap_detection_only(self):
+        """Test performance of gap detection, per gap size"""
+        gap_sizes = (7, 20, 40)
+        repeats = 10
+        print("\n== Testing gap detection performance ==", file=sys.stderr)
+        print("<layer>\t\t<gap>\t<avg time>", file=sys.stderr)
+        for src, gap_size in product(self.gap_layers, gap_sizes):
+            options = floodfill.GapClosingOptions(gap_size, False)
+            t0 = time()
+            self.fill_perf(src, repeats, gap_closing_options=options)
+            avg_time = 1000 * (time() - t0) / repeats
+            print(
+                src.name, "\t", gap_size,
+                "\t\t%0.2fms" % avg_time, file=sys.stderr
+            )
+
     @unittest.skipUnless(
         os.getenv("MORPH_FULL"),
         "This is a fairly heavy test, run separately"
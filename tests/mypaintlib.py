@@ -11,6 +11,11 @@ import sys
 import os
 import tempfile
 import shutil
+import weakref
+import contextlib
+import json
+import struct
+import zlib
 
 import numpy as np
 
@@ -19,6 +24,8 @@ from lib import mypaintlib
 from lib import tiledsurface
 from lib import brush
 from lib import document
+from lib import strokemap
+from lib import layer
 
 
 N = mypaintlib.TILE_SIZE
@@ -45,6 +52,491 @@ class TileConversions (unittest.TestCase):
         mypaintlib.tile_convert_rgba16_to_rgba8(src, dst, 2.2)
         self.assertTrue((dst[:, :, 3] == 255).all(), msg="Not fully opaque")
 
+    def test_fix15_to_uint8_eotf(self):
+        """Display conversion follows the EOTF, including semi-transparency"""
+        src = np.zeros((N, N, 4), 'uint16')
+        src[:, :, 3] = np.random.randint(1, (1 << 15) + 1, (N, N))
+        for i in range(3):
+            src[:, :, i] = np.random.randint(0, 1 << 15, (N, N)) \
+                * src[:, :, 3].astype('uint32') >> 15
+        for eotf in (2.2, 1.8):
+            straight = src[:, :, :3] / src[:, :, 3:].astype('float64')
+            rgbu = src[:, :, :3] / float(1 << 15)
+            for convert, colors in [
+                    (mypaintlib.tile_convert_rgba16_to_rgba8, straight),
+                    (mypaintlib.tile_convert_rgbu16_to_rgbu8, rgbu),
+            ]:
+                dst = np.zeros((N, N, 4), 'uint8')
+                convert(src, dst, eotf)
+                err = np.abs(dst[:, :, :3] - colors ** (1.0 / eotf) * 255)
+                self.assertLess(err.max(), 2.0, msg="EOTF %r" % (eotf,))
+
+    def _random_flat_pair(self):
+        """Random premultiplied tile, and a random flat background"""
+        top = np.zeros((N, N, 4), 'uint16')
+        top[:, :, 3] = np.random.randint(0, (1 << 15) + 1, (N, N))
+        top[::5, :, 3] = 1 << 15
+        top[::7, :, 3] = 0
+        for i in range(3):
+            top[:, :, i] = np.random.randint(0, (1 << 15) + 1, (N, N)) \
+                * top[:, :, 3].astype('uint32') >> 15
+        bg = np.random.randint(0, (1 << 15) + 1, (N, N, 4)).astype('uint16')
+        bg[::3, :, :3] = 0
+        bg[1::3, ::2, :3] = 1 << 15
+        return top, bg
+
+    def test_rgba2flat_flat2rgba(self):
+        """Flattening is exact, and making it translucent undoes it"""
+        top, bg = self._random_flat_pair()
+        flat = top.copy()
+        mypaintlib.tile_rgba2flat(flat, bg)
+        one_minus_alpha = (1 << 15) - top[:, :, 3:].astype('uint32')
+        expected = top[:, :, :3] + (one_minus_alpha * bg[:, :, :3] >> 15)
+        self.assertTrue((flat[:, :, :3] == expected).all())
+        self.assertTrue((flat[:, :, 3] == top[:, :, 3]).all())
+
+        layer = flat.copy()
+        layer[:, :, 3] = 0
+        mypaintlib.tile_flat2rgba(layer, bg)
+        self.assertTrue((layer[:, :, :3] <= layer[:, :, 3:]).all())
+        mypaintlib.tile_rgba2flat(layer, bg)
+        err = np.abs(layer[:, :, :3].astype('int32') - flat[:, :, :3])
+        self.assertLessEqual(err.max(), 2)
+
+    def test_repeat_variants_match_full_tile(self):
+        """Repeating background patterns give the same as whole tiles"""
+        top, bg = self._random_flat_pair()
+        pattern = bg[:3, :5].copy()
+        solid = bg[:1, :1].copy()
+        for x, y in [(0, 0), (7, 2), (-3, -11)]:
+            ys = (np.arange(N) + y) % 3
+            xs = (np.arange(N) + x) % 5
+            ys0 = np.zeros(N, 'intp')
+            for pat, full in [
+                    (pattern, pattern[ys][:, xs]),
+                    (solid, solid[ys0][:, ys0]),
+                    (bg, np.roll(np.roll(bg, -y, 0), -x, 1)),
+            ]:
+                for func, repeat_func in [
+                        (mypaintlib.tile_rgba2flat,
+                         mypaintlib.tile_rgba2flat_repeat),
+                        (mypaintlib.tile_flat2rgba,
+                         mypaintlib.tile_flat2rgba_repeat),
+                ]:
+                    expected = top.copy()
+                    func(expected, np.ascontiguousarray(full))
+                    result = top.copy()
+                    repeat_func(result, pat, x, y)
+                    self.assertTrue((result == expected).all())
+        self.assertRaises(ValueError, mypaintlib.tile_rgba2flat_repeat,
+                          top, pattern.astype('uint8'), 0, 0)
+
+    def test_rgba8_to_cairo(self):
+        """Display tiles are premultiplied into a clipped ARGB32 buffer"""
+        src = np.random.randint(0, 256, (N, N, 4)).astype('uint8')
+        src[0, 0, 3] = 0
+        src[0, 1, 3] = 255
+        w, h, stride = N + 10, N // 2, (N + 12) * 4
+        buf = bytearray(b"\xab" * (stride * h))
+        jobs = [(src, -5, -3), (src, N - 5, 0)]
+        mypaintlib.tile_rgba8_to_cairo_many(jobs, buf, w, h, stride)
+
+        a = src[..., 3:].astype('uint32')
+        t = src[..., :3] * a + 0x80
+        rgb = np.where(a == 255, src[..., :3], (t + (t >> 8)) >> 8)
+        rgb = np.where(a == 0, 0, rgb)
+        expected = ((a[..., 0] << 24) | (rgb[..., 0] << 16)
+                    | (rgb[..., 1] << 8) | rgb[..., 2])
+        out = np.frombuffer(bytes(buf), dtype='=u4').reshape(h, stride // 4)
+        self.assertTrue((out[:, :N - 5] == expected[3:3 + h, 5:]).all())
+        self.assertTrue((out[:, N - 5:w] == expected[:h, :15]).all())
+        self.assertTrue((out[:, w:] == 0xabababab).all())
+
+        with self.assertRaises(ValueError):
+            mypaintlib.tile_rgba8_to_cairo_many(jobs, buf, w, h, 4 * w - 4)
+        with self.assertRaises(ValueError):
+            mypaintlib.tile_rgba8_to_cairo_many(jobs, buf, w, h + 1, stride)
+
+    def test_strokemap_bits_match_bytes(self):
+        """Packed stroke bitmaps hold the same pixels as unpacked ones"""
+        before, after = self._random_flat_pair()
+        after[:, :, 3] |= 1 << 14
+        after[:, :, :3] = np.minimum(after[:, :, :3], after[:, :, 3:])
+        after[::2] = before[::2]
+        expected = np.empty((N, N), 'uint8')
+        mypaintlib.tile_perceptual_change_strokemap(before, after, expected)
+        self.assertTrue(expected.any())
+        bits = mypaintlib.tile_perceptual_change_strokemap_bits(before, after)
+        self.assertEqual(len(bits), N * N // 8)
+        unpacked = np.unpackbits(np.frombuffer(bits, 'uint8'))
+        self.assertTrue((unpacked.reshape((N, N)) == expected).all())
+        for unchanged in (before, before.copy()):
+            self.assertIsNone(
+                mypaintlib.tile_perceptual_change_strokemap_bits(
+                    before, unchanged,
+                ),
+            )
+
+
+class TilePool (unittest.TestCase):
+    """Test the pooled allocator for new tile arrays."""
+
+    def test_blocks_are_reused(self):
+        """Freed tile arrays go back to the pool, and come out zeroed"""
+        kinds = [
+            (mypaintlib.TilePoolRGBA16, (N, N, 4), 'uint16'),
+            (mypaintlib.TilePoolRGBA8, (N, N, 4), 'uint8'),
+            (mypaintlib.TilePoolAlpha16, (N, N), 'uint16'),
+        ]
+        mypaintlib.tile_pool_trim()
+        for kind, shape, dtype in kinds:
+            self.assertEqual(mypaintlib.tile_pool_free_count(kind), 0)
+            tiles = [mypaintlib.tile_pool_new(kind) for i in range(3)]
+            for tile in tiles:
+                self.assertEqual(tile.shape, shape)
+                self.assertEqual(tile.dtype, np.dtype(dtype))
+                self.assertTrue(tile.flags.c_contiguous)
+                self.assertTrue(tile.flags.writeable)
+                self.assertFalse(tile.any())
+                tile.fill(7)
+            del tiles, tile
+            self.assertEqual(mypaintlib.tile_pool_free_count(kind), 3)
+            tile = mypaintlib.tile_pool_new(kind)
+            self.assertEqual(mypaintlib.tile_pool_free_count(kind), 2)
+            self.assertFalse(tile.any())
+            del tile
+        mypaintlib.tile_pool_trim()
+        for kind, shape, dtype in kinds:
+            self.assertEqual(mypaintlib.tile_pool_free_count(kind), 0)
+        with self.assertRaises(ValueError):
+            mypaintlib.tile_pool_new(len(kinds))
+
+
+class Tracing (unittest.TestCase):
+    """Test the native code's trace recording."""
+
+    def tearDown(self):
+        mypaintlib.trace_set_enabled(False)
+        mypaintlib.trace_clear()
+
+    def _events(self):
+        return json.loads(mypaintlib.trace_dump_json().decode("ascii"))
+
+    def test_records_only_while_enabled(self):
+        """Scopes are recorded as complete events while tracing is on"""
+        src = np.zeros((N, N, 4), 'uint16')
+        dst = np.zeros((N, N, 4), 'uint16')
+        mypaintlib.trace_clear()
+        mypaintlib.tile_combine(mypaintlib.CombineNormal, src, dst,
+                                True, 1.0)
+        self.assertEqual(self._events()["traceEvents"], [])
+        mypaintlib.trace_set_enabled(True)
+        self.assertTrue(mypaintlib.trace_is_enabled())
+        for i in range(3):
+            mypaintlib.tile_combine(mypaintlib.CombineNormal, src, dst,
+                                    True, 1.0)
+        mypaintlib.trace_set_enabled(False)
+        mypaintlib.tile_combine(mypaintlib.CombineNormal, src, dst,
+                                True, 1.0)
+        events = [e for e in self._events()["traceEvents"]
+                  if e["name"] == "tile_combine"]
+        self.assertEqual(len(events), 3)
+        for e in events:
+            self.assertEqual(e["ph"], "X")
+            self.assertGreaterEqual(e["ts"], 0)
+            self.assertGreaterEqual(e["dur"], 0)
+        mypaintlib.trace_clear()
+        self.assertEqual(self._events()["traceEvents"], [])
+
+
+class TileCombine (unittest.TestCase):
+    """Test the vectorized and batched tile_combine() code paths."""
+
+    def _random_tile(self):
+        """Random premultiplied tile, with some fully transparent pixels"""
+        alpha = np.random.randint(0, (1 << 15) + 1, (N, N, 1))
+        alpha[::7] = 0
+        alpha[::5] = 1 << 15
+        rgb = np.random.randint(0, (1 << 15) + 1, (N, N, 3))
+        rgb = (rgb * alpha) // (1 << 15)
+        return np.concatenate((rgb, alpha), axis=2).astype('uint16')
+
+    def test_simd_matches_generic(self):
+        """Vectorized kernels produce the same bits as the generic code"""
+        modes = (
+            mypaintlib.CombineNormal,
+            mypaintlib.CombineMultiply,
+            mypaintlib.CombineScreen,
+            mypaintlib.CombineOverlay,
+            mypaintlib.CombineDarken,
+            mypaintlib.CombineLighten,
+            mypaintlib.CombineHardLight,
+            mypaintlib.CombineColorBurn,
+            mypaintlib.CombineColorDodge,
+            mypaintlib.CombineDifference,
+            mypaintlib.CombineExclusion,
+            mypaintlib.CombineDestinationOut,
+        )
+        src = self._random_tile()
+        dst_orig = self._random_tile()
+        variant = mypaintlib.tile_combine_simd_variant()
+        try:
+            for mode, dst_has_alpha, opacity in product(
+                    modes, (True, False), (0.0, 0.3, 1.0)):
+                results = []
+                for enabled in (False, True):
+                    mypaintlib.tile_combine_set_simd_enabled(enabled)
+                    dst = dst_orig.copy()
+                    mypaintlib.tile_combine(mode, src, dst,
+                                            dst_has_alpha, opacity)
+                    results.append(dst)
+                self.assertTrue(
+                    (results[0] == results[1]).all(),
+                    msg="%s output differs for mode %d (alpha=%r, opac=%r)"
+                        % (variant, mode, dst_has_alpha, opacity),
+                )
+        finally:
+            mypaintlib.tile_combine_set_simd_enabled(True)
+
+    def test_combine_many_matches_single(self):
+        """Batched combining gives the same result as one tile at a time"""
+        srcs = [self._random_tile() for i in range(4)]
+        dsts = [self._random_tile() for i in range(3)]
+        stack = np.zeros((N, N, 4), 'uint16')
+        jobs = [
+            (mypaintlib.CombineNormal, srcs[0], dsts[0], True, 0.5),
+            (mypaintlib.CombineMultiply, srcs[1], dsts[0], True, 1.0),
+            (mypaintlib.CombineScreen, srcs[0], dsts[1], False, 0.7),
+            (mypaintlib.CombineOverlay, srcs[2], stack, True, 1.0),
+            (mypaintlib.CombineNormal, stack, dsts[2], True, 0.8),
+            (mypaintlib.CombineDestinationOut, srcs[3], dsts[1], False, 1.0),
+        ]
+        arrays = srcs + dsts + [stack]
+        copies = dict((id(a), a.copy()) for a in arrays)
+        for mode, src, dst, dst_has_alpha, opacity in jobs:
+            mypaintlib.tile_combine(mode, copies[id(src)], copies[id(dst)],
+                                    dst_has_alpha, opacity)
+        mypaintlib.tile_combine_many(jobs)
+        for a in arrays:
+            self.assertTrue((a == copies[id(a)]).all())
+
+    def test_combine_many_rejects_bad_jobs(self):
+        """Malformed batches raise errors and leave tiles untouched"""
+        src = self._random_tile()
+        dst = self._random_tile()
+        dst_orig = dst.copy()
+        good = (mypaintlib.CombineNormal, src, dst, True, 1.0)
+        bad_jobs = [
+            (mypaintlib.NumCombineModes, src, dst, True, 1.0),
+            (mypaintlib.CombineNormal, src, dst[:N//2], True, 1.0),
+            (mypaintlib.CombineNormal, src, dst.astype('uint8'), True, 1.0),
+            (mypaintlib.CombineNormal, src),
+        ]
+        for bad in bad_jobs:
+            with self.assertRaises((TypeError, ValueError)):
+                mypaintlib.tile_combine_many([good, bad])
+            self.assertTrue((dst == dst_orig).all())
+
+    def test_render_ops_many(self):
+        """Native render programs match the ops run one by one"""
+        bg, l1, l2, l3 = [self._random_tile() for i in range(4)]
+        bg[..., 3] = 1 << 15
+        l3[...] = (1000, 2000, 3000, 1 << 14)
+        COMPOSITE, BLIT, PUSH, POP = 1, 2, 3, 4
+        program = [
+            (BLIT, 0, 1.0),
+            (COMPOSITE, mypaintlib.CombineNormal, 0.7),
+            (PUSH, 0, 1.0),
+            (COMPOSITE, mypaintlib.CombineMultiply, 1.0),
+            (COMPOSITE, mypaintlib.CombineScreen, 1.0),
+            (COMPOSITE, mypaintlib.CombineNormal, 1.0),
+            (POP, mypaintlib.CombineOverlay, 0.5),
+        ]
+        sources = (
+            (bg, mypaintlib.TileSummaryUnknown),
+            (l1, mypaintlib.TileSummaryMixed),
+            (l2, mypaintlib.TileSummaryUnknown),
+            None,
+            (l3, mypaintlib.TileSummaryUniform),
+        )
+        for dst_has_alpha in (True, False):
+            expected = bg.copy()
+            mypaintlib.tile_combine(mypaintlib.CombineNormal, l1, expected,
+                                    dst_has_alpha, 0.7)
+            group = np.zeros((N, N, 4), 'uint16')
+            mypaintlib.tile_combine(mypaintlib.CombineMultiply, l2, group,
+                                    True, 1.0)
+            mypaintlib.tile_combine(mypaintlib.CombineScreen,
+                                    np.zeros((N, N, 4), 'uint16'), group,
+                                    True, 1.0)
+            mypaintlib.tile_combine(mypaintlib.CombineNormal, l3, group,
+                                    True, 1.0)
+            mypaintlib.tile_combine(mypaintlib.CombineOverlay, group,
+                                    expected, dst_has_alpha, 0.5)
+            dsts = [self._random_tile() for i in range(3)]
+            jobs = [(dst, dst_has_alpha, sources) for dst in dsts]
+            mypaintlib.tile_render_ops_many(program, jobs)
+            for dst in dsts:
+                self.assertTrue((dst == expected).all())
+
+        bad_programs = [
+            [(PUSH, 0, 1.0)],
+            [(POP, mypaintlib.CombineNormal, 1.0)],
+            [(5, 0, 1.0)],
+            [(COMPOSITE, mypaintlib.NumCombineModes, 1.0)],
+        ]
+        for bad in bad_programs:
+            with self.assertRaises(ValueError):
+                mypaintlib.tile_render_ops_many(bad, [])
+        dst = self._random_tile()
+        with self.assertRaises(TypeError):
+            mypaintlib.tile_render_ops_many(program, [(dst, True, ())])
+
+    def test_summarize(self):
+        """Tiles are classified as empty, uniform, or mixed"""
+        tile = np.zeros((N, N, 4), 'uint16')
+        summary, color = mypaintlib.tile_summarize(tile)
+        self.assertEqual(summary, mypaintlib.TileSummaryEmpty)
+        tile[...] = (100, 200, 300, 1 << 15)
+        summary, color = mypaintlib.tile_summarize(tile)
+        self.assertEqual(summary, mypaintlib.TileSummaryUniform)
+        self.assertEqual(color, (100, 200, 300, 1 << 15))
+        tile[N-1, N-1, 3] = 0
+        summary, color = mypaintlib.tile_summarize(tile)
+        self.assertEqual(summary, mypaintlib.TileSummaryMixed)
+
+    def test_summary_shortcuts_match_full_combine(self):
+        """Passing a tile's summary doesn't change the combine results"""
+        srcs = [
+            np.zeros((N, N, 4), 'uint16'),
+            np.empty((N, N, 4), 'uint16'),
+            np.empty((N, N, 4), 'uint16'),
+        ]
+        srcs[1][...] = (1000, 20000, 1 << 15, 1 << 15)
+        srcs[2][...] = (1000, 2000, 3000, 4000)
+        dst_orig = self._random_tile()
+        for src, mode, dst_has_alpha, opacity in product(
+                srcs, range(mypaintlib.NumCombineModes),
+                (True, False), (0.5, 1.0)):
+            summary = mypaintlib.tile_summarize(src)[0]
+            results = []
+            for src_summary in (mypaintlib.TileSummaryUnknown, summary):
+                dst = dst_orig.copy()
+                mypaintlib.tile_combine(mode, src, dst, dst_has_alpha,
+                                        opacity, src_summary)
+                results.append(dst)
+            self.assertTrue(
+                (results[0] == results[1]).all(),
+                msg="summary %d changes mode %d (alpha=%r, opac=%r)"
+                    % (summary, mode, dst_has_alpha, opacity),
+            )
+
+
+class Mapping (unittest.TestCase):
+    """Test the brush input mapping wrapper."""
+
+    def _curve(self, compiled, points):
+        m = mypaintlib.MappingWrapper(1)
+        m.set_compiled(compiled)
+        m.set_n(0, len(points))
+        for i, (x, y) in enumerate(points):
+            m.set_point(0, i, x, y)
+        return m
+
+    def test_compiled_matches_exact(self):
+        """Lookup tables give the curve's values, also beyond its ends"""
+        curves = [
+            [(0.0, 0.0), (1.0, 1.0)],
+            [(0.0, 0.1), (0.2, 0.7), (0.2, 0.3), (0.9, 0.9), (1.0, 0.2)],
+            [(-2.0, 1.0), (0.5, 1.0), (3.0, -1.5)],
+            [(0.0, 0.5), (0.0, 0.5)],
+        ]
+        inputs = np.linspace(-3.0, 4.0, 1001)
+        for points in curves:
+            exact = self._curve(False, points)
+            compiled = self._curve(True, points)
+            self.assertTrue(compiled.get_compiled())
+            for x in inputs:
+                self.assertAlmostEqual(
+                    exact.calculate_single_input(x),
+                    compiled.calculate_single_input(x),
+                    places=4,
+                )
+
+    def test_compiled_tables_follow_edits(self):
+        """Changing the points invalidates the lookup tables"""
+        m = self._curve(True, [(0.0, 0.0), (1.0, 1.0)])
+        self.assertAlmostEqual(m.calculate_single_input(0.5), 0.5, places=5)
+        m.set_point(0, 1, 1.0, 0.0)
+        self.assertAlmostEqual(m.calculate_single_input(0.5), 0.0, places=5)
+        m.set_n(0, 3)
+        m.set_point(0, 1, 0.5, 1.0)
+        m.set_point(0, 2, 1.0, 0.0)
+        self.assertAlmostEqual(m.calculate_single_input(0.5), 1.0, places=5)
+
+
+class StrokeMaps (unittest.TestCase):
+    """Test stroke picking through the native stroke index."""
+
+    def _paint_strokes(self):
+        """Shapes of overlapping rectangular "strokes" on a surface"""
+        surf = tiledsurface.MyPaintSurface()
+        rects = [
+            (-70, -20, 150, 60),
+            (10, 5, 20, 200),
+            (-3, -90, 8, 100),
+            (40, 0, 100, 30),
+        ]
+        shapes = []
+        for x, y, w, h in rects:
+            before = surf.save_snapshot()
+            for ty in range(y // N, (y + h - 1) // N + 1):
+                for tx in range(x // N, (x + w - 1) // N + 1):
+                    with surf.tile_request(tx, ty, readonly=False) as t:
+                        x0 = max(x - tx*N, 0)
+                        y0 = max(y - ty*N, 0)
+                        x1 = min(x + w - tx*N, N)
+                        y1 = min(y + h - ty*N, N)
+                        t[y0:y1, x0:x1] += 1 << 13
+                        t[y0:y1, x0:x1, 3] = 1 << 15
+            shape = strokemap.StrokeShape.new_from_snapshots(
+                before, surf.save_snapshot(),
+            )
+            shapes.append(shape)
+        return shapes
+
+    def test_index_matches_touches_pixel(self):
+        """The index picks the newest stroke touching each pixel"""
+        shapes = self._paint_strokes()
+        index = strokemap.StrokeMapIndex()
+        points = product(range(-80, 150, 7), range(-100, 210, 9))
+        for i, (x, y) in enumerate(points):
+            if i == 200:
+                for shape in shapes:
+                    shape.tasks.finish_all()
+            expected = None
+            for shape in reversed(shapes):
+                if shape.touches_pixel(x, y):
+                    expected = shape
+                    break
+            self.assertIs(index.pick(shapes, x, y), expected,
+                          msg="at %r" % ((x, y),))
+
+    def test_index_follows_list_changes(self):
+        """Removed and reordered strokes make the index start over"""
+        shapes = self._paint_strokes()
+        for shape in shapes:
+            shape.tasks.finish_all()
+        index = strokemap.StrokeMapIndex()
+        self.assertIs(index.pick(shapes, 15, 10), shapes[1])
+        self.assertIs(index.pick(shapes[:1], 15, 10), shapes[0])
+        self.assertIs(index.pick(shapes[:3][::-1], 15, 10), shapes[0])
+        self.assertIsNone(index.pick([], 15, 10))
+        shapes[1].translate(N, 0)
+        shapes[1].tasks.finish_all()
+        self.assertIs(index.pick(shapes, 15, 10), shapes[0])
+        self.assertIs(index.pick(shapes, 15 + N, 100), shapes[1])
+
 
 class Painting (unittest.TestCase):
     """Tests basic painting functionality."""
@@ -75,6 +567,169 @@ class Painting (unittest.TestCase):
         s.save_as_png('test_directPaint.png')
         print('%0.4fs, ' % (time() - t0,), end="", file=sys.stderr)
 
+    def test_repeat_dabs_respect_snapshots(self):
+        """Cached tile requests still copy snapshots, and update mipmaps"""
+        s = tiledsurface.Surface()
+        dst = np.zeros((N, N, 4), 'uint16')
+
+        def dab(r, g, b):
+            s.begin_atomic()
+            s.draw_dab(N // 2, N // 2, 8, r, g, b, 1.0)
+            s.end_atomic()
+
+        dab(1, 0, 0)
+        dab(0, 1, 0)
+        sshot = s.save_snapshot()
+        before = sshot.tiledict[(0, 0)].rgba.copy()
+        dab(0, 0, 1)
+        self.assertTrue((sshot.tiledict[(0, 0)].rgba == before).all())
+        self.assertFalse((s.tiledict[(0, 0)].rgba == before).all())
+
+        s.composite_tile(dst, True, 0, 0, mipmap_level=1)
+        self.assertIsNot(s._mipmaps[1].tiledict[(0, 0)],
+                         tiledsurface.mipmap_dirty_tile)
+        dab(1, 1, 1)
+        self.assertIs(s._mipmaps[1].tiledict[(0, 0)],
+                      tiledsurface.mipmap_dirty_tile)
+
+    def test_discarded_snapshot_tiles_are_reused(self):
+        """Tiles are only copied on write while a snapshot holds them"""
+        s = tiledsurface.Surface()
+        with s.tile_request(0, 0, readonly=False) as rgba:
+            rgba[...] = 1 << 15
+        del rgba
+        tile = weakref.ref(s.tiledict[(0, 0)])
+
+        sshot = s.save_snapshot()
+        with s.tile_request(0, 0, readonly=False):
+            pass
+        self.assertIsNot(s.tiledict[(0, 0)], tile())
+        self.assertIs(sshot.tiledict[(0, 0)], tile())
+
+        tile = weakref.ref(s.tiledict[(0, 0)])
+        del sshot
+        s.save_snapshot()
+        with s.tile_request(0, 0, readonly=False):
+            pass
+        self.assertIs(s.tiledict[(0, 0)], tile())
+        self.assertFalse(tile().readonly)
+
+    def test_forgotten_constant_tiles_are_copied(self):
+        """Constant tiles no cache holds any more are still copied"""
+        s = tiledsurface.Surface()
+        s.set_constant_tile(0, 0, (1, 2, 3, 4))
+        for i in range(mypaintlib.ConstTiles.MAX_INTERNED + 1):
+            tiledsurface.constant_tile((0, 0, i, 1 << 15))
+        tile = s.tiledict[(0, 0)]
+        self.assertFalse(mypaintlib.ConstTiles.is_interned(tile.rgba))
+        with s.tile_request(0, 0, readonly=False) as rgba:
+            rgba[...] = 0
+        self.assertIsNot(s.tiledict[(0, 0)], tile)
+        self.assertFalse(s.tiledict[(0, 0)].constant)
+        self.assertTrue(tile.readonly)
+        self.assertEqual(tuple(tile.rgba[N-1, N-1]), (1, 2, 3, 4))
+
+    def test_cold_tiles_compress_transparently(self):
+        """Compressed tiles come back unchanged when requested"""
+        s = tiledsurface.Surface()
+        with s.tile_request(0, 0, readonly=False) as rgba:
+            rgba[...] = np.random.randint(0, 1 << 15, (N, N, 4))
+            expected = rgba.copy()
+        del rgba
+        tile = s.tiledict[(0, 0)]
+        for i in s.iter_compress_cold_tiles():
+            pass
+        self.assertIsNone(tile._zdata, msg="tile was in use")
+        for i in s.iter_compress_cold_tiles():
+            pass
+        self.assertIsNotNone(tile._zdata, msg="cold tile not compressed")
+        with s.tile_request(0, 0, readonly=True) as rgba:
+            self.assertTrue((rgba == expected).all())
+            self.assertTrue(rgba.flags.writeable)
+
+    def test_tiles_in_use_stay_uncompressed(self):
+        """Tiles used via the native cache or mid-compression are kept"""
+        s = tiledsurface.Surface()
+        with s.tile_request(0, 0, readonly=False) as rgba:
+            rgba[...] = 1 << 14
+        del rgba
+        tile = s.tiledict[(0, 0)]
+        s.get_color(N // 2, N // 2, 4)
+        for i in s.iter_compress_cold_tiles():
+            pass
+        # Answered from the backend's cache, without asking Python
+        s.get_color(N // 2, N // 2, 4)
+        for i in s.iter_compress_cold_tiles():
+            pass
+        self.assertIsNone(tile._zdata, msg="tile in use was compressed")
+
+        # Arrays handed out while compressing may have been written to
+        real_compress = tiledsurface.zlib.compress
+
+        def compress_and_write(data, level):
+            tile.rgba[...] = 1 << 15
+            return real_compress(data, level)
+
+        s.backend.clear_tile_cache()
+        tiledsurface.zlib.compress = compress_and_write
+        try:
+            self.assertFalse(tile.compress())
+        finally:
+            tiledsurface.zlib.compress = real_compress
+        self.assertIsNone(tile._zdata)
+        self.assertTrue((tile.rgba == 1 << 15).all())
+        with s.in_use():
+            for i in s.iter_compress_cold_tiles(all_tiles=True):
+                pass
+        self.assertIsNone(tile._zdata)
+
+    def test_mipmaps_match_per_tile_downscale(self):
+        """Batched mipmap building matches downscaling tile by tile"""
+        s = tiledsurface.Surface()
+        for tx, ty in product(range(9), range(5)):
+            if (tx + ty) % 3:
+                with s.tile_request(tx, ty, readonly=False) as rgba:
+                    rgba[...] = np.random.randint(0, 1 << 15, (N, N, 4))
+        s.build_mipmaps()
+        for level in range(1, tiledsurface.MAX_MIPMAP_LEVEL + 1):
+            below = s._mipmaps[level-1].tiledict
+            tiles = s._mipmaps[level].tiledict
+            wanted = set((tx // 2, ty // 2) for (tx, ty) in below)
+            self.assertEqual(set(tiles), wanted)
+            for (tx, ty), t in tiles.items():
+                self.assertIsNot(t, tiledsurface.mipmap_dirty_tile)
+                expected = np.zeros((N, N, 4), 'uint16')
+                for x, y in product(range(2), range(2)):
+                    src = below.get((tx*2 + x, ty*2 + y))
+                    if src is not None:
+                        mypaintlib.tile_downscale_rgba16(
+                            src.rgba, expected, x * N // 2, y * N // 2)
+                self.assertTrue((t.rgba == expected).all())
+
+    def test_mipmap_sampling_matches_full_resolution(self):
+        """Large get_color() areas are sampled from the mipmaps"""
+        s = tiledsurface.Surface()
+        for tx, ty in product(range(12), range(12)):
+            with s.tile_request(tx, ty, readonly=False) as rgba:
+                rgba[...] = (1 << 15) * np.array([tx % 2, 0.5, ty / 12, 1])
+        x = y = 6 * N
+        # Off by default
+        exact = s.get_color(x, y, 4 * N)
+        exact_alpha = s.get_alpha(x, y, 4 * N)
+        top = s._mipmaps[-1].tiledict
+        self.assertIs(top[(0, 0)], tiledsurface.mipmap_dirty_tile)
+        s.backend.set_mipmap_sampling(True)
+        sampled = s.get_color(x, y, 4 * N)
+        self.assertIsNot(top[(0, 0)], tiledsurface.mipmap_dirty_tile)
+        for a, b in zip(exact, sampled):
+            self.assertAlmostEqual(a, b, delta=0.02)
+        self.assertAlmostEqual(s.get_alpha(x, y, 4 * N), exact_alpha,
+                               delta=0.01)
+        # Small areas are still sampled at full resolution
+        small = s.get_color(x + 5, y + 3, 8)
+        s.backend.set_mipmap_sampling(False)
+        self.assertEqual(small, s.get_color(x + 5, y + 3, 8))
+
     def test_brush_paint(self):
         """30s of painting at 4x with a charcoal brush"""
         s = tiledsurface.Surface()
@@ -112,6 +767,116 @@ class Painting (unittest.TestCase):
 
         s.save_as_png('test_brushPaint.png')
 
+    def test_stroke_to_many_matches_stroke_to(self):
+        """Batched events paint the same as one stroke_to() per event"""
+        myb_path = join(paths.TESTS_DIR, 'brushes/v2/charcoal.myb')
+        with open(myb_path, "r") as fp:
+            bi = brush.BrushInfo(fp.read())
+        bi.set_color_rgb((0.0, 0.9, 1.0))
+        events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+        events = events[:500]
+        dtimes = np.diff(events[:, 0], prepend=events[0, 0])
+
+        s1 = tiledsurface.Surface()
+        b1 = brush.Brush(bi)
+        s1.begin_atomic()
+        for (t, x, y, pressure), dtime in zip(events, dtimes):
+            b1.stroke_to(s1.backend, x * 4, y * 4, pressure,
+                         0.0, 0.0, dtime, 1.0, 0.0, 0.0)
+        s1.end_atomic()
+
+        s2 = tiledsurface.Surface()
+        b2 = brush.Brush(bi)
+        batch = np.zeros((len(events), 9))
+        batch[:, 0:2] = events[:, 1:3] * 4
+        batch[:, 2] = events[:, 3]
+        batch[:, 5] = dtimes
+        batch[:, 6] = 1.0
+        s2.begin_atomic()
+        b2.stroke_to_many(s2.backend, batch)
+        s2.end_atomic()
+
+        self.assertTrue(s1.tiledict)
+        self.assertEqual(set(s1.tiledict), set(s2.tiledict))
+        for pos, t in s1.tiledict.items():
+            self.assertTrue((t.rgba == s2.tiledict[pos].rgba).all())
+        with self.assertRaises(ValueError):
+            b2.stroke_to_many(s2.backend, np.zeros((3, 4)))
+
+    def test_stroke_to_many_smudges_large_areas(self):
+        """Large smudge samples are fetched safely with the GIL released"""
+        bi = brush.BrushInfo()
+        bi.set_base_value('smudge', 1.0)
+        bi.set_base_value('smudge_length', 0.0)
+        bi.set_base_value('smudge_radius_log', 3.0)
+        bi.set_base_value('radius_logarithmic', 2.5)
+        xs = np.linspace(2 * N, 10 * N, 200)
+        batch = np.zeros((len(xs), 9))
+        batch[:, 0] = xs
+        batch[:, 1] = 6 * N
+        batch[:, 2] = 1.0
+        batch[:, 5] = 0.01
+        batch[:, 6] = 1.0
+
+        results = []
+        for many in (False, True):
+            s = tiledsurface.Surface()
+            for tx, ty in product(range(12), range(12)):
+                with s.tile_request(tx, ty, readonly=False) as rgba:
+                    rgba[...] = (1 << 15) * np.array([tx % 2, 0, ty % 2, 1])
+            s.backend.clear_tile_cache()
+            b = brush.Brush(bi)
+            s.begin_atomic()
+            if many:
+                b.stroke_to_many(s.backend, batch)
+            else:
+                for e in batch:
+                    b.stroke_to(s.backend, *e)
+            s.end_atomic()
+            results.append(s)
+
+        s1, s2 = results
+        self.assertEqual(set(s1.tiledict), set(s2.tiledict))
+        for pos, t in s1.tiledict.items():
+            self.assertTrue((t.rgba == s2.tiledict[pos].rgba).all())
+
+    def test_symmetry_bboxes_stay_separate(self):
+        """Many symmetric dabs still get one redraw rectangle each"""
+        s = tiledsurface.Surface()
+        lines = 40
+        s.set_symmetry_state(True, 0.0, 0.0,
+                             mypaintlib.SymmetrySnowflake, lines)
+        s.begin_atomic()
+        s.draw_dab(500.0, 0.0, 4, 1.0, 0.0, 0.0, 1.0)
+        bboxes = s.backend.end_atomic()
+        self.assertEqual(bboxes.dtype, np.int32)
+        self.assertEqual(bboxes.ndim, 1)
+        rects = bboxes.reshape(-1, 4)
+        self.assertGreater(len(rects), 50)
+        # Each one only covers a single small dab.
+        self.assertTrue((rects[:, 2] < 64).all())
+        self.assertTrue((rects[:, 3] < 64).all())
+
+    def test_symmetry_prefetch_matches_plain_requests(self):
+        """Prefetching tiles for symmetric dabs leaves the same result"""
+        events = np.loadtxt(join(paths.TESTS_DIR, 'painting30sec.dat'))
+        surfaces = []
+        for prefetch in (False, True):
+            s = tiledsurface.Surface()
+            s.backend.set_symmetry_prefetch(prefetch)
+            s.set_symmetry_state(True, 300.0, 200.0,
+                                 mypaintlib.SymmetrySnowflake, 8)
+            for t, x, y, pressure in events[:300]:
+                s.begin_atomic()
+                s.draw_dab(x, y, 20, 0.2, 0.6, 0.9, pressure, 0.6)
+                s.end_atomic()
+            surfaces.append(s)
+        s1, s2 = surfaces
+        self.assertTrue(s1.tiledict)
+        self.assertEqual(set(s1.tiledict), set(s2.tiledict))
+        for pos, t in s1.tiledict.items():
+            self.assertTrue((t.rgba == s2.tiledict[pos].rgba).all())
+
 
 class DocPaint (unittest.TestCase):
     """Test document equality after saving and loading."""
@@ -359,6 +1124,363 @@ class DocPaint (unittest.TestCase):
             join(paths.TESTS_DIR, 'correct_docPaint_alpha.png'),
         )
 
+    def test_lazy_load_matches_eager(self):
+        """Layers decoded on demand hold the same tiles"""
+        filename = join(paths.TESTS_DIR, 'bigimage.ora')
+        eager = document.Document()
+        eager.load_ora(filename, lazy=False)
+        lazy = document.Document()
+        lazy.load_ora(filename)
+        pairs = [
+            (e, l) for (e, l) in zip(eager.layer_stack.deepiter(),
+                                     lazy.layer_stack.deepiter())
+            if isinstance(e, layer.PaintingLayer)
+        ]
+        pending = [l for (e, l) in pairs if l._surface.is_pending_load()]
+        self.assertTrue(pending)
+        for e, l in pairs:
+            self.assertEqual(e.get_bbox(), l.get_bbox())
+        # Bboxes are known without decoding anything
+        self.assertTrue(all(l._surface.is_pending_load() for l in pending))
+        for e, l in pairs:
+            e_tiles = e._surface.get_tiles()
+            l_tiles = l._surface.get_tiles()
+            self.assertEqual(set(e_tiles), set(l_tiles))
+            for pos, tile in e_tiles.items():
+                self.assertTrue((tile.rgba == l_tiles[pos].rgba).all())
+
+
+    def test_failed_lazy_load_is_not_saved(self):
+        """Surfaces whose deferred load failed refuse to be saved"""
+        from lib.errors import FileHandlingError
+
+        def load():
+            raise ValueError("corrupt PNG")
+
+        s = tiledsurface.Surface()
+        s.set_pending_load(load, bbox=(0, 0, 100, 100))
+        self.assertFalse(s.is_empty())
+        self.assertEqual(s.get_tiles(), {})
+        self.assertFalse(s.is_pending_load())
+        self.assertIsInstance(s.load_error, ValueError)
+        tmp = tempfile.mkdtemp()
+        try:
+            with self.assertRaises(FileHandlingError):
+                s.save_as_png(join(tmp, "failed.png"))
+        finally:
+            shutil.rmtree(tmp)
+
+
+class PNGWriter (unittest.TestCase):
+    """Test the progressive PNG writer's serial and parallel modes."""
+
+    def setUp(self):
+        self._temp_dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self._temp_dir, ignore_errors=True)
+
+    def _write(self, arr, alpha, level, png_filter, threads, strip=N,
+               bit_depth=8, eotf=1.0):
+        filename = join(self._temp_dir, "out.png")
+        h, w = arr.shape[:2]
+        with open(filename, "wb") as fp:
+            writer = mypaintlib.ProgressivePNGWriter(
+                fp, w, h, alpha, True, level, png_filter, threads,
+                bit_depth, eotf,
+            )
+            for y in range(0, h, strip):
+                writer.write(arr[y:y+strip])
+            writer.close()
+        return filename
+
+    def _read(self, filename):
+        bufs = []
+
+        def get_buffer(w, h):
+            bufs.append(np.zeros((h, w, 4), 'uint8'))
+            return bufs[-1]
+
+        mypaintlib.load_png_fast_progressive(filename, get_buffer, False)
+        return bufs[0]
+
+    def test_parallel_matches_serial(self):
+        """Band-parallel output decodes to the same pixels as serial"""
+        Writer = mypaintlib.ProgressivePNGWriter
+        filters = [
+            Writer.FILTER_NONE, Writer.FILTER_SUB, Writer.FILTER_UP,
+            Writer.FILTER_AVERAGE, Writer.FILTER_PAETH,
+            Writer.FILTER_ADAPTIVE,
+        ]
+        arr = np.random.randint(0, 256, (3*N + 5, 700, 4)).astype('uint8')
+        arr[:N] //= 64  # something compressible
+        for alpha, png_filter in product((True, False), filters):
+            expected = arr.copy()
+            if not alpha:
+                expected[:, :, 3] = 255
+            for level, threads in [(2, 1), (2, 3), (-1, 2), (0, 8)]:
+                filename = self._write(arr, alpha, level, png_filter, threads)
+                self.assertTrue((self._read(filename) == expected).all())
+
+    def test_parallel_output_ignores_thread_count(self):
+        """Parallel output is the same for any number of threads"""
+        arr = np.random.randint(0, 256, (2*N + 3, 500, 4)).astype('uint8')
+        filter_sub = mypaintlib.ProgressivePNGWriter.FILTER_SUB
+        outputs = set()
+        for threads, strip in [(2, N), (4, 7), (5, 1)]:
+            filename = self._write(arr, True, 2, filter_sub, threads, strip)
+            with open(filename, "rb") as fp:
+                outputs.add(fp.read())
+        self.assertEqual(len(outputs), 1)
+
+    def _read_unfiltered_16bit(self, filename):
+        """Decodes a 16-bit PNG written with FILTER_NONE, as uint16"""
+        with open(filename, "rb") as fp:
+            data = fp.read()
+        pos = 8
+        idat = []
+        while pos < len(data):
+            length, kind = struct.unpack(">I4s", data[pos:pos+8])
+            chunk = data[pos+8:pos+8+length]
+            if kind == b"IHDR":
+                w, h, depth, colour = struct.unpack(">IIBB", chunk[:10])
+            elif kind == b"IDAT":
+                idat.append(chunk)
+            pos += 12 + length
+        self.assertEqual(depth, 16)
+        channels = {2: 3, 6: 4}[colour]
+        raw = np.frombuffer(zlib.decompress(b"".join(idat)), 'uint8')
+        raw = raw.reshape((h, 1 + w * channels * 2))
+        self.assertFalse(raw[:, 0].any())
+        return raw[:, 1:].copy().view('>u2').reshape((h, w, channels))
+
+    def test_16bit_from_fix15(self):
+        """16-bit output unpremultiplies and rescales fix15 strips"""
+        one = 1 << 15
+        shape = (2*N + 5, 301)
+        alpha = np.random.randint(0, one + 1, shape)
+        alpha[:, :50] = one
+        alpha[:N, 50:100] = 0
+        arr = np.empty(shape + (4,), 'uint16')
+        for c in range(3):
+            arr[..., c] = (np.random.random(shape) * (alpha + 1)).astype(int)
+        arr[..., 3] = alpha
+        arr = np.minimum(arr, arr[..., 3:])   # no colour brighter than alpha
+        filter_none = mypaintlib.ProgressivePNGWriter.FILTER_NONE
+        for has_alpha, eotf, threads in product(
+                (True, False), (1.0, 2.2), (1, 3)):
+            wide = arr.astype('uint64')
+            a = wide[..., 3:]
+            if has_alpha:
+                num = (wide << 15) + a // 2
+                straight = np.where(a, num // np.maximum(a, 1), 0)
+                straight[..., 3] = arr[..., 3]
+            else:
+                straight = wide[..., :3]
+            expected = (straight * 65535 + (1 << 14)) >> 15
+            if eotf != 1.0:
+                colour = straight[..., :3].astype('float32') / one
+                colour = colour ** np.float32(1.0 / eotf) * 65535 + 0.5
+                expected[..., :3] = np.minimum(colour, 65535).astype(int)
+            filename = self._write(arr, has_alpha, 2, filter_none, threads,
+                                   strip=7, bit_depth=16, eotf=eotf)
+            got = self._read_unfiltered_16bit(filename)
+            if eotf == 1.0:
+                self.assertTrue((got == expected).all())
+            else:
+                # numpy's float pow may round differently from powf()
+                diff = np.abs(got.astype(int) - expected.astype(int))
+                self.assertLessEqual(diff.max(), 1)
+                self.assertTrue((got[..., 3:] == expected[..., 3:]).all())
+        with self.assertRaises(ValueError):
+            self._write(arr.astype('uint8'), True, 2, filter_none, 1,
+                        bit_depth=16)
+
+    def test_write_rendered_matches_write(self):
+        """Natively rendered output is the same as rendering, then write()"""
+        COMPOSITE, BLIT = 1, 2
+        program = [
+            (BLIT, 0, 1.0),
+            (COMPOSITE, mypaintlib.CombineNormal, 0.7),
+        ]
+        tw, th = 4, 3
+        rows = []
+        for ty in range(th):
+            row = []
+            for tx in range(tw):
+                alpha = np.random.randint(0, (1 << 15) + 1, (2, N, N, 1))
+                alpha[:, ::5] = 0
+                tiles = np.random.random((2, N, N, 4)) * (alpha + 1)
+                tiles = tiles.astype('uint16')
+                tiles[..., 3:] = alpha
+                row.append((
+                    (tiles[0], mypaintlib.TileSummaryUnknown),
+                    (tiles[1], mypaintlib.TileSummaryMixed),
+                ))
+            rows.append(tuple(row))
+        x, y, w, h = 10, 3, 3*N + 20, 2*N + 40
+        filter_sub = mypaintlib.ProgressivePNGWriter.FILTER_SUB
+        for alpha, bit_depth, threads in product(
+                (True, False), (8, 16), (1, 3)):
+            dtype = 'uint8' if bit_depth == 8 else 'uint16'
+            full = np.zeros((th*N, tw*N, 4), dtype)
+            for ty, tx in product(range(th), range(tw)):
+                dst = np.zeros((N, N, 4), 'uint16')
+                mypaintlib.tile_render_ops_many(
+                    program, [(dst, True, rows[ty][tx])],
+                )
+                if bit_depth == 16:
+                    out = dst
+                else:
+                    out = np.zeros((N, N, 4), 'uint8')
+                    if alpha:
+                        mypaintlib.tile_convert_rgba16_to_rgba8(dst, out, 2.2)
+                    else:
+                        mypaintlib.tile_convert_rgbu16_to_rgbu8(dst, out, 2.2)
+                full[ty*N:(ty+1)*N, tx*N:(tx+1)*N] = out
+            expected = self._write(
+                full[y:y+h, x:x+w], alpha, 2, filter_sub, threads,
+                bit_depth=bit_depth, eotf=2.2,
+            )
+            with open(expected, "rb") as fp:
+                expected = fp.read()
+            filename = join(self._temp_dir, "rendered.png")
+            with open(filename, "wb") as fp:
+                writer = mypaintlib.ProgressivePNGWriter(
+                    fp, w, h, alpha, True, 2, filter_sub, threads,
+                    bit_depth, 2.2,
+                )
+                writer.write_rendered(program, iter(rows), x, y)
+                writer.close()
+            with open(filename, "rb") as fp:
+                self.assertEqual(fp.read(), expected)
+
+    def test_tile_loader_matches_progressive(self):
+        """Tiled PNG loading matches strip loading plus tile conversion"""
+        arr = np.random.randint(0, 256, (2*N + 9, 3*N + 1, 4)).astype('uint8')
+        arr[N:2*N, :, 3] = 0  # a row of empty tiles
+        filter_sub = mypaintlib.ProgressivePNGWriter.FILTER_SUB
+        filename = self._write(arr, True, 2, filter_sub, 1)
+        rgba8 = self._read(filename)
+        h, w = rgba8.shape[:2]
+        for (x, y), eotf, threads in product(
+                [(0, 0), (5, -70), (-N, 3)], [1.0, 2.2], [1, 3]):
+            tx0, ty0 = x // N, y // N
+            tx1, ty1 = (x + w - 1) // N, (y + h - 1) // N
+            padded = np.zeros(((ty1 - ty0 + 1) * N, (tx1 - tx0 + 1) * N, 4),
+                              'uint8')
+            padded[y - ty0*N:y - ty0*N + h, x - tx0*N:x - tx0*N + w] = rgba8
+            rows = []
+            tiles = {}
+
+            def store(png_w, png_h, ty, row_tiles):
+                self.assertEqual((png_w, png_h), (w, h))
+                rows.append(ty)
+                for tx, rgba in row_tiles.items():
+                    tiles[(tx, ty)] = rgba
+
+            mypaintlib.load_png_fast_to_tiles(
+                filename, store, x, y, False, eotf, threads,
+            )
+            self.assertEqual(rows, list(range(ty0, ty1 + 1)))
+            for ty, tx in product(range(ty0, ty1 + 1), range(tx0, tx1 + 1)):
+                src = padded[(ty-ty0)*N:(ty-ty0+1)*N, (tx-tx0)*N:(tx-tx0+1)*N]
+                if not src[:, :, 3].any():
+                    self.assertNotIn((tx, ty), tiles)
+                    continue
+                expected = np.zeros((N, N, 4), 'uint16')
+                mypaintlib.tile_convert_rgba8_to_rgba16(
+                    src.copy(), expected, eotf,
+                )
+                self.assertTrue((tiles[(tx, ty)] == expected).all())
+
+    def test_tile_loader_mipmaps_match_surface(self):
+        """Reduced PNG loading gives the tiles of the surface's mipmaps"""
+        arr = np.random.randint(0, 256, (5*N + 9, 7*N + 1, 4)).astype('uint8')
+        arr[N:3*N, :, 3] = 0
+        arr[3*N:, :4*N] = (10, 200, 30, 255)  # for the single-colour case
+        filter_sub = mypaintlib.ProgressivePNGWriter.FILTER_SUB
+        filename = self._write(arr, True, 2, filter_sub, 1)
+        for x, y in [(0, 0), (5, -70), (-3*N - 1, 2*N + 9)]:
+            full = tiledsurface.Surface()
+            full.load_from_png(filename, x, y, convert_to_srgb=False)
+            full.build_mipmaps()
+            for level in range(1, tiledsurface.MAX_MIPMAP_LEVEL + 1):
+                reduced = tiledsurface.Surface()
+                reduced.load_from_png(filename, x, y, convert_to_srgb=False,
+                                      mipmap_level=level)
+                expected = full._mipmaps[level].tiledict
+                self.assertEqual(set(reduced.tiledict), set(expected))
+                for pos, tile in expected.items():
+                    rgba = reduced.tiledict[pos].rgba
+                    self.assertTrue((rgba == tile.rgba).all())
+
+
+class PartialStackRendering (unittest.TestCase):
+    """Test rendering with the layers around the current one kept"""
+
+    class _Target (object):
+        """Minimal 8bpc display target"""
+
+        def __init__(self):
+            self.tiles = {}
+
+        @contextlib.contextmanager
+        def tile_request(self, tx, ty, readonly):
+            key = (tx, ty)
+            if key not in self.tiles:
+                self.tiles[key] = np.zeros((N, N, 4), 'uint8')
+            yield self.tiles[key]
+
+    @staticmethod
+    def _random_fill(layer, tx, ty):
+        with layer._surface.tile_request(tx, ty, readonly=False) as t:
+            t[..., 3] = np.random.randint(0, (1 << 15) + 1, (N, N))
+            for i in range(3):
+                t[..., i] = (np.random.randint(0, 1 << 15, (N, N))
+                             * t[..., 3].astype('uint32')) >> 15
+
+    def _render(self, root, tiles, cached):
+        target = self._Target()
+        # An explicit background makes the spec uncacheable
+        root.render(target, tiles, 0, background=None if cached else True)
+        return target.tiles
+
+    def assert_renders_match(self, root, tiles):
+        a = self._render(root, tiles, True)
+        b = self._render(root, tiles, False)
+        for key in tiles:
+            diff = np.abs(a[key].astype('int') - b[key].astype('int'))
+            self.assertLessEqual(diff.max(), 1)
+
+    def test_matches_full_render(self):
+        """Kept partial renderings follow edits made above and below"""
+        root = layer.RootLayerStack(doc=None)
+        layers = [layer.PaintingLayer() for i in range(5)]
+        for l in layers:
+            root.append(l)
+        tiles = [(0, 0), (1, 0)]
+        for l in layers:
+            for tx, ty in tiles:
+                self._random_fill(l, tx, ty)
+        root.current_path = (2,)
+        self.assert_renders_match(root, tiles)
+
+        # Painting the current layer keeps them
+        self._random_fill(layers[2], 0, 0)
+        root.layer_content_changed(layers[2], 0, 0, N, N)
+        self.assertIsNotNone(root._partial_cache._tiles.get((1, 0, 0)))
+        self.assert_renders_match(root, tiles)
+        self.assertIsNotNone(root._partial_cache._tiles.get((1, 0, 0)))
+
+        # Changes to other layers don't reuse them
+        for i in (0, 4):
+            self._random_fill(layers[i], 0, 0)
+            root.layer_content_changed(layers[i], 0, 0, N, N)
+            self.assert_renders_match(root, tiles)
+        layers[3].mode = mypaintlib.CombineMultiply
+        self.assert_renders_match(root, tiles)
+
 
 class Frame (unittest.TestCase):
     """Test frame saving"""